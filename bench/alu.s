@@ -0,0 +1,31 @@
+@ Thumb ALU instructions in a loop, with flags that are mostly never read.
+
+	.syntax unified
+	.thumb
+
+	.section .vectors, "a"
+	.word 0x20008000 @ initial stack pointer
+	.word reset
+
+	.text
+	.thumb_func
+	.global reset
+reset:
+	ldr r7, =3000000
+	movs r0, #0
+	movs r1, #1
+1:	adds r0, r0, r1
+	adds r1, r1, #3
+	subs r2, r0, r1
+	eors r2, r0
+	adcs r3, r2
+	adds r0, r3
+	subs r4, r0, #7
+	lsls r5, r4, #2
+	ands r5, r1
+	muls r5, r2
+	bics r5, r0
+	orrs r2, r5
+	subs r7, #1
+	bne 1b
+	bx lr @ exit
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Run benchmark images on the given execution engines and write one line of
+# JSON per image and engine to stdout, for the fastest of $BENCH_RUNS runs:
+#
+#     bench/bench.sh ./emculator "step blocks" bench/*.bin
+#
+# A longer workload, like a MicroPython image with input that runs its tests
+# and ends with a Ctrl-X, is added with MICROPYTHON=<image> and
+# MICROPYTHON_INPUT=<path>.
+
+set -e
+
+emculator=$1
+engines=$2
+shift 2
+runs=${BENCH_RUNS:-3}
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+# bench <name> <image> [emculator flags]
+bench() {
+	name=$1
+	image=$2
+	shift 2
+	for engine in $engines; do
+		best=""
+		i=0
+		while [ $i -lt "$runs" ]; do
+			stats=$("$emculator" -s -e "$engine" "$@" "$image" 2>&1 >/dev/null </dev/null | awk '
+				/^instructions:/ { instructions = $2 }
+				/^cycles:/       { cycles = $2 }
+				/^time:/         { seconds = $2 + 0; mips = substr($3, 2) + 0 }
+				/^max RSS:/      { rss = $3 }
+				END { if (instructions != "") print seconds, instructions, cycles, mips, rss }')
+			if [ -z "$stats" ]; then
+				echo "$image: no statistics for engine $engine" >&2
+				exit 1
+			fi
+			if [ -z "$best" ] || awk -v a="$stats" -v b="$best" 'BEGIN { split(a, x, " "); split(b, y, " "); exit !(x[1] < y[1]) }'; then
+				best=$stats
+			fi
+			i=$((i + 1))
+		done
+		echo "$best" | awk -v commit="$commit" -v name="$name" -v engine="$engine" '{
+			printf "{\"commit\": \"%s\", \"image\": \"%s\", \"engine\": \"%s\", \"seconds\": %.3f, \"instructions\": %s, \"cycles\": %s, \"mips\": %.1f, \"max_rss_kb\": %s}\n",
+				commit, name, engine, $1, $2, $3, $4, $5
+		}'
+	done
+}
+
+for image in "$@"; do
+	name=$(basename "$image")
+	bench "${name%.*}" "$image"
+done
+if [ -n "$MICROPYTHON" ]; then
+	bench micropython "$MICROPYTHON" -i "${MICROPYTHON_INPUT:?MICROPYTHON_INPUT must be set}"
+fi
@@ -0,0 +1,49 @@
+@ Calls and unpredictable conditional branches, driven by a Galois LFSR.
+
+	.syntax unified
+	.thumb
+
+	.section .vectors, "a"
+	.word 0x20008000 @ initial stack pointer
+	.word reset
+
+	.text
+	.thumb_func
+	.global reset
+reset:
+	push {r4-r7, lr}
+	ldr r7, =2000000
+	ldr r6, =0xb4bcd35c @ LFSR taps
+	movs r0, #1         @ LFSR state
+	movs r4, #0
+1:	lsrs r0, r0, #1
+	bcc 2f
+	eors r0, r6
+2:	lsls r1, r0, #31
+	beq 3f
+	bl odd
+	b 4f
+3:	bl even
+4:	lsls r1, r0, #30
+	bmi 5f
+	adds r4, #3
+5:	subs r7, #1
+	bne 1b
+	pop {r4-r7, pc} @ exit
+
+	.thumb_func
+odd:
+	adds r4, #1
+	cmp r4, r0
+	bhi 1f
+	subs r4, #2
+1:	bx lr
+
+	.thumb_func
+even:
+	push {lr}
+	lsrs r1, r0, #8
+	cmp r1, r4
+	blo 1f
+	bl odd
+1:	pop {pc}
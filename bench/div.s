@@ -0,0 +1,30 @@
+@ Thumb-2 UDIV and SDIV with changing operands.
+
+	.syntax unified
+	.thumb
+
+	.section .vectors, "a"
+	.word 0x20008000 @ initial stack pointer
+	.word reset
+
+	.text
+	.thumb_func
+	.global reset
+reset:
+	push {r4-r7, lr}
+	ldr r7, =5000000
+	ldr r0, =0x7fffffff
+	movs r1, #3
+	movs r4, #0
+1:	udiv r2, r0, r1
+	sdiv r3, r4, r1
+	mls r5, r2, r1, r0 @ remainder
+	adds r4, r5
+	subs r4, r3
+	adds r1, #2
+	subs r0, r0, r2
+	bne 2f
+	ldr r0, =0x7fffffff
+2:	subs r7, #1
+	bne 1b
+	pop {r4-r7, pc} @ exit
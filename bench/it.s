@@ -0,0 +1,40 @@
+@ Thumb-2 IT blocks: branchless minimum, maximum, absolute value and
+@ saturation.
+
+	.syntax unified
+	.thumb
+
+	.section .vectors, "a"
+	.word 0x20008000 @ initial stack pointer
+	.word reset
+
+	.text
+	.thumb_func
+	.global reset
+reset:
+	push {r4-r7, lr}
+	ldr r7, =2000000
+	ldr r0, =0x12345678
+	ldr r6, =1103515245
+	movs r4, #0
+	movs r5, #0
+1:	mul r0, r0, r6
+	add.w r0, r0, #0x3900
+	asrs r1, r0, #16
+	cmp r1, r4
+	ite lt
+	movlt r2, r1 @ min
+	movge r2, r4
+	it gt
+	movgt r4, r1 @ max
+	cmp r2, #0
+	it lt
+	rsblt r2, r2, #0 @ abs
+	cmp r2, #255
+	itt hi
+	movhi r2, #255 @ saturate
+	addhi r5, r5, #1
+	add r5, r5, r2
+	subs r7, #1
+	bne 1b
+	pop {r4-r7, pc} @ exit
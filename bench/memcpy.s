@@ -0,0 +1,36 @@
+@ Copy a 4kB buffer back and forth in RAM with LDM/STM, 16 bytes at a time.
+
+	.syntax unified
+	.thumb
+
+	.section .vectors, "a"
+	.word 0x20008000 @ initial stack pointer
+	.word reset
+
+	.text
+	.thumb_func
+	.global reset
+reset:
+	push {r4-r7, lr}
+	ldr r7, =20000
+	ldr r0, =buf_a
+	ldr r1, =buf_b
+1:	movs r2, #1
+	lsls r2, #12 @ 4096 bytes
+	push {r0, r1}
+2:	ldmia r1!, {r3-r6}
+	stmia r0!, {r3-r6}
+	subs r2, #16
+	bne 2b
+	pop {r0, r1}
+	mov r2, r0 @ swap source and destination
+	mov r0, r1
+	mov r1, r2
+	subs r7, #1
+	bne 1b
+	pop {r4-r7, pc} @ exit
+
+	.bss
+	.balign 4
+buf_a:	.space 4096
+buf_b:	.space 4096
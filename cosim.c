@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cosim.h"
+
+// This file runs several machines at the same time, for firmware on separate
+// chips that talks over the UART. Every machine runs on its own thread, for
+// a quantum of cycles at a time. At the end of each quantum all threads wait
+// for each other, and the last one to arrive moves the UART output of every
+// linked terminal (see terminal_create_link) to the input of its peer. So the
+// machines never get more than a quantum apart, and a byte that is sent
+// arrives at the start of the next quantum. With a quantum below the time of
+// a UART byte, the firmware can't tell the difference. The threads only share
+// state at that point, so a run is repeatable.
+
+typedef struct {
+	struct cosim *cosim;
+	machine_t *machine;
+	terminal_t *terminal; // may be NULL, when the UART isn't linked
+	pthread_t thread;
+	uint64_t start;       // cycle count at the start of cosim_run()
+	int err;              // result of the last quantum
+} cosim_node_t;
+
+struct cosim {
+	uint32_t quantum;
+	uint64_t max_cycles; // 0 for no limit
+	cosim_node_t nodes[COSIM_NODES_MAX];
+	size_t num_nodes;
+
+	// End of the quantum, protected by lock.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t waiting;      // threads that reached the end of the quantum
+	uint64_t generation; // number of quanta that ended
+	uint64_t time;       // cycles since the start of cosim_run()
+	bool stopped;
+};
+
+// Create a co-simulation that runs the machines in quanta of the given number
+// of cycles. Returns NULL when out of memory.
+cosim_t * cosim_create(uint32_t quantum) {
+	cosim_t *cosim = calloc(1, sizeof(cosim_t));
+	if (cosim == NULL) {
+		return NULL;
+	}
+	cosim->quantum = quantum;
+	pthread_mutex_init(&cosim->lock, NULL);
+	pthread_cond_init(&cosim->cond, NULL);
+	return cosim;
+}
+
+// Add a machine, with the terminal of its UART when it is linked to another
+// one. Returns false when there are already COSIM_NODES_MAX machines.
+bool cosim_add(cosim_t *cosim, machine_t *machine, terminal_t *terminal) {
+	if (cosim->num_nodes == COSIM_NODES_MAX) {
+		return false;
+	}
+	cosim_node_t *node = &cosim->nodes[cosim->num_nodes++];
+	node->cosim = cosim;
+	node->machine = machine;
+	node->terminal = terminal;
+	return true;
+}
+
+// Run the machine up to the given cycle count. Returns ERR_YIELD when it gets
+// there. BKPT 0x82 doesn't stop it.
+static int cosim_run_until(machine_t *machine, uint64_t cycles) {
+	machine_counters_t counters;
+	machine_get_counters(machine, &counters);
+	while (counters.cycles < cycles) {
+		uint64_t left = cycles - counters.cycles;
+		int err = machine_run_slice(machine, left < UINT32_MAX ? left : UINT32_MAX);
+		if (err != ERR_YIELD && err != ERR_HALT) {
+			return err;
+		}
+		machine_get_counters(machine, &counters);
+	}
+	return ERR_YIELD;
+}
+
+// Wait until all machines have finished the quantum, and exchange their UART
+// output. Returns false when the run is over.
+static bool cosim_sync(cosim_t *cosim) {
+	pthread_mutex_lock(&cosim->lock);
+	uint64_t generation = cosim->generation;
+	if (++cosim->waiting == cosim->num_nodes) {
+		// The others are all waiting for this one.
+		for (size_t i = 0; i < cosim->num_nodes; i++) {
+			cosim_node_t *node = &cosim->nodes[i];
+			if (node->err != ERR_YIELD) {
+				cosim->stopped = true;
+			}
+			if (node->terminal != NULL && !terminal_deliver(node->terminal)) {
+				fprintf(stderr, "cosim: out of memory for the UART input\n");
+				cosim->stopped = true;
+			}
+		}
+		cosim->time += cosim->quantum;
+		if (cosim->max_cycles != 0 && cosim->time >= cosim->max_cycles) {
+			cosim->stopped = true;
+		}
+		cosim->waiting = 0;
+		cosim->generation++;
+		pthread_cond_broadcast(&cosim->cond);
+	} else {
+		while (cosim->generation == generation) {
+			pthread_cond_wait(&cosim->cond, &cosim->lock);
+		}
+	}
+	bool stopped = cosim->stopped;
+	pthread_mutex_unlock(&cosim->lock);
+	return !stopped;
+}
+
+static void * cosim_thread(void *arg) {
+	cosim_node_t *node = arg;
+	cosim_t *cosim = node->cosim;
+	do {
+		// Only the last thread in cosim_sync() changes time, while this one
+		// is waiting.
+		uint64_t end = cosim->time + cosim->quantum;
+		if (cosim->max_cycles != 0 && end > cosim->max_cycles) {
+			end = cosim->max_cycles;
+		}
+		node->err = cosim_run_until(node->machine, node->start + end);
+	} while (cosim_sync(cosim));
+	return NULL;
+}
+
+// Run all machines until one of them stops with an error (or ERR_EXIT), or
+// for max_cycles cycles (when not 0). Returns the result of the first machine
+// that stopped, ERR_YIELD at the limit, or -1 when the threads couldn't be
+// started.
+int cosim_run(cosim_t *cosim, uint64_t max_cycles) {
+	cosim->max_cycles = max_cycles;
+	cosim->time = 0;
+	cosim->stopped = false;
+	for (size_t i = 0; i < cosim->num_nodes; i++) {
+		cosim_node_t *node = &cosim->nodes[i];
+		machine_counters_t counters;
+		machine_get_counters(node->machine, &counters);
+		node->start = counters.cycles;
+		node->err = ERR_YIELD;
+	}
+	size_t started;
+	for (started = 0; started < cosim->num_nodes; started++) {
+		cosim_node_t *node = &cosim->nodes[started];
+		if (pthread_create(&node->thread, NULL, cosim_thread, node) != 0) {
+			break;
+		}
+	}
+	bool failed = started != cosim->num_nodes;
+	if (failed) {
+		// Let the started threads stop at the end of the quantum.
+		fprintf(stderr, "cosim: could not start a thread\n");
+		pthread_mutex_lock(&cosim->lock);
+		cosim->stopped = true;
+		cosim->num_nodes = started;
+		if (started != 0 && cosim->waiting == started) {
+			cosim->waiting = 0;
+			cosim->generation++;
+			pthread_cond_broadcast(&cosim->cond);
+		}
+		pthread_mutex_unlock(&cosim->lock);
+	}
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(cosim->nodes[i].thread, NULL);
+	}
+	if (failed) {
+		return -1;
+	}
+	for (size_t i = 0; i < cosim->num_nodes; i++) {
+		if (cosim->nodes[i].err != ERR_YIELD) {
+			return cosim->nodes[i].err;
+		}
+	}
+	return ERR_YIELD;
+}
+
+// Free the co-simulation, but not the machines and terminals.
+void cosim_free(cosim_t *cosim) {
+	pthread_mutex_destroy(&cosim->lock);
+	pthread_cond_destroy(&cosim->cond);
+	free(cosim);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "machine.h"
+#include "terminal.h"
+
+// Runs several machines in lock-step, each on its own thread, see cosim.c.
+typedef struct cosim cosim_t;
+
+#define COSIM_NODES_MAX (8)
+
+cosim_t * cosim_create(uint32_t quantum);
+bool cosim_add(cosim_t *cosim, machine_t *machine, terminal_t *terminal);
+int cosim_run(cosim_t *cosim, uint64_t max_cycles);
+void cosim_free(cosim_t *cosim);
@@ -0,0 +1,638 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "coverage.h"
+
+// This file merges the coverage bitmaps of machine_coverage_start() of any
+// number of runs of the same image (a bitwise OR), and writes them as an lcov
+// tracefile, for genhtml and the other tools that read those. Addresses are
+// mapped to source lines with the line number table of the ELF file
+// (.debug_line, DWARF versions 2 to 5). Every row of the table covers the
+// addresses up to the next row. A line is hit when any halfword of its rows
+// was executed, and every conditional branch on it gets a taken and a not
+// taken entry. The bitmaps don't count, so the counts are 0 or 1.
+
+// DWARF constants, only those of the line number table.
+#define COVERAGE_DW_LNS_COPY               (1)
+#define COVERAGE_DW_LNS_ADVANCE_PC         (2)
+#define COVERAGE_DW_LNS_ADVANCE_LINE       (3)
+#define COVERAGE_DW_LNS_SET_FILE           (4)
+#define COVERAGE_DW_LNS_CONST_ADD_PC       (8)
+#define COVERAGE_DW_LNS_FIXED_ADVANCE_PC   (9)
+#define COVERAGE_DW_LNE_END_SEQUENCE       (1)
+#define COVERAGE_DW_LNE_SET_ADDRESS        (2)
+#define COVERAGE_DW_LNCT_PATH              (1)
+#define COVERAGE_DW_LNCT_DIRECTORY_INDEX   (2)
+#define COVERAGE_DW_FORM_DATA2             (0x05)
+#define COVERAGE_DW_FORM_DATA4             (0x06)
+#define COVERAGE_DW_FORM_DATA8             (0x07)
+#define COVERAGE_DW_FORM_STRING            (0x08)
+#define COVERAGE_DW_FORM_BLOCK             (0x09)
+#define COVERAGE_DW_FORM_DATA1             (0x0b)
+#define COVERAGE_DW_FORM_STRP              (0x0e)
+#define COVERAGE_DW_FORM_UDATA             (0x0f)
+#define COVERAGE_DW_FORM_DATA16            (0x1e)
+#define COVERAGE_DW_FORM_LINE_STRP         (0x1f)
+
+#define COVERAGE_FORMATS_MAX (16) // entry formats of a DWARF 5 header
+
+struct coverage {
+	const loader_t *loader;
+	size_t size;   // bytes per bitmap
+	uint8_t *bits; // COVERAGE_KINDS bitmaps, like those of machine_coverage()
+};
+
+// A source line (address 0), or a conditional branch on it.
+typedef struct {
+	uint32_t file; // index in coverage_table_t.files
+	uint32_t line;
+	uint32_t address;
+	uint8_t  state; // 1 << COVERAGE_* for the bits that are set
+} coverage_entry_t;
+
+typedef struct {
+	coverage_entry_t *entries;
+	size_t len;
+	size_t cap;
+} coverage_entries_t;
+
+// The lines and branches found in the line number table.
+typedef struct {
+	const coverage_t *coverage;
+	const uint8_t *image;
+	size_t image_size;
+	const uint8_t *line_str; // .debug_line_str
+	size_t line_str_size;
+	const uint8_t *str;      // .debug_str
+	size_t str_size;
+	char **files;
+	size_t num_files;
+	coverage_entries_t lines;
+	coverage_entries_t branches;
+	bool error; // out of memory
+} coverage_table_t;
+
+typedef struct {
+	const uint8_t *p;
+	const uint8_t *end;
+	bool error;
+} coverage_reader_t;
+
+// A directory or file of a DWARF 5 header.
+typedef struct {
+	const char *path;
+	uint64_t dir;
+} coverage_name_t;
+
+// Create an empty coverage for the runs of the firmware of the loader, which
+// must stay alive until it is freed. Returns NULL when out of memory.
+coverage_t * coverage_create(const loader_t *loader) {
+	coverage_t *coverage = calloc(1, sizeof(coverage_t));
+	if (coverage == NULL) {
+		return NULL;
+	}
+	size_t image_size;
+	loader_image(loader, &image_size);
+	coverage->loader = loader;
+	coverage->size = (image_size / 2 + 7) / 8;
+	coverage->bits = calloc(COVERAGE_KINDS, coverage->size);
+	if (coverage->bits == NULL) {
+		free(coverage);
+		return NULL;
+	}
+	return coverage;
+}
+
+// Add the coverage of a machine, see machine_coverage_start().
+void coverage_add(coverage_t *coverage, machine_t *machine) {
+	for (machine_coverage_t kind = 0; kind < COVERAGE_KINDS; kind++) {
+		size_t size;
+		const uint8_t *bits = machine_coverage(machine, kind, &size);
+		if (bits == NULL || size != coverage->size) {
+			return;
+		}
+		uint8_t *dst = coverage->bits + kind * size;
+		for (size_t i = 0; i < size; i++) {
+			dst[i] |= bits[i];
+		}
+	}
+}
+
+static bool coverage_bit(const coverage_t *coverage, machine_coverage_t kind, uint32_t address) {
+	return (coverage->bits[kind * coverage->size + address / 16] >> (address / 2 % 8)) & 1;
+}
+
+static uint64_t coverage_read_fixed(coverage_reader_t *r, size_t size) {
+	if ((size_t)(r->end - r->p) < size) {
+		r->error = true;
+		r->p = r->end;
+		return 0;
+	}
+	uint64_t value = 0;
+	for (size_t i = 0; i < size && i < 8; i++) {
+		value |= (uint64_t)r->p[i] << (i * 8);
+	}
+	r->p += size;
+	return value;
+}
+
+static uint64_t coverage_read_uleb(coverage_reader_t *r) {
+	uint64_t value = 0;
+	for (int shift = 0; r->p < r->end; shift += 7) {
+		uint8_t c = *r->p++;
+		if (shift < 64) {
+			value |= (uint64_t)(c & 0x7f) << shift;
+		}
+		if ((c & 0x80) == 0) {
+			return value;
+		}
+	}
+	r->error = true;
+	return 0;
+}
+
+static int64_t coverage_read_sleb(coverage_reader_t *r) {
+	uint64_t value = 0;
+	for (int shift = 0; r->p < r->end; shift += 7) {
+		uint8_t c = *r->p++;
+		if (shift < 64) {
+			value |= (uint64_t)(c & 0x7f) << shift;
+		}
+		if ((c & 0x80) == 0) {
+			if (shift + 7 < 64 && (c & 0x40)) {
+				value |= ~(uint64_t)0 << (shift + 7); // sign extend
+			}
+			return value;
+		}
+	}
+	r->error = true;
+	return 0;
+}
+
+static const char * coverage_read_string(coverage_reader_t *r) {
+	const uint8_t *nul = memchr(r->p, 0, r->end - r->p);
+	if (nul == NULL) {
+		r->error = true;
+		r->p = r->end;
+		return "";
+	}
+	const char *s = (const char*)r->p;
+	r->p = nul + 1;
+	return s;
+}
+
+// Return the string at an offset of a string section.
+static const char * coverage_read_strp(coverage_reader_t *r, const uint8_t *section, size_t size) {
+	uint64_t offset = coverage_read_fixed(r, 4);
+	if (section == NULL || offset >= size || memchr(section + offset, 0, size - offset) == NULL) {
+		r->error = true;
+		return "";
+	}
+	return (const char*)section + offset;
+}
+
+// Read an attribute of a DWARF 5 directory or file entry. Strings are
+// returned in *string, numbers in *value.
+static void coverage_read_form(coverage_table_t *table, coverage_reader_t *r, uint64_t form, const char **string, uint64_t *value) {
+	switch (form) {
+	case COVERAGE_DW_FORM_STRING:
+		*string = coverage_read_string(r);
+		break;
+	case COVERAGE_DW_FORM_LINE_STRP:
+		*string = coverage_read_strp(r, table->line_str, table->line_str_size);
+		break;
+	case COVERAGE_DW_FORM_STRP:
+		*string = coverage_read_strp(r, table->str, table->str_size);
+		break;
+	case COVERAGE_DW_FORM_UDATA:
+		*value = coverage_read_uleb(r);
+		break;
+	case COVERAGE_DW_FORM_DATA1:
+		*value = coverage_read_fixed(r, 1);
+		break;
+	case COVERAGE_DW_FORM_DATA2:
+		*value = coverage_read_fixed(r, 2);
+		break;
+	case COVERAGE_DW_FORM_DATA4:
+		*value = coverage_read_fixed(r, 4);
+		break;
+	case COVERAGE_DW_FORM_DATA8:
+		*value = coverage_read_fixed(r, 8);
+		break;
+	case COVERAGE_DW_FORM_DATA16: // MD5
+		coverage_read_fixed(r, 16);
+		break;
+	case COVERAGE_DW_FORM_BLOCK:
+		coverage_read_fixed(r, coverage_read_uleb(r));
+		break;
+	default:
+		r->error = true;
+	}
+}
+
+// Read the directory or file name table of a DWARF 5 header into a new array.
+// Returns the number of entries.
+static size_t coverage_read_names(coverage_table_t *table, coverage_reader_t *r, coverage_name_t **names) {
+	uint64_t formats[COVERAGE_FORMATS_MAX][2];
+	size_t num_formats = coverage_read_fixed(r, 1);
+	if (num_formats > COVERAGE_FORMATS_MAX) {
+		r->error = true;
+		return 0;
+	}
+	for (size_t i = 0; i < num_formats; i++) {
+		formats[i][0] = coverage_read_uleb(r); // content type
+		formats[i][1] = coverage_read_uleb(r); // form
+	}
+	uint64_t count = coverage_read_uleb(r);
+	if (count > (uint64_t)(r->end - r->p) || (num_formats == 0 && count != 0)) {
+		r->error = true; // every entry takes at least a byte
+		return 0;
+	}
+	*names = calloc(count ? count : 1, sizeof(coverage_name_t));
+	if (*names == NULL) {
+		table->error = true;
+		return 0;
+	}
+	for (size_t i = 0; i < count && !r->error; i++) {
+		(*names)[i].path = "";
+		for (size_t j = 0; j < num_formats; j++) {
+			const char *string = "";
+			uint64_t value = 0;
+			coverage_read_form(table, r, formats[j][1], &string, &value);
+			if (formats[j][0] == COVERAGE_DW_LNCT_PATH) {
+				(*names)[i].path = string;
+			} else if (formats[j][0] == COVERAGE_DW_LNCT_DIRECTORY_INDEX) {
+				(*names)[i].dir = value;
+			}
+		}
+	}
+	return count;
+}
+
+// Return the index of a source file (dir may be NULL) in table->files, and
+// add it when it is new.
+static uint32_t coverage_file(coverage_table_t *table, const char *dir, const char *name) {
+	if (dir == NULL || dir[0] == 0 || name[0] == '/') {
+		dir = NULL;
+	}
+	size_t length = strlen(name) + (dir != NULL ? strlen(dir) + 1 : 0);
+	char *path = malloc(length + 1);
+	char **files = realloc(table->files, (table->num_files + 1) * sizeof(char*));
+	if (path == NULL || files == NULL) {
+		free(path);
+		table->error = true;
+		return 0;
+	}
+	table->files = files;
+	if (dir != NULL) {
+		snprintf(path, length + 1, "%s/%s", dir, name);
+	} else {
+		memcpy(path, name, length + 1);
+	}
+	for (size_t i = 0; i < table->num_files; i++) {
+		if (strcmp(table->files[i], path) == 0) {
+			free(path);
+			return i;
+		}
+	}
+	table->files[table->num_files] = path;
+	return table->num_files++;
+}
+
+static void coverage_push(coverage_table_t *table, coverage_entries_t *entries, coverage_entry_t entry) {
+	if (entries->len == entries->cap) {
+		size_t cap = entries->cap ? entries->cap * 2 : 256;
+		coverage_entry_t *new_entries = realloc(entries->entries, cap * sizeof(coverage_entry_t));
+		if (new_entries == NULL) {
+			table->error = true;
+			return;
+		}
+		entries->entries = new_entries;
+		entries->cap = cap;
+	}
+	entries->entries[entries->len++] = entry;
+}
+
+// Add a row of the line number table, which covers [start, end) of the image.
+static void coverage_row(coverage_table_t *table, uint32_t file, uint64_t line, uint64_t start, uint64_t end) {
+	if (start >= table->image_size || end <= start || line == 0 || line > UINT32_MAX) {
+		return;
+	}
+	if (end > table->image_size) {
+		end = table->image_size;
+	}
+	start &= ~1;
+	bool hit = false;
+	for (uint32_t address = start; address < end && !hit; address += 2) {
+		hit = coverage_bit(table->coverage, COVERAGE_EXECUTED, address);
+	}
+	coverage_push(table, &table->lines, (coverage_entry_t){file, line, 0, hit << COVERAGE_EXECUTED});
+
+	// The conditional branches, like machine_op_is_cond_branch(), skipping
+	// literal pools and other data marked by $d mapping symbols.
+	for (uint32_t address = start; address + 2 <= end; ) {
+		if (loader_is_data(table->coverage->loader, address)) {
+			address += 2;
+			continue;
+		}
+		uint16_t hw1 = table->image[address] | table->image[address + 1] << 8;
+		bool wide = (hw1 >> 11) >= 0b11101;
+		bool branch = false;
+		if (!wide) {
+			branch = ((hw1 >> 12) == 0b1101 && ((hw1 >> 9) & 0b111) != 0b111) || // B<c>
+				(hw1 & 0xf500) == 0xb100; // CBZ, CBNZ
+		} else if (address + 4 <= table->image_size) {
+			uint16_t hw2 = table->image[address + 2] | table->image[address + 3] << 8;
+			branch = (hw1 >> 11) == 0b11110 && ((hw2 >> 12) & 0b1101) == 0b1000 && ((hw1 >> 7) & 0b111) != 0b111;
+		}
+		if (branch) {
+			uint8_t state = 0;
+			for (machine_coverage_t kind = 0; kind < COVERAGE_KINDS; kind++) {
+				state |= coverage_bit(table->coverage, kind, address) << kind;
+			}
+			coverage_push(table, &table->branches, (coverage_entry_t){file, line, address, state});
+		}
+		address += wide ? 4 : 2;
+	}
+}
+
+// Read one unit of .debug_line: its header with the file names, and the line
+// number program, which produces the rows.
+static void coverage_read_unit(coverage_table_t *table, coverage_reader_t *r) {
+	uint64_t unit_length = coverage_read_fixed(r, 4);
+	if (unit_length >= 0xfffffff0 || unit_length > (uint64_t)(r->end - r->p)) {
+		r->error = true; // also 64-bit DWARF, which isn't used for ARM
+		return;
+	}
+	coverage_reader_t unit = {r->p, r->p + unit_length, false};
+	r->p = unit.end;
+	uint64_t version = coverage_read_fixed(&unit, 2);
+	if (version < 2 || version > 5) {
+		return; // skip it
+	}
+	if (version >= 5) {
+		coverage_read_fixed(&unit, 2); // address and segment selector size
+	}
+	uint64_t header_length = coverage_read_fixed(&unit, 4);
+	if (header_length > (uint64_t)(unit.end - unit.p)) {
+		r->error = true;
+		return;
+	}
+	const uint8_t *program = unit.p + header_length;
+	uint64_t min_inst_length = coverage_read_fixed(&unit, 1);
+	if (version >= 4) {
+		coverage_read_fixed(&unit, 1); // maximum operations per instruction
+	}
+	coverage_read_fixed(&unit, 1); // default is_stmt
+	int8_t line_base = coverage_read_fixed(&unit, 1);
+	uint8_t line_range = coverage_read_fixed(&unit, 1);
+	uint8_t opcode_base = coverage_read_fixed(&unit, 1);
+	const uint8_t *opcode_lengths = unit.p;
+	coverage_read_fixed(&unit, opcode_base > 0 ? opcode_base - 1 : 0);
+	if (line_range == 0 || opcode_base == 0 || unit.error) {
+		r->error = true;
+		return;
+	}
+
+	// The file names, as indices in table->files. Files are numbered from 1
+	// before DWARF 5.
+	uint32_t *files = NULL;
+	size_t num_files = 0;
+	if (version < 5) {
+		const char **dirs = NULL;
+		size_t num_dirs = 0;
+		while (!unit.error && !table->error) {
+			const char *dir = coverage_read_string(&unit);
+			if (dir[0] == 0) {
+				break;
+			}
+			const char **new_dirs = realloc(dirs, (num_dirs + 1) * sizeof(char*));
+			if (new_dirs == NULL) {
+				table->error = true;
+				break;
+			}
+			dirs = new_dirs;
+			dirs[num_dirs++] = dir;
+		}
+		files = malloc(sizeof(uint32_t));
+		if (files == NULL) {
+			table->error = true;
+		} else {
+			files[num_files++] = UINT32_MAX; // no file 0
+		}
+		while (!unit.error && !table->error) {
+			const char *name = coverage_read_string(&unit);
+			if (name[0] == 0) {
+				break;
+			}
+			uint32_t *new_files = realloc(files, (num_files + 1) * sizeof(uint32_t));
+			if (new_files == NULL) {
+				table->error = true;
+				break;
+			}
+			files = new_files;
+			uint64_t dir = coverage_read_uleb(&unit);
+			coverage_read_uleb(&unit); // modification time
+			coverage_read_uleb(&unit); // size
+			files[num_files++] = coverage_file(table, dir != 0 && dir <= num_dirs ? dirs[dir - 1] : NULL, name);
+		}
+		free(dirs);
+	} else {
+		coverage_name_t *dirs = NULL, *names = NULL;
+		size_t num_dirs = coverage_read_names(table, &unit, &dirs);
+		if (!unit.error && !table->error) {
+			num_files = coverage_read_names(table, &unit, &names);
+		}
+		if (!unit.error && !table->error) {
+			files = calloc(num_files ? num_files : 1, sizeof(uint32_t));
+			if (files == NULL) {
+				table->error = true;
+				num_files = 0;
+			}
+		}
+		for (size_t i = 0; i < num_files && files != NULL; i++) {
+			files[i] = coverage_file(table, names[i].dir < num_dirs ? dirs[names[i].dir].path : NULL, names[i].path);
+		}
+		free(dirs);
+		free(names);
+	}
+	if (unit.error || table->error) {
+		free(files);
+		r->error = unit.error;
+		return;
+	}
+
+	// Run the line number program. A row covers everything up to the next
+	// one. Sequences at address 0 are functions that the linker removed.
+	unit.p = program;
+	uint64_t address = 0, file = 1, row_address = 0, row_file = 0;
+	int64_t line = 1, row_line = 0;
+	bool in_sequence = false, skip_sequence = false;
+	while (unit.p < unit.end && !unit.error) {
+		uint8_t opcode = *unit.p++;
+		bool row = false, end_sequence = false;
+		if (opcode >= opcode_base) {
+			// Special opcode: advance both and add a row.
+			uint8_t adjusted = opcode - opcode_base;
+			address += (adjusted / line_range) * min_inst_length;
+			line += line_base + adjusted % line_range;
+			row = true;
+		} else if (opcode == 0) {
+			// Extended opcode
+			uint64_t length = coverage_read_uleb(&unit);
+			if (length == 0 || length > (uint64_t)(unit.end - unit.p)) {
+				unit.error = true;
+				break;
+			}
+			const uint8_t *next = unit.p + length;
+			uint8_t extended = *unit.p++;
+			if (extended == COVERAGE_DW_LNE_END_SEQUENCE) {
+				row = end_sequence = true;
+			} else if (extended == COVERAGE_DW_LNE_SET_ADDRESS) {
+				address = coverage_read_fixed(&unit, length - 1);
+			}
+			unit.p = next;
+		} else if (opcode == COVERAGE_DW_LNS_COPY) {
+			row = true;
+		} else if (opcode == COVERAGE_DW_LNS_ADVANCE_PC) {
+			address += coverage_read_uleb(&unit) * min_inst_length;
+		} else if (opcode == COVERAGE_DW_LNS_ADVANCE_LINE) {
+			line += coverage_read_sleb(&unit);
+		} else if (opcode == COVERAGE_DW_LNS_SET_FILE) {
+			file = coverage_read_uleb(&unit);
+		} else if (opcode == COVERAGE_DW_LNS_CONST_ADD_PC) {
+			address += ((255 - opcode_base) / line_range) * min_inst_length;
+		} else if (opcode == COVERAGE_DW_LNS_FIXED_ADVANCE_PC) {
+			address += coverage_read_fixed(&unit, 2);
+		} else {
+			// Skip the arguments of all other standard opcodes.
+			for (size_t i = 0; i < opcode_lengths[opcode - 1]; i++) {
+				coverage_read_uleb(&unit);
+			}
+		}
+		if (!row) {
+			continue;
+		}
+		if (!in_sequence) {
+			skip_sequence = address == 0;
+		} else if (!skip_sequence && row_file < num_files && files[row_file] != UINT32_MAX) {
+			coverage_row(table, files[row_file], row_line, row_address, address);
+		}
+		in_sequence = !end_sequence;
+		row_address = address;
+		row_file = file;
+		row_line = line;
+		if (end_sequence) {
+			address = 0;
+			file = 1;
+			line = 1;
+		}
+	}
+	free(files);
+	r->error = unit.error;
+}
+
+static int coverage_compare(const void *a, const void *b) {
+	const coverage_entry_t *ea = a, *eb = b;
+	if (ea->file != eb->file) {
+		return ea->file < eb->file ? -1 : 1;
+	}
+	if (ea->line != eb->line) {
+		return ea->line < eb->line ? -1 : 1;
+	}
+	return ea->address < eb->address ? -1 : ea->address > eb->address;
+}
+
+// Write the records of all source files of the table.
+static void coverage_write_files(coverage_table_t *table, FILE *fp) {
+	const coverage_entries_t *lines = &table->lines, *branches = &table->branches;
+	size_t l = 0, b = 0;
+	while (l < lines->len) {
+		uint32_t file = lines->entries[l].file;
+		fprintf(fp, "SF:%s\n", table->files[file]);
+		size_t found = 0, hit = 0;
+		for (; b < branches->len && branches->entries[b].file == file; b++) {
+			const coverage_entry_t *e = &branches->entries[b];
+			for (int i = 0; i < 2; i++) {
+				machine_coverage_t kind = i == 0 ? COVERAGE_TAKEN : COVERAGE_NOT_TAKEN;
+				if (e->state & (1 << COVERAGE_EXECUTED)) {
+					bool taken = (e->state >> kind) & 1;
+					fprintf(fp, "BRDA:%u,%u,%d,%d\n", e->line, e->address, i, taken);
+					hit += taken;
+				} else {
+					fprintf(fp, "BRDA:%u,%u,%d,-\n", e->line, e->address, i);
+				}
+				found++;
+			}
+		}
+		if (found != 0) {
+			fprintf(fp, "BRF:%zu\nBRH:%zu\n", found, hit);
+		}
+		found = hit = 0;
+		while (l < lines->len && lines->entries[l].file == file) {
+			uint32_t line = lines->entries[l].line;
+			bool line_hit = false;
+			for (; l < lines->len && lines->entries[l].file == file && lines->entries[l].line == line; l++) {
+				line_hit |= lines->entries[l].state != 0;
+			}
+			fprintf(fp, "DA:%u,%d\n", line, line_hit);
+			found++;
+			hit += line_hit;
+		}
+		fprintf(fp, "LF:%zu\nLH:%zu\nend_of_record\n", found, hit);
+	}
+}
+
+// Write the coverage as a test with the given name (for example the image
+// path) to an lcov tracefile. Several of them can be written to the same file.
+// Returns false (after printing an error) when the ELF file has no line
+// number table or the file can't be written.
+bool coverage_write_lcov(coverage_t *coverage, const char *name, FILE *fp) {
+	coverage_table_t table = {coverage};
+	size_t size;
+	const uint8_t *debug_line = loader_section(coverage->loader, ".debug_line", &size);
+	if (debug_line == NULL) {
+		fprintf(stderr, "coverage: %s has no line number table (.debug_line)\n", name);
+		return false;
+	}
+	table.image = loader_image(coverage->loader, &table.image_size);
+	table.line_str = loader_section(coverage->loader, ".debug_line_str", &table.line_str_size);
+	table.str = loader_section(coverage->loader, ".debug_str", &table.str_size);
+	coverage_reader_t r = {debug_line, debug_line + size, false};
+	while (r.p < r.end && !r.error && !table.error) {
+		coverage_read_unit(&table, &r);
+	}
+	if (r.error) {
+		fprintf(stderr, "coverage: invalid line number table in %s\n", name);
+	}
+	qsort(table.lines.entries, table.lines.len, sizeof(coverage_entry_t), coverage_compare);
+	qsort(table.branches.entries, table.branches.len, sizeof(coverage_entry_t), coverage_compare);
+
+	// Test names may only have letters, digits and underscores.
+	fputs("TN:", fp);
+	for (const char *c = name; *c != 0; c++) {
+		bool valid = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9');
+		fputc(valid ? *c : '_', fp);
+	}
+	fputc('\n', fp);
+	if (!table.error) {
+		coverage_write_files(&table, fp);
+	}
+
+	for (size_t i = 0; i < table.num_files; i++) {
+		free(table.files[i]);
+	}
+	free(table.files);
+	free(table.lines.entries);
+	free(table.branches.entries);
+	if (table.error) {
+		fprintf(stderr, "coverage: out of memory\n");
+		return false;
+	}
+	return !ferror(fp);
+}
+
+void coverage_free(coverage_t *coverage) {
+	free(coverage->bits);
+	free(coverage);
+}
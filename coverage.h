@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "loader.h"
+#include "machine.h"
+
+// Code coverage of the runs of one firmware image, see coverage.c.
+typedef struct coverage coverage_t;
+
+coverage_t * coverage_create(const loader_t *loader);
+void coverage_add(coverage_t *coverage, machine_t *machine);
+bool coverage_write_lcov(coverage_t *coverage, const char *name, FILE *fp);
+void coverage_free(coverage_t *coverage);
@@ -4,28 +4,528 @@
 
 #ifdef EMCULATOR_MAIN
 
-#define _POSIX_C_SOURCE 1
+#define _POSIX_C_SOURCE 200809L
 
+#include "cosim.h"
+#include "coverage.h"
+#include "loader.h"
 #include "machine.h"
+#include "profile.h"
+#include "replay.h"
+#include "terminal.h"
+#include "trace.h"
 
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <stdint.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The emulated chip.
+#define IMAGE_SIZE (256 * 1024)
+#define PAGESIZE   (1024)
+#define RAM_SIZE   (32 * 1024) // 32kB of RAM
+
+// Sample interval of the profiler in cycles. A prime, so that the samples
+// don't follow loops.
+#define PROFILE_INTERVAL (1009)
+#define TRACE_RECORDS_PER_INSTR (4) // for -T, most instructions need fewer
+
+// Default quantum of -l in cycles, a bit less than the time of a UART byte.
+#define COSIM_QUANTUM (1000)
+
+// Read a whole file into a buffer of at least min_size bytes (plus one, for
+// a terminating zero), with the rest set to fill. Returns NULL (after printing
+// an error) if that fails or the file is bigger than max_size.
+static uint8_t * read_file(const char *path, size_t *size, size_t min_size, size_t max_size, int fill) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fileno(fp), &st)) {
+		perror(path);
+		fclose(fp);
+		return NULL;
+	}
+	if (st.st_size > max_size) {
+		fprintf(stderr, "%s: file too big\n", path);
+		fclose(fp);
+		return NULL;
+	}
+	uint8_t *buf = malloc((st.st_size > min_size ? st.st_size : min_size) + 1);
+	if (fread(buf, 1, st.st_size, fp) != st.st_size) {
+		perror(path);
+		fclose(fp);
+		free(buf);
+		return NULL;
+	}
+	fclose(fp);
+	if (st.st_size < min_size) {
+		memset(buf + st.st_size, fill, min_size - st.st_size);
+	}
+	*size = st.st_size;
+	return buf;
+}
+
+// Batch mode: run many images, each with UART input from a file, on a pool of
+// threads. Every run gets its own machine with a captured terminal, runs of
+// the same image share it (see loader_apply). The results are written
+// as one line of JSON per run, in the order of the job list.
+typedef struct {
+	const char *image_path;
+	const char *input_path; // may be NULL
+	loader_t *loader;       // shared by runs of the same image
+	coverage_t *coverage;   // the same, NULL without -C
+	uint8_t *input;
+	size_t input_len;
+
+	// Results.
+	const char *status; // exit, timeout or error
+	int err;
+	machine_counters_t counters;
+	uint8_t *output;
+	size_t output_len;
+} batch_job_t;
+
+typedef struct {
+	batch_job_t *jobs;
+	size_t num_jobs;
+	size_t next; // next job to run, protected by lock
+	pthread_mutex_t lock;
+	int loglevel;
+	machine_engine_t engine;
+	machine_core_t core;
+	uint64_t max_cycles; // 0 for no limit
+	bool hooks;          // see machine_hook_symbols()
+	bool coverage;       // merge the coverage of the runs, see coverage.c
+} batch_t;
+
+static void batch_timeout(machine_t *machine, void *ctx) {
+	bool *timed_out = ctx;
+	*timed_out = true;
+	machine_halt(machine);
+}
+
+static void batch_run(batch_t *batch, batch_job_t *job) {
+	job->status = "error";
+	machine_t *machine = machine_create(IMAGE_SIZE, PAGESIZE, RAM_SIZE, batch->loglevel, batch->engine);
+	terminal_t *terminal = terminal_create_capture(job->input, job->input_len);
+	if (machine == NULL || terminal == NULL) {
+		if (terminal != NULL) {
+			terminal_free(terminal);
+		}
+		if (machine != NULL) {
+			machine_free(machine);
+		}
+		return;
+	}
+	machine_set_core(machine, batch->core);
+	loader_apply(job->loader, machine);
+	if (batch->hooks) {
+		machine_hook_symbols(machine);
+	}
+	machine_set_terminal(machine, terminal);
+	machine_reset(machine);
+	if (job->coverage != NULL) {
+		machine_coverage_start(machine);
+	}
+	bool timed_out = false;
+	machine_event_t timeout = {0, batch_timeout, &timed_out, 0};
+	if (batch->max_cycles != 0) {
+		machine_schedule(machine, &timeout, batch->max_cycles);
+	}
+
+	// Halted by the timeout, Ctrl-X at the end of the input or BKPT 0x82.
+	while ((job->err = machine_run(machine)) == ERR_HALT && !timed_out && !terminal_exited(terminal)) {
+	}
+	if (job->err == ERR_OK || (job->err == ERR_HALT && !timed_out)) {
+		job->status = "exit";
+	} else if (job->err == ERR_HALT) {
+		job->status = "timeout";
+	}
+	machine_get_counters(machine, &job->counters);
+	if (job->coverage != NULL) {
+		pthread_mutex_lock(&batch->lock);
+		coverage_add(job->coverage, machine);
+		pthread_mutex_unlock(&batch->lock);
+	}
+	size_t length;
+	const uint8_t *output = terminal_get_output(terminal, &length);
+	job->output = malloc(length);
+	if (job->output != NULL && length != 0) {
+		memcpy(job->output, output, length);
+		job->output_len = length;
+	}
+	terminal_free(terminal);
+	machine_free(machine);
+}
+
+static void * batch_worker(void *arg) {
+	batch_t *batch = arg;
+	while (1) {
+		pthread_mutex_lock(&batch->lock);
+		size_t i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (i >= batch->num_jobs) {
+			return NULL;
+		}
+		batch_run(batch, &batch->jobs[i]);
+	}
+}
+
+static void batch_write_string(FILE *fp, const uint8_t *s, size_t length) {
+	fputc('"', fp);
+	for (size_t i = 0; i < length; i++) {
+		if (s[i] == '"' || s[i] == '\\') {
+			fprintf(fp, "\\%c", s[i]);
+		} else if (s[i] == '\n') {
+			fputs("\\n", fp);
+		} else if (s[i] < 0x20 || s[i] >= 0x7f) {
+			fprintf(fp, "\\u%04x", s[i]);
+		} else {
+			fputc(s[i], fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+// Parse the job list, a file with an image and optionally an input file on
+// each line, and load all files.
+static bool batch_load(batch_t *batch, const char *path) {
+	size_t size;
+	char *list = (char*)read_file(path, &size, 1, SIZE_MAX, 0);
+	if (list == NULL) {
+		return false;
+	}
+	list[size] = 0; // read_file() allocates one byte more
+	for (char *line = strtok(list, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+		batch->jobs = realloc(batch->jobs, (batch->num_jobs + 1) * sizeof(batch_job_t));
+		batch_job_t *job = &batch->jobs[batch->num_jobs];
+		memset(job, 0, sizeof(batch_job_t));
+		char *save;
+		job->image_path = strtok_r(line, " \t", &save);
+		job->input_path = strtok_r(NULL, " \t", &save);
+		if (job->image_path == NULL) {
+			continue; // empty line
+		}
+		batch->num_jobs++;
+	}
+
+	for (size_t i = 0; i < batch->num_jobs; i++) {
+		batch_job_t *job = &batch->jobs[i];
+		for (size_t j = 0; j < i; j++) {
+			if (strcmp(batch->jobs[j].image_path, job->image_path) == 0) {
+				job->loader = batch->jobs[j].loader;
+				job->coverage = batch->jobs[j].coverage;
+				break;
+			}
+		}
+		if (job->loader == NULL) {
+			job->loader = loader_open(job->image_path, IMAGE_SIZE, RAM_SIZE);
+			if (job->loader != NULL && batch->coverage && (job->coverage = coverage_create(job->loader)) == NULL) {
+				return false;
+			}
+		}
+		if (job->input_path != NULL) {
+			job->input = read_file(job->input_path, &job->input_len, 0, SIZE_MAX, 0);
+		}
+		if (job->loader == NULL || (job->input_path != NULL && job->input == NULL)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int batch_main(batch_t *batch, const char *list_path, const char *report_path, const char *coverage_path, size_t num_threads) {
+	if (!batch_load(batch, list_path)) {
+		return 1;
+	}
+	FILE *report = report_path != NULL ? fopen(report_path, "w") : stdout;
+	if (report == NULL) {
+		perror(report_path);
+		return 1;
+	}
+
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_t threads[num_threads];
+	for (size_t i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, batch_worker, batch) != 0) {
+			perror("could not start thread");
+			return 1;
+		}
+	}
+	for (size_t i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	int result = 0;
+	for (size_t i = 0; i < batch->num_jobs; i++) {
+		batch_job_t *job = &batch->jobs[i];
+		fprintf(report, "{\"image\": ");
+		batch_write_string(report, (const uint8_t*)job->image_path, strlen(job->image_path));
+		if (job->input_path != NULL) {
+			fprintf(report, ", \"input\": ");
+			batch_write_string(report, (const uint8_t*)job->input_path, strlen(job->input_path));
+		}
+		fprintf(report, ", \"status\": \"%s\", \"error\": %d, \"instructions\": %llu, \"cycles\": %llu, \"output\": ",
+			job->status, job->err, (unsigned long long)job->counters.instructions, (unsigned long long)job->counters.cycles);
+		batch_write_string(report, job->output, job->output_len);
+		fprintf(report, "}\n");
+		if (strcmp(job->status, "exit") != 0) {
+			result = 2; // not all runs exited normally
+		}
+	}
+	if (report != stdout) {
+		fclose(report);
+	}
+
+	// The coverage of every image, as a test in the same tracefile.
+	if (coverage_path != NULL) {
+		FILE *fp = fopen(coverage_path, "w");
+		if (fp == NULL) {
+			perror(coverage_path);
+			return 1;
+		}
+		for (size_t i = 0; i < batch->num_jobs; i++) {
+			batch_job_t *job = &batch->jobs[i];
+			bool first = true;
+			for (size_t j = 0; j < i && first; j++) {
+				first = batch->jobs[j].coverage != job->coverage;
+			}
+			if (first && !coverage_write_lcov(job->coverage, job->image_path, fp)) {
+				result = 1;
+			}
+		}
+		if (fclose(fp) != 0) {
+			perror(coverage_path);
+			result = 1;
+		}
+	}
+	return result;
+}
+
+// Save a snapshot of the machine to the given file. The buffer must stay
+// alive until the machine is freed (see machine_restore).
+static void * save_snapshot(machine_t *machine, const char *path) {
+	size_t size = machine_snapshot(machine, NULL, 0);
+	void *buf = malloc(size);
+	machine_snapshot(machine, buf, size);
+	FILE *fp = fopen(path, "w");
+	if (!fp || fwrite(buf, 1, size, fp) != size || fclose(fp) != 0) {
+		perror("could not write snapshot");
+	}
+	return buf;
+}
+
+// Restore a snapshot from the given file. It is mapped instead of read, so
+// that only the pages that are actually used are loaded.
+static bool restore_snapshot(machine_t *machine, const char *path) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror("could not open snapshot");
+		return false;
+	}
+	void *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED) {
+		perror("could not map snapshot");
+		return false;
+	}
+	return machine_restore(machine, buf, st.st_size);
+}
+
+// Run until at least the given number of instructions (in total) have been
+// executed, and then return ERR_YIELD. The blocks engines stop at the end of a
+// block, so -e step is needed to stop at exactly that instruction.
+static int run_until(machine_t *machine, uint64_t instructions) {
+	machine_counters_t counters;
+	machine_get_counters(machine, &counters);
+	while (counters.instructions < instructions) {
+		// The instructions that are left take at least as many cycles.
+		uint64_t left = instructions - counters.instructions;
+		int err = machine_run_slice(machine, left < UINT32_MAX ? left : UINT32_MAX);
+		if (err != ERR_YIELD) {
+			return err;
+		}
+		machine_get_counters(machine, &counters);
+	}
+	return ERR_YIELD;
+}
 
 static void usage(char *argv[]) {
-	fprintf(stderr, "Usage: %s [-v] image.bin\n", argv[0]);
+	fprintf(stderr, "Usage: %s [-v] [-s] [-H] [-g] [-c m0|m4] [-e step|blocks|jit] [-i input] [-r hz] [-S snapshot] [-R snapshot] [-N instructions] [-I record | -P replay] [-p profile] [-t trace [-T millions]] [-l image [-q cycles] [-n cycles]] [-C coverage] image\n", argv[0]);
+	fprintf(stderr, "       %s [-v] [-H] [-g] [-c m0|m4] [-e step|blocks|jit] -b jobs [-j threads] [-o report] [-n cycles] [-C coverage]\n", argv[0]);
+	fprintf(stderr, "       %s -d trace\n", argv[0]);
 }
 
 int main(int argc, char *argv[]) {
 	int loglevel = LOG_ERROR;
+	machine_engine_t engine = ENGINE_BLOCKS; // ENGINE_JIT isn't faster for every firmware
+	machine_core_t core = CORTEX_M4;
+	bool stats = false;
+	bool hooks = false;
+	bool guard_pages = false;
+	uint32_t realtime_hz = 0;
+	const char *save_path = NULL;
+	const char *restore_path = NULL;
+	const char *batch_path = NULL;
+	const char *report_path = NULL;
+	const char *profile_path = NULL;
+	const char *trace_path = NULL;
+	const char *record_path = NULL;
+	const char *replay_path = NULL;
+	const char *coverage_path = NULL;
+	uint64_t stop_instructions = 0;
+	size_t trace_last = 0;
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t max_cycles = 0;
+	const char *link_path = NULL;
+	bool input = false; // -i was given
+	uint32_t quantum = COSIM_QUANTUM;
 	int opt;
-	while ((opt = getopt(argc, argv, "v")) != -1) {
+	while ((opt = getopt(argc, argv, "vsHgc:e:i:r:S:R:N:I:P:b:j:o:n:p:t:T:l:q:C:d:")) != -1) {
 		switch (opt) {
 			case 'v':
 				loglevel++;
 				break;
+			case 's':
+				stats = true;
+				break;
+			case 'H':
+				// Run memcpy, memset, memcmp and strlen natively, when the
+				// image has symbols for them.
+				hooks = true;
+				break;
+			case 'g':
+				// Catch accesses outside of the RAM in compiled code with
+				// guard pages (ENGINE_JIT).
+				guard_pages = true;
+				break;
+			case 'c':
+				if (strcmp(optarg, "m0") == 0) {
+					core = CORTEX_M0;
+				} else if (strcmp(optarg, "m4") == 0) {
+					core = CORTEX_M4;
+				} else {
+					fprintf(stderr, "unknown core: %s\n", optarg);
+					usage(argv);
+					return 1;
+				}
+				break;
+			case 'e':
+				if (strcmp(optarg, "step") == 0) {
+					engine = ENGINE_STEP;
+				} else if (strcmp(optarg, "blocks") == 0) {
+					engine = ENGINE_BLOCKS;
+				} else if (strcmp(optarg, "jit") == 0) {
+					engine = ENGINE_JIT;
+				} else {
+					fprintf(stderr, "unknown engine: %s\n", optarg);
+					usage(argv);
+					return 1;
+				}
+				break;
+			case 'i':
+				// Read UART input from a file or pipe instead of the terminal.
+				if (!terminal_set_input(optarg)) {
+					perror("could not open input");
+					return 1;
+				}
+				input = true;
+				break;
+			case 'r':
+				// Run no faster than the given clock frequency (e.g. 16000000).
+				realtime_hz = strtoul(optarg, NULL, 10);
+				break;
+			case 'S':
+				// Save a snapshot when the firmware executes BKPT 0x82.
+				save_path = optarg;
+				break;
+			case 'R':
+				// Start from a snapshot instead of resetting.
+				restore_path = optarg;
+				break;
+			case 'N':
+				// Stop after this many instructions (since reset), and save
+				// the snapshot of -S there.
+				stop_instructions = strtoull(optarg, NULL, 10);
+				break;
+			case 'I':
+				// Record the UART input and random numbers, see replay.c.
+				record_path = optarg;
+				break;
+			case 'P':
+				// Replay them instead of reading them.
+				replay_path = optarg;
+				break;
+			case 'b':
+				// Run all images (and inputs) listed in this file.
+				batch_path = optarg;
+				break;
+			case 'j':
+				num_threads = strtol(optarg, NULL, 10);
+				break;
+			case 'o':
+				report_path = optarg;
+				break;
+			case 'n':
+				// Stop batch runs (or those of -l) after this many cycles.
+				max_cycles = strtoull(optarg, NULL, 10);
+				break;
+			case 'l':
+				// Run this image on a second machine, with its UART wired to
+				// that of the first, see cosim.c.
+				link_path = optarg;
+				break;
+			case 'q':
+				// Let the machines of -l run this many cycles at a time.
+				quantum = strtoul(optarg, NULL, 10);
+				if (quantum == 0) {
+					fprintf(stderr, "invalid quantum: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'C':
+				// Write the code coverage as an lcov tracefile, see
+				// coverage.c. Batch runs of the same image are merged.
+				coverage_path = optarg;
+				break;
+			case 'p':
+				// Write a profile of the run, see profile.c.
+				profile_path = optarg;
+				break;
+			case 't':
+				// Write a binary trace of all instructions, see trace.c.
+				trace_path = optarg;
+				break;
+			case 'T':
+				// Only keep the last millions of instructions of the trace,
+				// and write them when the run ends with an error.
+				trace_last = strtoul(optarg, NULL, 10) * 1000000;
+				break;
+			case 'd': {
+				// Print a trace file as text.
+				FILE *fp = fopen(optarg, "rb");
+				if (fp == NULL) {
+					perror(optarg);
+					return 1;
+				}
+				if (!trace_print(fp, stdout)) {
+					fprintf(stderr, "%s: invalid trace\n", optarg);
+					return 1;
+				}
+				fclose(fp);
+				return 0;
+			}
 			default:
 				fprintf(stderr, "unknown flag: %c\n", opt);
 				usage(argv);
@@ -33,45 +533,222 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (guard_pages && !machine_enable_guard_pages()) {
+		fprintf(stderr, "guard pages are not supported in this build\n");
+	}
+
+	if (batch_path != NULL) {
+		batch_t batch = {0};
+		batch.loglevel = loglevel;
+		batch.engine = engine;
+		batch.core = core;
+		batch.max_cycles = max_cycles;
+		batch.hooks = hooks;
+		batch.coverage = coverage_path != NULL;
+		return batch_main(&batch, batch_path, report_path, coverage_path, num_threads > 0 ? num_threads : 1);
+	}
+
 	if (optind >= argc) {
 		fprintf(stderr, "no image specified\n");
 		usage(argv);
 		return 1;
 	}
 	const char *imagepath = argv[optind];
-
-	FILE *fp = fopen(imagepath, "r");
-	if (!fp) {
-		perror("could not open file");
+	if (link_path != NULL && (input || save_path != NULL || stop_instructions != 0 || record_path != NULL || replay_path != NULL)) {
+		fprintf(stderr, "-l can't be combined with -i, -S, -N, -I or -P\n");
 		return 1;
 	}
 
-	struct stat st;
-	if (fstat(fileno(fp), &st)) {
-		perror("could not stat file");
+	loader_t *loader = loader_open(imagepath, IMAGE_SIZE, RAM_SIZE);
+	if (loader == NULL) {
 		return 1;
 	}
 
-	size_t image_size = 256 * 1024;
-	size_t pagesize = 1024;
-	size_t ram_size = 32 * 1024; // 32kB of RAM
-
-	if (st.st_size > image_size) {
-		fprintf(stderr, "file too big\n");
+	machine_t *machine = machine_create(IMAGE_SIZE, PAGESIZE, RAM_SIZE, loglevel, engine);
+	if (machine == NULL) {
+		fprintf(stderr, "out of memory\n");
 		return 1;
 	}
-	uint8_t *image = malloc(st.st_size);
-	if (fread(image, 1, st.st_size, fp) != st.st_size) {
-		perror("could not read file");
-		return 1;
+	machine_set_core(machine, core);
+	loader_apply(loader, machine);
+	if (hooks && machine_hook_symbols(machine) == 0) {
+		fprintf(stderr, "%s: no functions to hook\n", imagepath);
 	}
-	fclose(fp);
-
-	machine_t *machine = machine_create(image_size, pagesize, ram_size, loglevel);
-	machine_load(machine, image, st.st_size);
 	machine_reset(machine);
-	machine_run(machine);
+	if (restore_path != NULL && !restore_snapshot(machine, restore_path)) {
+		return 1;
+	}
+	if (realtime_hz != 0) {
+		machine_set_realtime(machine, realtime_hz);
+	}
+	if (coverage_path != NULL && !machine_coverage_start(machine)) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	// Co-simulation: the second machine runs from reset, the output of the
+	// first one also goes to stdout.
+	loader_t *link_loader = NULL;
+	machine_t *link_machine = NULL;
+	terminal_t *terminals[2] = {NULL, NULL};
+	cosim_t *cosim = NULL;
+	if (link_path != NULL) {
+		link_loader = loader_open(link_path, IMAGE_SIZE, RAM_SIZE);
+		if (link_loader == NULL) {
+			return 1;
+		}
+		link_machine = machine_create(IMAGE_SIZE, PAGESIZE, RAM_SIZE, loglevel, engine);
+		if (link_machine == NULL) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		machine_set_core(link_machine, core);
+		loader_apply(link_loader, link_machine);
+		if (hooks && machine_hook_symbols(link_machine) == 0) {
+			fprintf(stderr, "%s: no functions to hook\n", link_path);
+		}
+		machine_reset(link_machine);
+		if (realtime_hz != 0) {
+			machine_set_realtime(link_machine, realtime_hz);
+		}
+		terminals[0] = terminal_create_link(true);
+		terminals[1] = terminal_create_link(false);
+		cosim = cosim_create(quantum);
+		if (terminals[0] == NULL || terminals[1] == NULL || cosim == NULL) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		terminal_connect(terminals[0], terminals[1]);
+		terminal_connect(terminals[1], terminals[0]);
+		machine_set_terminal(machine, terminals[0]);
+		machine_set_terminal(link_machine, terminals[1]);
+		cosim_add(cosim, machine, terminals[0]);
+		cosim_add(cosim, link_machine, terminals[1]);
+	}
+	FILE *replay_fp = NULL;
+	replay_t *replay = NULL;
+	if (record_path != NULL || replay_path != NULL) {
+		replay_fp = fopen(record_path != NULL ? record_path : replay_path, record_path != NULL ? "wb" : "rb");
+		if (replay_fp == NULL) {
+			perror(record_path != NULL ? record_path : replay_path);
+			return 1;
+		}
+		if (record_path != NULL) {
+			replay = replay_record(machine, replay_fp);
+			if (replay == NULL) {
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+		} else {
+			replay = replay_start(machine, replay_fp);
+			if (replay == NULL) {
+				fprintf(stderr, "%s: not a recording\n", replay_path);
+				return 1;
+			}
+		}
+	}
+	profile_t *profile = NULL;
+	if (profile_path != NULL) {
+		profile = profile_start(machine, PROFILE_INTERVAL);
+	}
+	FILE *trace_fp = NULL;
+	trace_t *trace = NULL;
+	if (trace_path != NULL) {
+		trace_fp = fopen(trace_path, "wb");
+		if (trace_fp == NULL) {
+			perror(trace_path);
+			return 1;
+		}
+		if (trace_last != 0) {
+			machine_trace_start(machine, trace_last * TRACE_RECORDS_PER_INSTR, true);
+		} else {
+			trace = trace_start(machine, trace_fp);
+		}
+	}
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	void *snapshot = NULL;
+	int err;
+	if (cosim != NULL) {
+		err = cosim_run(cosim, max_cycles);
+	} else {
+		while ((err = stop_instructions != 0 ? run_until(machine, stop_instructions) : machine_run(machine)) == ERR_HALT &&
+			!terminal_exited(NULL) && !(replay != NULL && replay_stopped(replay))) {
+			// Halted by BKPT 0x82.
+			if (save_path != NULL) {
+				snapshot = save_snapshot(machine, save_path);
+				break;
+			}
+		}
+	}
+	if (err == ERR_YIELD && save_path != NULL) {
+		snapshot = save_snapshot(machine, save_path); // reached -N
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	terminal_flush();
+	if (replay != NULL) {
+		bool ok = replay_stop(replay);
+		if (fclose(replay_fp) != 0 || !ok) {
+			fprintf(stderr, "%s: %s failed\n", record_path != NULL ? record_path : replay_path, record_path != NULL ? "recording" : "replay");
+		}
+	}
+	if (trace_fp != NULL) {
+		bool ok = true;
+		if (trace != NULL) {
+			ok = trace_stop(trace);
+		} else if (err != 0 && err != ERR_HALT) {
+			ok = trace_dump(machine, trace_fp);
+		}
+		if (fclose(trace_fp) != 0 || !ok) {
+			perror(trace_path);
+		}
+	}
+	if (stats) {
+		// Print the counters and how fast the emulator was.
+		machine_counters_t counters;
+		machine_get_counters(machine, &counters);
+		double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		fprintf(stderr, "instructions: %llu\ncycles:       %llu\ntime:         %.3fs (%.1f MIPS)\nmax RSS:      %ld kB\n",
+			(unsigned long long)counters.instructions, (unsigned long long)counters.cycles,
+			seconds, counters.instructions / seconds / 1e6, (long)usage.ru_maxrss); // kB on Linux
+	}
+	if (coverage_path != NULL) {
+		coverage_t *coverage = coverage_create(loader);
+		FILE *fp = coverage != NULL ? fopen(coverage_path, "w") : NULL;
+		if (fp == NULL) {
+			perror(coverage_path);
+		} else {
+			coverage_add(coverage, machine);
+			coverage_write_lcov(coverage, imagepath, fp);
+			if (fclose(fp) != 0) {
+				perror(coverage_path);
+			}
+		}
+		if (coverage != NULL) {
+			coverage_free(coverage);
+		}
+	}
+	if (profile != NULL) {
+		FILE *fp = fopen(profile_path, "w");
+		if (fp == NULL) {
+			perror(profile_path);
+		} else {
+			profile_write_folded(profile, fp);
+			fclose(fp);
+		}
+		profile_free(profile);
+	}
+	if (cosim != NULL) {
+		cosim_free(cosim);
+		machine_free(link_machine);
+		loader_free(link_loader);
+		terminal_free(terminals[0]);
+		terminal_free(terminals[1]);
+	}
 	machine_free(machine);
+	loader_free(loader);
+	free(snapshot);
 	return 0;
 }
 
@@ -0,0 +1,228 @@
+// This file is a fuzz target for the UART input of a firmware image, for
+// libFuzzer or AFL++ (built with "make fuzz"). Every input starts from the
+// same snapshot: either one saved by "emculator -N instructions -S file", or
+// the state when the firmware first waits for input after a reset. Restoring
+// it only copies the pages that the previous input changed (see
+// machine_restore), so most of the time of a short input is the emulation
+// itself. An input runs until the firmware asks twice for more input than
+// there is (the first time it may still have to handle input that it read in
+// an interrupt), exits with Ctrl-X, or reaches the instruction limit. Memory,
+// PC, undefined instruction and division by zero errors abort, so that the
+// fuzzer saves a crash.
+//
+// The emulator itself isn't instrumented. Instead, the edges between basic
+// blocks of the firmware go to the coverage map of the fuzzer: the AFL++ map
+// when its runtime is linked in, or the extra counters of libFuzzer.
+//
+// libFuzzer takes its own arguments, so this target is set up with
+// environment variables:
+//   EMCULATOR_IMAGE         image file (required)
+//   EMCULATOR_SNAPSHOT      snapshot to start from
+//   EMCULATOR_INSTRUCTIONS  limit per input (default FUZZ_INSTRUCTIONS)
+//   EMCULATOR_ENGINE        step, blocks or jit
+//   EMCULATOR_HOOKS         run C library functions natively (see -H)
+//   EMCULATOR_LOG           log level, 1 logs the errors of crashes
+
+#ifdef EMCULATOR_FUZZ
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "loader.h"
+#include "machine.h"
+#include "terminal.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The emulated chip, the same as in emculator.c so that its snapshots fit.
+#define IMAGE_SIZE (256 * 1024)
+#define PAGESIZE   (1024)
+#define RAM_SIZE   (32 * 1024)
+
+#define FUZZ_INSTRUCTIONS      (1000000) // default limit per input
+#define FUZZ_BOOT_INSTRUCTIONS (100000000) // limit from reset to the first input
+#define FUZZ_SLICE             (1000) // cycles between checks of the terminal
+
+// The coverage map of AFL++, when its runtime is linked in.
+extern uint8_t *__afl_area_ptr __attribute__((weak));
+extern uint32_t __afl_map_size __attribute__((weak));
+
+// Extra coverage counters for libFuzzer, which only supports them on Linux.
+#ifdef __linux__
+#define FUZZ_COUNTERS_SIZE (65536)
+__attribute__((used, section("__libfuzzer_extra_counters")))
+static uint8_t fuzz_counters[FUZZ_COUNTERS_SIZE];
+#endif
+
+static struct {
+	machine_t *machine;
+	const void *snapshot;
+	size_t snapshot_size;
+	uint64_t max_instructions;
+} fuzz;
+
+static uint64_t fuzz_instructions(machine_t *machine) {
+	machine_counters_t counters;
+	machine_get_counters(machine, &counters);
+	return counters.instructions;
+}
+
+// Run the machine on the given input. Returns ERR_YIELD when it waits for more
+// input or gets to the instruction limit, ERR_HALT after Ctrl-X, or another
+// error (ERR_SLEEP for example).
+static int fuzz_run(machine_t *machine, terminal_t *terminal, uint64_t max_instructions) {
+	uint64_t instructions = fuzz_instructions(machine);
+	uint64_t end = instructions + max_instructions;
+	while (instructions < end && terminal_drained(terminal) < 2) {
+		// The instructions that are left take at least as many cycles.
+		uint64_t left = end - instructions;
+		int err = machine_run_slice(machine, left < FUZZ_SLICE ? left : FUZZ_SLICE);
+		if (terminal_exited(terminal)) {
+			return ERR_HALT;
+		}
+		if (err != ERR_YIELD && err != ERR_HALT) { // continue after BKPT 0x82
+			return err;
+		}
+		instructions = fuzz_instructions(machine);
+	}
+	return ERR_YIELD;
+}
+
+// Map a snapshot file, see restore_snapshot() in emculator.c.
+static const void * fuzz_map_snapshot(const char *path, size_t *size) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		return NULL;
+	}
+	void *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED) {
+		perror(path);
+		return NULL;
+	}
+	*size = st.st_size;
+	return buf;
+}
+
+// Boot the firmware until it waits for input, and keep a snapshot of that.
+static const void * fuzz_boot(machine_t *machine, size_t *size) {
+	terminal_t *terminal = terminal_create_capture(NULL, 0);
+	if (terminal == NULL) {
+		return NULL;
+	}
+	machine_set_terminal(machine, terminal);
+	int err = fuzz_run(machine, terminal, FUZZ_BOOT_INSTRUCTIONS);
+	machine_set_terminal(machine, NULL);
+	terminal_free(terminal);
+	if (err != ERR_YIELD) {
+		fprintf(stderr, "fuzz: firmware stopped with error %d while booting\n", err);
+		return NULL;
+	}
+	*size = machine_snapshot(machine, NULL, 0);
+	void *buf = malloc(*size);
+	if (buf == NULL) {
+		return NULL;
+	}
+	machine_snapshot(machine, buf, *size);
+	return buf;
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+	const char *image = getenv("EMCULATOR_IMAGE");
+	const char *snapshot = getenv("EMCULATOR_SNAPSHOT");
+	const char *instructions = getenv("EMCULATOR_INSTRUCTIONS");
+	const char *engine_name = getenv("EMCULATOR_ENGINE");
+	const char *hooks = getenv("EMCULATOR_HOOKS");
+	const char *log = getenv("EMCULATOR_LOG");
+	if (image == NULL) {
+		fprintf(stderr, "fuzz: set EMCULATOR_IMAGE to the firmware image\n");
+		exit(1);
+	}
+	fuzz.max_instructions = instructions != NULL ? strtoull(instructions, NULL, 0) : FUZZ_INSTRUCTIONS;
+	machine_engine_t engine = ENGINE_BLOCKS; // ENGINE_JIT isn't faster for every firmware
+	if (engine_name == NULL) {
+		// keep the default
+	} else if (strcmp(engine_name, "step") == 0) {
+		engine = ENGINE_STEP;
+	} else if (strcmp(engine_name, "blocks") == 0) {
+		engine = ENGINE_BLOCKS;
+	} else if (strcmp(engine_name, "jit") == 0) {
+		engine = ENGINE_JIT;
+	} else {
+		fprintf(stderr, "fuzz: unknown engine %s\n", engine_name);
+		exit(1);
+	}
+
+	loader_t *loader = loader_open(image, IMAGE_SIZE, RAM_SIZE);
+	if (loader == NULL) {
+		exit(1);
+	}
+	machine_t *machine = machine_create(IMAGE_SIZE, PAGESIZE, RAM_SIZE, log != NULL ? atoi(log) : LOG_NONE, engine);
+	if (machine == NULL) {
+		exit(1);
+	}
+	loader_apply(loader, machine);
+	if (hooks != NULL && atoi(hooks) != 0) {
+		machine_hook_symbols(machine);
+	}
+	machine_reset(machine);
+	if (snapshot != NULL) {
+		fuzz.snapshot = fuzz_map_snapshot(snapshot, &fuzz.snapshot_size);
+		if (fuzz.snapshot == NULL || !machine_restore(machine, fuzz.snapshot, fuzz.snapshot_size)) {
+			exit(1);
+		}
+	} else {
+		fuzz.snapshot = fuzz_boot(machine, &fuzz.snapshot_size);
+		if (fuzz.snapshot == NULL) {
+			exit(1);
+		}
+	}
+	fuzz.machine = machine;
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	machine_t *machine = fuzz.machine;
+	terminal_t *terminal = terminal_create_capture(data, size);
+	if (terminal == NULL || !machine_restore(machine, fuzz.snapshot, fuzz.snapshot_size)) {
+		abort();
+	}
+	machine_set_terminal(machine, terminal);
+	if (&__afl_area_ptr != NULL && __afl_area_ptr != NULL) {
+		size_t map_size = &__afl_map_size != NULL ? __afl_map_size : 65536;
+		while (map_size & (map_size - 1)) {
+			map_size &= map_size - 1; // round down to a power of two
+		}
+		machine_set_edges(machine, __afl_area_ptr, map_size);
+	} else {
+#ifdef __linux__
+		machine_set_edges(machine, fuzz_counters, FUZZ_COUNTERS_SIZE);
+#endif
+	}
+
+	int err = fuzz_run(machine, terminal, fuzz.max_instructions);
+	machine_set_edges(machine, NULL, 0);
+	machine_set_terminal(machine, NULL);
+	terminal_free(terminal);
+	switch (err) {
+	case ERR_MEM:
+	case ERR_PC:
+	case ERR_UNDEFINED:
+	case ERR_DIVZERO: {
+		uint32_t regs[16];
+		machine_readregs(machine, regs, 16);
+		fprintf(stderr, "fuzz: firmware crashed with error %d (PC: %x)\n", err, regs[15] - 3);
+		abort();
+	}
+	}
+	return 0;
+}
+
+#endif // EMCULATOR_FUZZ
@@ -8,6 +8,7 @@ import (
 	"io"
 	"net"
 	"os"
+	"path/filepath"
 	"strings"
 )
 
@@ -104,7 +105,12 @@ func gdbHandle(sock net.Conn, machine *Machine) error {
 
 		if strings.HasPrefix(packet, "qSupported:") {
 			// Copied from OpenOCD.
-			gdbSendPacket(conn, "PacketSize=3fff;qXfer:memory-map:read+;qXfer:features:read+;QStartNoAckMode+")
+			features := "PacketSize=3fff;qXfer:memory-map:read+;qXfer:features:read+;QStartNoAckMode+;vContSupported+"
+			if flagELF != "" {
+				// Let GDB load the symbols without a "file" command.
+				features += ";qXfer:exec-file:read+"
+			}
+			gdbSendPacket(conn, features)
 		} else if packet == "QStartNoAckMode" {
 			gdbSendPacket(conn, "OK")
 			acks = false
@@ -127,6 +133,8 @@ func gdbHandle(sock net.Conn, machine *Machine) error {
 				data = gdbAnnexTarget
 			} else if strings.HasPrefix(packet, "qXfer:memory-map:read::") {
 				data = fmt.Sprintf(gdbAnnexMemoryMap, flagFlashSize*1024, flagFlashPageSize, flagRAMSize*1024)
+			} else if strings.HasPrefix(packet, "qXfer:exec-file:read:") && flagELF != "" {
+				data, _ = filepath.Abs(flagELF)
 			} else {
 				gdbSendPacket(conn, "")
 				continue
@@ -175,55 +183,117 @@ func gdbHandle(sock net.Conn, machine *Machine) error {
 			mem := machine.ReadMemory(addr, length)
 			out := hex.EncodeToString(mem)
 			gdbSendPacket(conn, out)
-		} else if packet == "c" {
-			// Continue running.
-			if machine.Halted() {
-				// The target was halted (this is not always the case). Start it
-				// again.
-				machine.Continue()
+		} else if packet[0] == 'M' || packet[0] == 'X' {
+			// Write memory, as hex (M) or binary (X) data.
+			var addr, length int
+			colon := strings.IndexByte(packet, ':')
+			if colon < 0 {
+				gdbSendPacket(conn, "E01")
+				continue
 			}
-			for machine.Running() {
-				// TODO: also continue on breakpoints.
-				select {
-				case packet := <-packetChan:
-					if packet == "\x03" {
-						machine.Halt()
-					} else {
-						fmt.Fprintln(os.Stderr, "gdb: unexpected packet during continue:", packet)
-					}
-				case <-machine.runChan:
-					machine.halted = true
-				}
+			_, err := fmt.Sscanf(packet[1:colon], "%x,%x", &addr, &length)
+			data := []byte(packet[colon+1:])
+			if err == nil && packet[0] == 'M' {
+				data, err = hex.DecodeString(packet[colon+1:])
 			}
-			// Send a response only after the target has halted again.
-			gdbSendPacket(conn, "S00")
-		} else if packet == "s" {
-			// Single-step.
-			if !machine.Halted() {
-				// target not halted
-				gdbSendPacket(conn, "E00")
+			if err != nil || len(data) != length || !machine.WriteMemory(addr, data) {
+				gdbSendPacket(conn, "E01")
 				continue
 			}
-			result := machine.Step()
-			gdbSendPacket(conn, fmt.Sprintf("S%02x", result))
-		} else if packet[0] == 'Z' || packet[0] == 'z' {
-			// Set or remove a breakpoint.
-			num := packet[1] - '0'
-			if num >= 4 {
-				gdbSendPacket(conn, "E00")
+			gdbSendPacket(conn, "OK")
+		} else if packet[0] == 'G' {
+			// Write all registers.
+			regs, err := hex.DecodeString(packet[1:])
+			if err != nil {
+				gdbSendPacket(conn, "E01")
+				continue
+			}
+			machine.WriteRegisters(regs)
+			gdbSendPacket(conn, "OK")
+		} else if strings.HasPrefix(packet, "vFlashErase:") {
+			var addr, length int
+			_, err := fmt.Sscanf(packet[len("vFlashErase:"):], "%x,%x", &addr, &length)
+			if err != nil || !machine.EraseFlash(addr, length) {
+				gdbSendPacket(conn, "E01")
+				continue
+			}
+			gdbSendPacket(conn, "OK")
+		} else if strings.HasPrefix(packet, "vFlashWrite:") {
+			// Binary data, written like the (emulated) NVMC would do it.
+			var addr int
+			args := packet[len("vFlashWrite:"):]
+			colon := strings.IndexByte(args, ':')
+			if colon < 0 {
+				gdbSendPacket(conn, "E01")
+				continue
+			}
+			_, err := fmt.Sscanf(args[:colon], "%x", &addr)
+			if err != nil || !machine.ProgramFlash(addr, []byte(args[colon+1:])) {
+				gdbSendPacket(conn, "E01")
+				continue
+			}
+			gdbSendPacket(conn, "OK")
+		} else if packet == "vFlashDone" {
+			gdbSendPacket(conn, "OK")
+		} else if packet == "vCont?" {
+			gdbSendPacket(conn, "vCont;c;C;s;S;r")
+		} else if strings.HasPrefix(packet, "vCont;") {
+			// There is only one thread, so only the first action matters.
+			action := strings.Split(packet[len("vCont;"):], ";")[0]
+			if colon := strings.IndexByte(action, ':'); colon >= 0 {
+				action = action[:colon] // drop the thread ID
+			}
+			if len(action) == 0 {
+				gdbSendPacket(conn, "")
 				continue
 			}
-			var address uint32
-			_, err := fmt.Sscanf(packet[2:], ",%x", &address)
+			switch action[0] {
+			case 'c', 'C':
+				gdbContinue(conn, machine, packetChan, 0, 0)
+			case 's', 'S':
+				gdbStep(conn, machine)
+			case 'r':
+				// Range stepping: step until the PC leaves [start, end).
+				var start, end uint32
+				_, err := fmt.Sscanf(action[1:], "%x,%x", &start, &end)
+				if err != nil || !machine.Halted() {
+					gdbSendPacket(conn, "E01")
+					break
+				}
+				gdbContinue(conn, machine, packetChan, start, end)
+			default:
+				gdbSendPacket(conn, "")
+			}
+		} else if packet == "c" {
+			gdbContinue(conn, machine, packetChan, 0, 0)
+		} else if packet == "s" {
+			gdbStep(conn, machine)
+		} else if packet[0] == 'Z' || packet[0] == 'z' {
+			// Set or remove a breakpoint (type 0 or 1) or a watchpoint (type
+			// 2, 3 or 4).
+			var kind int
+			var address, length uint32
+			_, err := fmt.Sscanf(packet[1:], "%d,%x,%x", &kind, &address, &length)
 			if err != nil {
 				gdbSendPacket(conn, "E00")
 				continue
 			}
-			if packet[0] == 'z' {
-				// remove breakpoint
-				address = 0
+			enable := packet[0] == 'Z'
+			ok := false
+			switch kind {
+			case 0, 1:
+				ok = machine.SetBreakpoint(address, enable)
+			case 2:
+				ok = machine.SetWatchpoint(address, length, C.WATCH_WRITE, enable)
+			case 3:
+				ok = machine.SetWatchpoint(address, length, C.WATCH_READ, enable)
+			case 4:
+				ok = machine.SetWatchpoint(address, length, C.WATCH_ACCESS, enable)
+			default:
+				gdbSendPacket(conn, "") // not supported
+				continue
 			}
-			if !machine.SetBreakpoint(int(num), address) {
+			if !ok {
 				gdbSendPacket(conn, "E00")
 				continue
 			}
@@ -232,15 +302,54 @@ func gdbHandle(sock net.Conn, machine *Machine) error {
 			// Unknown command, send an empty response.
 			gdbSendPacket(conn, "")
 		}
-
-		// Make sure the packet is sent, before we deadlock because GDB is still
-		// waiting on our packet while we're waiting on GDB's next packet.
-		conn.Flush()
 	}
 
 	return nil
 }
 
+// Continue running (optionally only while the PC is within a step range), and
+// respond once the target has halted again.
+func gdbContinue(conn *bufio.ReadWriter, machine *Machine, packetChan chan string, start, end uint32) {
+	if machine.Halted() {
+		// The target was halted (this is not always the case). Start it
+		// again.
+		machine.ContinueRange(start, end)
+	}
+	for machine.Running() {
+		// TODO: also continue on breakpoints.
+		select {
+		case packet := <-packetChan:
+			if packet == "\x03" {
+				machine.Halt()
+			} else {
+				fmt.Fprintln(os.Stderr, "gdb: unexpected packet during continue:", packet)
+			}
+		case <-machine.runChan:
+			machine.halted = true
+		}
+	}
+	// Send a response only after the target has halted again.
+	if kind, address := machine.WatchHit(); kind != 0 {
+		name := map[C.machine_watch_t]string{C.WATCH_WRITE: "watch", C.WATCH_READ: "rwatch", C.WATCH_ACCESS: "awatch"}[kind]
+		gdbSendPacket(conn, fmt.Sprintf("T05%s:%x;", name, address))
+	} else if end != 0 {
+		gdbSendPacket(conn, "S05") // SIGTRAP, like a single step
+	} else {
+		gdbSendPacket(conn, "S00")
+	}
+}
+
+// Execute a single instruction.
+func gdbStep(conn *bufio.ReadWriter, machine *Machine) {
+	if !machine.Halted() {
+		// target not halted
+		gdbSendPacket(conn, "E00")
+		return
+	}
+	result := machine.Step()
+	gdbSendPacket(conn, fmt.Sprintf("S%02x", result))
+}
+
 func gdbRecvPackets(conn *bufio.ReadWriter, packetChan chan string) {
 	defer close(packetChan)
 	for {
@@ -289,7 +398,6 @@ func gdbRecvPacket(conn *bufio.ReadWriter) (string, error) {
 	checksum := string([]byte{c1, c2})
 
 	// parse packet
-	// TODO: escaping
 	packet = packet[:len(packet)-1] // drop starting '#'
 	if len(packet) == 0 {
 		return "", nil
@@ -299,6 +407,21 @@ func gdbRecvPacket(conn *bufio.ReadWriter) (string, error) {
 		return "", errors.New("checksum mismatch")
 	}
 
+	// Binary data (in X and vFlashWrite packets) has '#', '$', '*' and '}'
+	// escaped as '}' followed by the character xor 0x20.
+	if strings.IndexByte(packet, '}') >= 0 {
+		buf := make([]byte, 0, len(packet))
+		for i := 0; i < len(packet); i++ {
+			if packet[i] == '}' && i+1 < len(packet) {
+				i++
+				buf = append(buf, packet[i]^0x20)
+			} else {
+				buf = append(buf, packet[i])
+			}
+		}
+		packet = string(buf)
+	}
+
 	return packet, nil
 }
 
@@ -310,7 +433,10 @@ func gdbSendPacket(conn *bufio.ReadWriter, msg string) error {
 	if err != nil {
 		return err
 	}
-	return nil
+	// Make sure the packet is sent, before we deadlock because GDB is still
+	// waiting on our packet while we're waiting on GDB's next packet. This
+	// includes error responses that skip the rest of the loop in gdbHandle.
+	return conn.Flush()
 }
 
 // Calculate the checksum over the payload of an RSP packet.
@@ -0,0 +1,8 @@
+//go:build jit
+
+package main
+
+// Build the x86-64 JIT compiler into the C library, see machine_jit.inc.
+
+// #cgo CFLAGS: -DMACHINE_JIT=1
+import "C"
@@ -0,0 +1,505 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "loader.h"
+
+// This file loads firmware from a raw binary, an ELF file (the PT_LOAD
+// segments, at their physical address) or an Intel HEX file.
+// The flash contents become an image that machines share (see
+// machine_share_image), so one loader_t can be applied to many machines.
+// Parts of the file that have the same alignment within a host page as their
+// flash address are mapped copy-on-write into the image instead of being
+// read, so they are only loaded when they are used. Data for RAM is copied
+// into the machine by loader_apply().
+
+#define LOADER_RAM_START (0x20000000)
+
+// ELF definitions, only what's needed for 32-bit little-endian ARM files.
+#define LOADER_EM_ARM     (40)
+#define LOADER_PT_LOAD    (1)
+#define LOADER_SHT_SYMTAB (2)
+#define LOADER_STT_NOTYPE (0)
+#define LOADER_STT_FUNC   (2)
+
+typedef struct {
+	uint8_t  ident[16];
+	uint16_t type;
+	uint16_t machine;
+	uint32_t version;
+	uint32_t entry;
+	uint32_t phoff;
+	uint32_t shoff;
+	uint32_t flags;
+	uint16_t ehsize;
+	uint16_t phentsize;
+	uint16_t phnum;
+	uint16_t shentsize;
+	uint16_t shnum;
+	uint16_t shstrndx;
+} loader_elf_header_t;
+
+typedef struct {
+	uint32_t type;
+	uint32_t offset;
+	uint32_t vaddr;
+	uint32_t paddr;
+	uint32_t filesz;
+	uint32_t memsz;
+	uint32_t flags;
+	uint32_t align;
+} loader_elf_phdr_t;
+
+typedef struct {
+	uint32_t name;
+	uint32_t type;
+	uint32_t flags;
+	uint32_t addr;
+	uint32_t offset;
+	uint32_t size;
+	uint32_t link;
+	uint32_t info;
+	uint32_t addralign;
+	uint32_t entsize;
+} loader_elf_shdr_t;
+
+typedef struct {
+	uint32_t name;
+	uint32_t value;
+	uint32_t size;
+	uint8_t  info;
+	uint8_t  other;
+	uint16_t shndx;
+} loader_elf_sym_t;
+
+// Data to write to RAM.
+typedef struct {
+	uint32_t address;
+	size_t size;
+	uint8_t *data;
+} loader_segment_t;
+
+struct loader {
+	const char *path;
+	const uint8_t *file; // the whole file, mapped read-only (NULL when empty)
+	size_t file_size;
+	int fd;
+	size_t host_pagesize;
+
+	uint8_t *image; // image_size bytes of flash, mapped read-only when loaded
+	size_t image_size;
+	size_t map_size; // image_size rounded up to host pages
+	size_t ram_size;
+
+	loader_segment_t *ram;
+	size_t num_ram;
+
+	machine_symbol_t *symbols; // names point into the file
+	size_t num_symbols;
+
+	loader_mapping_t *mappings; // $a, $t and $d symbols, sorted by address
+	size_t num_mappings;
+};
+
+static bool loader_error(loader_t *loader, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "%s: ", loader->path);
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+	va_end(args);
+	return false;
+}
+
+// Copy size bytes at the given offset of the file, if the file is big enough.
+static bool loader_read(loader_t *loader, void *buf, uint64_t offset, size_t size) {
+	if (offset + size > loader->file_size) {
+		return false;
+	}
+	memcpy(buf, loader->file + offset, size);
+	return true;
+}
+
+// Put data in flash. When the data is part of the file, host pages that are
+// completely covered by it are mapped from the file instead of copied.
+static void loader_put_flash(loader_t *loader, uint32_t address, const uint8_t *data, size_t size) {
+	size_t start = address, end = address + size;
+	size_t mapped_start = start, mapped_end = start; // nothing mapped
+	size_t mask = loader->host_pagesize - 1;
+	if (loader->file != NULL && data >= loader->file && data < loader->file + loader->file_size) {
+		size_t offset = data - loader->file;
+		if (((offset - start) & mask) == 0 && ((start + mask) & ~mask) < (end & ~mask)) {
+			mapped_start = (start + mask) & ~mask;
+			mapped_end = end & ~mask;
+			void *p = mmap(loader->image + mapped_start, mapped_end - mapped_start, PROT_READ, MAP_PRIVATE | MAP_FIXED, loader->fd, offset + (mapped_start - start));
+			if (p == MAP_FAILED) {
+				mapped_start = mapped_end = start; // copy instead
+			}
+		}
+	}
+	memcpy(loader->image + start, data, mapped_start - start);
+	memcpy(loader->image + mapped_end, data + (mapped_end - start), end - mapped_end);
+}
+
+// Keep a copy of data for RAM, merged with the previous data if it follows
+// directly.
+static bool loader_put_ram(loader_t *loader, uint32_t address, const uint8_t *data, size_t size) {
+	loader_segment_t *last = loader->num_ram != 0 ? &loader->ram[loader->num_ram - 1] : NULL;
+	if (last != NULL && last->address + last->size == address) {
+		uint8_t *buf = realloc(last->data, last->size + size);
+		if (buf == NULL) {
+			return loader_error(loader, "out of memory");
+		}
+		memcpy(buf + last->size, data, size);
+		last->data = buf;
+		last->size += size;
+		return true;
+	}
+	loader_segment_t *ram = realloc(loader->ram, (loader->num_ram + 1) * sizeof(loader_segment_t));
+	uint8_t *buf = malloc(size);
+	if (ram != NULL) {
+		loader->ram = ram;
+	}
+	if (ram == NULL || buf == NULL) {
+		free(buf);
+		return loader_error(loader, "out of memory");
+	}
+	memcpy(buf, data, size);
+	loader->ram[loader->num_ram++] = (loader_segment_t){address, size, buf};
+	return true;
+}
+
+static bool loader_put(loader_t *loader, uint32_t address, const uint8_t *data, size_t size) {
+	if (address + (uint64_t)size <= loader->image_size) {
+		loader_put_flash(loader, address, data, size);
+		return true;
+	}
+	if (address >= LOADER_RAM_START && address - LOADER_RAM_START + (uint64_t)size <= loader->ram_size) {
+		return loader_put_ram(loader, address, data, size);
+	}
+	return loader_error(loader, "0x%x bytes at 0x%08x don't fit in flash or RAM", (unsigned)size, address);
+}
+
+static int loader_compare_symbols(const void *a, const void *b) {
+	const machine_symbol_t *sa = a, *sb = b;
+	return sa->start < sb->start ? -1 : sa->start > sb->start;
+}
+
+static int loader_compare_mappings(const void *a, const void *b) {
+	const loader_mapping_t *ma = a, *mb = b;
+	return ma->address < mb->address ? -1 : ma->address > mb->address;
+}
+
+// Whether a symbol name is an ARM mapping symbol ($a, $t or $d, optionally
+// followed by a dot and anything), which marks the start of code or data.
+static bool loader_is_mapping(const char *name) {
+	return name[0] == '$' && (name[1] == 'a' || name[1] == 't' || name[1] == 'd') && (name[2] == 0 || name[2] == '.');
+}
+
+// Read the function symbols and the mapping symbols of an ELF file, if it has
+// a symbol table.
+static bool loader_elf_symbols(loader_t *loader, const loader_elf_header_t *header) {
+	for (size_t i = 0; i < header->shnum; i++) {
+		loader_elf_shdr_t symtab, strtab;
+		if (!loader_read(loader, &symtab, header->shoff + (uint64_t)i * header->shentsize, sizeof(symtab))) {
+			return loader_error(loader, "truncated section header");
+		}
+		if (symtab.type != LOADER_SHT_SYMTAB) {
+			continue;
+		}
+		if (symtab.link >= header->shnum ||
+			!loader_read(loader, &strtab, header->shoff + (uint64_t)symtab.link * header->shentsize, sizeof(strtab)) ||
+			(uint64_t)strtab.offset + strtab.size > loader->file_size ||
+			(uint64_t)symtab.offset + symtab.size > loader->file_size) {
+			return loader_error(loader, "invalid symbol table");
+		}
+		const char *strings = (const char*)loader->file + strtab.offset;
+		size_t count = symtab.size / sizeof(loader_elf_sym_t);
+		loader->symbols = malloc(count * sizeof(machine_symbol_t));
+		loader->mappings = malloc(count * sizeof(loader_mapping_t));
+		if ((loader->symbols == NULL || loader->mappings == NULL) && count != 0) {
+			return loader_error(loader, "out of memory");
+		}
+		for (size_t j = 0; j < count; j++) {
+			loader_elf_sym_t sym;
+			memcpy(&sym, loader->file + symtab.offset + j * sizeof(sym), sizeof(sym));
+			if (sym.name >= strtab.size || memchr(strings + sym.name, 0, strtab.size - sym.name) == NULL) {
+				continue;
+			}
+			const char *name = strings + sym.name;
+			if ((sym.info & 0xf) == LOADER_STT_NOTYPE && loader_is_mapping(name)) {
+				loader->mappings[loader->num_mappings++] = (loader_mapping_t){sym.value, name[1] == 'd'};
+			}
+			if ((sym.info & 0xf) != LOADER_STT_FUNC) {
+				continue;
+			}
+			uint32_t start = sym.value & ~1; // clear the Thumb bit
+			loader->symbols[loader->num_symbols++] = (machine_symbol_t){start, sym.size, name};
+		}
+		qsort(loader->symbols, loader->num_symbols, sizeof(machine_symbol_t), loader_compare_symbols);
+		qsort(loader->mappings, loader->num_mappings, sizeof(loader_mapping_t), loader_compare_mappings);
+		return true;
+	}
+	return true; // stripped
+}
+
+static bool loader_load_elf(loader_t *loader) {
+	loader_elf_header_t header;
+	if (!loader_read(loader, &header, 0, sizeof(header))) {
+		return loader_error(loader, "truncated ELF header");
+	}
+	if (header.ident[4] != 1 || header.ident[5] != 1 || header.machine != LOADER_EM_ARM) {
+		return loader_error(loader, "not a 32-bit little-endian ARM ELF file");
+	}
+	if ((header.phnum != 0 && header.phentsize < sizeof(loader_elf_phdr_t)) ||
+		(header.shnum != 0 && header.shentsize < sizeof(loader_elf_shdr_t))) {
+		return loader_error(loader, "invalid ELF header");
+	}
+	for (size_t i = 0; i < header.phnum; i++) {
+		loader_elf_phdr_t phdr;
+		if (!loader_read(loader, &phdr, header.phoff + (uint64_t)i * header.phentsize, sizeof(phdr))) {
+			return loader_error(loader, "truncated program header");
+		}
+		if (phdr.type != LOADER_PT_LOAD || phdr.filesz == 0) {
+			continue; // .bss is cleared by the firmware
+		}
+		if ((uint64_t)phdr.offset + phdr.filesz > loader->file_size) {
+			return loader_error(loader, "truncated segment at 0x%08x", phdr.paddr);
+		}
+		// Load at the physical address, like objcopy does. For example
+		// .data is stored in flash and copied to RAM by the firmware.
+		if (!loader_put(loader, phdr.paddr, loader->file + phdr.offset, phdr.filesz)) {
+			return false;
+		}
+	}
+	return loader_elf_symbols(loader, &header);
+}
+
+static int loader_hex_digit(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+static bool loader_load_hex(loader_t *loader) {
+	const char *p = (const char*)loader->file;
+	const char *end = p + loader->file_size;
+	uint32_t base = 0; // from extended address records
+	for (int line = 1; p < end; line++) {
+		const char *start = p;
+		const char *eol = memchr(p, '\n', end - p);
+		p = eol != NULL ? eol + 1 : end;
+		if (eol == NULL) {
+			eol = end;
+		}
+		while (eol > start && (eol[-1] == '\r' || eol[-1] == ' ' || eol[-1] == '\t')) {
+			eol--;
+		}
+		if (eol == start) {
+			continue; // empty line
+		}
+
+		// A record is ":" followed by the byte count, a 16-bit address, the
+		// type, the data and a checksum, all in hexadecimal.
+		uint8_t record[5 + 255];
+		size_t length = (eol - start - 1) / 2;
+		if (*start != ':' || (eol - start) % 2 != 1 || length < 5 || length > sizeof(record)) {
+			return loader_error(loader, "line %d: invalid record", line);
+		}
+		uint8_t sum = 0;
+		for (size_t i = 0; i < length; i++) {
+			int high = loader_hex_digit(start[1 + i * 2]);
+			int low = loader_hex_digit(start[2 + i * 2]);
+			if (high < 0 || low < 0) {
+				return loader_error(loader, "line %d: invalid record", line);
+			}
+			record[i] = high << 4 | low;
+			sum += record[i];
+		}
+		if (record[0] + 5 != length || sum != 0) {
+			return loader_error(loader, "line %d: invalid length or checksum", line);
+		}
+		uint32_t address = record[1] << 8 | record[2];
+		const uint8_t *data = &record[4];
+		switch (record[3]) {
+		case 0: // data
+			if (!loader_put(loader, base + address, data, record[0])) {
+				return false;
+			}
+			break;
+		case 1: // end of file
+			return true;
+		case 2: // extended segment address
+		case 4: // extended linear address
+			if (record[0] != 2) {
+				return loader_error(loader, "line %d: invalid address record", line);
+			}
+			base = (data[0] << 8 | data[1]) << (record[3] == 2 ? 4 : 16);
+			break;
+		case 3: // start segment address
+		case 5: // start linear address
+			break; // the reset vector is used instead
+		default:
+			return loader_error(loader, "line %d: unknown record type %d", line, record[3]);
+		}
+	}
+	return true;
+}
+
+// Load a firmware file for machines with the given flash (image) and RAM
+// size. The file type is detected from its contents: anything that isn't an
+// ELF or Intel HEX file is a raw image of flash. Returns NULL (after printing
+// an error) when the file can't be loaded.
+loader_t * loader_open(const char *path, size_t image_size, size_t ram_size) {
+	loader_t *loader = calloc(1, sizeof(loader_t));
+	if (loader == NULL) {
+		return NULL;
+	}
+	loader->path = path;
+	loader->image_size = image_size;
+	loader->ram_size = ram_size;
+	loader->host_pagesize = sysconf(_SC_PAGESIZE);
+	loader->map_size = (image_size + loader->host_pagesize - 1) & ~(loader->host_pagesize - 1);
+	loader->image = MAP_FAILED;
+
+	struct stat st;
+	loader->fd = open(path, O_RDONLY);
+	if (loader->fd < 0 || fstat(loader->fd, &st) != 0) {
+		perror(path);
+		loader_free(loader);
+		return NULL;
+	}
+	loader->file_size = st.st_size;
+	if (loader->file_size != 0) {
+		void *file = mmap(NULL, loader->file_size, PROT_READ, MAP_PRIVATE, loader->fd, 0);
+		if (file == MAP_FAILED) {
+			perror(path);
+			loader_free(loader);
+			return NULL;
+		}
+		loader->file = file;
+	}
+	loader->image = mmap(NULL, loader->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (loader->image == MAP_FAILED) {
+		perror(path);
+		loader_free(loader);
+		return NULL;
+	}
+	memset(loader->image, 0xff, image_size); // erased flash
+
+	bool ok;
+	if (loader->file_size >= 4 && memcmp(loader->file, "\x7f" "ELF", 4) == 0) {
+		ok = loader_load_elf(loader);
+	} else if (loader->file_size != 0 && loader->file[0] == ':') {
+		ok = loader_load_hex(loader);
+	} else if (loader->file_size > image_size) {
+		ok = loader_error(loader, "file too big");
+	} else {
+		ok = loader->file_size == 0 || loader_put(loader, 0, loader->file, loader->file_size);
+	}
+	close(loader->fd);
+	loader->fd = -1;
+	if (!ok) {
+		loader_free(loader);
+		return NULL;
+	}
+	// Machines never write to a shared image.
+	mprotect(loader->image, loader->map_size, PROT_READ);
+	return loader;
+}
+
+// Load the firmware into a machine, before machine_reset(). The loader must
+// stay alive until the machine is freed.
+void loader_apply(const loader_t *loader, machine_t *machine) {
+	machine_share_image(machine, loader->image);
+	for (size_t i = 0; i < loader->num_ram; i++) {
+		const loader_segment_t *segment = &loader->ram[i];
+		machine_writemem(machine, segment->data, segment->address, segment->size);
+	}
+	machine_set_symbols(machine, loader->symbols, loader->num_symbols);
+}
+
+// Return the flash image, for example to look at the code.
+const uint8_t * loader_image(const loader_t *loader, size_t *size) {
+	*size = loader->image_size;
+	return loader->image;
+}
+
+// Whether the address is in data (like a literal pool) between the code,
+// according to the mapping symbols of the ELF file. Addresses without a
+// mapping symbol before them are taken to be code.
+bool loader_is_data(const loader_t *loader, uint32_t address) {
+	size_t low = 0, high = loader->num_mappings;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (loader->mappings[mid].address <= address) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low > 0 && loader->mappings[low - 1].data;
+}
+
+// Return the contents of the ELF section with the given name (for example
+// ".debug_line"), or NULL when the file doesn't have it.
+const uint8_t * loader_section(const loader_t *loader, const char *name, size_t *size) {
+	loader_elf_header_t header;
+	loader_elf_shdr_t names;
+	if (loader->file_size < sizeof(header) || memcmp(loader->file, "\x7f" "ELF", 4) != 0) {
+		return NULL;
+	}
+	memcpy(&header, loader->file, sizeof(header));
+	if (header.shstrndx >= header.shnum ||
+		(uint64_t)header.shoff + (uint64_t)header.shnum * header.shentsize > loader->file_size) {
+		return NULL;
+	}
+	memcpy(&names, loader->file + header.shoff + header.shstrndx * header.shentsize, sizeof(names));
+	if ((uint64_t)names.offset + names.size > loader->file_size) {
+		return NULL;
+	}
+	size_t length = strlen(name);
+	for (size_t i = 0; i < header.shnum; i++) {
+		loader_elf_shdr_t shdr;
+		memcpy(&shdr, loader->file + header.shoff + i * header.shentsize, sizeof(shdr));
+		if (shdr.name < names.size && names.size - shdr.name > length &&
+			memcmp(loader->file + names.offset + shdr.name, name, length + 1) == 0 &&
+			(uint64_t)shdr.offset + shdr.size <= loader->file_size) {
+			*size = shdr.size;
+			return loader->file + shdr.offset;
+		}
+	}
+	return NULL;
+}
+
+void loader_free(loader_t *loader) {
+	if (loader->fd >= 0) {
+		close(loader->fd);
+	}
+	if (loader->image != MAP_FAILED) {
+		munmap(loader->image, loader->map_size);
+	}
+	if (loader->file != NULL) {
+		munmap((void*)loader->file, loader->file_size);
+	}
+	for (size_t i = 0; i < loader->num_ram; i++) {
+		free(loader->ram[i].data);
+	}
+	free(loader->ram);
+	free(loader->symbols);
+	free(loader->mappings);
+	free(loader);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "machine.h"
+
+// Firmware loaded from a raw binary, ELF or Intel HEX file, see loader.c.
+typedef struct loader loader_t;
+
+// The start of code or data in the flash image, from an ARM mapping symbol.
+typedef struct {
+	uint32_t address;
+	bool data;
+} loader_mapping_t;
+
+loader_t * loader_open(const char *path, size_t image_size, size_t ram_size);
+void loader_apply(const loader_t *loader, machine_t *machine);
+const uint8_t * loader_image(const loader_t *loader, size_t *size);
+const uint8_t * loader_section(const loader_t *loader, const char *name, size_t *size);
+bool loader_is_data(const loader_t *loader, uint32_t address);
+void loader_free(loader_t *loader);
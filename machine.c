@@ -1,8 +1,16 @@
 
+#define _POSIX_C_SOURCE 200809L // for clock_gettime and nanosleep
+#if MACHINE_JIT
+#define _GNU_SOURCE // for MAP_ANONYMOUS and REG_RIP
+#endif
+
 #include "machine.h"
-#include "terminal.h"
+#include "machine_internal.h"
+#include "nrf.h"
 
+#include <stdatomic.h>
 #include <string.h>
+#include <time.h>
 
 // This file implements the CPU core and memory subsystem.
 // For more information on the instruction set, see:
@@ -10,199 +18,1162 @@
 // http://hermes.wings.cs.wisc.edu/files/Thumb-2SupplementReferenceManual.pdf
 // https://www.heyrick.co.uk/armwiki/The_Status_register
 
-#ifdef __EMSCRIPTEN__
 
-#include <emscripten.h>
+// Opcode IDs for predecoded instructions, see machine_ops.inc for their
+// implementation. Most Thumb (16-bit) instructions and the 32-bit data
+// processing instructions get their own ID, other 32-bit instructions are
+// handled by machine_step_thumb2().
+#define MACHINE_OPS(X) \
+	X(NONE) /* not yet decoded */ \
+	X(UNDEFINED) \
+	X(NOP) \
+	X(END) /* end of a basic block (not an instruction) */ \
+	/* Format 1, 2, 3: shifts, add/subtract, immediates */ \
+	X(LSLS_IMM) \
+	X(LSRS_IMM) \
+	X(ASRS_IMM) \
+	X(ADDS_REG) \
+	X(SUBS_REG) \
+	X(ADDS_IMM) \
+	X(SUBS_IMM) \
+	X(MOVS_IMM) \
+	X(CMP_IMM) \
+	/* Format 4: ALU operations */ \
+	X(ANDS) \
+	X(EORS) \
+	X(LSLS_REG) \
+	X(LSRS_REG) \
+	X(ASRS_REG) \
+	X(ADCS) \
+	X(SBCS) \
+	X(TST) \
+	X(RSBS) \
+	X(CMP_REG) \
+	X(CMN) \
+	X(ORRS) \
+	X(MULS) \
+	X(BICS) \
+	X(MVNS) \
+	X(RORS_REG) \
+	/* Format 5: hi register operations/branch exchange */ \
+	X(ADD_HI) \
+	X(MOV_HI) \
+	X(BX) \
+	X(BLX) \
+	/* Format 6 .. 11: load/store */ \
+	X(LDR_LIT) \
+	X(STR_REG) \
+	X(STRB_REG) \
+	X(LDR_REG) \
+	X(LDRB_REG) \
+	X(STRH_REG) \
+	X(LDRH_REG) \
+	X(LDRSB_REG) \
+	X(LDRSH_REG) \
+	X(STR_IMM) \
+	X(LDR_IMM) \
+	X(STRB_IMM) \
+	X(LDRB_IMM) \
+	X(STRH_IMM) \
+	X(LDRH_IMM) \
+	/* Format 12, 13: load address, add offset to SP */ \
+	X(MOV_IMM32) \
+	X(ADD_IMM) \
+	X(ADD_SP_IMM) \
+	X(SUB_SP_IMM) \
+	/* Misc 16-bit instructions */ \
+	X(SXTH) \
+	X(SXTB) \
+	X(UXTH) \
+	X(UXTB) \
+	X(CBZ) \
+	X(CBNZ) \
+	X(REV) \
+	X(REV16) \
+	X(REVSH) \
+	X(BKPT) \
+	X(IT) \
+	X(CPS) \
+	X(SVC) \
+	X(WFI) /* also WFE */ \
+	X(SEV) \
+	/* Format 14, 15: push/pop, multiple load/store */ \
+	X(PUSH) \
+	X(POP) \
+	X(STMIA) \
+	X(LDMIA) \
+	/* Format 16, 18: branches */ \
+	X(BCOND) \
+	X(B) \
+	/* Native implementation of a function, see machine_set_hook() */ \
+	X(HOOK) \
+	/* 32-bit instructions (must be at the end, see machine_op_is_32bit) */ \
+	X(BL) \
+	/* 32-bit data processing, modified or plain immediate */ \
+	X(T2_AND_IMM) \
+	X(T2_TST_IMM) \
+	X(T2_BIC_IMM) \
+	X(T2_ORR_IMM) \
+	X(T2_MOV_IMM) /* also MOVW and ADR */ \
+	X(T2_ORN_IMM) \
+	X(T2_MVN_IMM) \
+	X(T2_EOR_IMM) \
+	X(T2_TEQ_IMM) \
+	X(T2_ADD_IMM) /* also ADDW */ \
+	X(T2_CMN_IMM) \
+	X(T2_ADC_IMM) \
+	X(T2_SBC_IMM) \
+	X(T2_SUB_IMM) /* also SUBW */ \
+	X(T2_CMP_IMM) \
+	X(T2_RSB_IMM) \
+	X(T2_MOVT) \
+	/* 32-bit data processing, shifted register */ \
+	X(T2_AND_REG) \
+	X(T2_TST_REG) \
+	X(T2_BIC_REG) \
+	X(T2_ORR_REG) \
+	X(T2_MOV_REG) /* also shifts by a constant and RRX */ \
+	X(T2_ORN_REG) \
+	X(T2_MVN_REG) \
+	X(T2_EOR_REG) \
+	X(T2_TEQ_REG) \
+	X(T2_PKHBT) \
+	X(T2_PKHTB) \
+	X(T2_ADD_REG) \
+	X(T2_CMN_REG) \
+	X(T2_ADC_REG) \
+	X(T2_SBC_REG) \
+	X(T2_SUB_REG) \
+	X(T2_CMP_REG) \
+	X(T2_RSB_REG) \
+	X(T2_LSL_REG) \
+	X(T2_LSR_REG) \
+	X(T2_ASR_REG) \
+	X(T2_ROR_REG) \
+	/* Bitfield and saturate */ \
+	X(T2_BFI) \
+	X(T2_BFC) \
+	X(T2_UBFX) \
+	X(T2_SBFX) \
+	X(T2_SSAT) \
+	X(T2_USAT) \
+	X(T2_SSAT16) \
+	X(T2_USAT16) \
+	/* Sign or zero extend, with optional addition */ \
+	X(T2_SXTB) \
+	X(T2_SXTH) \
+	X(T2_UXTB) \
+	X(T2_UXTH) \
+	X(T2_SXTB16) \
+	X(T2_UXTB16) \
+	X(T2_SXTAB) \
+	X(T2_SXTAH) \
+	X(T2_UXTAB) \
+	X(T2_UXTAH) \
+	X(T2_SXTAB16) \
+	X(T2_UXTAB16) \
+	/* Parallel add/subtract, saturating arithmetic, miscellaneous */ \
+	X(T2_PARALLEL) /* see machine_parallel() */ \
+	X(T2_QADD) \
+	X(T2_QSUB) \
+	X(T2_QDADD) \
+	X(T2_QDSUB) \
+	X(T2_REV) \
+	X(T2_REV16) \
+	X(T2_RBIT) \
+	X(T2_REVSH) \
+	X(T2_SEL) \
+	X(T2_CLZ) \
+	/* Multiply, multiply accumulate and absolute difference */ \
+	X(T2_MUL) \
+	X(T2_MLA) \
+	X(T2_MLS) \
+	X(T2_SMULXY) \
+	X(T2_SMLAXY) \
+	X(T2_SMULWY) \
+	X(T2_SMLAWY) \
+	X(T2_SMUAD) \
+	X(T2_SMLAD) \
+	X(T2_SMUSD) \
+	X(T2_SMLSD) \
+	X(T2_SMMUL) \
+	X(T2_SMMLA) \
+	X(T2_SMMLS) \
+	X(T2_USAD8) \
+	X(T2_USADA8) \
+	/* Long multiply, long multiply accumulate and divide */ \
+	X(T2_SMULL) \
+	X(T2_UMULL) \
+	X(T2_SMLAL) \
+	X(T2_UMLAL) \
+	X(T2_UMAAL) \
+	X(T2_SMLALXY) \
+	X(T2_SMLALD) \
+	X(T2_SMLSLD) \
+	X(T2_SDIV) \
+	X(T2_UDIV) \
+	/* all other 32-bit instructions */ \
+	X(THUMB2)
 
-// Implemented in JavaScript.
-void *wasm_malloc(size_t size);
-#define malloc wasm_malloc
-#define calloc(size, nmemb) wasm_malloc(size * nmemb)
+enum {
+#define MACHINE_OP_ENUM(name) OP_##name,
+	MACHINE_OPS(MACHINE_OP_ENUM)
+#undef MACHINE_OP_ENUM
+};
 
-#define machine_versioncheck(machine, core) (false)
-#define machine_loglevel(machine) (0)
-#define machine_log(machine, level, ...) ((false) ? fprintf(stderr, __VA_ARGS__) : 0)
+static inline bool machine_op_is_32bit(uint8_t op) {
+	return op >= OP_BL;
+}
 
-#define KEEPALIVE EMSCRIPTEN_KEEPALIVE
+// Timing model: the number of cycles each instruction takes on top of the
+// first, for the Cortex-M0 and the Cortex-M4 (see the technical reference
+// manuals). Multiple load/store instructions take one more cycle for each
+// register and taken branches take MACHINE_BRANCH_PENALTY cycles to refill
+// the pipeline. This is only an approximation: wait states, pipelined loads
+// and stores on the M4 and the timing of most 32-bit instructions aren't
+// modelled.
+static const uint8_t machine_op_cycles[OP_THUMB2 + 1][2] = {
+	[OP_LDR_LIT]   = {1, 1},
+	[OP_STR_REG]   = {1, 1},
+	[OP_STRB_REG]  = {1, 1},
+	[OP_LDR_REG]   = {1, 1},
+	[OP_LDRB_REG]  = {1, 1},
+	[OP_STRH_REG]  = {1, 1},
+	[OP_LDRH_REG]  = {1, 1},
+	[OP_LDRSB_REG] = {1, 1},
+	[OP_LDRSH_REG] = {1, 1},
+	[OP_STR_IMM]   = {1, 1},
+	[OP_LDR_IMM]   = {1, 1},
+	[OP_STRB_IMM]  = {1, 1},
+	[OP_LDRB_IMM]  = {1, 1},
+	[OP_STRH_IMM]  = {1, 1},
+	[OP_LDRH_IMM]  = {1, 1},
+	[OP_BL]        = {1, 0},
+	[OP_T2_MLA]    = {0, 1},
+	[OP_T2_MLS]    = {0, 1},
+	[OP_T2_SDIV]   = {0, 6}, // 2 to 12 cycles, depending on the operands
+	[OP_T2_UDIV]   = {0, 6},
+	[OP_THUMB2]    = {3, 0}, // on the M0 only MRS, MSR and barriers
+};
 
-#else // all other compilers
+#define MACHINE_BRANCH_PENALTY (2)
 
-#include <stdio.h>
+static inline uint32_t machine_instr_cycles(const machine_decoded_t *d, machine_core_t core) {
+	uint32_t cycles = 1 + machine_op_cycles[d->op][core == CORTEX_M4];
+	if (d->op == OP_PUSH || d->op == OP_POP || d->op == OP_STMIA || d->op == OP_LDMIA) {
+		for (uint32_t list = d->imm; list != 0; list &= list - 1) {
+			cycles++;
+		}
+	}
+	return cycles;
+}
 
-// TODO: make this configurable
-#define machine_versioncheck(machine, core) (true)
-#define machine_loglevel(machine) (machine->loglevel)
-#define machine_log(machine, level, ...) ((machine->loglevel >= level) ? fprintf(stderr, __VA_ARGS__) : 0)
+static inline void machine_decode_set(machine_decoded_t *d, uint8_t op, uint8_t rd, uint8_t rn, uint8_t rm, uint32_t imm) {
+	d->op = op;
+	d->rd = rd;
+	d->rn = rn;
+	d->rm = rm;
+	d->imm = imm;
+}
 
-#define KEEPALIVE
+// Invalidate all predecoded instructions that overlap with the given range
+// of the flash image. Must be called whenever the image is written to.
+static void machine_invalidate(machine_t *machine, uint32_t address, size_t length) {
+	// A 32-bit instruction starting just before the range also covers it.
+	size_t start = address >= 2 ? (address - 2) / 2 : 0;
+	size_t end = (address + length + 1) / 2;
+	if (end > machine->image_size / 2) {
+		end = machine->image_size / 2;
+	}
+	for (size_t i = start; i < end; i++) {
+		machine->decoded[i].op = OP_NONE;
+	}
 
-#endif
+	if (machine->blocks == NULL) {
+		return;
+	}
+	// Remove all blocks that overlap with the range. They may still be
+	// executing, so only free them in machine_block_lookup().
+	start = start > MACHINE_BLOCK_MAX * 2 ? start - MACHINE_BLOCK_MAX * 2 : 0;
+	for (size_t i = start; i < end; i++) {
+		machine_block_t *block = machine->blocks[i];
+		if (block != NULL && i * 2 + block->size > address) {
+			machine->blocks[i] = NULL;
+			block->next = machine->blocks_garbage;
+			machine->blocks_garbage = block;
+		}
+	}
+}
 
-static int machine_transfer(machine_t *machine, uint32_t address, transfer_type_t transfer_type, uint32_t *reg, width_t width, bool signextend) {
-	// Select memory region
-	uint32_t region = address >> 29; // 3 bits for the region
-	uint32_t region_address = address & (0xffffffff >> 3);
-
-	void *ptr = 0;
-	if (region == 0) {
-		// code: 0x00000000 .. 0x1fffffff
-		if (region_address < machine->image_size) {
-			ptr = &machine->image8[region_address];
-		} else if (transfer_type == LOAD && address == 0x10000130) {
-			*reg = 0; // undocumented, but somewhere in FICR
-			return 0;
-		} else if (address == 0x10001200) {
-			ptr = &machine->uicr.pselreset[0];
-		} else if (address == 0x10001204) {
-			ptr = &machine->uicr.pselreset[1];
-		}
-		if (transfer_type == STORE && ptr != NULL) {
-			if ((address & 3) != 0 || width != WIDTH_32) {
-				machine_log(machine, LOG_ERROR, "ERROR: unaligned write to read-only memory (PC: %x, ptr: 0x%x)\n", machine->pc - 3, address);
-				return ERR_MEM;
-			}
-			if (!machine->image_writable) {
-				machine_log(machine, LOG_ERROR, "ERROR: write to read-only memory (PC: %x, ptr: 0x%x)\n", machine->pc - 3, address);
-				return ERR_MEM;
-			}
+int machine_invalid_address(machine_t *machine, uint32_t address, transfer_type_t transfer_type, uint32_t value) {
+	if (transfer_type == LOAD) {
+		machine_log(machine, LOG_ERROR, "\nERROR: invalid load address: 0x%08x (PC: %x)\n", address, machine->pc - 3);
+	} else {
+		machine_log(machine, LOG_ERROR, "\nERROR: invalid store address: 0x%08x (PC: %x, value: %x)\n", address, machine->pc - 3, value);
+	}
+	return ERR_MEM;
+}
 
-			// Emulate NOR memory where bits can only be cleared.
-			*(uint32_t*)ptr &= *reg;
-			return 0;
+static inline bool machine_is_aligned(machine_t *machine, uint32_t address, width_t width) {
+	// Note: Cortex-M4 supports unaligned memory accesses when enabled.
+	return (address & ((1 << width) - 1)) == 0 || machine_versioncheck(machine, CORTEX_M4);
+}
+
+static int machine_unaligned(machine_t *machine, uint32_t address, transfer_type_t transfer_type) {
+	machine_log(machine, LOG_ERROR, "\nERROR: unaligned %s address: 0x%08x (PC: %x)\n", transfer_type == LOAD ? "load" : "store", address, machine->pc - 3);
+	return ERR_MEM;
+}
+
+int machine_nor_write(machine_t *machine, uint32_t *ptr, uint32_t address, uint32_t value, width_t width) {
+	if ((address & 3) != 0 || width != WIDTH_32) {
+		machine_log(machine, LOG_ERROR, "ERROR: unaligned write to read-only memory (PC: %x, ptr: 0x%x)\n", machine->pc - 3, address);
+		return ERR_MEM;
+	}
+	if (!machine->image_writable) {
+		machine_log(machine, LOG_ERROR, "ERROR: write to read-only memory (PC: %x, ptr: 0x%x)\n", machine->pc - 3, address);
+		return ERR_MEM;
+	}
+
+	// Emulate NOR memory where bits can only be cleared.
+	*ptr &= value;
+	return 0;
+}
+
+int machine_peripheral_unknown(machine_t *machine, uint32_t address, transfer_type_t transfer_type, uint32_t value) {
+	machine_log(machine, LOG_WARN, "unknown %s peripheral address: 0x%08x (value: 0x%x, PC: %x)\n", transfer_type == LOAD ? "load" : "store", address, value, machine->pc - 3);
+	return 0;
+}
+
+static bool machine_image_unshare(machine_t *machine);
+static void machine_sram_unprotect(machine_t *machine, uint32_t offset);
+
+// Flash: only full pages can be read directly, and writes need NOR emulation.
+static int machine_flash_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	if (offset + (1 << width) > machine->image_size) {
+		return machine_invalid_address(machine, offset, LOAD, 0);
+	}
+	if (!machine_is_aligned(machine, offset, width)) {
+		return machine_unaligned(machine, offset, LOAD);
+	}
+	*value = machine_ptr_read(&machine->image8[offset], width);
+	return 0;
+}
+
+static int machine_flash_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	if (offset >= machine->image_size) {
+		return machine_invalid_address(machine, offset, STORE, value);
+	}
+	if (!machine_image_unshare(machine)) {
+		return ERR_MEM;
+	}
+	int err = machine_nor_write(machine, (uint32_t*)&machine->image8[offset & ~3], offset, value, width);
+	if (err == 0) {
+		machine->image_dirty[offset >> MACHINE_PAGE_BITS] = 1;
+		machine_invalidate(machine, offset, 4);
+	}
+	return err;
+}
+
+static const machine_peripheral_ops_t machine_flash_ops = {machine_flash_read, machine_flash_write, NULL, NULL};
+static const machine_peripheral_t machine_flash = {0x00000000, 0x10000000, &machine_flash_ops, NULL, NULL};
+
+bool machine_flash_erase(machine_t *machine, uint32_t address, size_t length) {
+	if (!machine_image_unshare(machine)) {
+		return false;
+	}
+	memset(machine->image8 + address, 0xff, length);
+	for (size_t offset = address & ~MACHINE_PAGE_MASK; offset < address + length; offset += MACHINE_PAGE_SIZE) {
+		machine->image_dirty[offset >> MACHINE_PAGE_BITS] = 1;
+	}
+	machine_invalidate(machine, address, length);
+	return true;
+}
+
+// The last SRAM page, if the SRAM size isn't a multiple of the page size, and
+// the first store to a page after a snapshot (see machine_protect_ram).
+static int machine_sram_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	if (offset + (1 << width) > machine->mem_size) {
+		return machine_invalid_address(machine, 0x20000000 + offset, LOAD, 0);
+	}
+	if (!machine_is_aligned(machine, offset, width)) {
+		return machine_unaligned(machine, 0x20000000 + offset, LOAD);
+	}
+	*value = machine_ptr_read(&machine->mem8[offset], width);
+	return 0;
+}
+
+static int machine_sram_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	if (offset + (1 << width) > machine->mem_size) {
+		return machine_invalid_address(machine, 0x20000000 + offset, STORE, value);
+	}
+	if (!machine_is_aligned(machine, offset, width)) {
+		return machine_unaligned(machine, 0x20000000 + offset, STORE);
+	}
+	// An unaligned store may touch two pages.
+	machine_sram_unprotect(machine, offset);
+	machine_sram_unprotect(machine, offset + (1 << width) - 1);
+	machine_ptr_write(&machine->mem8[offset], value, width);
+	return 0;
+}
+
+static const machine_peripheral_ops_t machine_sram_ops = {machine_sram_read, machine_sram_write, NULL, NULL};
+static const machine_peripheral_t machine_sram = {0x20000000, 0x20000000, &machine_sram_ops, NULL, NULL};
+
+// Priority of an exception, lower numbers are more urgent.
+static int machine_exception_priority(machine_t *machine, uint32_t exception) {
+	if (exception >= 16) {
+		return machine->nvic.ip[exception - 16];
+	}
+	if (exception >= 4) {
+		return machine->scb.shp[exception - 4];
+	}
+	return (int)exception - 4; // reset, NMI and HardFault have a fixed priority
+}
+
+// Return the pending exception that must be taken now, or 0 if there is
+// none. With wakeup set, return the exception that wakes up the CPU from WFI
+// (which ignores PRIMASK).
+static uint32_t machine_exception_next(machine_t *machine, bool wakeup) {
+	uint32_t irqs = machine->nvic.pending & machine->nvic.enabled;
+	uint32_t system = machine->scb.pending;
+	if (irqs == 0 && system == 0) {
+		return 0;
+	}
+
+	// Only exceptions that are more urgent than the ones that are currently
+	// active can preempt.
+	int current = 256; // thread mode
+	for (uint32_t n = 0; n < 16; n++) {
+		if ((machine->scb.active >> n) & 1 && machine_exception_priority(machine, n) < current) {
+			current = machine_exception_priority(machine, n);
 		}
-	} else if (region == 1) {
-		// SRAM: 0x20000000 .. 0x3ffffff
-		if (region_address < machine->mem_size) {
-			ptr = &machine->mem8[region_address];
+	}
+	for (uint32_t n = 0; n < 32; n++) {
+		if ((machine->nvic.active >> n) & 1 && machine_exception_priority(machine, n + 16) < current) {
+			current = machine_exception_priority(machine, n + 16);
 		}
-	} else if (region == 2) {
-		// Peripherals: 0x40000000 .. 0x5fffffff
-		// Make this a special case
-		uint32_t value = 0;
-		if ((address & 3) != 0 || width != WIDTH_32) {
-			machine_log(machine, LOG_ERROR, "\nERROR: invalid %s peripheral address: 0x%08x (PC: %x)\n", transfer_type == LOAD ? "load" : "store", address, machine->pc - 3);
-			return ERR_MEM;
+	}
+	if (machine->primask && current > 0 && !wakeup) {
+		current = 0;
+	}
+
+	uint32_t next = 0;
+	for (uint32_t n = 0; n < 48; n++) {
+		bool pending = n < 16 ? (system >> n) & 1 : (irqs >> (n - 16)) & 1;
+		if (pending && machine_exception_priority(machine, n) < current) {
+			current = machine_exception_priority(machine, n);
+			next = n;
 		}
-		if (transfer_type == STORE && address == 0x40002000) { // STARTRX
-		} else if (transfer_type == STORE && address == 0x40002004) { // STOPRX
-		} else if (transfer_type == STORE && address == 0x40002008) { // STARTTX
-		} else if (transfer_type == STORE && address == 0x4000200c) { // STOPTX
-		} else if (address == 0x40002108) { // RXDRDY
-			value = 1;
-		} else if (address == 0x4000211c) { // TXDRDY
-			value = 1;
-		} else if (address == 0x40002124) { // ERROR
-		} else if (address == 0x40002144) { // RXTO
-		} else if (transfer_type == LOAD && address == 0x40002518) { // RXD
-			value = terminal_getchar();
-		} else if (transfer_type == STORE && address == 0x4000251c) { // TXD
-			terminal_putchar(*reg);
-		} else if (transfer_type == LOAD && address == 0x4000d100) { // RNG.VALRDY
-			value = 1;
-		} else if (transfer_type == LOAD && address == 0x4000d508) { // RNG.VALUE
-			value = rand() & 0xff;
-		} else if (transfer_type == LOAD && address == 0x4001e400) { // NVMC.READY
-			value = 1; // always ready
-		} else if (transfer_type == STORE && address == 0x4001e504) { // NVMC.CONFIG
-			machine->image_writable = *reg != 0;
-		} else if (transfer_type == STORE && address == 0x4001e508) { // NVMC.ERASEPAGE
-			if ((*reg & (machine->pagesize-1)) != 0 || *reg >= machine->image_size) {
-				machine_log(machine, LOG_ERROR, "ERROR: invalid page address: %x (PC: %x)\n", *reg, machine->pc - 3);
-				return ERR_MEM;
+	}
+	return next;
+}
+
+// Must be called after anything that changed the event queue or the
+// exception state.
+static void machine_update_deadline(machine_t *machine) {
+	if (machine->sleeping || machine->reselect || machine_exception_next(machine, false) != 0) {
+		machine->deadline = 0;
+	} else if (machine->events_len != 0) {
+		machine->deadline = machine->events[1]->when;
+	} else {
+		machine->deadline = UINT64_MAX;
+	}
+}
+
+// Returned by the variants of machine_run() when machine_run() must pick
+// another one.
+#define ERR_RESELECT (-1)
+
+// Whether the machine needs a variant of machine_run() with support for
+// logging, tracing and step ranges, see machine_exec.inc. Watchpoints don't
+// need one, they only take the slow path of machine_transfer().
+static inline bool machine_debugging(machine_t *machine) {
+	return machine_loglevel(machine) >= LOG_CALLS || machine->trace != NULL || machine->step_end != 0;
+}
+
+// Let machine_run() pick its variant again after the current instruction or
+// block, when machine_debugging() changed while running. This goes through
+// the deadline check, so that the variants don't need another check.
+static void machine_reselect(machine_t *machine) {
+	machine->reselect = true;
+	machine->deadline = 0;
+}
+
+KEEPALIVE
+void machine_set_irq_pending(machine_t *machine, uint32_t irq) {
+	if (irq < 32) {
+		machine->nvic.pending |= 1 << irq;
+		machine_update_deadline(machine);
+	}
+}
+
+static void machine_events_swap(machine_t *machine, size_t i, size_t j) {
+	machine_event_t *event = machine->events[i];
+	machine->events[i] = machine->events[j];
+	machine->events[j] = event;
+	machine->events[i]->index = i;
+	machine->events[j]->index = j;
+}
+
+// Restore the heap order after the time of events[i] changed.
+static void machine_events_fix(machine_t *machine, size_t i) {
+	while (i > 1 && machine->events[i]->when < machine->events[i / 2]->when) {
+		machine_events_swap(machine, i, i / 2);
+		i /= 2;
+	}
+	while (1) {
+		size_t first = i;
+		for (size_t child = i * 2; child <= i * 2 + 1 && child <= machine->events_len; child++) {
+			if (machine->events[child]->when < machine->events[first]->when) {
+				first = child;
 			}
-			// Emulate erasing NOR flash.
-			memset(machine->image8 + *reg, 0xff, machine->pagesize);
-		} else {
-			machine_log(machine, LOG_WARN, "unknown %s peripheral address: 0x%08x (value: 0x%x, PC: %x)\n", transfer_type == LOAD ? "load" : "store", address, *reg, machine->pc - 3);
 		}
-		if (transfer_type == LOAD) {
-			if (width == WIDTH_8) {
-				value &= 0xff;
-			} else if (width == WIDTH_16) {
-				value &= 0xffff;
-			}
-			*reg = value;
+		if (first == i) {
+			break;
 		}
+		machine_events_swap(machine, i, first);
+		i = first;
+	}
+}
+
+// Call event->fn once the cycle counter reaches when (at the end of a basic
+// block), replacing the previous time if the event was already scheduled.
+// Returns false if the event queue is full.
+bool machine_schedule(machine_t *machine, machine_event_t *event, uint64_t when) {
+	if (event->index == 0) {
+		if (machine->events_len == MACHINE_EVENTS_MAX) {
+			machine_log(machine, LOG_ERROR, "\nERROR: too many events\n");
+			return false;
+		}
+		machine->events[++machine->events_len] = event;
+		event->index = machine->events_len;
+		machine->events_idle += event->idle;
+	}
+	event->when = when;
+	machine_events_fix(machine, event->index);
+	machine_update_deadline(machine);
+	return true;
+}
+
+void machine_unschedule(machine_t *machine, machine_event_t *event) {
+	size_t i = event->index;
+	if (i == 0) {
+		return; // not scheduled
+	}
+	event->index = 0;
+	machine->events_idle -= event->idle;
+	machine_event_t *last = machine->events[machine->events_len--];
+	if (last != event) {
+		machine->events[i] = last;
+		last->index = i;
+		machine_events_fix(machine, i);
+	}
+	machine_update_deadline(machine);
+}
+
+// SysTick: counts down from RVR to zero once per cycle.
+static uint32_t machine_systick_cvr(machine_t *machine) {
+	if (machine->systick.wrap.index == 0) {
+		return machine->systick.cvr; // stopped
+	}
+	if (machine->systick.wrap.when <= machine->cycles) {
 		return 0;
-	} else if (region == 7) {
-		// Private peripheral bus + Device: 0xe0000000 .. 0xffffffff
-		if (address == 0xe000e100 && transfer_type == STORE) {
-			// NVIC Interrupt Set-enable Register
-			machine_log(machine, LOG_WARN, "set interrupts: %08x\n", *reg);
-			return 0;
+	}
+	return machine->systick.wrap.when - machine->cycles;
+}
+
+// Start (or stop) counting so that the counter reaches zero after the given
+// number of cycles.
+static void machine_systick_start(machine_t *machine, uint64_t cycles) {
+	if ((machine->systick.csr & 1) == 0 || machine->systick.rvr == 0) {
+		machine->systick.cvr = machine_systick_cvr(machine);
+		machine_unschedule(machine, &machine->systick.wrap);
+		return;
+	}
+	machine_schedule(machine, &machine->systick.wrap, machine->cycles + cycles);
+}
+
+static void machine_systick_wrap(machine_t *machine, void *ctx) {
+	machine->systick.csr |= 1 << 16; // COUNTFLAG
+	if (machine->systick.csr & 2) { // TICKINT
+		machine->scb.pending |= 1 << 15;
+	}
+	// Count from the previous wrap, unless the emulator fell behind.
+	uint64_t next = machine->systick.wrap.when + machine->systick.rvr + 1;
+	machine_systick_start(machine, next > machine->cycles ? next - machine->cycles : machine->systick.rvr + 1);
+}
+
+// System control space: NVIC, SCB and SysTick.
+static uint8_t * machine_scs_ptr(machine_t *machine, uint32_t offset) {
+	if ((offset & ~0xf) == 0x400) {
+		return &machine->nvic.ip[offset % 32];
+	}
+	if (offset == 0xd08) {
+		return (uint8_t*)&machine->scb.vtor;
+	}
+	if (offset == 0xd14) {
+		return (uint8_t*)&machine->scb.ccr;
+	}
+	if (offset >= 0xd18 && offset < 0xd24) {
+		return &machine->scb.shp[offset - 0xd18];
+	}
+	if (offset == 0xd88) {
+		return (uint8_t*)&machine->scb.cpacr;
+	}
+	if (offset == 0xdfc) {
+		return (uint8_t*)&machine->scb.demcr;
+	}
+	return NULL;
+}
+
+static int machine_scs_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	switch (offset) {
+	case 0x010: // SysTick CSR
+		*value = machine->systick.csr;
+		machine->systick.csr &= ~(1 << 16); // COUNTFLAG is cleared on read
+		return 0;
+	case 0x014: // SysTick RVR
+		*value = machine->systick.rvr;
+		return 0;
+	case 0x018: // SysTick CVR
+		*value = machine_systick_cvr(machine);
+		return 0;
+	case 0x01c: // SysTick CALIB
+		*value = 1 << 31; // no reference clock
+		return 0;
+	case 0x100: // ISER
+	case 0x180: // ICER
+		*value = machine->nvic.enabled;
+		return 0;
+	case 0x200: // ISPR
+	case 0x280: // ICPR
+		*value = machine->nvic.pending;
+		return 0;
+	case 0x300: // IABR
+		*value = machine->nvic.active;
+		return 0;
+	case 0xd04: // ICSR
+		*value = machine->ipsr;
+		if (machine->nvic.pending != 0) {
+			*value |= 1 << 22; // ISRPENDING
 		}
-		if (address == 0xe000e180 && transfer_type == STORE) {
-			// NVIC Interrupt Clear-enable Register
-			machine_log(machine, LOG_WARN, "clear interrupts: %08x\n", *reg);
-			return 0;
+		if (machine->scb.pending & (1 << 15)) {
+			*value |= 1 << 26; // PENDSTSET
 		}
-		if (address == 0xe000ed88) {
-			ptr = &machine->scb.cpacr;
+		if (machine->scb.pending & (1 << 14)) {
+			*value |= 1 << 28; // PENDSVSET
 		}
-		if ((address & 0xfffffff0) == 0xe000e400) {
-			ptr = &machine->nvic.ip[address % 32];
+		return 0;
+	}
+	uint8_t *ptr = machine_scs_ptr(machine, offset);
+	if (ptr == NULL) {
+		return machine_invalid_address(machine, 0xe000e000 + offset, LOAD, 0);
+	}
+	if (!machine_is_aligned(machine, offset, width)) {
+		return machine_unaligned(machine, 0xe000e000 + offset, LOAD);
+	}
+	*value = machine_ptr_read(ptr, width);
+	return 0;
+}
+
+static int machine_scs_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	switch (offset) {
+	case 0x010: // SysTick CSR
+		machine->systick.cvr = machine_systick_cvr(machine);
+		machine->systick.csr = (machine->systick.csr & (1 << 16)) | (value & 0b111);
+		machine_systick_start(machine, machine->systick.cvr != 0 ? machine->systick.cvr : machine->systick.rvr + 1);
+		return 0;
+	case 0x014: // SysTick RVR
+		machine->systick.rvr = value & 0xffffff;
+		if (machine->systick.wrap.index == 0) {
+			machine_systick_start(machine, machine->systick.rvr + 1);
 		}
-		if ((address & 0xfffffff0) == 0xf0000fe0 && transfer_type == LOAD) {
-			machine_log(machine, LOG_WARN, "private address: %x\n", address);
-			// 0xf0000fe0, 0xf0000fe4, 0xf0000fe8, 0xf0000fec
-			// Not sure what this is all about but this is what the nrf
-			// seems to expect...
-			*reg = 0;
-			return 0;
+		return 0;
+	case 0x018: // SysTick CVR: any write clears the counter
+		machine->systick.cvr = 0;
+		machine->systick.csr &= ~(1 << 16);
+		machine_systick_start(machine, machine->systick.rvr + 1);
+		return 0;
+	case 0x100: // ISER
+		machine->nvic.enabled |= value;
+		break;
+	case 0x180: // ICER
+		machine->nvic.enabled &= ~value;
+		break;
+	case 0x200: // ISPR
+		machine->nvic.pending |= value;
+		break;
+	case 0x280: // ICPR
+		machine->nvic.pending &= ~value;
+		break;
+	case 0xd04: // ICSR
+		if (value & (1 << 25)) { // PENDSTCLR
+			machine->scb.pending &= ~(1 << 15);
+		}
+		if (value & (1 << 26)) { // PENDSTSET
+			machine->scb.pending |= 1 << 15;
+		}
+		if (value & (1 << 27)) { // PENDSVCLR
+			machine->scb.pending &= ~(1 << 14);
+		}
+		if (value & (1 << 28)) { // PENDSVSET
+			machine->scb.pending |= 1 << 14;
+		}
+		break;
+	default: {
+		uint8_t *ptr = machine_scs_ptr(machine, offset);
+		if (ptr == NULL) {
+			return machine_invalid_address(machine, 0xe000e000 + offset, STORE, value);
 		}
+		if (!machine_is_aligned(machine, offset, width)) {
+			return machine_unaligned(machine, 0xe000e000 + offset, STORE);
+		}
+		machine_ptr_write(ptr, value, width);
+		break;
+	}
 	}
+	machine_update_deadline(machine); // enables, priorities, etc. may have changed
+	return 0;
+}
 
-	if (ptr == 0) {
-		if (transfer_type == LOAD) {
-			machine_log(machine, LOG_ERROR, "\nERROR: invalid load address: 0x%08x (PC: %x)\n", address, machine->pc - 3);
-		} else {
-			machine_log(machine, LOG_ERROR, "\nERROR: invalid store address: 0x%08x (PC: %x, value: %x)\n", address, machine->pc - 3, *reg);
-		}
-		return ERR_MEM;
-	} else if (((width == WIDTH_16 && (address & 1) != 0) || (width == WIDTH_32 && (address & 3) != 0))
-			&& !machine_versioncheck(machine, CORTEX_M4)) {
-		// Note: Cortex-M4 supports unaligned memory accesses when
-		// enabled.
-		machine_log(machine, LOG_ERROR, "\nERROR: unaligned %s address: 0x%08x (PC: %x)\n", transfer_type == LOAD ? "load" : "store", address, machine->pc - 3);
-		return ERR_MEM;
+static const machine_peripheral_ops_t machine_scs_ops = {machine_scs_read, machine_scs_write, NULL, NULL};
+
+// Data watchpoint and trace unit. Only the cycle counter is implemented, which
+// counts the estimated cycles (see machine_op_cycles) while CYCCNTENA is set.
+static uint32_t machine_dwt_cyccnt(machine_t *machine) {
+	if (machine->dwt.ctrl & 1) {
+		return machine->dwt.cyccnt + (uint32_t)(machine->cycles - machine->dwt.cyccnt_start);
 	}
+	return machine->dwt.cyccnt;
+}
 
-	if (transfer_type == LOAD) {
-		if (width == WIDTH_8) {
-			uint8_t value = *(uint8_t*)ptr;
-			if (signextend) {
-				*reg = (int8_t)value;
-			} else {
-				*reg = value;
+static int machine_dwt_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	switch (offset) {
+	case 0x000: // CTRL
+		*value = machine->dwt.ctrl;
+		return 0;
+	case 0x004: // CYCCNT
+		*value = machine_dwt_cyccnt(machine);
+		return 0;
+	default:
+		return machine_invalid_address(machine, 0xe0001000 + offset, LOAD, 0);
+	}
+}
+
+static int machine_dwt_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	switch (offset) {
+	case 0x000: // CTRL
+		machine->dwt.cyccnt = machine_dwt_cyccnt(machine);
+		machine->dwt.cyccnt_start = machine->cycles;
+		machine->dwt.ctrl = value;
+		return 0;
+	case 0x004: // CYCCNT
+		machine->dwt.cyccnt = value;
+		machine->dwt.cyccnt_start = machine->cycles;
+		return 0;
+	default:
+		return machine_invalid_address(machine, 0xe0001000 + offset, STORE, value);
+	}
+}
+
+static const machine_peripheral_ops_t machine_dwt_ops = {machine_dwt_read, machine_dwt_write, NULL, NULL};
+
+static int machine_romtable_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	if ((offset & ~0xf) == 0xfe0) {
+		machine_log(machine, LOG_WARN, "private address: %x\n", 0xf0000000 + offset);
+		// 0xf0000fe0, 0xf0000fe4, 0xf0000fe8, 0xf0000fec
+		// Not sure what this is all about but this is what the nrf
+		// seems to expect...
+		*value = 0;
+		return 0;
+	}
+	return machine_invalid_address(machine, 0xf0000000 + offset, LOAD, 0);
+}
+
+static int machine_romtable_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	return machine_invalid_address(machine, 0xf0000000 + offset, STORE, value);
+}
+
+static const machine_peripheral_ops_t machine_romtable_ops = {machine_romtable_read, machine_romtable_write, NULL, NULL};
+
+// Second-level table for unmapped parts of the address space. Never written.
+static machine_page_t machine_pages_unmapped[1 << MACHINE_PAGE_L2_BITS];
+
+static inline machine_page_t * machine_page(machine_t *machine, uint32_t address) {
+	machine_page_t *table = machine->pages[address >> (MACHINE_PAGE_BITS + MACHINE_PAGE_L2_BITS)];
+	return &table[(address >> MACHINE_PAGE_BITS) & ((1 << MACHINE_PAGE_L2_BITS) - 1)];
+}
+
+// Write protect all full SRAM pages, so that the first store to each of them
+// is marked in mem_dirty by machine_sram_write().
+static void machine_protect_ram(machine_t *machine) {
+	for (size_t offset = 0; offset + MACHINE_PAGE_SIZE <= machine->mem_size; offset += MACHINE_PAGE_SIZE) {
+		machine_page(machine, 0x20000000 + offset)->store = NULL;
+	}
+}
+
+// Remove the direct pointers of all pages with a data watchpoint, or of all
+// flash and SRAM pages while tracing so that every access is recorded.
+static void machine_watch_map(machine_t *machine) {
+	if (machine->trace != NULL) {
+		for (size_t offset = 0; offset < machine->image_size; offset += MACHINE_PAGE_SIZE) {
+			machine_page(machine, offset)->load = NULL;
+		}
+		for (size_t offset = 0; offset < machine->mem_size; offset += MACHINE_PAGE_SIZE) {
+			machine_page_t *page = machine_page(machine, 0x20000000 + offset);
+			page->load = NULL;
+			page->store = NULL;
+		}
+		return;
+	}
+	for (size_t i = 0; i < machine->num_watchpoints; i++) {
+		const machine_watchpoint_t *w = &machine->watchpoints[i];
+		for (uint64_t address = w->address & ~MACHINE_PAGE_MASK; address < (uint64_t)w->address + w->length; address += MACHINE_PAGE_SIZE) {
+			// Unmapped pages may be shared, but have no pointers anyway.
+			machine_page_t *page = machine_page(machine, address);
+			if ((w->type & WATCH_READ) && page->load != NULL) {
+				page->load = NULL;
 			}
-		} else if (width == WIDTH_16) {
-			uint16_t value = *(uint16_t*)ptr;
-			if (signextend) {
-				*reg = (int16_t)value;
-			} else {
-				*reg = value;
+			if ((w->type & WATCH_WRITE) && page->store != NULL) {
+				page->store = NULL;
 			}
-		} else if (width == WIDTH_32) {
-			*reg = *(uint32_t*)ptr;
+		}
+	}
+}
+
+// Halt when a (slow path) access hits a data watchpoint.
+static void machine_watch_check(machine_t *machine, uint32_t address, uint32_t size, transfer_type_t transfer_type) {
+	machine_watch_t type = transfer_type == LOAD ? WATCH_READ : WATCH_WRITE;
+	for (size_t i = 0; i < machine->num_watchpoints; i++) {
+		const machine_watchpoint_t *w = &machine->watchpoints[i];
+		if ((w->type & type) && address < (uint64_t)w->address + w->length && w->address < (uint64_t)address + size) {
+			machine->watch_hit = w->type;
+			machine->watch_address = address > w->address ? address : w->address;
+			machine->halt = true;
+			return;
+		}
+	}
+}
+
+// Whether a write watchpoint overlaps with the page at the given address.
+static bool machine_watch_page(machine_t *machine, uint32_t address) {
+	for (size_t i = 0; i < machine->num_watchpoints; i++) {
+		const machine_watchpoint_t *w = &machine->watchpoints[i];
+		if ((w->type & WATCH_WRITE) && address < (uint64_t)w->address + w->length && w->address < (uint64_t)address + MACHINE_PAGE_SIZE) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Give a full SRAM page its direct store pointer back after the first store,
+// unless every store to it must take the slow path (see machine_watch_map).
+static void machine_sram_unprotect(machine_t *machine, uint32_t offset) {
+	machine->mem_dirty[offset >> MACHINE_PAGE_BITS] = 1;
+	uint32_t start = offset & ~MACHINE_PAGE_MASK;
+	if ((offset | MACHINE_PAGE_MASK) < machine->mem_size && machine->trace == NULL && !machine_watch_page(machine, 0x20000000 + start)) {
+		machine_page(machine, 0x20000000 + start)->store = machine->mem8 + start;
+	}
+}
+
+// Like machine_page(), but allocate the second-level table if needed so that
+// the page can be modified. Returns NULL when out of memory.
+static machine_page_t * machine_page_alloc(machine_t *machine, uint32_t address) {
+	machine_page_t **table = &machine->pages[address >> (MACHINE_PAGE_BITS + MACHINE_PAGE_L2_BITS)];
+	if (*table == machine_pages_unmapped) {
+		machine_page_t *new_table = calloc(1 << MACHINE_PAGE_L2_BITS, sizeof(machine_page_t));
+		if (new_table == NULL) {
+			return NULL;
+		}
+		*table = new_table;
+	}
+	return machine_page(machine, address);
+}
+
+// Map all pages that overlap with the given range. Only pages that are
+// entirely inside the range get a direct pointer (if any), partial pages are
+// handled by the peripheral. Returns false when out of memory.
+static bool machine_map(machine_t *machine, uint32_t address, size_t size, uint8_t *load, uint8_t *store, const machine_peripheral_t *peripheral) {
+	for (size_t offset = 0; offset < size; offset += MACHINE_PAGE_SIZE) {
+		machine_page_t *page = machine_page_alloc(machine, address + offset);
+		if (page == NULL) {
+			return false;
+		}
+		bool full = offset + MACHINE_PAGE_SIZE <= size;
+		page->load = load != NULL && full ? load + offset : NULL;
+		page->store = store != NULL && full ? store + offset : NULL;
+		page->peripheral = peripheral;
+	}
+	machine_watch_map(machine);
+	return true;
+}
+
+// Give the machine its own copy of a shared image before writing to it.
+// Returns false when out of memory, then the image is still shared.
+static bool machine_image_unshare(machine_t *machine) {
+	if (!machine->image_shared) {
+		return true;
+	}
+	uint8_t *image = malloc(machine->image_size);
+	if (image == NULL) {
+		machine_log(machine, LOG_ERROR, "ERROR: out of memory for a copy of the image\n");
+		return false;
+	}
+	memcpy(image, machine->image8, machine->image_size);
+	machine->image8 = image;
+	machine->image_shared = false;
+	// The flash pages are already mapped, so this can't fail.
+	machine_map(machine, 0x00000000, machine->image_size, machine->image8, NULL, &machine_flash);
+	return true;
+}
+
+// Add a memory-mapped device. The base address and size must be a multiple of
+// MACHINE_PAGE_SIZE and the range must not overlap with anything that is
+// already mapped. On success, ops->free (if set) is called for ctx when the
+// machine is freed.
+bool machine_add_peripheral(machine_t *machine, uint32_t base, uint32_t size, const machine_peripheral_ops_t *ops, void *ctx) {
+	if ((base & MACHINE_PAGE_MASK) != 0 || (size & MACHINE_PAGE_MASK) != 0 || size == 0 || base + (uint64_t)size > 0x100000000) {
+		machine_log(machine, LOG_ERROR, "ERROR: invalid peripheral range: 0x%08x, size 0x%x\n", base, size);
+		return false;
+	}
+	for (size_t offset = 0; offset < size; offset += MACHINE_PAGE_SIZE) {
+		const machine_page_t *page = machine_page_alloc(machine, base + offset);
+		if (page == NULL) {
+			return false;
+		}
+		if (page->load != NULL || page->store != NULL || page->peripheral != NULL) {
+			machine_log(machine, LOG_ERROR, "ERROR: peripheral at 0x%08x overlaps with 0x%08x\n", base, base + (uint32_t)offset);
+			return false;
+		}
+	}
+
+	machine_peripheral_t *peripheral = malloc(sizeof(machine_peripheral_t));
+	if (peripheral == NULL) {
+		return false;
+	}
+	peripheral->base = base;
+	peripheral->size = size;
+	peripheral->ops = ops;
+	peripheral->ctx = ctx;
+	peripheral->next = machine->peripherals;
+	machine->peripherals = peripheral;
+	if (ops->tick != NULL) {
+		machine->peripherals_tick++;
+	}
+	// All second-level tables have been allocated above, so this can't fail.
+	return machine_map(machine, base, size, NULL, NULL, peripheral);
+}
+
+// Call the tick callback of all peripherals that have one.
+static void machine_tick(machine_t *machine) {
+	for (machine_peripheral_t *peripheral = machine->peripherals; peripheral != NULL; peripheral = peripheral->next) {
+		if (peripheral->ops->tick != NULL) {
+			peripheral->ops->tick(machine, peripheral->ctx);
+		}
+	}
+}
+
+static bool machine_map_init(machine_t *machine) {
+	for (size_t i = 0; i < (1 << MACHINE_PAGE_L1_BITS); i++) {
+		machine->pages[i] = machine_pages_unmapped;
+	}
+	return machine_map(machine, 0x00000000, machine->image_size, machine->image8, NULL, &machine_flash) &&
+		machine_map(machine, 0x20000000, machine->mem_size, machine->mem8, machine->mem8, &machine_sram) &&
+		machine_add_peripheral(machine, 0xe0001000, 0x1000, &machine_dwt_ops, NULL) &&
+		machine_add_peripheral(machine, 0xe000e000, 0x1000, &machine_scs_ops, NULL) &&
+		machine_add_peripheral(machine, 0xf0000000, 0x1000, &machine_romtable_ops, NULL) &&
+		nrf_add_peripherals(machine);
+}
+
+static void machine_map_free(machine_t *machine) {
+	while (machine->peripherals != NULL) {
+		machine_peripheral_t *peripheral = machine->peripherals;
+		machine->peripherals = peripheral->next;
+		if (peripheral->ops->free != NULL) {
+			peripheral->ops->free(peripheral->ctx);
+		}
+		free(peripheral);
+	}
+	machine->peripherals_tick = 0;
+	for (size_t i = 0; i < (1 << MACHINE_PAGE_L1_BITS); i++) {
+		if (machine->pages[i] != machine_pages_unmapped) {
+			free(machine->pages[i]);
+		}
+		machine->pages[i] = machine_pages_unmapped;
+	}
+}
+
+// Binary trace ring buffer, see machine_trace_start(). Records are written by
+// the thread that runs the machine and taken out by machine_trace_read().
+struct machine_trace {
+	size_t size;         // number of records, a power of two
+	bool overwrite;      // drop the oldest records instead of waiting
+	_Atomic size_t head; // next record to read
+	_Atomic size_t tail; // next record to write
+	machine_trace_record_t records[];
+};
+
+static void machine_trace_put(machine_t *machine, machine_trace_type_t type, uint8_t arg, uint32_t a, uint32_t b) {
+	struct machine_trace *trace = machine->trace;
+	size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+	while (tail - atomic_load_explicit(&trace->head, memory_order_acquire) == trace->size) {
+		if (trace->overwrite) {
+			atomic_store_explicit(&trace->head, tail - trace->size + 1, memory_order_relaxed);
+			break;
+		}
+#if !defined(__EMSCRIPTEN__)
+		// Wait for the reader.
+		nanosleep(&(struct timespec){0, 100000}, NULL);
+#endif
+	}
+	trace->records[tail & (trace->size - 1)] = (machine_trace_record_t){type, arg, a, b};
+	atomic_store_explicit(&trace->tail, tail + 1, memory_order_release);
+}
+
+// Load or store through the memory map, without checking watchpoints.
+static int machine_access(machine_t *machine, uint32_t address, transfer_type_t transfer_type, uint32_t *reg, width_t width, bool signextend) {
+	machine_page_t *page = machine_page(machine, address);
+	uint8_t *ptr = transfer_type == LOAD ? page->load : page->store;
+	uint32_t value = 0;
+	int err = 0;
+
+	if (ptr != NULL) {
+		if (!machine_is_aligned(machine, address, width)) {
+			return machine_unaligned(machine, address, transfer_type);
+		}
+		if ((address & MACHINE_PAGE_MASK) + (1 << width) > MACHINE_PAGE_SIZE) {
+			// Unaligned access that crosses a page boundary: do it one
+			// byte at a time.
+			for (uint32_t i = 0; i < (1 << width); i++) {
+				uint32_t byte = *reg >> (i * 8);
+				if (machine_access(machine, address + i, transfer_type, &byte, WIDTH_8, false)) {
+					return ERR_MEM;
+				}
+				value |= (byte & 0xff) << (i * 8);
+			}
+		} else if (transfer_type == LOAD) {
+			value = machine_ptr_read(ptr + (address & MACHINE_PAGE_MASK), width);
+		} else {
+			machine_ptr_write(ptr + (address & MACHINE_PAGE_MASK), *reg, width);
+		}
+	} else {
+		if ((address >> 29) == 2 && ((address & 3) != 0 || width != WIDTH_32)) {
+			// Peripherals: 0x40000000 .. 0x5fffffff
+			machine_log(machine, LOG_ERROR, "\nERROR: invalid %s peripheral address: 0x%08x (PC: %x)\n", transfer_type == LOAD ? "load" : "store", address, machine->pc - 3);
+			return ERR_MEM;
+		}
+		const machine_peripheral_t *peripheral = page->peripheral;
+		if (peripheral != NULL) {
+			page->accesses++; // only the shared unmapped pages have no peripheral
+		}
+		if (peripheral != NULL && transfer_type == LOAD) {
+			err = peripheral->ops->read(machine, peripheral->ctx, address - peripheral->base, &value, width);
+		} else if (peripheral != NULL) {
+			err = peripheral->ops->write(machine, peripheral->ctx, address - peripheral->base, *reg, width);
+		} else if ((address >> 29) == 2) {
+			err = machine_peripheral_unknown(machine, address, transfer_type, transfer_type == LOAD ? 0 : *reg);
 		} else {
-			// should be unreachable
+			err = machine_invalid_address(machine, address, transfer_type, *reg);
+		}
+		if (err != 0) {
+			return err;
 		}
-	} else { // STORE
+	}
+
+	if (transfer_type == LOAD) {
 		if (width == WIDTH_8) {
-			*(uint8_t*)ptr = *reg;
+			*reg = signextend ? (uint32_t)(int8_t)value : (value & 0xff);
 		} else if (width == WIDTH_16) {
-			*(uint16_t*)ptr = *reg;
-		} else if (width == WIDTH_32) {
-			*(uint32_t*)ptr = *reg;
+			*reg = signextend ? (uint32_t)(int16_t)value : (value & 0xffff);
 		} else {
-			// should be unreachable
+			*reg = value;
 		}
 	}
 	return 0;
 }
 
+// Load or store through the memory map. The machine_load*() and
+// machine_store*() functions below handle the common case inline.
+static int machine_transfer(machine_t *machine, uint32_t address, transfer_type_t transfer_type, uint32_t *reg, width_t width, bool signextend) {
+	if (machine->num_watchpoints != 0) {
+		machine_watch_check(machine, address, 1 << width, transfer_type);
+	}
+	int err = machine_access(machine, address, transfer_type, reg, width, signextend);
+	if (machine->trace != NULL && err == 0) {
+		machine_trace_put(machine, transfer_type == LOAD ? TRACE_LOAD : TRACE_STORE, width, address, *reg);
+	}
+	return err;
+}
+
+// Whether an access of the given size can use the direct pointer of a page.
+// Unaligned accesses only can on the Cortex-M4, elsewhere machine_transfer()
+// checks them. The core is a parameter so that it can be a constant, see
+// machine_exec.inc.
+static inline bool machine_page_direct(uint32_t address, uint32_t size, machine_core_t core) {
+	return (address & MACHINE_PAGE_MASK) <= MACHINE_PAGE_SIZE - size &&
+		((address & (size - 1)) == 0 || core == CORTEX_M4);
+}
+
+static inline int machine_load8(machine_t *machine, uint32_t address, uint32_t *reg) {
+	const uint8_t *ptr = machine_page(machine, address)->load;
+	if (ptr != NULL) {
+		*reg = ptr[address & MACHINE_PAGE_MASK];
+		return 0;
+	}
+	return machine_transfer(machine, address, LOAD, reg, WIDTH_8, false);
+}
+
+static inline int machine_load16(machine_t *machine, uint32_t address, uint32_t *reg, machine_core_t core) {
+	const uint8_t *ptr = machine_page(machine, address)->load;
+	if (ptr != NULL && machine_page_direct(address, 2, core)) {
+		*reg = *(uint16_t*)(ptr + (address & MACHINE_PAGE_MASK));
+		return 0;
+	}
+	return machine_transfer(machine, address, LOAD, reg, WIDTH_16, false);
+}
+
+static inline int machine_load32(machine_t *machine, uint32_t address, uint32_t *reg, machine_core_t core) {
+	const uint8_t *ptr = machine_page(machine, address)->load;
+	if (ptr != NULL && machine_page_direct(address, 4, core)) {
+		*reg = *(uint32_t*)(ptr + (address & MACHINE_PAGE_MASK));
+		return 0;
+	}
+	return machine_transfer(machine, address, LOAD, reg, WIDTH_32, false);
+}
+
+static inline int machine_store8(machine_t *machine, uint32_t address, uint32_t value) {
+	uint8_t *ptr = machine_page(machine, address)->store;
+	if (ptr != NULL) {
+		ptr[address & MACHINE_PAGE_MASK] = value;
+		return 0;
+	}
+	return machine_transfer(machine, address, STORE, &value, WIDTH_8, false);
+}
+
+static inline int machine_store16(machine_t *machine, uint32_t address, uint32_t value, machine_core_t core) {
+	uint8_t *ptr = machine_page(machine, address)->store;
+	if (ptr != NULL && machine_page_direct(address, 2, core)) {
+		*(uint16_t*)(ptr + (address & MACHINE_PAGE_MASK)) = value;
+		return 0;
+	}
+	return machine_transfer(machine, address, STORE, &value, WIDTH_16, false);
+}
+
+static inline int machine_store32(machine_t *machine, uint32_t address, uint32_t value, machine_core_t core) {
+	uint8_t *ptr = machine_page(machine, address)->store;
+	if (ptr != NULL && machine_page_direct(address, 4, core)) {
+		*(uint32_t*)(ptr + (address & MACHINE_PAGE_MASK)) = value;
+		return 0;
+	}
+	return machine_transfer(machine, address, STORE, &value, WIDTH_32, false);
+}
+
 KEEPALIVE
 void machine_reset(machine_t *machine) {
+	// The image may have been modified directly (see machine_get_image).
+	machine_invalidate(machine, 0, machine->image_size);
+	machine->snapshot = NULL;
+
 	// Do a reset
 	machine->sp = machine->image32[0]; // initial stack pointer
 	//machine->lr = 0xffffffff; // exit address
@@ -210,6 +1181,18 @@ void machine_reset(machine_t *machine) {
 	machine->pc = machine->image32[1]; // Reset_Vector address
 	machine->backtrace[1].pc = machine->pc - 1;
 	machine->backtrace[1].sp = machine->sp;
+	machine->ipsr = 0;
+	machine->primask = false;
+	machine->sleeping = false;
+	machine->event_register = false;
+	machine->nvic.enabled = 0;
+	machine->nvic.pending = 0;
+	machine->nvic.active = 0;
+	machine->scb.pending = 0;
+	machine->scb.active = 0;
+	machine->scb.ccr = 1 << 9; // STKALIGN
+	machine->systick.csr = 0;
+	machine_systick_start(machine, 0); // stop
 	machine_log(machine, LOG_CALLS, "RESET %5x (sp: %x)\n", machine->pc - 1, machine->sp);
 }
 
@@ -225,8 +1208,52 @@ static void machine_add_backtrace(machine_t *machine, uint32_t pc, uint32_t sp)
 	}
 }
 
+// Direct pointer to the length bytes at address, or NULL when they don't fit
+// in a single page with a direct pointer.
+static inline uint8_t * machine_range_ptr(machine_t *machine, uint32_t address, uint32_t length, transfer_type_t transfer_type) {
+	const machine_page_t *page = machine_page(machine, address);
+	uint8_t *ptr = transfer_type == LOAD ? page->load : page->store;
+	if (ptr == NULL || (address & MACHINE_PAGE_MASK) + length > MACHINE_PAGE_SIZE) {
+		return NULL;
+	}
+	return ptr + (address & MACHINE_PAGE_MASK);
+}
+
+// Direct pointer to the count words of a multiple load or store at address,
+// or NULL when they aren't aligned or don't fit in a single page with a direct
+// pointer. Those take the slow path, one register at a time.
+static inline uint32_t * machine_multiple_ptr(machine_t *machine, uint32_t address, uint32_t count, transfer_type_t transfer_type) {
+	if ((address & 3) != 0) {
+		return NULL;
+	}
+	return (uint32_t*)machine_range_ptr(machine, address, count * 4, transfer_type);
+}
+
+// Copy the registers in reg_list to or from ascending words at ptr, lowest
+// register first.
+static inline void machine_multiple_store(machine_t *machine, uint32_t *ptr, uint32_t reg_list) {
+	for (; reg_list != 0; reg_list &= reg_list - 1) {
+		*ptr++ = machine->regs[__builtin_ctz(reg_list)];
+	}
+}
+
+static inline void machine_multiple_load(machine_t *machine, const uint32_t *ptr, uint32_t reg_list) {
+	for (; reg_list != 0; reg_list &= reg_list - 1) {
+		machine->regs[__builtin_ctz(reg_list)] = *ptr++;
+	}
+}
+
 static int machine_instr_stmdb(machine_t *machine, uint32_t *reg, uint32_t reg_list, bool wback) {
 	uint32_t address = *reg;
+	uint32_t count = __builtin_popcount(reg_list & 0x7fff);
+	uint32_t *ptr = machine_multiple_ptr(machine, address - count * 4, count, STORE);
+	if (ptr != NULL && (reg != &machine->sp || machine_loglevel(machine) < LOG_CALLS)) {
+		machine_multiple_store(machine, ptr, reg_list & 0x7fff);
+		if (wback) {
+			*reg = address - count * 4;
+		}
+		return 0;
+	}
 	for (int i = 14; i >= 0; i--) {
 		if (reg_list & (1 << i)) {
 			address -= 4;
@@ -237,7 +1264,7 @@ static int machine_instr_stmdb(machine_t *machine, uint32_t *reg, uint32_t reg_l
 					machine_log(machine, LOG_CALLS, "%*spush r%d      (sp: %x)\n", machine->call_depth * 2, "", i, address);
 				}
 			}
-			if (machine_transfer(machine, address, STORE, &machine->regs[i], WIDTH_32, false)) {
+			if (machine_store32(machine, address, machine->regs[i], machine->core)) {
 				return ERR_MEM;
 			}
 		}
@@ -250,10 +1277,18 @@ static int machine_instr_stmdb(machine_t *machine, uint32_t *reg, uint32_t reg_l
 
 static int machine_instr_stmia(machine_t *machine, uint32_t *reg, uint32_t reg_list, bool wback) {
 	uint32_t address = *reg;
+	uint32_t count = __builtin_popcount(reg_list & 0xffff);
+	uint32_t *ptr = machine_multiple_ptr(machine, address, count, STORE);
+	if (ptr != NULL) {
+		machine_multiple_store(machine, ptr, reg_list & 0xffff);
+		if (wback) {
+			*reg = address + count * 4;
+		}
+		return 0;
+	}
 	for (size_t i = 0; i <= 15; i++) {
 		if (((reg_list >> i) & 1) == 1) {
-			uint32_t *reg = &machine->regs[i];
-			if (machine_transfer(machine, address, STORE, reg, WIDTH_32, false)) {
+			if (machine_store32(machine, address, machine->regs[i], machine->core)) {
 				return ERR_MEM;
 			}
 			address += 4;
@@ -267,10 +1302,19 @@ static int machine_instr_stmia(machine_t *machine, uint32_t *reg, uint32_t reg_l
 
 static int machine_instr_ldmdb(machine_t *machine, uint32_t *reg, uint32_t reg_list, bool wback) {
 	uint32_t address = *reg;
+	uint32_t count = __builtin_popcount(reg_list & 0x7fff);
+	const uint32_t *ptr = machine_multiple_ptr(machine, address - count * 4, count, LOAD);
+	if (ptr != NULL) {
+		machine_multiple_load(machine, ptr, reg_list & 0x7fff);
+		if (wback) {
+			*reg = address - count * 4;
+		}
+		return 0;
+	}
 	for (int i = 14; i >= 0; i--) {
 		if (reg_list & (1 << i)) {
 			address -= 4;
-			if (machine_transfer(machine, address, LOAD, &machine->regs[i], WIDTH_32, false)) {
+			if (machine_load32(machine, address, &machine->regs[i], machine->core)) {
 				return ERR_MEM;
 			}
 		}
@@ -283,6 +1327,15 @@ static int machine_instr_ldmdb(machine_t *machine, uint32_t *reg, uint32_t reg_l
 
 static int machine_instr_ldmia(machine_t *machine, uint32_t *reg, uint32_t reg_list, bool wback) {
 	uint32_t address = *reg;
+	uint32_t count = __builtin_popcount(reg_list & 0xffff);
+	const uint32_t *ptr = machine_multiple_ptr(machine, address, count, LOAD);
+	if (ptr != NULL && (reg != &machine->sp || machine_loglevel(machine) < LOG_CALLS)) {
+		machine_multiple_load(machine, ptr, reg_list & 0xffff);
+		if (wback) {
+			*reg = address + count * 4;
+		}
+		return 0;
+	}
 	for (int i = 0; i <= 15; i++) {
 		if (reg_list & (1 << i)) {
 			if (reg == &machine->sp && wback) {
@@ -292,7 +1345,7 @@ static int machine_instr_ldmia(machine_t *machine, uint32_t *reg, uint32_t reg_l
 					machine_log(machine, LOG_CALLS, "%*spop r%d       (sp: %x)\n", machine->call_depth * 2, "", i, address);
 				}
 			}
-			if (machine_transfer(machine, address, LOAD, &machine->regs[i], WIDTH_32, false)) {
+			if (machine_load32(machine, address, &machine->regs[i], machine->core)) {
 				return ERR_MEM;
 			}
 			address += 4;
@@ -304,9 +1357,240 @@ static int machine_instr_ldmia(machine_t *machine, uint32_t *reg, uint32_t reg_l
 	return 0;
 }
 
-static uint32_t machine_instr_lsl(machine_t *machine, uint32_t src, uint32_t shift, bool setflags) {
-	if (setflags && shift != 0) { // range 0..31, setflags only when shifting non-zero amount
-		machine->psr.c = src >> (32 - shift) & 1;
+// Estimated cycles of the newlib implementations of hooked functions: a fixed
+// cost, plus a cost per four bytes that they process.
+static const uint8_t machine_hook_cycles[][2] = {
+	[HOOK_MEMCPY] = {20, 4},  // four instructions per word
+	[HOOK_MEMSET] = {20, 2},  // a STM of several words per loop
+	[HOOK_MEMCMP] = {20, 20}, // five instructions per byte
+	[HOOK_STRLEN] = {16, 8},  // a word at a time with bit tricks
+};
+
+// Number of bytes at a and b that a hook can handle at once: the rest of the
+// pages of both addresses, but at most length.
+static inline uint32_t machine_hook_chunk(uint32_t length, uint32_t a, uint32_t b) {
+	uint32_t chunk = MACHINE_PAGE_SIZE - (a & MACHINE_PAGE_MASK);
+	if (chunk > MACHINE_PAGE_SIZE - (b & MACHINE_PAGE_MASK)) {
+		chunk = MACHINE_PAGE_SIZE - (b & MACHINE_PAGE_MASK);
+	}
+	return chunk < length ? chunk : length;
+}
+
+// The hooks below work a chunk at a time through the direct pointers of pages,
+// or a byte at a time through machine_transfer() for pages without them, so
+// that they see the same memory map as the firmware.
+static int machine_hook_memcpy(machine_t *machine, uint32_t dst, uint32_t src, uint32_t length) {
+	while (length != 0) {
+		uint32_t chunk = machine_hook_chunk(length, dst, src);
+		const uint8_t *from = machine_range_ptr(machine, src, chunk, LOAD);
+		uint8_t *to = machine_range_ptr(machine, dst, chunk, STORE);
+		if (from != NULL && to != NULL) {
+			memmove(to, from, chunk);
+		} else {
+			for (uint32_t i = 0; i < chunk; i++) {
+				uint32_t byte;
+				if (machine_transfer(machine, src + i, LOAD, &byte, WIDTH_8, false) ||
+					machine_transfer(machine, dst + i, STORE, &byte, WIDTH_8, false)) {
+					return ERR_MEM;
+				}
+			}
+		}
+		dst += chunk;
+		src += chunk;
+		length -= chunk;
+	}
+	return 0;
+}
+
+static int machine_hook_memset(machine_t *machine, uint32_t dst, uint32_t value, uint32_t length) {
+	while (length != 0) {
+		uint32_t chunk = machine_hook_chunk(length, dst, dst);
+		uint8_t *to = machine_range_ptr(machine, dst, chunk, STORE);
+		if (to != NULL) {
+			memset(to, value & 0xff, chunk);
+		} else {
+			for (uint32_t i = 0; i < chunk; i++) {
+				if (machine_transfer(machine, dst + i, STORE, &value, WIDTH_8, false)) {
+					return ERR_MEM;
+				}
+			}
+		}
+		dst += chunk;
+		length -= chunk;
+	}
+	return 0;
+}
+
+// Compare like memcmp() and set *result to the difference of the first bytes
+// that differ, and *length to the number of bytes compared.
+static int machine_hook_memcmp(machine_t *machine, uint32_t a, uint32_t b, uint32_t *length, uint32_t *result) {
+	uint32_t left = *length;
+	*result = 0;
+	while (left != 0) {
+		uint32_t chunk = machine_hook_chunk(left, a, b);
+		const uint8_t *pa = machine_range_ptr(machine, a, chunk, LOAD);
+		const uint8_t *pb = machine_range_ptr(machine, b, chunk, LOAD);
+		if (pa == NULL || pb == NULL || memcmp(pa, pb, chunk) != 0) {
+			// Find the first difference.
+			for (uint32_t i = 0; i < chunk; i++) {
+				uint32_t x, y;
+				if (machine_transfer(machine, a + i, LOAD, &x, WIDTH_8, false) ||
+					machine_transfer(machine, b + i, LOAD, &y, WIDTH_8, false)) {
+					return ERR_MEM;
+				}
+				if (x != y) {
+					*length -= left - i - 1;
+					*result = x - y;
+					return 0;
+				}
+			}
+		}
+		a += chunk;
+		b += chunk;
+		left -= chunk;
+	}
+	return 0;
+}
+
+static int machine_hook_strlen(machine_t *machine, uint32_t str, uint32_t *length) {
+	*length = 0;
+	for (;;) {
+		uint32_t chunk = machine_hook_chunk(MACHINE_PAGE_SIZE, str, str);
+		const uint8_t *ptr = machine_range_ptr(machine, str, chunk, LOAD);
+		if (ptr != NULL) {
+			const uint8_t *end = memchr(ptr, 0, chunk);
+			if (end != NULL) {
+				*length += end - ptr;
+				return 0;
+			}
+		} else {
+			for (uint32_t i = 0; i < chunk; i++) {
+				uint32_t byte;
+				if (machine_transfer(machine, str + i, LOAD, &byte, WIDTH_8, false)) {
+					return ERR_MEM;
+				}
+				if (byte == 0) {
+					*length += i;
+					return 0;
+				}
+			}
+		}
+		str += chunk;
+		*length += chunk;
+	}
+}
+
+// Run the native implementation of a hooked function on the arguments in
+// r0..r3 and set r0 to its result, like the firmware function would (see the
+// AAPCS). Its estimated cycles are added, the caller then returns to LR.
+static int machine_hook_call(machine_t *machine, machine_hook_t hook) {
+	uint32_t r0 = machine->r0, r1 = machine->r1, r2 = machine->r2;
+	uint32_t bytes = r2;
+	int err = ERR_UNDEFINED;
+	switch (hook) {
+	case HOOK_MEMCPY:
+		machine_log(machine, LOG_CALLS, "%*shook memcpy(%x, %x, %u)\n", machine->call_depth * 2, "", r0, r1, r2);
+		err = machine_hook_memcpy(machine, r0, r1, r2);
+		break;
+	case HOOK_MEMSET:
+		machine_log(machine, LOG_CALLS, "%*shook memset(%x, %x, %u)\n", machine->call_depth * 2, "", r0, r1, r2);
+		err = machine_hook_memset(machine, r0, r1, r2);
+		break;
+	case HOOK_MEMCMP:
+		machine_log(machine, LOG_CALLS, "%*shook memcmp(%x, %x, %u)\n", machine->call_depth * 2, "", r0, r1, r2);
+		err = machine_hook_memcmp(machine, r0, r1, &bytes, &machine->r0);
+		break;
+	case HOOK_STRLEN:
+		machine_log(machine, LOG_CALLS, "%*shook strlen(%x)\n", machine->call_depth * 2, "", r0);
+		err = machine_hook_strlen(machine, r0, &bytes);
+		machine->r0 = bytes;
+		break;
+	case HOOK_NONE:
+		break;
+	}
+	if (err == 0) {
+		machine->cycles += machine_hook_cycles[hook][0] + (uint64_t)bytes * machine_hook_cycles[hook][1] / 4;
+	}
+	return err;
+}
+
+// Bits in machine->flags.op.
+enum {
+	FLAGS_PSR = 0,      // all flags are in psr
+	FLAGS_NZ  = 1 << 0, // N and Z follow from flags.result
+	FLAGS_ADD = 1 << 1, // C and V follow from flags.a + flags.b + flags.carry
+	FLAGS_SUB = 1 << 2, // C and V follow from flags.a - flags.b - !flags.carry
+};
+
+// Return the current carry flag, without writing pending flags to psr.
+static inline bool machine_get_carry(machine_t *machine) {
+	uint32_t a = machine->flags.a;
+	uint32_t b = machine->flags.b;
+	bool carry = machine->flags.carry;
+	if (machine->flags.op & FLAGS_ADD) {
+		uint32_t result = a + b + carry;
+		return result < a || (carry && result == a); // unsigned overflow
+	} else if (machine->flags.op & FLAGS_SUB) {
+		return a > b || (carry && a == b); // no borrow
+	}
+	return machine->psr.c;
+}
+
+// Return psr with all pending flags applied.
+static inline flags_t machine_get_psr(machine_t *machine) {
+	flags_t psr = machine->psr;
+	uint8_t op = machine->flags.op;
+	if (op & FLAGS_NZ) {
+		psr.n = (int32_t)machine->flags.result < 0;
+		psr.z = machine->flags.result == 0;
+	}
+	if (op & (FLAGS_ADD | FLAGS_SUB)) {
+		uint32_t a = machine->flags.a;
+		uint32_t b = machine->flags.b;
+		psr.c = machine_get_carry(machine);
+		if (op & FLAGS_ADD) {
+			uint32_t result = a + b + machine->flags.carry;
+			psr.v = (~(a ^ b) & (a ^ result)) >> 31; // signed overflow
+		} else {
+			uint32_t result = a - b - !machine->flags.carry;
+			psr.v = ((a ^ b) & (a ^ result)) >> 31;
+		}
+	}
+	return psr;
+}
+
+// Write all pending flags to psr.
+KEEPALIVE
+void machine_sync_flags(machine_t *machine) {
+	machine->psr = machine_get_psr(machine);
+	machine->flags.op = FLAGS_PSR;
+}
+
+static inline void machine_set_carry(machine_t *machine, bool carry) {
+	if (machine->flags.op & (FLAGS_ADD | FLAGS_SUB)) {
+		machine_sync_flags(machine); // V must be preserved
+	}
+	machine->psr.c = carry;
+}
+
+// Set N and Z from the given result, leaving C and V as they are.
+static inline void machine_set_nz(machine_t *machine, uint32_t result) {
+	machine->flags.result = result;
+	machine->flags.op |= FLAGS_NZ;
+}
+
+// Set all flags from an addition (op FLAGS_ADD) or subtraction (FLAGS_SUB).
+static inline void machine_set_flags(machine_t *machine, uint8_t op, uint32_t a, uint32_t b, bool carry, uint32_t result) {
+	machine->flags.op = FLAGS_NZ | op;
+	machine->flags.result = result;
+	machine->flags.a = a;
+	machine->flags.b = b;
+	machine->flags.carry = carry;
+}
+
+static inline uint32_t machine_instr_lsl(machine_t *machine, uint32_t src, uint32_t shift, bool setflags) {
+	if (setflags && shift != 0) { // setflags only when shifting non-zero amount
+		machine_set_carry(machine, shift <= 32 ? src >> (32 - shift) & 1 : 0);
 	}
 	if (shift >= 32) {
 		return 0;
@@ -314,29 +1598,29 @@ static uint32_t machine_instr_lsl(machine_t *machine, uint32_t src, uint32_t shi
 	return src << shift;
 }
 
-static uint32_t machine_instr_lsr(machine_t *machine, uint32_t src, uint32_t shift, bool setflags) {
+static inline uint32_t machine_instr_lsr(machine_t *machine, uint32_t src, uint32_t shift, bool setflags) {
 	if (shift >= 32) {
 		if (setflags) {
-			machine->psr.c = (src >> 31) & 1;
+			machine_set_carry(machine, shift == 32 ? (src >> 31) & 1 : 0);
 		}
 		return 0;
 	}
 	if (shift != 0 && setflags) {
-		machine->psr.c = src >> (shift - 1) & 1;
+		machine_set_carry(machine, src >> (shift - 1) & 1);
 	}
 	return src >> shift;
 }
 
-static uint32_t machine_instr_asr(machine_t *machine, uint32_t src, uint32_t shift, bool setflags) {
+static inline uint32_t machine_instr_asr(machine_t *machine, uint32_t src, uint32_t shift, bool setflags) {
 	if (shift >= 32) {
 		if (setflags) {
-			machine->psr.c = (((int32_t)src) >> 31) & 1;
+			machine_set_carry(machine, (((int32_t)src) >> 31) & 1);
 		}
 		// shift twice to avoid undefined behavior in the C compiler
 		return (((int32_t)src) >> 16) >> 16;
-	} else if (shift >= 0) {
+	} else if (shift != 0) {
 		if (setflags) {
-			machine->psr.c = ((int32_t)src) >> (shift - 1) & 1;
+			machine_set_carry(machine, ((int32_t)src) >> (shift - 1) & 1);
 		}
 		return ((int32_t)src) >> shift;
 	} else {
@@ -344,82 +1628,196 @@ static uint32_t machine_instr_asr(machine_t *machine, uint32_t src, uint32_t shi
 	}
 }
 
-static uint32_t machine_instr_add(machine_t *machine, uint32_t a, uint32_t b, bool setflags) {
+static inline uint32_t machine_ror(uint32_t src, uint32_t shift) {
+	return src >> (shift & 31) | src << (-shift & 31);
+}
+
+static inline uint32_t machine_instr_ror(machine_t *machine, uint32_t src, uint32_t shift, bool setflags) {
+	if (shift == 0) {
+		return src;
+	}
+	uint32_t result = machine_ror(src, shift);
+	if (setflags) {
+		machine_set_carry(machine, result >> 31);
+	}
+	return result;
+}
+
+static inline uint32_t machine_instr_rrx(machine_t *machine, uint32_t src, bool setflags) {
+	uint32_t result = (uint32_t)machine_get_carry(machine) << 31 | src >> 1;
+	if (setflags) {
+		machine_set_carry(machine, src & 1);
+	}
+	return result;
+}
+
+// Shift a register operand by a constant, encoded as the shift type (LSL,
+// LSR, ASR, ROR) in bits 0..1 and the amount (1..32, 0 for LSL #0 and RRX) in
+// bits 2..7. See machine_decode_shift().
+static inline uint32_t machine_shift_imm(machine_t *machine, uint32_t src, uint32_t shift, bool setflags) {
+	uint32_t amount = (shift >> 2) & 0x3f;
+	switch (shift & 0b11) {
+	case 0b00:
+		return machine_instr_lsl(machine, src, amount, setflags);
+	case 0b01:
+		return machine_instr_lsr(machine, src, amount, setflags);
+	case 0b10:
+		return machine_instr_asr(machine, src, amount, setflags);
+	default:
+		return amount == 0 ? machine_instr_rrx(machine, src, setflags) : machine_instr_ror(machine, src, amount, setflags);
+	}
+}
+
+static inline uint32_t machine_instr_add(machine_t *machine, uint32_t a, uint32_t b, bool setflags) {
 	uint32_t result = a + b;
 	if (setflags) {
-		int64_t result64s = (int64_t)(int32_t)a + (int64_t)(int32_t)b;
-		uint64_t result64u = (uint64_t)a + (uint64_t)b;
-		machine->psr.n = (int32_t)result < 0;
-		machine->psr.z = result == 0;
-		machine->psr.c = result64u >= ((uint64_t)1 << 32); // true if 32-bit overflow
-		machine->psr.v = ((int32_t)result < 0) != (result64s < 0);
+		machine_set_flags(machine, FLAGS_ADD, a, b, false, result);
 	}
 	return result;
 }
 
-static uint32_t machine_instr_adc(machine_t *machine, uint32_t a, uint32_t b, bool setflags) {
-	uint32_t result = a + b + machine->psr.c;
+static inline uint32_t machine_instr_adc(machine_t *machine, uint32_t a, uint32_t b, bool setflags) {
+	bool carry = machine_get_carry(machine);
+	uint32_t result = a + b + carry;
 	if (setflags) {
-		int64_t result64s = (int64_t)(int32_t)a + (int64_t)(int32_t)b + machine->psr.c;
-		uint64_t result64u = (uint64_t)a + (uint64_t)b + machine->psr.c;
-		machine->psr.n = (int32_t)result < 0;
-		machine->psr.z = result == 0;
-		machine->psr.c = result64u >= ((uint64_t)1 << 32); // true if 32-bit overflow
-		machine->psr.v = ((int32_t)result < 0) != (result64s < 0);
+		machine_set_flags(machine, FLAGS_ADD, a, b, carry, result);
 	}
 	return result;
 }
 
-static uint32_t machine_instr_sub(machine_t *machine, uint32_t a, uint32_t b, bool setflags) {
+static inline uint32_t machine_instr_sub(machine_t *machine, uint32_t a, uint32_t b, bool setflags) {
 	uint32_t result = a - b;
 	if (setflags) {
-		int64_t result64s = (int64_t)(int32_t)a - (int64_t)(int32_t)b;
-		uint64_t result64u = (uint64_t)a - (uint64_t)b;
-		machine->psr.n = (int32_t)result < 0;
-		machine->psr.z = result == 0;
-		machine->psr.c = (int64_t)result64u >= 0;
-		machine->psr.v = ((int32_t)result < 0) != (result64s < 0);
+		machine_set_flags(machine, FLAGS_SUB, a, b, true, result);
 	}
 	return result;
 }
 
-static uint32_t machine_instr_sbc(machine_t *machine, uint32_t a, uint32_t b, bool setflags) {
-	uint32_t result = a - b - !machine->psr.c;
+static inline uint32_t machine_instr_sbc(machine_t *machine, uint32_t a, uint32_t b, bool setflags) {
+	bool carry = machine_get_carry(machine);
+	uint32_t result = a - b - !carry;
 	if (setflags) {
-		int64_t result64s = (int64_t)(int32_t)a - (int64_t)(int32_t)b - !machine->psr.c;
-		int64_t result64u = (uint64_t)a - (uint64_t)b - !machine->psr.c;
-		machine->psr.n = (int32_t)result < 0;
-		machine->psr.z = result == 0;
-		machine->psr.c = (int64_t)result64u >= 0;
-		machine->psr.v = ((int32_t)result < 0) != (result64s < 0);
+		machine_set_flags(machine, FLAGS_SUB, a, b, carry, result);
+	}
+	return result;
+}
+
+// Saturate to a signed value of the given number of bits (1..32), setting
+// the Q flag when the value doesn't fit.
+static inline uint32_t machine_ssat(machine_t *machine, int64_t value, uint32_t bits) {
+	int64_t max = ((int64_t)1 << (bits - 1)) - 1;
+	if (value > max) {
+		machine->psr.q = 1;
+		return (uint32_t)max;
+	}
+	if (value < -max - 1) {
+		machine->psr.q = 1;
+		return (uint32_t)(-max - 1);
+	}
+	return (uint32_t)value;
+}
+
+// Saturate to an unsigned value of the given number of bits (0..31).
+static inline uint32_t machine_usat(machine_t *machine, int64_t value, uint32_t bits) {
+	int64_t max = ((int64_t)1 << bits) - 1;
+	if (value > max) {
+		machine->psr.q = 1;
+		return (uint32_t)max;
+	}
+	if (value < 0) {
+		machine->psr.q = 1;
+		return 0;
+	}
+	return (uint32_t)value;
+}
+
+// Parallel addition and subtraction of halfwords or bytes. The low 3 bits of
+// op select the operation (op1 of the encoding: ADD8, ADD16, ASX, SUB8, SUB16
+// or SAX), the bits above it the kind: signed (S), saturating (Q), halving
+// (SH) and the unsigned variants (U, UQ, UH). Only S and U set the GE flags.
+static uint32_t machine_parallel(machine_t *machine, uint32_t op, uint32_t a, uint32_t b) {
+	uint32_t kind = op >> 3;
+	bool flag_signed = kind < 3;
+	uint32_t width = (op & 0b11) == 0b00 ? 8 : 16;
+	uint32_t lanes = 32 / width;
+	uint32_t mask = (1 << width) - 1;
+	int32_t max = mask >> 1; // for signed saturation
+	uint32_t ge_lane = width == 8 ? 0b1 : 0b11;
+	uint32_t result = 0;
+	uint32_t ge = 0;
+	for (uint32_t i = 0; i < lanes; i++) {
+		uint32_t shift = i * width;
+		uint32_t shift_b = shift;
+		bool flag_sub = (op & 0b100) != 0;
+		if ((op & 0b11) == 0b10) {
+			// ASX and SAX combine each halfword of a with the other one of
+			// b, subtracting in the low (ASX) or high (SAX) halfword.
+			shift_b = 16 - shift;
+			flag_sub = (i == 1) == flag_sub;
+		}
+		int32_t x, y;
+		if (flag_signed) {
+			x = (int32_t)(a << (32 - width - shift)) >> (32 - width);
+			y = (int32_t)(b << (32 - width - shift_b)) >> (32 - width);
+		} else {
+			x = (a >> shift) & mask;
+			y = (b >> shift_b) & mask;
+		}
+		int32_t lane = flag_sub ? x - y : x + y;
+		switch (kind) {
+		case 0: // S
+			if (lane >= 0) {
+				ge |= ge_lane << (shift / 8);
+			}
+			break;
+		case 1: // Q
+			lane = lane > max ? max : lane < -max - 1 ? -max - 1 : lane;
+			break;
+		case 3: // U
+			if (flag_sub ? lane >= 0 : lane > (int32_t)mask) {
+				ge |= ge_lane << (shift / 8);
+			}
+			break;
+		case 4: // UQ
+			lane = lane > (int32_t)mask ? (int32_t)mask : lane < 0 ? 0 : lane;
+			break;
+		default: // SH, UH
+			lane >>= 1;
+			break;
+		}
+		result |= ((uint32_t)lane & mask) << shift;
+	}
+	if (kind == 0 || kind == 3) {
+		machine->psr.ge = ge;
 	}
 	return result;
 }
 
 // Return 1 if true, 0 if false, and -1 if invalid.
 static int machine_condition(machine_t *machine, uint32_t condition) {
+	flags_t psr = machine_get_psr(machine);
 	if (condition == 0b0000) { // BEQ: Z == 1
-		return machine->psr.z == true;
+		return psr.z == true;
 	} else if (condition == 0b0001) { // BNE: Z == 0
-		return machine->psr.z == false;
+		return psr.z == false;
 	} else if (condition == 0b0010) { // BCS: C == 1
-		return machine->psr.c == true;
+		return psr.c == true;
 	} else if (condition == 0b0011) { // BCC: C == 0
-		return machine->psr.c == false;
+		return psr.c == false;
 	} else if (condition == 0b0100) { // BMI: N == 1
-		return machine->psr.n == true;
+		return psr.n == true;
 	} else if (condition == 0b0101) { // BPL: N == 0
-		return machine->psr.n == false;
+		return psr.n == false;
 	} else if (condition == 0b1000) { // BHI: C == 1 && Z == 0
-		return machine->psr.c == true && machine->psr.z == false;
+		return psr.c == true && psr.z == false;
 	} else if (condition == 0b1001) { // BLS: C == 0 || Z == 1
-		return machine->psr.c == false || machine->psr.z == true;
+		return psr.c == false || psr.z == true;
 	} else if (condition == 0b1010) { // BGE: N == V
-		return machine->psr.n == machine->psr.v;
+		return psr.n == psr.v;
 	} else if (condition == 0b1011) { // BLT: N != V
-		return machine->psr.n != machine->psr.v;
+		return psr.n != psr.v;
 	} else if (condition == 0b1100) { // BGT: Z == 0 && N == V
-		return machine->psr.z == false && machine->psr.n == machine->psr.v;
+		return psr.z == false && psr.n == psr.v;
 	} else if (condition == 0b1101) { // BLE: Z == 1 || N != V
 		// For this instruction, different manuals say different
 		// things.
@@ -431,494 +1829,568 @@ static int machine_condition(machine_t *machine, uint32_t condition) {
 		// former is correct. Also, it is more consistent with e.g.
 		// BHI/BLS. An example of a page that says otherwise:
 		//   http://infocenter.arm.com/help/index.jsp?topic=/com.arm.doc.dui0497a/BABEHFEF.html
-		return machine->psr.z == true || machine->psr.n != machine->psr.v;
+		return psr.z == true || psr.n != psr.v;
 	} else {
 		return -1;
 	}
 }
 
-// ALU operations for Thumb-2, which are used in two different instruction
-// formats.
-static int machine_alu_op(machine_t *machine, uint32_t op, uint32_t *reg_dst, uint32_t *reg_src, uint32_t value, bool setflags) {
-	if (op == 0b0000) {
-		uint32_t result = *reg_src & value;
-		if (reg_dst == &machine->pc && setflags) {
-			// TST
-			machine->psr.n = (int32_t)result < 0;
-			machine->psr.z = result == 0;
-			setflags = false;
-		} else {
-			// AND
-			*reg_dst = result;
-		}
-	} else if (op == 0b0001) {
-		// BIC
-		*reg_dst = *reg_src & ~value; // AND NOT
-	} else if (op == 0b0010) {
-		if (reg_src == &machine->pc) {
-			// MOV
-			*reg_dst = value;
-		} else {
-			// ORR
-			*reg_dst = *reg_src | value;
-		}
-	} else if (op == 0b0011) {
-		if (reg_src == &machine->pc) {
-			// MVN
-			*reg_dst = ~value;
-		} else {
-			// ORN
-			*reg_dst = *reg_src | ~value;
-		}
-	} else if (op == 0b0100) {
-		uint32_t result = *reg_src ^ value;
-		if (reg_dst == &machine->pc && setflags) {
-			// TEQ
-			machine->psr.n = (int32_t)result < 0;
-			machine->psr.z = result == 0;
-			setflags = false;
-		} else {
-			// EOR
-			*reg_dst = result;
-		}
-	} else if (op == 0b1000) {
-		if (reg_dst == &machine->pc && setflags) {
-			// CMN
-			machine_instr_add(machine, *reg_src, value, true);
-			setflags = false;
-		} else {
-			// ADD
-			*reg_dst = machine_instr_add(machine, *reg_src, value, setflags);
-		}
-	} else if (op == 0b1010) {
-		// ADC
-		*reg_dst = machine_instr_adc(machine, *reg_src, value, setflags);
-	} else if (op == 0b1011) {
-		// SBC
-		*reg_dst = machine_instr_sbc(machine, *reg_src, value, setflags);
-	} else if (op == 0b1110) {
-		// RSB
-		*reg_dst = machine_instr_sub(machine, value, *reg_src, setflags);
-	} else if (op == 0b1101) {
-		if (reg_dst == &machine->pc && setflags) {
-			// CMP
-			machine_instr_sub(machine, *reg_src, value, true);
-			setflags = false;
-		} else {
-			// SUB
-			*reg_dst = machine_instr_sub(machine, *reg_src, value, setflags);
-		}
-	} else {
-		return ERR_UNDEFINED;
-	}
-	if (setflags) {
-		machine->psr.n = (int32_t)*reg_dst < 0;
-		machine->psr.z = *reg_dst == 0;
+// Option bits of the predecoded 32-bit data processing instructions. With an
+// immediate operand they are in rm, with a shifted register operand in bits
+// 8.. of imm (above the shift, see machine_shift_imm).
+enum {
+	DP_SETFLAGS = 1 << 0, // the S bit
+	DP_CARRY    = 1 << 1, // with DP_SETFLAGS: the immediate sets the carry flag
+};
+
+// Encode a constant shift (DecodeImmShift in the ARMv7-M manual) for
+// machine_shift_imm().
+static inline uint32_t machine_decode_shift(uint32_t type, uint32_t imm5) {
+	if ((type == 0b01 || type == 0b10) && imm5 == 0) {
+		imm5 = 32; // LSR #32, ASR #32
 	}
-	return ERR_OK;
+	return type | imm5 << 2;
 }
 
-static bool machine_is_32bit_instruction(uint16_t instruction) {
-	return ((instruction >> 11) == 0b11101 || (instruction >> 12) == 0b1111);
+// ThumbExpandImm(): the modified 12-bit immediate of data processing
+// instructions.
+static uint32_t machine_expand_imm(uint32_t imm12) {
+	uint32_t imm8 = imm12 & 0xff;
+	if ((imm12 >> 10) != 0b00) {
+		return machine_ror(0x80 | (imm12 & 0x7f), imm12 >> 7);
+	}
+	switch ((imm12 >> 8) & 0b11) {
+	case 0b00:
+		return imm8;
+	case 0b01:
+		return (imm8 << 16) | imm8;
+	case 0b10:
+		return (imm8 << 24) | (imm8 << 8);
+	default:
+		return (imm8 << 24) | (imm8 << 16) | (imm8 << 8) | imm8;
+	}
 }
 
-int machine_step(machine_t *machine) {
-	// Some handy aliases
-	uint32_t *pc = &machine->pc; // r15
-	uint32_t *lr = &machine->lr; // r14
-	uint32_t *sp = &machine->sp; // r13
+// Decode a 32-bit data processing instruction of the Cortex-M4 into its own
+// opcode ID. Return false for all other instructions (including unpredictable
+// ones with the PC as operand), which are left to machine_step_thumb2().
+//
+// Multiplies keep their fourth register (Ra, or RdLo of long multiplies) in
+// bits 0..3 of imm. Halfword multiplies keep the shift that selects the
+// halfword of Rn in bits 8..15 and the one of Rm in bits 16..23, dual
+// multiplies the rotation of Rm (for the X variants) in bits 16..23, and
+// SMMUL, SMMLA and SMMLS the rounding bit in bit 8.
+static bool machine_decode_thumb2(uint32_t address, uint16_t hw1, uint16_t hw2, machine_decoded_t *d) {
+	uint8_t  rn   = (hw1 >> 0)  & 0b1111;
+	uint8_t  rd   = (hw2 >> 8)  & 0b1111;
+	uint8_t  rm   = (hw2 >> 0)  & 0b1111;
+	uint8_t  ra   = (hw2 >> 12) & 0b1111; // also RdLo
+	uint32_t imm3 = (hw2 >> 12) & 0b111;
+	uint32_t imm2 = (hw2 >> 6)  & 0b11;
+	uint32_t imm5 = (imm3 << 2) | imm2;
+
+	if ((hw1 >> 11) == 0b11110 && (hw2 >> 15) == 0b0 && ((hw1 >> 9) & 0b1) == 0b0) {
+		// Data processing with modified 12-bit immediate
+		static const uint8_t ops[16] = {
+			OP_T2_AND_IMM, OP_T2_BIC_IMM, OP_T2_ORR_IMM, OP_T2_ORN_IMM,
+			OP_T2_EOR_IMM, OP_NONE,       OP_NONE,       OP_NONE,
+			OP_T2_ADD_IMM, OP_NONE,       OP_T2_ADC_IMM, OP_T2_SBC_IMM,
+			OP_NONE,       OP_T2_SUB_IMM, OP_T2_RSB_IMM, OP_NONE,
+		};
+		uint8_t  op       = ops[(hw1 >> 5) & 0b1111];
+		bool     flag_set = (hw1 >> 4) & 0b1;
+		uint32_t imm12    = ((hw1 >> 10) & 0b1) << 11 | imm3 << 8 | (hw2 & 0xff);
+		uint8_t  flags    = 0;
+		if (flag_set) {
+			flags = (imm12 >> 10) != 0b00 ? DP_SETFLAGS | DP_CARRY : DP_SETFLAGS;
+		}
+		if (rd == 15 && flag_set) {
+			// Compare and test: only set the flags.
+			op = op == OP_T2_AND_IMM ? OP_T2_TST_IMM :
+			     op == OP_T2_EOR_IMM ? OP_T2_TEQ_IMM :
+			     op == OP_T2_ADD_IMM ? OP_T2_CMN_IMM :
+			     op == OP_T2_SUB_IMM ? OP_T2_CMP_IMM : OP_NONE;
+			rd = 0;
+		}
+		if (rn == 15) {
+			op = op == OP_T2_ORR_IMM ? OP_T2_MOV_IMM : op == OP_T2_ORN_IMM ? OP_T2_MVN_IMM : OP_NONE;
+			rn = 0;
+		}
+		if (op == OP_NONE || rd == 15) {
+			return false;
+		}
+		machine_decode_set(d, op, rd, rn, flags, machine_expand_imm(imm12));
+		return true;
+	}
 
-	if (*pc - 1 == machine->hwbreak[0] ||
-		*pc - 1 == machine->hwbreak[1] ||
-		*pc - 1 == machine->hwbreak[2] ||
-		*pc - 1 == machine->hwbreak[3]) {
-		return ERR_BREAK;
+	if ((hw1 >> 11) == 0b11110 && (hw2 >> 15) == 0b0) {
+		// Data processing with plain binary immediate, bitfield and saturate
+		uint32_t op    = (hw1 >> 4) & 0b11111;
+		uint32_t imm12 = ((hw1 >> 10) & 0b1) << 11 | imm3 << 8 | (hw2 & 0xff);
+		uint32_t imm16 = (uint32_t)rn << 12 | imm12;
+		bool     flag_sh = (hw1 >> 5) & 0b1;
+		uint32_t lsb   = imm5;
+		uint32_t bits  = hw2 & 0b11111; // msb, widthminus1 or sat_imm
+		if (rd == 15) {
+			return false;
+		}
+		if (rn == 15 && op != 0b00000 && op != 0b01010 && op != 0b00100 && op != 0b01100 && op != 0b10110) {
+			return false;
+		}
+		switch (op) {
+		case 0b00000: // ADDW, ADR
+			if (rn == 15) {
+				machine_decode_set(d, OP_T2_MOV_IMM, rd, 0, 0, ((address + 4) & ~3UL) + imm12);
+			} else {
+				machine_decode_set(d, OP_T2_ADD_IMM, rd, rn, 0, imm12);
+			}
+			return true;
+		case 0b01010: // SUBW, ADR
+			if (rn == 15) {
+				machine_decode_set(d, OP_T2_MOV_IMM, rd, 0, 0, ((address + 4) & ~3UL) - imm12);
+			} else {
+				machine_decode_set(d, OP_T2_SUB_IMM, rd, rn, 0, imm12);
+			}
+			return true;
+		case 0b00100: // MOVW
+			machine_decode_set(d, OP_T2_MOV_IMM, rd, 0, 0, imm16);
+			return true;
+		case 0b01100: // MOVT
+			machine_decode_set(d, OP_T2_MOVT, rd, 0, 0, imm16 << 16);
+			return true;
+		case 0b10000:
+		case 0b10010:
+			if (flag_sh && imm5 == 0) { // SSAT16
+				machine_decode_set(d, OP_T2_SSAT16, rd, rn, 0, (bits & 0b1111) + 1);
+			} else { // SSAT
+				machine_decode_set(d, OP_T2_SSAT, rd, rn, machine_decode_shift(flag_sh ? 0b10 : 0b00, imm5), bits + 1);
+			}
+			return true;
+		case 0b11000:
+		case 0b11010:
+			if (flag_sh && imm5 == 0) { // USAT16
+				machine_decode_set(d, OP_T2_USAT16, rd, rn, 0, bits & 0b1111);
+			} else { // USAT
+				machine_decode_set(d, OP_T2_USAT, rd, rn, machine_decode_shift(flag_sh ? 0b10 : 0b00, imm5), bits);
+			}
+			return true;
+		case 0b10100: // SBFX
+		case 0b11100: // UBFX
+			if (lsb + bits + 1 > 32) {
+				return false;
+			}
+			// Shift the field to the top, then back to the bottom.
+			machine_decode_set(d, op == 0b10100 ? OP_T2_SBFX : OP_T2_UBFX, rd, rn, 31 - lsb - bits, 31 - bits);
+			return true;
+		case 0b10110: { // BFI, BFC
+			if (bits < lsb) {
+				return false;
+			}
+			uint32_t mask = (0xffffffff >> (31 - bits)) & (0xffffffff << lsb);
+			if (rn == 15) {
+				machine_decode_set(d, OP_T2_BFC, rd, 0, lsb, mask);
+			} else {
+				machine_decode_set(d, OP_T2_BFI, rd, rn, lsb, mask);
+			}
+			return true;
+		}
+		default:
+			return false;
+		}
 	}
 
-	if (*pc == 0xdeadbeef) {
-		return ERR_EXIT;
+	if ((hw1 >> 9) == 0b1110101) {
+		// Data processing with constant shift
+		static const uint8_t ops[16] = {
+			OP_T2_AND_REG, OP_T2_BIC_REG, OP_T2_ORR_REG, OP_T2_ORN_REG,
+			OP_T2_EOR_REG, OP_NONE,       OP_T2_PKHBT,   OP_NONE,
+			OP_T2_ADD_REG, OP_NONE,       OP_T2_ADC_REG, OP_T2_SBC_REG,
+			OP_NONE,       OP_T2_SUB_REG, OP_T2_RSB_REG, OP_NONE,
+		};
+		uint8_t  op       = ops[(hw1 >> 5) & 0b1111];
+		bool     flag_set = (hw1 >> 4) & 0b1;
+		uint32_t type     = (hw2 >> 4) & 0b11;
+		if (op == OP_T2_PKHBT) {
+			if (flag_set || (type & 0b01) != 0) {
+				return false;
+			}
+			op = type == 0b10 ? OP_T2_PKHTB : OP_T2_PKHBT;
+		}
+		if (rd == 15 && flag_set) {
+			// Compare and test: only set the flags.
+			op = op == OP_T2_AND_REG ? OP_T2_TST_REG :
+			     op == OP_T2_EOR_REG ? OP_T2_TEQ_REG :
+			     op == OP_T2_ADD_REG ? OP_T2_CMN_REG :
+			     op == OP_T2_SUB_REG ? OP_T2_CMP_REG : OP_NONE;
+			rd = 0;
+		}
+		if (rn == 15) {
+			op = op == OP_T2_ORR_REG ? OP_T2_MOV_REG : op == OP_T2_ORN_REG ? OP_T2_MVN_REG : OP_NONE;
+			rn = 0;
+		}
+		if (op == OP_NONE || rd == 15 || rm == 15) {
+			return false;
+		}
+		machine_decode_set(d, op, rd, rn, rm, machine_decode_shift(type, imm5) | (flag_set ? DP_SETFLAGS << 8 : 0));
+		return true;
 	}
-	if (*pc > machine->image_size - 2) {
-		return ERR_PC;
+
+	if ((hw1 >> 8) == 0b11111010 && (hw2 >> 12) == 0b1111) {
+		// Data processing (register)
+		uint32_t op1 = (hw1 >> 4) & 0b1111;
+		uint32_t op2 = (hw2 >> 4) & 0b1111;
+		if (rd == 15 || rm == 15) {
+			return false;
+		}
+		if ((op1 >> 3) == 0b0 && op2 == 0b0000) {
+			// Register-controlled shift
+			static const uint8_t ops[4] = {OP_T2_LSL_REG, OP_T2_LSR_REG, OP_T2_ASR_REG, OP_T2_ROR_REG};
+			if (rn == 15) {
+				return false;
+			}
+			machine_decode_set(d, ops[(op1 >> 1) & 0b11], rd, rn, rm, (op1 & 0b1) ? DP_SETFLAGS << 8 : 0);
+			return true;
+		}
+		if ((op1 >> 3) == 0b0 && (op2 >> 2) == 0b10) {
+			// Sign or zero extension, with optional addition
+			static const uint8_t ops[2][6] = {
+				{OP_T2_SXTAH, OP_T2_UXTAH, OP_T2_SXTAB16, OP_T2_UXTAB16, OP_T2_SXTAB, OP_T2_UXTAB},
+				{OP_T2_SXTH,  OP_T2_UXTH,  OP_T2_SXTB16,  OP_T2_UXTB16,  OP_T2_SXTB,  OP_T2_UXTB},
+			};
+			if ((op1 & 0b111) >= 6) {
+				return false;
+			}
+			machine_decode_set(d, ops[rn == 15][op1 & 0b111], rd, rn == 15 ? 0 : rn, rm, (op2 & 0b11) << 3);
+			return true;
+		}
+		if (rn == 15) {
+			return false;
+		}
+		if ((op1 >> 3) == 0b1 && (op2 >> 3) == 0b0) {
+			// Parallel addition and subtraction
+			uint32_t prefix = op2 & 0b11;
+			if (prefix == 0b11 || (op1 & 0b11) == 0b11) {
+				return false;
+			}
+			uint32_t kind = ((op2 >> 2) & 0b1) * 3 + prefix;
+			machine_decode_set(d, OP_T2_PARALLEL, rd, rn, rm, (op1 & 0b111) | kind << 3);
+			return true;
+		}
+		if ((op1 >> 2) == 0b10 && (op2 >> 2) == 0b10) {
+			// Miscellaneous operations
+			static const uint8_t ops[4][4] = {
+				{OP_T2_QADD, OP_T2_QDADD, OP_T2_QSUB, OP_T2_QDSUB},
+				{OP_T2_REV,  OP_T2_REV16, OP_T2_RBIT, OP_T2_REVSH},
+				{OP_T2_SEL,  OP_NONE,     OP_NONE,    OP_NONE},
+				{OP_T2_CLZ,  OP_NONE,     OP_NONE,    OP_NONE},
+			};
+			uint8_t op = ops[op1 & 0b11][op2 & 0b11];
+			if (op == OP_NONE) {
+				return false;
+			}
+			machine_decode_set(d, op, rd, rn, rm, 0);
+			return true;
+		}
+		return false;
 	}
-	if ((*pc & 1) != 1) {
-		return ERR_PC;
+
+	if ((hw1 >> 7) == 0b111110110 && ((hw2 >> 6) & 0b11) == 0b00) {
+		// Multiply, multiply accumulate, and absolute difference
+		uint32_t op1 = (hw1 >> 4) & 0b111;
+		uint32_t op2 = (hw2 >> 4) & 0b11;
+		uint32_t half_n = ((hw2 >> 5) & 0b1) * 16; // also the X and R bits
+		uint32_t half_m = ((hw2 >> 4) & 0b1) * 16;
+		bool     flag_acc = ra != 15;
+		uint8_t  op = OP_NONE;
+		if (rd == 15 || rn == 15 || rm == 15) {
+			return false;
+		}
+		switch (op1) {
+		case 0b000:
+			op = op2 == 0b00 ? (flag_acc ? OP_T2_MLA : OP_T2_MUL) : op2 == 0b01 && flag_acc ? OP_T2_MLS : OP_NONE;
+			break;
+		case 0b001:
+			op = flag_acc ? OP_T2_SMLAXY : OP_T2_SMULXY;
+			break;
+		case 0b010:
+			op = op2 >> 1 ? OP_NONE : flag_acc ? OP_T2_SMLAD : OP_T2_SMUAD;
+			break;
+		case 0b011:
+			op = op2 >> 1 ? OP_NONE : flag_acc ? OP_T2_SMLAWY : OP_T2_SMULWY;
+			half_n = 0;
+			break;
+		case 0b100:
+			op = op2 >> 1 ? OP_NONE : flag_acc ? OP_T2_SMLSD : OP_T2_SMUSD;
+			break;
+		case 0b101:
+			op = op2 >> 1 ? OP_NONE : flag_acc ? OP_T2_SMMLA : OP_T2_SMMUL;
+			break;
+		case 0b110:
+			op = op2 >> 1 || !flag_acc ? OP_NONE : OP_T2_SMMLS;
+			break;
+		case 0b111:
+			op = op2 != 0b00 ? OP_NONE : flag_acc ? OP_T2_USADA8 : OP_T2_USAD8;
+			break;
+		}
+		if (op == OP_NONE) {
+			return false;
+		}
+		if (op1 == 0b000 || op1 == 0b111) {
+			half_n = half_m = 0;
+		} else if (op1 == 0b101 || op1 == 0b110) {
+			half_n = half_m / 16; // rounding
+			half_m = 0;
+		} else if (op1 == 0b010 || op1 == 0b100) {
+			half_n = 0; // exchange
+		}
+		machine_decode_set(d, op, rd, rn, rm, ra | half_n << 8 | half_m << 16);
+		return true;
 	}
-	uint16_t instruction = machine->image16[*pc/2];
 
-	// Increment PC to point to the next instruction.
-	*pc += 2;
+	if ((hw1 >> 7) == 0b111110111) {
+		// Long multiply, long multiply accumulate, and divide
+		uint32_t op1 = (hw1 >> 4) & 0b111;
+		uint32_t op2 = (hw2 >> 4) & 0b1111;
+		uint32_t half_n = ((hw2 >> 5) & 0b1) * 16;
+		uint32_t half_m = ((hw2 >> 4) & 0b1) * 16;
+		uint8_t  op = OP_NONE;
+		if (rd == 15 || rn == 15 || rm == 15) {
+			return false;
+		}
+		if (op1 == 0b001 && op2 == 0b1111) {
+			machine_decode_set(d, OP_T2_SDIV, rd, rn, rm, 0);
+			return true;
+		}
+		if (op1 == 0b011 && op2 == 0b1111) {
+			machine_decode_set(d, OP_T2_UDIV, rd, rn, rm, 0);
+			return true;
+		}
+		if (ra == 15) {
+			return false;
+		}
+		if (op2 == 0b0000) {
+			static const uint8_t ops[8] = {OP_T2_SMULL, OP_NONE, OP_T2_UMULL, OP_NONE, OP_T2_SMLAL, OP_NONE, OP_T2_UMLAL, OP_NONE};
+			op = ops[op1];
+			half_n = half_m = 0;
+		} else if (op1 == 0b100 && (op2 >> 2) == 0b10) {
+			op = OP_T2_SMLALXY;
+		} else if ((op1 == 0b100 || op1 == 0b101) && (op2 >> 1) == 0b110) {
+			op = op1 == 0b100 ? OP_T2_SMLALD : OP_T2_SMLSLD;
+			half_n = 0; // exchange
+		} else if (op1 == 0b110 && op2 == 0b0110) {
+			op = OP_T2_UMAAL;
+			half_n = half_m = 0;
+		}
+		if (op == OP_NONE) {
+			return false;
+		}
+		machine_decode_set(d, op, rd, rn, rm, ra | half_n << 8 | half_m << 16);
+		return true;
+	}
 
-	bool inITBlock = machine_versioncheck(machine, CORTEX_M4) ? machine->psr.it2 != 0 : false;
+	return false;
+}
 
-	if (inITBlock) {
-		// Check whether we need to execute the following instruction.
-		uint32_t state = machine->psr.it1 | (machine->psr.it2 << 2);
-		uint32_t condition = state >> 4;
-		uint32_t newstate = (state & 0b11100000) | ((state << 1) & 0b11111);
-		if ((newstate & 0b1111) == 0) {
-			newstate = 0;
+// The hook of the function at the given address, see machine_set_hook().
+static machine_hook_t machine_hook_at(machine_t *machine, uint32_t address) {
+	for (size_t i = 0; i < machine->num_hooks; i++) {
+		if (machine->hooks[i].address == address) {
+			return machine->hooks[i].hook;
 		}
-		machine->psr.it1 = newstate & 0b11;
-		machine->psr.it2 = newstate >> 2;
-		int result = machine_condition(machine, condition);
-		if (result < 0) {
-			return ERR_UNDEFINED;
-		}
-		if (!result) {
-			// Don't do anything.
-			// We could also have changed instruction to a nop.
-			if (machine_is_32bit_instruction(instruction)) {
-				*pc += 2;
-			}
-			return ERR_OK;
-		} else {
-			// Continue.
+	}
+	return HOOK_NONE;
+}
+
+// Decode the instruction at the given (even) address into d. This only
+// extracts fields, it does not depend on or modify any register state.
+// The decode order follows the ARM7-TDMI manual formats. 32-bit instructions
+// other than BL and data processing are left to machine_step_thumb2().
+static void machine_decode(machine_t *machine, uint32_t address, machine_decoded_t *d) {
+	if (machine->num_hooks != 0) {
+		machine_hook_t hook = machine_hook_at(machine, address);
+		if (hook != HOOK_NONE) {
+			machine_decode_set(d, OP_HOOK, 0, 0, 0, hook);
+			return;
 		}
 	}
+	uint16_t instruction = machine->image16[address/2];
+	uint32_t pc = address + 3; // value of PC while executing (like *pc)
 
-	// Decode/execute instruction
+	uint8_t r0 = (instruction >> 0) & 0b111;
+	uint8_t r3 = (instruction >> 3) & 0b111;
+	uint8_t r6 = (instruction >> 6) & 0b111;
+	uint8_t r8 = (instruction >> 8) & 0b111;
 
 	if ((instruction >> 13) == 0b000) {
-		uint32_t *reg_dst = &machine->regs[(instruction >> 0) & 0b111];
-		uint32_t *reg_src = &machine->regs[(instruction >> 3) & 0b111];
-		uint32_t op       = (instruction >> 11)  & 0b11;
-		bool setflags = !inITBlock;
+		uint32_t op = (instruction >> 11) & 0b11;
 		if (op != 3) {
 			// Format 1: move shifted register
 			uint32_t offset5 = (instruction >> 6) & 0x1f;
 			if (op == 0) { // LSLS
-				*reg_dst = machine_instr_lsl(machine, *reg_src, offset5, setflags);
+				machine_decode_set(d, OP_LSLS_IMM, r0, r3, 0, offset5);
 			} else if (op == 1) { // LSRS
-				*reg_dst = machine_instr_lsr(machine, *reg_src, offset5 == 0 ? 32 : offset5, setflags);
-			} else if (op == 2) { // ASRS
-				*reg_dst = machine_instr_asr(machine, *reg_src, offset5 == 0 ? 32 : offset5, setflags);
+				machine_decode_set(d, OP_LSRS_IMM, r0, r3, 0, offset5 == 0 ? 32 : offset5);
+			} else { // ASRS
+				machine_decode_set(d, OP_ASRS_IMM, r0, r3, 0, offset5 == 0 ? 32 : offset5);
 			}
-		} else { // op == 3
+		} else {
 			// Format 2: add/subtract
-			uint32_t value    = (instruction >> 6)  & 0b111;
-			uint32_t op       = (instruction >> 9)  & 0b1;
-			bool     flag_imm = (instruction >> 10) & 0b1;
-			if (!flag_imm) {
-				value = machine->regs[value];
-			}
-			if (op == 0) { // ADDS
-				*reg_dst = machine_instr_add(machine, *reg_src, value, setflags);
-			} else { // SUBS
-				*reg_dst = machine_instr_sub(machine, *reg_src, value, setflags);
+			bool flag_sub = (instruction >> 9)  & 0b1;
+			bool flag_imm = (instruction >> 10) & 0b1;
+			if (flag_imm) {
+				machine_decode_set(d, flag_sub ? OP_SUBS_IMM : OP_ADDS_IMM, r0, r3, 0, r6);
+			} else {
+				machine_decode_set(d, flag_sub ? OP_SUBS_REG : OP_ADDS_REG, r0, r3, r6, 0);
 			}
 		}
-		if (setflags) {
-			machine->psr.n = (int32_t)*reg_dst < 0;
-			machine->psr.z = *reg_dst == 0;
-		}
 
 	} else if ((instruction >> 13) == 0b001) {
 		// Format 3: move/compare/add/subtract immediate
-		uint32_t  imm  = instruction & 0xff;
-		uint32_t *reg = &machine->regs[(instruction >> 8)  & 0b111];
-		size_t   op   = (instruction >> 11) & 0b11;
-		bool setflags = !inITBlock;
-		if (op == 0) { // MOVS
-			*reg = imm;
-		} else if (op == 1) { // CMP
-			// Update flags as if doing *reg - imm
-			machine_instr_sub(machine, *reg, imm, true);
-			setflags = false;
-			// Don't update *reg
-		} else if (op == 2) { // ADDS
-			*reg = machine_instr_add(machine, *reg, imm, setflags);
-		} else if (op == 3) { // SUBS
-			*reg = machine_instr_sub(machine, *reg, imm, setflags);
-		}
-		if (setflags) {
-			machine->psr.n = (int32_t)*reg < 0;
-			machine->psr.z = *reg == 0;
-		}
+		static const uint8_t ops[4] = {OP_MOVS_IMM, OP_CMP_IMM, OP_ADDS_IMM, OP_SUBS_IMM};
+		uint32_t imm = instruction & 0xff;
+		machine_decode_set(d, ops[(instruction >> 11) & 0b11], r8, r8, 0, imm);
 
 	} else if ((instruction >> 10) == 0b010000) {
 		// Format 4: ALU operations
-		uint32_t *reg_dst = &machine->regs[(instruction >> 0) & 0b111];
-		uint32_t *reg_src = &machine->regs[(instruction >> 3) & 0b111];
-		uint32_t op       = (instruction >> 6) & 0b1111;
-		bool setflags = !inITBlock;
-		if (op == 0b0000) { // ANDS
-			*reg_dst &= *reg_src;
-		} else if (op == 0b0001) { // EORS
-			*reg_dst ^= *reg_src;
-		} else if (op == 0b0010) { // LSLS
-			*reg_dst = machine_instr_lsl(machine, *reg_dst, *reg_src & 0xff, setflags);
-		} else if (op == 0b0011) { // LSRS
-			*reg_dst = machine_instr_lsr(machine, *reg_dst, *reg_src & 0xff, setflags);
-		} else if (op == 0b0100) { // ASRS
-			*reg_dst = machine_instr_asr(machine, *reg_dst, *reg_src & 0xff, setflags);
-		} else if (op == 0b0101) { // ADCS
-			*reg_dst = machine_instr_adc(machine, *reg_dst, *reg_src, setflags);
-		} else if (op == 0b0110) { // SBCS
-			*reg_dst = machine_instr_sbc(machine, *reg_dst, *reg_src, setflags);
-		} else if (op == 0b1000) { // TST
-			// set CC on Rd AND Rs
-			machine->psr.n = (int32_t)(*reg_src & *reg_dst) < 0;
-			machine->psr.z = (int32_t)(*reg_src & *reg_dst) == 0;
-			setflags = false;
-		} else if (op == 0b1001) { // NEG / RSBS
-			*reg_dst = machine_instr_sub(machine, 0, *reg_src, setflags);
-		} else if (op == 0b1010) { // CMP
-			// set CC on Rd - Rs
-			machine_instr_sub(machine, *reg_dst, *reg_src, true);
-			setflags = false;
-		} else if (op == 0b1011) { // CMN
-			// set cc on Rd + Rs
-			machine_instr_add(machine, *reg_dst, *reg_src, true);
-			setflags = false;
-		} else if (op == 0b1100) { // ORRS
-			// does not update C or V
-			*reg_dst |= *reg_src;
-		} else if (op == 0b1101) { // MULS
-			// does not update C or V
-			*reg_dst *= *reg_src;
-		} else if (op == 0b1110) { // BICS
-			// does not update C or V
-			*reg_dst &= ~*reg_src;
-		} else if (op == 0b1111) { // MVNS
-			// does not update C or V
-			*reg_dst = ~*reg_src;
-		} else {
-			// The only missing ALU op is ROR.
-			return ERR_UNDEFINED;
-		}
-		if (setflags) {
-			machine->psr.n = (int32_t)*reg_dst < 0;
-			machine->psr.z = *reg_dst == 0;
-		}
+		static const uint8_t ops[16] = {
+			OP_ANDS, OP_EORS, OP_LSLS_REG, OP_LSRS_REG,
+			OP_ASRS_REG, OP_ADCS, OP_SBCS, OP_RORS_REG,
+			OP_TST, OP_RSBS, OP_CMP_REG, OP_CMN,
+			OP_ORRS, OP_MULS, OP_BICS, OP_MVNS,
+		};
+		machine_decode_set(d, ops[(instruction >> 6) & 0b1111], r0, r0, r3, 0);
 
 	} else if ((instruction >> 10) == 0b010001) {
 		// Format 5: Hi register operations/branch exchange
-		uint32_t *reg_dst = &machine->regs[(instruction >> 0) & 0b111];
-		uint32_t *reg_src = &machine->regs[(instruction >> 3) & 0b111];
-		bool     h2       = (instruction >> 6) & 0b1;
-		bool     h1       = (instruction >> 7) & 0b1;
-		uint32_t op       = (instruction >> 8) & 0b11;
-		reg_src += h2 * 8; // make high register (if h2 is 1)
+		bool    h2 = (instruction >> 6) & 0b1;
+		bool    h1 = (instruction >> 7) & 0b1;
+		uint8_t rs = r3 + h2 * 8;
+		uint8_t rd = r0 + h1 * 8;
+		uint32_t op = (instruction >> 8) & 0b11;
 		if (op == 3) { // BX/BLX
-			if (reg_dst != &machine->r0) {
-				return ERR_UNDEFINED; // unimplemented
-			}
-			if (h1) {
-				machine_log(machine, LOG_CALLS, "%*sBLX r%ld %6x (sp: %x) -> %x\n", machine->call_depth * 2, "", reg_src - machine->regs, *pc - 3, *sp, *reg_src - 1);
-				machine_add_backtrace(machine, *pc - 3, *sp);
-			} else if (reg_src == lr) {
-				machine_log(machine, LOG_CALLS, "%*sBX lr %6x (sp: %x) <- %x\n", machine->call_depth * 2, "", *pc - 3, *sp, *reg_src - 1);
-			}
-			uint32_t next_lr = *pc;
-			*pc = *reg_src;
-			if (h1) { // BLX
-				*lr = next_lr;
-			}
-		} else { // ALU operation with high registers
-			reg_dst += h1 * 8; // make high register (if h1 is 1)
-			if (op == 0) { // ADD
-				*reg_dst += *reg_src;
-			} else if (op == 1) { // CMP
-				// set CC on Rd - Rs
-				machine_instr_sub(machine, *reg_dst, *reg_src, true);
-			} else if (op == 2) { // MOV
-				*reg_dst = *reg_src;
-				if (reg_dst == pc) {
-					*reg_dst |= 1; // force T-bit to 1
-				}
+			if (r0 != 0) {
+				machine_decode_set(d, OP_UNDEFINED, 0, 0, 0, 0); // unimplemented
+			} else {
+				machine_decode_set(d, h1 ? OP_BLX : OP_BX, 0, 0, rs, 0);
 			}
+		} else if (op == 0) { // ADD
+			machine_decode_set(d, OP_ADD_HI, rd, rd, rs, 0);
+		} else if (op == 1) { // CMP
+			machine_decode_set(d, OP_CMP_REG, 0, rd, rs, 0);
+		} else { // MOV
+			machine_decode_set(d, OP_MOV_HI, rd, 0, rs, 0);
 		}
 
 	} else if ((instruction >> 11) == 0b01001) {
 		// Format 6: PC-relative load
 		uint32_t imm = instruction & 0xff; // 8 bits
-		uint32_t *reg = &machine->regs[(instruction >> 8)  & 0b111];
-		uint32_t address = ((*pc + 2) & ~3UL) + imm * 4;
-		if (machine_transfer(machine, address, LOAD, reg, WIDTH_32, false)) {
-			return ERR_MEM;
-		}
+		uint32_t address = ((pc + 2) & ~3UL) + imm * 4;
+		machine_decode_set(d, OP_LDR_LIT, r8, 0, 0, address);
 
 	} else if ((instruction >> 12) == 0b0101) {
-		uint32_t *reg_change = &machine->regs[(instruction >> 0) & 0b111];
-		uint32_t *reg_base   = &machine->regs[(instruction >> 3) & 0b111];
-		uint32_t *reg_offset = &machine->regs[(instruction >> 6) & 0b111];
-		if (((instruction >> 9) & 0b1) == 0) {
-			// Format 7: Load/store with register offset (LDR)
-			bool flag_byte = (instruction >> 10) & 0b1;
-			bool flag_load = (instruction >> 11) & 0b1;
-			transfer_type_t transfer_type = flag_load ? LOAD : STORE;
-			width_t width = flag_byte ? WIDTH_8 : WIDTH_32;
-			if (machine_transfer(machine, *reg_base + *reg_offset, transfer_type, reg_change, width, false)) {
-				return ERR_MEM;
-			}
-		} else {
-			// Format 8: Load/store sign-extended byte/halfword
-			bool flag_sign_extend = (instruction >> 10) & 0b1;
-			bool flag_H           = (instruction >> 11) & 0b1;
-			uint32_t address = *reg_base + *reg_offset;
-			if (flag_sign_extend) {
-				if (flag_H) {
-					if (machine_transfer(machine, address, LOAD, reg_change, WIDTH_16, true)) { // LDSH
-						return ERR_MEM;
-					}
-				} else {
-					if (machine_transfer(machine, address, LOAD, reg_change, WIDTH_8, true)) { // LDSB
-						return ERR_MEM;
-					}
-				}
-			} else {
-				transfer_type_t transfer_type = flag_H ? LOAD : STORE;
-				if (machine_transfer(machine, address, transfer_type, reg_change, WIDTH_16, false)) { // STRH/LDRH
-					return ERR_MEM;
-				}
-			}
-		}
+		// Format 7: Load/store with register offset (LDR)
+		// Format 8: Load/store sign-extended byte/halfword
+		static const uint8_t ops[8] = {
+			OP_STR_REG, OP_STRH_REG, OP_STRB_REG, OP_LDRSB_REG,
+			OP_LDR_REG, OP_LDRH_REG, OP_LDRB_REG, OP_LDRSH_REG,
+		};
+		machine_decode_set(d, ops[(instruction >> 9) & 0b111], r0, r3, r6, 0);
 
 	} else if ((instruction >> 13) == 0b011) {
 		// Format 9: load/store with immediate offset
-		uint32_t *reg_change = &machine->regs[(instruction >> 0)  & 0b111];
-		uint32_t *reg_base   = &machine->regs[(instruction >> 3)  & 0b111];
-		uint32_t offset5     = (instruction >> 6) & 0x1f;
-		bool     flag_load   = (instruction >> 11) & 0b1;
-		bool     flag_byte   = (instruction >> 12) & 0b1;
-		transfer_type_t transfer_type = flag_load ? LOAD : STORE;
+		uint32_t offset5   = (instruction >> 6) & 0x1f;
+		bool     flag_load = (instruction >> 11) & 0b1;
+		bool     flag_byte = (instruction >> 12) & 0b1;
 		if (flag_byte) {
-			uint32_t address = *reg_base + offset5;
-			if (machine_transfer(machine, address, transfer_type, reg_change, WIDTH_8, false)) {
-				return ERR_MEM;
-			}
+			machine_decode_set(d, flag_load ? OP_LDRB_IMM : OP_STRB_IMM, r0, r3, 0, offset5);
 		} else {
-			uint32_t address = *reg_base + offset5 * 4;
-			if (machine_transfer(machine, address, transfer_type, reg_change, WIDTH_32, false)) {
-				return ERR_MEM;
-			}
+			machine_decode_set(d, flag_load ? OP_LDR_IMM : OP_STR_IMM, r0, r3, 0, offset5 * 4);
 		}
 
 	} else if ((instruction >> 12) == 0b1000) {
 		// Format 10: load/store halfword
-		uint32_t *reg_change = &machine->regs[(instruction >> 0)  & 0b111];
-		uint32_t *reg_base   = &machine->regs[(instruction >> 3)  & 0b111];
-		uint32_t offset5     = (instruction >> 6) & 0x1f;
-		bool     flag_load   = (instruction >> 11) & 0b1;
-		transfer_type_t transfer_type = flag_load ? LOAD : STORE;
-		uint32_t address = *reg_base + (offset5 << 1);
-		if (machine_transfer(machine, address, transfer_type, reg_change, WIDTH_16, false)) {
-			return ERR_MEM;
-		}
+		uint32_t offset5   = (instruction >> 6) & 0x1f;
+		bool     flag_load = (instruction >> 11) & 0b1;
+		machine_decode_set(d, flag_load ? OP_LDRH_IMM : OP_STRH_IMM, r0, r3, 0, offset5 << 1);
 
 	} else if ((instruction >> 12) == 0b1001) {
 		// Format 11: SP-relative load/store
 		uint32_t word8     = (instruction >> 0) & 0xff; // 8 bits
-		uint32_t *reg      = &machine->regs[(instruction >> 8) & 0b111];
 		bool     flag_load = (instruction >> 11) & 0b1;
-		transfer_type_t transfer_type = flag_load ? LOAD : STORE;
-		if (machine_transfer(machine, *sp + word8 * 4, transfer_type, reg, WIDTH_32, false)) {
-			return ERR_MEM;
-		}
+		machine_decode_set(d, flag_load ? OP_LDR_IMM : OP_STR_IMM, r8, 13, 0, word8 * 4);
 
 	} else if ((instruction >> 12) == 0b1010) {
 		// Format 12: load address
-		uint32_t word8    = (instruction >> 0) & 0xff; // 8 bits
-		uint32_t *reg_dst = &machine->regs[(instruction >> 8) & 0b111];
-		bool     flag_sp  = (instruction >> 11) & 0b1;
-		uint32_t value = flag_sp ? *sp : *pc;
-		if (!flag_sp) {
+		uint32_t word8   = (instruction >> 0) & 0xff; // 8 bits
+		bool     flag_sp = (instruction >> 11) & 0b1;
+		if (flag_sp) {
+			machine_decode_set(d, OP_ADD_IMM, r8, 13, 0, word8 << 2);
+		} else {
 			// ADR
 			// for PC: force bit 1 to 0
-			value += 2;
-			value &= ~0b11UL;
+			uint32_t value = (pc + 2) & ~0b11UL;
+			machine_decode_set(d, OP_MOV_IMM32, r8, 0, 0, value + (word8 << 2));
 		}
-		*reg_dst = value + (word8 << 2);
 
 	} else if ((instruction >> 8) == 0b10110000) {
 		// Format 13: add offset to Stack Pointer
 		uint32_t offset6  = (instruction >> 0) & 0x3f; // 6 bits
 		bool     flag_neg = (instruction >> 7) & 0b1;
-		if (flag_neg) { // SUB SP, #imm
-			machine_log(machine, LOG_CALLS, "%*ssub     0x%02x (sp: %x)\n", machine->call_depth * 2, "", offset6 * 4, *sp);
-			*sp -= offset6 * 4;
-		} else { // ADD SP, #imm
-			machine_log(machine, LOG_CALLS, "%*sadd    %2x (sp: %x)\n", machine->call_depth * 2, "", offset6 * 4, *sp);
-			*sp += offset6 * 4;
-		}
+		machine_decode_set(d, flag_neg ? OP_SUB_SP_IMM : OP_ADD_SP_IMM, 13, 13, 0, offset6 * 4);
 
 	} else if ((instruction >> 8) == 0b10110010) {
 		// Sign or zero extend
-		uint32_t *reg_dst = &machine->regs[(instruction >> 0) & 0b111];
-		uint32_t *reg_src = &machine->regs[(instruction >> 3) & 0b111];
-		uint32_t opcode   = (instruction >> 6) & 0b11;
-		if (opcode == 0b00) {
-			// T1: SXTH (signed extend halfword)
-			*reg_dst = (int32_t)(*reg_src << 16) >> 16;
-		} else if (opcode == 0b01) {
-			// T1: SXTB (signed extend byte)
-			*reg_dst = (int32_t)(*reg_src << 24) >> 24;
-		} else if (opcode == 0b10) {
-			// T1: UXTH (unsigned extend halfword)
-			*reg_dst = *reg_src & 0xffff;
-		} else if (opcode == 0b11) {
-			// T1: UXTB (unsigned extend byte)
-			*reg_dst = *reg_src & 0xff;
-		}
+		static const uint8_t ops[4] = {OP_SXTH, OP_SXTB, OP_UXTH, OP_UXTB};
+		machine_decode_set(d, ops[(instruction >> 6) & 0b11], r0, 0, r3, 0);
 
 	} else if (((instruction >> 8) & 0b11110101) == 0b10110001 && machine_versioncheck(machine, CORTEX_M4)) {
 		// T1: CBZ / CBNZ (compare and branch on [non-]zero)
 		// Note: the previous two instruction encodings (sign/zero extend,
 		// add sp) must be before this instruction.
-		uint32_t *reg = &machine->regs[(instruction >> 0) & 0b111];
-		uint32_t imm5 = (instruction >> 3) & 0b11111;
+		uint32_t imm5    = (instruction >> 3) & 0b11111;
 		uint32_t flag_i  = ((instruction >> 9) & 0b1);
-		bool flag_nz = ((instruction >> 11) & 0b1);
-		if ((*reg == 0) == !flag_nz) {
-			*pc += (flag_i << 6) + (imm5 << 1) + 2;
-		}
+		bool     flag_nz = ((instruction >> 11) & 0b1);
+		uint32_t target  = pc + (flag_i << 6) + (imm5 << 1) + 2;
+		machine_decode_set(d, flag_nz ? OP_CBNZ : OP_CBZ, 0, r0, 0, target);
 
 	} else if ((instruction & 0xffef) == 0xb662) {
-		// CPSID/CPSIE
-		// Ignore for now.
+		// CPSID/CPSIE: set or clear PRIMASK
+		bool flag_disable = (instruction >> 4) & 0b1;
+		machine_decode_set(d, OP_CPS, 0, 0, 0, flag_disable);
 
 	} else if ((instruction >> 8) == 0b10111010) {
 		// T1: Reverse bytes
-		uint32_t *reg_dst = &machine->regs[(instruction >> 0) & 0b111];
-		uint32_t *reg_src = &machine->regs[(instruction >> 3) & 0b111];
-		uint32_t opcode   = (instruction >> 6) & 0b11;
+		uint32_t opcode = (instruction >> 6) & 0b11;
 		if (opcode == 0b00) { // REV: reverse bytes
-			*reg_dst =
-				(*reg_src >> 0  & 0xff) << 24 |
-				(*reg_src >> 8  & 0xff) << 16 |
-				(*reg_src >> 16 & 0xff) << 8 |
-				(*reg_src >> 24 & 0xff) << 0;
-		//} else if (opcode == 0b01) { // REV16
-		//} else if (opcode == 0b11) { // REVSH
+			machine_decode_set(d, OP_REV, r0, 0, r3, 0);
+		} else if (opcode == 0b01) { // REV16: reverse bytes in each halfword
+			machine_decode_set(d, OP_REV16, r0, 0, r3, 0);
+		} else if (opcode == 0b11) { // REVSH: reverse bytes in the low halfword, sign extend
+			machine_decode_set(d, OP_REVSH, r0, 0, r3, 0);
 		} else {
-			return ERR_UNDEFINED;
+			machine_decode_set(d, OP_UNDEFINED, 0, 0, 0, 0);
 		}
 
 	} else if ((instruction >> 8) == 0b10111110) {
 		// T1: BKPT (software breakpoint)
-		uint32_t imm8 = (instruction >> 0) & 0b11111111;
-		// This emulator handles some breakpoints in a special way.
-		if (imm8 == 0x81) {
-			machine->loglevel = LOG_INSTRS;
-		} else if (imm8 == 0x80) {
-			machine->loglevel = LOG_ERROR;
-		} else {
-			return ERR_BREAK;
+		machine_decode_set(d, OP_BKPT, 0, 0, 0, instruction & 0xff);
+
+	} else if ((instruction >> 8) == 0b10111111 && (instruction & 0b1111) == 0) {
+		// Hints
+		uint32_t hint = (instruction >> 4) & 0b1111;
+		if (hint == 0b0010 || hint == 0b0011) { // WFE, WFI
+			machine_decode_set(d, OP_WFI, 0, 0, 0, hint == 0b0010);
+		} else if (hint == 0b0100) { // SEV
+			machine_decode_set(d, OP_SEV, 0, 0, 0, 0);
+		} else { // NOP, YIELD and others
+			machine_decode_set(d, OP_NOP, 0, 0, 0, 0);
 		}
 
 	} else if ((instruction >> 8) == 0b10111111 && machine_versioncheck(machine, CORTEX_M4)) {
+		// IT
 		uint32_t firstcond = (instruction >> 4) & 0b1111;
 		uint32_t mask      = (instruction >> 0) & 0b1111;
-		if (mask == 0b0000) {
-			// NOP-compatible hints (NOP, YIELD, WFE, WFI, SEV, DBG).
-			// For now, ignore. TODO: implement WFE/WFI.
-		} else {
-			// IT
-			uint32_t state = (firstcond << 4) | mask;
-			machine->psr.it1 = state & 0b11;
-			machine->psr.it2 = state >> 2;
-		}
+		machine_decode_set(d, OP_IT, 0, 0, 0, (firstcond << 4) | mask);
 
 	} else if ((instruction >> 12) == 0b1011 && ((instruction >> 9) & 0b11) == 0b10) { // 1011x10
 		// Format 14: push/pop registers
@@ -929,38 +2401,19 @@ int machine_step(machine_t *machine) {
 			if (flag_pc_lr) {
 				reg_list |= (1 << 15); // PC
 			}
-			int err = machine_instr_ldmia(machine, sp, reg_list, true);
-			if (err != 0) {
-				return err;
-			}
+			machine_decode_set(d, OP_POP, 0, 13, 0, reg_list);
 		} else { // PUSH
 			if (flag_pc_lr) {
 				reg_list |= (1 << 14); // LR
 			}
-			int err = machine_instr_stmdb(machine, sp, reg_list, true);
-			if (err != 0) {
-				return err;
-			}
+			machine_decode_set(d, OP_PUSH, 0, 13, 0, reg_list);
 		}
 
 	} else if ((instruction >> 12) == 0b1100) {
 		// Format 15: multiple load/store (LDMIA and STMIA)
-		uint32_t  reg_list = (instruction >> 0) & 0xff;
-		uint32_t  reg_base_num = (instruction >> 8) & 0b111;
-		uint32_t *reg_base = &machine->regs[reg_base_num];
+		uint32_t reg_list  = (instruction >> 0) & 0xff;
 		bool     flag_load = (instruction >> 11) & 0b1;
-		if (reg_list == 0) {
-			machine_log(machine, LOG_ERROR, "\nERROR: LDMIA/STMIA does not allow zero registers (%04x)\n", instruction);
-			return ERR_UNDEFINED;
-		}
-		if (flag_load) {
-			// LDMIA!
-			bool wback = (reg_list & (1 << reg_base_num)) == 0;
-			machine_instr_ldmia(machine, reg_base, reg_list, wback);
-		} else {
-			// STMIA!
-			machine_instr_stmia(machine, reg_base, reg_list, true);
-		}
+		machine_decode_set(d, flag_load ? OP_LDMIA : OP_STMIA, 0, r8, 0, reg_list);
 
 	} else if ((instruction >> 12) == 0b1101) {
 		// Format 16: conditional branch
@@ -969,26 +2422,55 @@ int machine_step(machine_t *machine) {
 		uint32_t condition = (instruction >> 8) & 0b1111;
 		int32_t offset = ((int32_t)(offset8 << 24) >> 23);
 		offset += 2;
-		int result = machine_condition(machine, condition);
-		if (result < 0) {
-			return ERR_UNDEFINED;
-		}
-		if (result) {
-			*pc += offset;
+		if (condition == 0b1111) {
+			// Format 17: software interrupt
+			machine_decode_set(d, OP_SVC, 0, 0, 0, offset8);
+		} else if (machine_condition(machine, condition) < 0) {
+			// Invalid condition (doesn't depend on the flags).
+			machine_decode_set(d, OP_UNDEFINED, 0, 0, 0, 0);
+		} else {
+			machine_decode_set(d, OP_BCOND, condition, 0, 0, pc + offset);
 		}
 
 	} else if ((instruction >> 11) == 0b11100) {
 		// Format 18: unconditional branch
 		uint32_t offset11 = (instruction >> 0) & 0x7ff;
 		int32_t offset = ((int32_t)(offset11 << 21) >> 20);
-		*pc += offset + 2;
+		machine_decode_set(d, OP_B, 0, 0, 0, pc + offset + 2);
 
-	} else if ((instruction >> 11) == 0b11101 && machine_versioncheck(machine, CORTEX_M4)) {
+	} else if (((instruction >> 11) == 0b11101 && machine_versioncheck(machine, CORTEX_M4)) || (instruction >> 12) == 0b1111) {
 		// 32-bit instruction
 		uint16_t hw1 = instruction;
-		uint16_t hw2 = machine->image16[*pc/2];
-		*pc += 2;
+		uint16_t hw2 = machine->image16[address/2 + 1];
+		if ((hw1 >> 11) == 0b11110 && ((hw2 >> 11) & 0b10111) == 0b10111 &&
+				!((hw1 >> 4) == 0b111100111011 && (hw2 >> 14) == 0b10)) {
+			// BL, B.W (but not special control operations)
+			uint32_t imm10 = hw1 & 0x3ff;
+			uint32_t imm11 = hw2 & 0x7ff;
+			bool flag_link = (hw2 >> 14) & 0b1;
+			int32_t pc_offset = (int32_t)(((uint32_t)imm10 << 12) | ((uint32_t)imm11 << 1)); // >> 11;
+			pc_offset <<= 10; // put in the top bits
+			pc_offset >>= 10; // sign-extend
+			uint32_t new_pc = (int32_t)(pc + 2) + pc_offset;
+			machine_decode_set(d, OP_BL, flag_link, 0, 0, new_pc);
+		} else if (!machine_versioncheck(machine, CORTEX_M4) || !machine_decode_thumb2(address, hw1, hw2, d)) {
+			machine_decode_set(d, OP_THUMB2, 0, 0, 0, (uint32_t)hw1 | ((uint32_t)hw2 << 16));
+		}
+
+	} else {
+		machine_decode_set(d, OP_UNDEFINED, 0, 0, 0, 0);
+	}
+}
+
+// Execute a 32-bit Thumb-2 instruction that wasn't predecoded into its own
+// opcode ID: loads and stores, branches and special registers. PC must
+// already point to the next instruction.
+static int machine_step_thumb2(machine_t *machine, uint16_t hw1, uint16_t hw2) {
+	// Some handy aliases
+	uint32_t *pc = &machine->pc; // r15
+	uint32_t *sp = &machine->sp; // r13
 
+	if ((hw1 >> 11) == 0b11101) {
 		if (((hw1 >> 6) == 0b1110100100)) {
 			bool flag_load  = (hw1 >> 4) & 0b1;
 			bool flag_wback = (hw1 >> 5) & 0b1;
@@ -1089,187 +2571,14 @@ int machine_step(machine_t *machine) {
 				}
 			}
 
-		} else if ((hw1 >> 9) == 0b1110101) {
-			// Data processing instructions with constant shift
-			uint32_t op        = (hw1 >> 5) & 0b1111;
-			uint32_t flag_set  = (hw1 >> 4) & 0b1;
-			uint32_t *reg_dst  = &machine->regs[(hw2 >> 8) & 0b1111]; // Rd
-			uint32_t *reg_src  = &machine->regs[(hw1 >> 0) & 0b1111]; // Rn
-			uint32_t *reg_src2 = &machine->regs[(hw2 >> 0) & 0b1111]; // Rm
-			uint32_t imm3      = (hw2 >> 12) & 0b111;
-			uint32_t imm2      = (hw2 >> 6)  & 0b11;
-			uint32_t type      = (hw2 >> 4)  & 0b11;
-
-			uint32_t imm5 = (imm3 << 2) | imm2;
-			// DecodeImmShift(type, imm3:imm2)
-			// Shift(value, shift_t / type, shift_n / amount, APSR.C / carry_in)
-			uint32_t shifted;
-			switch (type) {
-				case 0b00: // LSL
-					shifted = machine_instr_lsl(machine, *reg_src2, imm5, flag_set);
-					break;
-				case 0b01: // LSR
-					shifted = machine_instr_lsr(machine, *reg_src2, imm5 == 0 ? 32 : imm5, flag_set);
-					break;
-				case 0b10: // ASR
-					shifted = machine_instr_asr(machine, *reg_src2, imm5 == 0 ? 32 : imm5, flag_set);
-					break;
-				case 0b11: // ROR, RRX
-					*pc -= 2; // undo 32-bit change
-					return ERR_UNDEFINED;
-			}
-
-			int err = machine_alu_op(machine, op, reg_dst, reg_src, shifted, flag_set);
-			if (err != ERR_OK) {
-				*pc -= 2;
-				return err;
-			}
-
 		} else {
 			*pc -= 2; // undo 32-bit change
 			return ERR_UNDEFINED;
 		}
-
-	} else if ((instruction >> 12) == 0b1111) {
-		// 32-bit instruction
-		uint16_t hw1 = instruction;
-		uint16_t hw2 = machine->image16[*pc/2];
-		*pc += 2;
-
-		if ((hw1 >> 11) == 0b11110 && (hw2 >> 15) == 0b0 && machine_versioncheck(machine, CORTEX_M4)) {
-			// Data processing instructions: immediate, including bitfield
-			// and saturate
-			uint32_t imm3 = (hw2 >> 12) & 0b111;
-			uint32_t *reg_dst = &machine->regs[(hw2 >> 8) & 0b1111]; // Rd
-			uint32_t *reg_src = &machine->regs[(hw1 >> 0) & 0b1111]; // Rn
-
-			if (((hw1 >> 9) & 0b1) == 0b0) {
-				// Data processing with modified 12-bit immediate
-				uint32_t bit_i    = (hw1 >> 10) & 0b1;
-				uint32_t op       = (hw1 >> 5) & 0b1111;
-				bool     flag_set = (hw1 >> 4) & 0b1;
-				uint32_t imm8     = (hw2 >> 0) & 0xff;
-				uint32_t imm12 = imm8 | (imm3 << 8) | (bit_i << 11);
-
-				// ThumbExpandImmWithC()
-				uint32_t imm32;
-				if ((imm12 >> 10) == 0b00) {
-					uint32_t imm8 = imm12 & 0xff;
-					switch ((imm12 >> 8) & 0b11) {
-						case 0b00:
-							imm32 = imm8;
-							break;
-						case 0b01:
-							imm32 = (imm8 << 16) | imm8;
-							break;
-						case 0b10:
-							imm32 = (imm8 << 24) | (imm8 << 8);
-							break;
-						case 0b11:
-							imm32 = (imm8 << 24) | (imm8 << 16) | (imm8 << 8) | imm8;
-							break;
-					}
-				} else {
-					uint32_t unrotated_value = 0x80 | (imm8 & 0x7f);
-					uint32_t n = imm12 >> 7;
-					// ROR_C(unrotated_value aka x, n)
-					imm32 = n == 0 ? unrotated_value : ((unrotated_value >> n) | (unrotated_value << (32 - n)));
-					if (flag_set) {
-						machine->psr.c = imm32 >> 31;
-					}
-				}
-
-				int err = machine_alu_op(machine, op, reg_dst, reg_src, imm32, flag_set);
-				if (err != ERR_OK) {
-					*pc -= 2;
-					return err;
-				}
-
-			} else if (((hw1 >> 6) & 0b1101) == 0b1001) {
-				// Move, plain 16-bit immediate
-				uint32_t bit_i    = (hw1 >> 10) & 0b1;
-				uint32_t op       = (hw1 >> 7) & 0b1;
-				uint32_t op2      = (hw1 >> 4) & 0b11;
-				uint32_t imm4     = (hw1 >> 0) & 0b1111;
-				uint32_t imm8     = (hw2 >> 0) & 0xff;
-
-				uint32_t imm16 = (imm4 << 12) | (bit_i << 11) | (imm3 << 8) | imm8;
-				if (op == 1 && op2 == 0b00) {
-					// MOVT
-					*pc -= 2;
-					return ERR_UNDEFINED;
-				} else if (op == 0 && op2 == 0b00) {
-					// MOVW
-					*reg_dst = imm16;
-				} else {
-					*pc -= 2;
-					return ERR_UNDEFINED;
-				}
-
-			} else if (((hw1 >> 8) & 0b11) == 0b11 && (((hw1 >> 4) & 0b1) == 0b0)) {
-				// Bit field operations, saturate with shift
-				uint32_t op       = (hw1 >> 5) & 0b111;
-				uint32_t imm5     = (hw2 >> 0) & 0b11111;
-				uint32_t imm2     = (hw2 >> 6) & 0b11;
-				if (op == 0b011) {
-					uint32_t msb = imm5;
-					uint32_t lsb = (imm3 << 2) | imm2;
-					uint32_t mask = 0xffffffff;
-					uint32_t msb_offset = 31 - msb;
-					mask = (mask >> lsb) << lsb;
-					mask = (mask << msb_offset) >> msb_offset;
-					uint32_t insert;
-					if (reg_src == pc) {
-						// BFC
-						insert = 0;
-					} else {
-						// BFI
-						insert = *reg_src << lsb;
-					}
-					*reg_dst = (*reg_dst & ~mask) | (insert & mask);
-				} else if (op == 0b110) {
-					// UBFX
-					uint32_t lsb         = (imm3 << 2) | imm2;
-					uint32_t widthminus1 = imm5;
-					uint32_t msb         = lsb + widthminus1;
-					*reg_dst = *reg_src << (31 - msb);
-					*reg_dst = *reg_dst >> (lsb + (31 - msb));
-				} else if (op == 0b010) {
-					// SBFX
-					uint32_t lsb         = (imm3 << 2) | imm2;
-					uint32_t widthminus1 = imm5;
-					uint32_t msb         = lsb + widthminus1;
-					*reg_dst = *reg_src << (31 - msb);
-					*reg_dst = (int32_t)*reg_dst >> (lsb + (31 - msb));
-				} else {
-					*pc -= 2; // undo 32-bit change
-					return ERR_UNDEFINED;
-				}
-
-			} else {
-				*pc -= 2; // undo 32-bit change
-				return ERR_UNDEFINED;
-			}
-
-		} else if ((hw1 >> 4) == 0b111100111011 && (hw2 >> 14) == 0b10) {
+	} else {
+		if ((hw1 >> 4) == 0b111100111011 && (hw2 >> 14) == 0b10) {
 			// Special control operations, ignore.
 
-		} else if ((hw1 >> 11) == 0b11110 && ((hw2 >> 11) & 0b10111) == 0b10111) {
-			// BL, B.W
-			uint32_t imm10 = hw1 & 0x3ff;
-			uint32_t imm11 = hw2 & 0x7ff;
-			bool flag_link = (hw2 >> 14) & 0b1;
-			int32_t pc_offset = (int32_t)(((uint32_t)imm10 << 12) | ((uint32_t)imm11 << 1)); // >> 11;
-			pc_offset <<= 10; // put in the top bits
-			pc_offset >>= 10; // sign-extend
-			uint32_t new_pc = (int32_t)*pc + pc_offset;
-			machine_log(machine, LOG_CALLS, "%*sBL   %7x (sp: %x) -> %x\n", machine->call_depth * 2, "", *pc - 5, *sp, new_pc - 1);
-			machine_add_backtrace(machine, *pc - 5, *sp);
-			if (flag_link) {
-				*lr = *pc;
-			}
-			*pc = new_pc;
-
 		} else if ((hw1 >> 11) == 0b11110 && ((hw2 >> 12) & 0b1101) == 0b1000) {
 			// T3: B (conditional branch)
 			uint32_t cond = (hw1 >> 6) & 0b1111;
@@ -1282,11 +2591,49 @@ int machine_step(machine_t *machine) {
 					// the disassembler produces.
 					uint32_t *reg_dst = &machine->regs[(hw2 >> 8) & 0b1111]; // Rd
 					uint32_t imm8 = (hw2 >> 0) & 0xff;
-					if (imm8 == 0x08) {
+					if (imm8 == 0x00) {
+						// APSR
+						flags_t psr = machine_get_psr(machine);
+						*reg_dst = (uint32_t)psr.n << 31 | psr.z << 30 | psr.c << 29 | psr.v << 28 | psr.q << 27 | psr.ge << 16;
+					} else if (imm8 == 0x05) {
+						// IPSR
+						*reg_dst = machine->ipsr;
+					} else if (imm8 == 0x08) {
 						// MSP
 						// No MSP/PSP distinction implemented yet so assuming it
 						// equals the stack pointer.
 						*reg_dst = *sp;
+					} else if (imm8 == 0x10) {
+						// PRIMASK
+						*reg_dst = machine->primask;
+					} else {
+						*pc -= 2;
+						return ERR_UNDEFINED;
+					}
+				} else if ((hw1 & 0xfff0) == 0xf380 && (hw2 & 0xf300) == 0x8000) {
+					// MSR
+					uint32_t value = machine->regs[hw1 & 0b1111]; // Rn
+					uint32_t imm8 = (hw2 >> 0) & 0xff;
+					if (imm8 == 0x00) {
+						// APSR: N, Z, C, V and Q, and/or GE
+						machine_sync_flags(machine);
+						if ((hw2 >> 11) & 0b1) {
+							machine->psr.n = value >> 31;
+							machine->psr.z = value >> 30;
+							machine->psr.c = value >> 29;
+							machine->psr.v = value >> 28;
+							machine->psr.q = value >> 27;
+						}
+						if ((hw2 >> 10) & 0b1) {
+							machine->psr.ge = value >> 16;
+						}
+					} else if (imm8 == 0x08) {
+						// MSP
+						*sp = value;
+					} else if (imm8 == 0x10) {
+						// PRIMASK
+						machine->primask = value & 1;
+						machine_update_deadline(machine);
 					} else {
 						*pc -= 2;
 						return ERR_UNDEFINED;
@@ -1398,155 +2745,435 @@ int machine_step(machine_t *machine) {
 				}
 			}
 
-		} else if ((hw1 >> 9) == 0b1111101 && machine_versioncheck(machine, CORTEX_M4)) {
-			// Data processing instructions, non-immediate
-			// (except for Data processing: constant shift)
-			uint32_t *reg_dst  = &machine->regs[(hw2 >> 8) & 0b1111]; // Rd
-			uint32_t *reg_src  = &machine->regs[(hw1 >> 0) & 0b1111]; // Rn
-			uint32_t *reg_src2 = &machine->regs[(hw2 >> 0) & 0b1111]; // Rm
-			if ((hw1 >> 7) == 0b111110100 && ((hw2 >> 7) & 0b111100001) == 0b111100000) {
-				// Register-controlled shift.
-				uint32_t op       = (hw1 >> 5) & 0b11;
-				bool     flag_set = (hw1 >> 4) & 0b1;
-				uint32_t op2      = (hw2 >> 4) & 0b111;
-				if (op2 != 0b000) {
-					*pc -= 2; // undo 32-bit change
-					return ERR_UNDEFINED;
-				}
-				if (op == 0b00) {
-					*reg_dst = machine_instr_lsl(machine, *reg_src, *reg_src2 & 0xff, flag_set);
-				} else if (op == 0b01) {
-					*reg_dst = machine_instr_lsr(machine, *reg_src, *reg_src2 & 0xff, flag_set);
-				} else if (op == 0b10) {
-					*reg_dst = machine_instr_asr(machine, *reg_src, *reg_src2 & 0xff, flag_set);
-				} else {
-					// ROR
-					*pc -= 2; // undo 32-bit change
-					return ERR_UNDEFINED;
-				}
-				if (flag_set) {
-					machine->psr.n = (int32_t)*reg_dst < 0;
-					machine->psr.z = *reg_dst == 0;
-				}
+		} else {
+			*pc -= 2; // undo 32-bit change
+			return ERR_UNDEFINED;
+		}
+	}
 
-			} else if ((hw1 >> 7) == 0b111110100 && ((hw2 >> 7) & 0b111100001) == 0b111100001) {
-				// Sign or zero extension, with optional addition.
-				uint32_t op       = (hw1 >> 4) & 0b111;
-				uint32_t rot      = (hw2 >> 4) & 0b11;
-				uint32_t rotate = rot << 3;
+	return ERR_OK;
+}
 
-				if (op == 0b101 && reg_src == pc) {
-					*reg_dst = (*reg_src2) >> rotate;
-				} else {
-					*pc -= 2; // undo 32-bit change
-					return ERR_UNDEFINED;
-				}
+// Helpers for machine_ops.inc.
+#define RD (machine->regs[d->rd])
+#define RN (machine->regs[d->rn])
+#define RM (machine->regs[d->rm])
+#define SETFLAGS_NZ(value) \
+	if (setflags) { \
+		machine_set_nz(machine, (value)); \
+	}
+// 32-bit instructions, see machine_decode_thumb2().
+#define OP32(name) OP(name) *pc += 2;
+#define RA (machine->regs[d->imm & 0xf]) // also RdLo
+#define HALF_N ((int32_t)(int16_t)(RN >> ((d->imm >> 8) & 0xff)))
+#define HALF_M ((int32_t)(int16_t)(RM >> ((d->imm >> 16) & 0xff)))
+#define ROTATED_M (machine_ror(RM, d->imm >> 16)) // dual multiplies
+#define IMM_SETFLAGS (d->rm & DP_SETFLAGS)
+#define REG_SETFLAGS ((d->imm >> 8) & DP_SETFLAGS)
+#define SHIFTED_RM(setflags) (machine_shift_imm(machine, RM, d->imm, (setflags)))
+#define SETFLAGS_IMM(value) \
+	if (IMM_SETFLAGS) { \
+		if (d->rm & DP_CARRY) { \
+			machine_set_carry(machine, d->imm >> 31); \
+		} \
+		machine_set_nz(machine, (value)); \
+	}
+#define SETFLAGS_REG(value) \
+	if (REG_SETFLAGS) { \
+		machine_set_nz(machine, (value)); \
+	}
 
-			} else if ((hw1 >> 7) == 0b111110101 && ((hw2 >> 7) & 0b111100001) == 0b111100001) {
-				// Other three register data processing
-				uint32_t op       = (hw1 >> 4) & 0b111;
-				uint32_t op2      = (hw2 >> 4) & 0b111;
-				if (op == 0b011 && op2 == 0b000) {
-					// CLZ: count leading zeroes
-					if (*reg_src2 == 0) {
-						// __builtin_clz is undefined when *reg_src2 is
-						// zero.
-						*reg_dst = 32;
-					} else {
-						if (sizeof(int) == sizeof(uint32_t)) {
-							*reg_dst = __builtin_clz(*reg_src2);
-						} else {
-							// Fallback for non-32bit integers.
-							for (*reg_dst = 0; *reg_dst < 32; *reg_dst += 1) {
-								if (*reg_src2 & (1 << (31 - *reg_dst))) {
-									break;
-								}
-							}
-						}
-					}
-				} else {
-					*pc -= 2; // undo 32-bit change
-					return ERR_UNDEFINED;
-				}
+// Whether this instruction must be the last in a basic block, because it may
+// change the PC or the way the following instructions must be executed.
+static bool machine_op_ends_block(const machine_decoded_t *d) {
+	switch (d->op) {
+	case OP_ADD_HI:
+	case OP_MOV_HI:
+		return d->rd == 15;
+	case OP_POP:
+		return (d->imm & (1 << 15)) != 0;
+	case OP_UNDEFINED:
+	case OP_BX:
+	case OP_BLX:
+	case OP_CBZ:
+	case OP_CBNZ:
+	case OP_BKPT: // may change the loglevel
+	case OP_IT:   // IT blocks are executed by machine_step()
+	case OP_SVC:  // the exception must be taken right away
+	case OP_WFI:  // must sleep before the next instruction
+	case OP_BCOND:
+	case OP_B:
+	case OP_HOOK:
+	case OP_BL:
+	case OP_THUMB2:
+		return true;
+	default:
+		return false;
+	}
+}
 
-			} else if ((hw1 >> 7) == 0b111110110) {
-				// 32-bit multiplies and sum of absolute differences, with
-				// or without accumulate.
-				uint32_t op = (hw1 >> 4) & 0b111;
-				uint32_t op2 = (hw2 >> 4) & 0b1111;
-				uint32_t *reg_acc = &machine->regs[(hw2 >> 12) & 0b1111]; // Ra
-				if (op == 0b000 && op2 == 0b0000) {
-					if (reg_acc == pc) {
-						// MUL
-						*reg_dst = *reg_src * *reg_src2;
-					} else {
-						// MLA
-						*reg_dst = *reg_src * *reg_src2 + *reg_acc;
-					}
-				} else if (op == 0b000 && op2 == 0b0001 && reg_acc != pc) {
-					// MLS
-					*reg_dst = *reg_acc - *reg_src * *reg_src2;
-				} else {
-					*pc -= 2; // undo 32-bit change
-					return ERR_UNDEFINED;
-				}
+// Whether the instruction is a conditional branch, for the coverage bitmaps.
+static bool machine_op_is_cond_branch(const machine_decoded_t *d) {
+	switch (d->op) {
+	case OP_BCOND:
+	case OP_CBZ:
+	case OP_CBNZ:
+		return true;
+	case OP_THUMB2: {
+		// T3: B<c>.W, see machine_step_thumb2()
+		uint32_t hw1 = d->imm & 0xffff, hw2 = d->imm >> 16;
+		return (hw1 >> 11) == 0b11110 && ((hw2 >> 12) & 0b1101) == 0b1000 && ((hw1 >> 7) & 0b111) != 0b111;
+	}
+	default:
+		return false;
+	}
+}
 
-			} else if ((hw1 >> 7) == 0b111110111) {
-				// 64-bit multiply, multiply-accumulate, and divide
-				// instructions.
-				uint32_t op = (hw1 >> 4) & 0b111;
-				uint32_t op2 = (hw2 >> 4) & 0b1111;
-				uint32_t *reg_dst_hi = reg_dst; // RdHi
-				uint32_t *reg_dst_lo = &machine->regs[(hw2 >> 12) & 0b1111]; // RdLo
-				if (op == 0b000 && op2 == 0b0000) {
-					// SMULL
-					int64_t result = (int64_t)*reg_src * (int64_t)*reg_src2;
-					*reg_dst_lo = (uint32_t)result;
-					*reg_dst_hi = (uint32_t)(result >> 32);
-				} else if (op == 0b010 && op2 == 0b0000) {
-					// UMULL
-					uint64_t result = (uint64_t)*reg_src * (uint64_t)*reg_src2;
-					*reg_dst_lo = (uint32_t)result;
-					*reg_dst_hi = (uint32_t)(result >> 32);
-				} else if (op == 0b001 && op2 == 0b1111) {
-					// SDIV
-					if (*reg_src2 == 0) {
-						// TODO: this shouldn't always trap
-						*pc -= 2; // undo 32-bit change
-						return ERR_DIVZERO;
-					}
-					*reg_dst = (int32_t)*reg_src / (int32_t)*reg_src2;
-				} else if (op == 0b011 && op2 == 0b1111) {
-					// UDIV
-					if (*reg_src2 == 0) {
-						// TODO: this shouldn't always trap
-						*pc -= 2; // undo 32-bit change
-						return ERR_DIVZERO;
-					}
-					*reg_dst = *reg_src / *reg_src2;
-				} else {
-					*pc -= 2; // undo 32-bit change
-					return ERR_UNDEFINED;
-				}
+// Set the coverage bits of the given kind for the halfwords in [start, end).
+static void machine_coverage_set(machine_t *machine, machine_coverage_t kind, uint32_t start, uint32_t end) {
+	uint8_t *bits = machine->coverage + kind * machine->coverage_size;
+	for (uint32_t i = start / 2; i < end / 2; i++) {
+		bits[i / 8] |= 1 << (i % 8);
+	}
+}
 
-			} else {
-				*pc -= 2; // undo 32-bit change
-				return ERR_UNDEFINED;
+// Update the coverage after executing a single instruction at the given
+// address. next is the PC without a branch.
+static void machine_coverage_step(machine_t *machine, uint32_t address, uint32_t next, bool cond_branch) {
+	machine_coverage_set(machine, COVERAGE_EXECUTED, address, next - 1);
+	if (cond_branch) {
+		machine_coverage_set(machine, machine->pc != next ? COVERAGE_TAKEN : COVERAGE_NOT_TAKEN, address, address + 2);
+	}
+}
+
+#define MACHINE_COVERED_ALL ((1 << COVERAGE_KINDS) - 1)
+
+// Count the edge from the previous block to the one at the given address, see
+// machine_set_edges().
+static inline void machine_edge(machine_t *machine, uint32_t pc) {
+	uint32_t location = pc * 0x9e3779b1;
+	location ^= location >> 15;
+	machine->edges[(location ^ machine->edges_prev) & machine->edges_mask]++;
+	machine->edges_prev = location >> 1;
+}
+
+// Whether there is a breakpoint on the instruction at the given address.
+static inline bool machine_breakpoint_at(machine_t *machine, uint32_t address) {
+	return address < machine->image_size && (machine->breakpoints[address / 16] >> (address / 2 % 8)) & 1;
+}
+
+// Find the longest run of straight-line code starting at the current PC (up
+// to MACHINE_BLOCK_MAX instructions) and store it in the block cache. Returns
+// NULL when out of memory, then machine_step() executes the instruction.
+static machine_block_t * machine_block_build(machine_t *machine) {
+	machine_decoded_t instrs[MACHINE_BLOCK_MAX];
+	uint32_t address = machine->pc - 1;
+	size_t count = 0;
+	while (count < MACHINE_BLOCK_MAX && address <= machine->image_size - 4) {
+		if (count != 0 && machine->num_breakpoints != 0 && machine_breakpoint_at(machine, address)) {
+			break; // the breakpoint is checked by machine_step()
+		}
+		machine_decoded_t *d = &machine->decoded[address/2];
+		if (d->op == OP_NONE) {
+			machine_decode(machine, address, d);
+		}
+		instrs[count++] = *d;
+		address += machine_op_is_32bit(d->op) ? 4 : 2;
+		if (machine_op_ends_block(d)) {
+			break;
+		}
+	}
+
+	machine_block_t *block = malloc(sizeof(machine_block_t) + (count + 1) * sizeof(machine_decoded_t));
+	if (block == NULL) {
+		return NULL;
+	}
+	block->pc = machine->pc;
+	block->size = address - (machine->pc - 1);
+	block->next = NULL;
+	block->runs = 0;
+	block->jit = NULL;
+	block->count = count;
+	block->cycles = 0;
+	block->covered = 0;
+	for (size_t i = 0; i < count; i++) {
+		block->cycles += machine_instr_cycles(&instrs[i], machine->core);
+	}
+	memcpy(block->instrs, instrs, count * sizeof(machine_decoded_t));
+	machine_decode_set(&block->instrs[count], OP_END, 0, 0, 0, 0);
+	machine->blocks[machine->pc/2] = block;
+	return block;
+}
+
+static void machine_block_free_garbage(machine_t *machine) {
+	while (machine->blocks_garbage != NULL) {
+		machine_block_t *block = machine->blocks_garbage;
+		machine->blocks_garbage = block->next;
+		free(block);
+	}
+}
+
+// Return the block at the current PC, or NULL if the current instruction must
+// be executed by machine_step() instead.
+static inline machine_block_t * machine_block_lookup(machine_t *machine, machine_core_t core) {
+	uint32_t pc = machine->pc;
+
+	// Now it is safe to free blocks that have been invalidated.
+	machine_block_free_garbage(machine);
+
+	if ((pc & 1) != 1 || pc > machine->image_size - 4) {
+		return NULL; // let machine_step() handle the error
+	}
+	if (core == CORTEX_M4 && machine->psr.it2 != 0) {
+		return NULL; // inside an IT block
+	}
+	if (machine->num_breakpoints != 0 && machine_breakpoint_at(machine, pc - 1)) {
+		return NULL; // the breakpoint is checked by machine_step()
+	}
+	machine_block_t *block = machine->blocks[pc/2];
+	if (block == NULL) {
+		block = machine_block_build(machine);
+	}
+	return block;
+}
+
+// Update the coverage after executing a block. Every block only sets each of
+// its bits once (see block->covered), so most blocks don't get here.
+static void machine_coverage_block(machine_t *machine, machine_block_t *block, int err) {
+	uint32_t start = block->pc - 1;
+	if (err != ERR_OK) {
+		// Only the instructions before the one at the PC were executed.
+		if (machine->pc - 3 > start && machine->pc - 3 <= start + block->size) {
+			machine_coverage_set(machine, COVERAGE_EXECUTED, start, machine->pc - 3);
+		}
+		return;
+	}
+	const machine_decoded_t *last = &block->instrs[block->count - 1];
+	if ((block->covered & (1 << COVERAGE_EXECUTED)) == 0) {
+		machine_coverage_set(machine, COVERAGE_EXECUTED, start, start + block->size);
+		block->covered |= machine_op_is_cond_branch(last) ? 1 << COVERAGE_EXECUTED : MACHINE_COVERED_ALL;
+	}
+	machine_coverage_t kind = machine->pc != block->pc + block->size ? COVERAGE_TAKEN : COVERAGE_NOT_TAKEN;
+	if ((block->covered & (1 << kind)) == 0) {
+		uint32_t address = start + block->size - (machine_op_is_32bit(last->op) ? 4 : 2);
+		machine_coverage_set(machine, kind, address, address + 2);
+		block->covered |= 1 << kind;
+	}
+}
+
+// Update the instruction and cycle counters after executing a block. After an
+// error, only the instructions before the one at the PC have been retired.
+static inline void machine_block_retire(machine_t *machine, machine_block_t *block, int err) {
+	if (err == ERR_OK) {
+		machine->instructions += block->count;
+		machine->cycles += block->cycles;
+		bool taken = machine->pc != block->pc + block->size;
+		if (taken) {
+			machine->cycles += MACHINE_BRANCH_PENALTY; // taken branch
+		}
+		if (machine->edges != NULL) {
+			machine_edge(machine, block->pc);
+		}
+		if (machine->coverage != NULL) {
+			uint8_t covered = 1 << COVERAGE_EXECUTED | 1 << (taken ? COVERAGE_TAKEN : COVERAGE_NOT_TAKEN);
+			if ((block->covered & covered) != covered) {
+				machine_coverage_block(machine, block, err);
 			}
+		}
+		return;
+	}
+	if (machine->coverage != NULL) {
+		machine_coverage_block(machine, block, err);
+	}
+	uint32_t end = block->pc - 1;
+	for (const machine_decoded_t *d = block->instrs; d->op != OP_END; d++) {
+		end += machine_op_is_32bit(d->op) ? 4 : 2;
+		if (end > machine->pc - 3) {
+			break;
+		}
+		machine->instructions++;
+		machine->cycles += machine_instr_cycles(d, machine->core);
+	}
+}
+
+// The architectural xPSR value (flags_t has a different layout).
+static uint32_t machine_get_xpsr(machine_t *machine) {
+	machine_sync_flags(machine);
+	flags_t psr = machine->psr;
+	return (uint32_t)psr.n << 31 | psr.z << 30 | psr.c << 29 | psr.v << 28 | psr.q << 27 |
+		psr.it1 << 25 | psr.t << 24 | psr.ge << 16 | psr.it2 << 10 | machine->ipsr;
+}
+
+static void machine_set_xpsr(machine_t *machine, uint32_t xpsr) {
+	machine_sync_flags(machine);
+	machine->psr.n = xpsr >> 31;
+	machine->psr.z = xpsr >> 30;
+	machine->psr.c = xpsr >> 29;
+	machine->psr.v = xpsr >> 28;
+	machine->psr.q = xpsr >> 27;
+	machine->psr.it1 = xpsr >> 25;
+	machine->psr.t = xpsr >> 24;
+	machine->psr.ge = xpsr >> 16;
+	machine->psr.it2 = xpsr >> 10;
+	machine->ipsr = xpsr & 0x1ff;
+}
+
+// Cycles taken by exception entry and return.
+#define MACHINE_EXCEPTION_CYCLES(machine) (machine_versioncheck(machine, CORTEX_M4) ? 12 : 16)
+
+// Take an exception: push the caller-saved registers and jump to the
+// handler. Only the main stack is supported.
+static int machine_exception_enter(machine_t *machine, uint32_t exception) {
+	bool realign = (machine->sp & 4) != 0; // the frame is 8-byte aligned
+	uint32_t frame = (machine->sp - 0x20) & ~4;
+	const uint32_t values[8] = {
+		machine->r0, machine->r1, machine->r2, machine->r3, machine->r12, machine->lr,
+		machine->pc - 1, // return address
+		machine_get_xpsr(machine) | realign << 9,
+	};
+	for (size_t i = 0; i < 8; i++) {
+		if (machine_store32(machine, frame + i * 4, values[i], machine->core)) {
+			return ERR_MEM;
+		}
+	}
+	uint32_t handler;
+	if (machine_load32(machine, machine->scb.vtor + exception * 4, &handler, machine->core)) {
+		return ERR_MEM;
+	}
+
+	machine_log(machine, LOG_CALLS, "%*sexception %d %5x (sp: %x) -> %x\n", machine->call_depth * 2, "", exception, machine->pc - 1, machine->sp, handler - 1);
+	machine_add_backtrace(machine, machine->pc - 1, machine->sp);
+	machine->sp = frame;
+	machine->lr = machine->ipsr != 0 ? 0xfffffff1 : 0xfffffff9; // EXC_RETURN
+	machine->pc = handler;
+	machine->ipsr = exception;
+	machine->psr.it1 = 0;
+	machine->psr.it2 = 0;
+	if (exception >= 16) {
+		machine->nvic.pending &= ~(1 << (exception - 16));
+		machine->nvic.active |= 1 << (exception - 16);
+	} else {
+		machine->scb.pending &= ~(1 << exception);
+		machine->scb.active |= 1 << exception;
+	}
+	machine->cycles += MACHINE_EXCEPTION_CYCLES(machine);
+	machine->event_register = true;
+	return ERR_OK;
+}
+
+// Return from an exception handler, after it loaded EXC_RETURN into the PC.
+static int machine_exception_return(machine_t *machine) {
+	if (machine->ipsr == 0 || (machine->pc != 0xfffffff1 && machine->pc != 0xfffffff9)) {
+		return ERR_PC;
+	}
+	uint32_t values[8];
+	for (size_t i = 0; i < 8; i++) {
+		if (machine_load32(machine, machine->sp + i * 4, &values[i], machine->core)) {
+			return ERR_MEM;
+		}
+	}
+
+	uint32_t exception = machine->ipsr;
+	if (exception >= 16) {
+		machine->nvic.active &= ~(1 << (exception - 16));
+	} else {
+		machine->scb.active &= ~(1 << exception);
+	}
+	machine->r0 = values[0];
+	machine->r1 = values[1];
+	machine->r2 = values[2];
+	machine->r3 = values[3];
+	machine->r12 = values[4];
+	machine->lr = values[5];
+	machine->pc = values[6] | 1;
+	machine_set_xpsr(machine, values[7]);
+	machine->sp += 0x20 + ((values[7] >> 9) & 1) * 4;
+	machine_log(machine, LOG_CALLS, "%*sreturn from exception %d -> %x (sp: %x)\n", machine->call_depth * 2, "", exception, machine->pc - 1, machine->sp);
+	machine->cycles += MACHINE_EXCEPTION_CYCLES(machine);
+	machine->event_register = true;
+	machine_update_deadline(machine);
+	return ERR_OK;
+}
+
+#if !defined(__EMSCRIPTEN__)
+static int64_t machine_host_time() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+#endif
+
+// Don't let the emulated clock run ahead of the host clock, at the given
+// number of cycles per second (or 0 to run as fast as possible). This is
+// checked at events, so the emulator can run ahead a bit in between.
+void machine_set_realtime(machine_t *machine, uint32_t hz) {
+	machine->realtime_hz = hz;
+	machine->realtime_cycles = machine->cycles;
+#if !defined(__EMSCRIPTEN__)
+	machine->realtime_start = machine_host_time();
+#endif
+}
 
-		} else {
-			*pc -= 2; // undo 32-bit change
-			return ERR_UNDEFINED;
+static void machine_pace(machine_t *machine) {
+#if !defined(__EMSCRIPTEN__)
+	uint32_t hz = machine->realtime_hz;
+	if (hz == 0) {
+		return;
+	}
+	uint64_t cycles = machine->cycles - machine->realtime_cycles;
+	int64_t target = machine->realtime_start + (cycles / hz) * 1000000000LL + (cycles % hz) * 1000000000LL / hz;
+	while (!machine->halt) {
+		int64_t now = machine_host_time();
+		if (now >= target) {
+			break;
 		}
-
-	} else {
-		return ERR_UNDEFINED;
+		// Sleep in small steps, to respond to machine_halt().
+		struct timespec duration = {0, target - now < 10000000 ? target - now : 10000000};
+		nanosleep(&duration, NULL);
 	}
+#endif
+}
 
-	return ERR_OK;
+// Call all events that are due and take the most urgent pending exception,
+// if it can preempt the current code. While sleeping, skip ahead to the next
+// event until there is an exception that wakes up the CPU: idle firmware
+// costs (almost) nothing.
+static int machine_handle_events(machine_t *machine) {
+	while (1) {
+		machine_pace(machine);
+		while (machine->events_len != 0 && machine->events[1]->when <= machine->cycles) {
+			machine_event_t *event = machine->events[1];
+			machine_unschedule(machine, event);
+			event->fn(machine, event->ctx);
+		}
+		if (!machine->sleeping) {
+			break;
+		}
+		if (machine_exception_next(machine, true) != 0) {
+			machine->sleeping = false; // even when PRIMASK is set
+			break;
+		}
+		if (machine->halt) {
+			return ERR_OK; // still sleeping, see machine_run()
+		}
+		if (machine->events_len == machine->events_idle) {
+			return ERR_SLEEP; // only sampling is left
+		}
+		if (machine->events[1]->when > machine->cycles) {
+			machine->cycles = machine->events[1]->when;
+		}
+	}
+	uint32_t exception = machine_exception_next(machine, false);
+	int err = ERR_OK;
+	if (exception != 0) {
+		err = machine_exception_enter(machine, exception);
+	}
+	machine_update_deadline(machine);
+	return err;
 }
 
 void machine_print_registers(machine_t *machine) {
+	machine_sync_flags(machine);
 	machine_log(machine, LOG_ERROR, "\n[ ");
 	for (size_t i=0; i<8; i++) {
 		machine_log(machine, LOG_ERROR, "%8x ", machine->regs[i]);
@@ -1558,8 +3185,123 @@ void machine_print_registers(machine_t *machine) {
 	machine_log(machine, LOG_ERROR, "]\n");
 }
 
+// Report why machine_run() stopped with the given error, and return its result.
+static int machine_run_error(machine_t *machine, int err) {
+	switch (err) {
+		case ERR_HALT:
+			// expected
+			break;
+		case ERR_EXIT:
+			return 0;
+		case ERR_BREAK:
+			machine_log(machine, LOG_ERROR, "\nhit breakpoint at address %x\n", machine->pc - 3);
+			break;
+		case ERR_MEM:
+			// already printed
+			break;
+		case ERR_PC:
+			machine_log(machine, LOG_ERROR, "\nERROR: invalid PC address: 0x%08x\n", machine->pc);
+			break;
+		case ERR_UNDEFINED:
+			machine_log(machine, LOG_ERROR, "\nERROR: unknown instruction %04x at address %x\n", machine->image16[machine->pc/2 - 1], machine->pc - 3);
+			break;
+		case ERR_SLEEP:
+			machine_log(machine, LOG_ERROR, "\nERROR: sleeping at address %x without any enabled interrupt source\n", machine->pc - 3);
+			break;
+		case ERR_DIVZERO:
+			machine_log(machine, LOG_ERROR, "\nERROR: divide by zero at address %x\n", machine->pc - 3);
+			break;
+		default:
+			machine_log(machine, LOG_ERROR, "\nERROR: unknown error: %d\n", err);
+			break;
+	}
+	if (machine_loglevel(machine) < LOG_INSTRS) { // don't double-log
+		machine_print_registers(machine);
+	}
+	machine_add_backtrace(machine, machine->pc, machine->sp);
+	machine_log(machine, LOG_ERROR, "Backtrace:\n");
+	for (int i = 0; i < machine->call_depth; i++) {
+		if (i >= MACHINE_BACKTRACE_LEN) {
+			machine_log(machine, LOG_ERROR, " %3d. (too much recursion)\n", i);
+			break;
+		}
+		if (machine->backtrace[i].sp < machine->sp) {
+			continue; // unused entry
+		}
+		uint32_t offset;
+		const char *name = machine_symbolize(machine, machine->backtrace[i].pc, &offset);
+		if (name != NULL) {
+			machine_log(machine, LOG_ERROR, " %3d. %8x (SP: %x) %s+0x%x\n", i, machine->backtrace[i].pc, machine->backtrace[i].sp, name, offset);
+		} else {
+			machine_log(machine, LOG_ERROR, " %3d. %8x (SP: %x)\n", i, machine->backtrace[i].pc, machine->backtrace[i].sp);
+		}
+	}
+	return err;
+}
+
+
+#if MACHINE_JIT
+static bool machine_jit_compiled(machine_t *machine, machine_block_t *block);
+static int machine_jit_exec_block(machine_t *machine, machine_block_t *block);
+#endif
+
+// Specialized variants of the execution engines, see machine_exec.inc.
+#define MACHINE_EXEC_CORE CORTEX_M0
+#define MACHINE_EXEC_DEBUG 0
+#define MACHINE_EXEC(name) machine_##name##_m0
+#include "machine_exec.inc"
+
+#define MACHINE_EXEC_CORE CORTEX_M0
+#define MACHINE_EXEC_DEBUG 1
+#define MACHINE_EXEC(name) machine_##name##_m0_debug
+#include "machine_exec.inc"
+
+#define MACHINE_EXEC_CORE CORTEX_M4
+#define MACHINE_EXEC_DEBUG 0
+#define MACHINE_EXEC(name) machine_##name##_m4
+#include "machine_exec.inc"
+
+#define MACHINE_EXEC_CORE CORTEX_M4
+#define MACHINE_EXEC_DEBUG 1
+#define MACHINE_EXEC(name) machine_##name##_m4_debug
+#include "machine_exec.inc"
+
+// Indexed by whether the core is a Cortex-M4 and by machine_debugging().
+static int (*const machine_step_variants[2][2])(machine_t *machine) = {
+	{machine_step_m0, machine_step_m0_debug},
+	{machine_step_m4, machine_step_m4_debug},
+};
+static int (*const machine_run_variants[2][2])(machine_t *machine) = {
+	{machine_run_m0, machine_run_m0_debug},
+	{machine_run_m4, machine_run_m4_debug},
+};
+
+#if MACHINE_JIT
+#include "machine_jit.inc"
+#endif
+
+// Execute a single instruction.
+int machine_step(machine_t *machine) {
+	return machine_step_variants[machine_versioncheck(machine, CORTEX_M4)][machine_debugging(machine)](machine);
+}
+
+// Let compiled code (ENGINE_JIT) access the RAM without checking the address
+// first: machines created after this reserve the whole address space, with
+// only the RAM accessible. Other accesses fault, and a SIGSEGV handler makes
+// them take the checked path (and that one access site from then on), which
+// reports an ERR_MEM as usual. This installs the handler for the process, so
+// don't use it in a program that handles SIGSEGV itself, like the Go runtime
+// does. Returns false when it isn't supported.
+bool machine_enable_guard_pages(void) {
+#if MACHINE_JIT && defined(__linux__)
+	return machine_jit_guards_init();
+#else
+	return false;
+#endif
+}
+
 KEEPALIVE
-machine_t * machine_create(size_t image_size, size_t pagesize, size_t ram_size, int loglevel) {
+machine_t * machine_create(size_t image_size, size_t pagesize, size_t ram_size, int loglevel, machine_engine_t engine) {
 	if (image_size < 16 * 4) {
 #if !defined(__EMSCRIPTEN__)
 		if (loglevel >= LOG_ERROR) {
@@ -1570,144 +3312,826 @@ machine_t * machine_create(size_t image_size, size_t pagesize, size_t ram_size,
 	}
 
 	machine_t *machine = calloc(sizeof(machine_t), 1);
+	if (machine == NULL) {
+		return NULL;
+	}
 	machine->pagesize = pagesize;
 	machine->call_depth = 1;
 	machine->loglevel = loglevel;
+	machine->core = MACHINE_DEFAULT_CORE;
 	machine->image_size = image_size;
 	machine->mem_size = ram_size;
 	machine->psr.t = 1; // Thumb mode
+	machine->deadline = UINT64_MAX;
+	machine->systick.wrap.fn = machine_systick_wrap;
 
 	uint32_t *image = malloc(image_size);
-	memset(image, 0xff, image_size); // erase flash
 	machine->image32 = image;
+	machine->decoded = calloc(image_size / 2, sizeof(machine_decoded_t));
+	if (image == NULL || machine->decoded == NULL) {
+		machine_free(machine);
+		return NULL;
+	}
+	memset(image, 0xff, image_size); // erase flash
+#if MACHINE_JIT
+	if (engine == ENGINE_JIT && !machine_jit_init(machine)) {
+		engine = ENGINE_BLOCKS;
+	}
+#else
+	if (engine == ENGINE_JIT) {
+		engine = ENGINE_BLOCKS; // not compiled in
+	}
+#endif
+	machine->engine = engine;
+	if (engine != ENGINE_STEP) {
+		machine->blocks = calloc(image_size / 2, sizeof(machine_block_t*));
+		if (machine->blocks == NULL) {
+			machine_free(machine);
+			return NULL;
+		}
+	}
 
 	// TODO: put random data in here to make a better simulation
-	uint32_t *ram = calloc(ram_size, 1);
+	uint32_t *ram = NULL;
+#if MACHINE_JIT
+	if (engine == ENGINE_JIT) {
+		ram = machine_jit_window_init(machine, ram_size);
+	}
+#endif
+	if (ram == NULL) {
+		ram = calloc(ram_size, 1);
+	}
 	machine->mem32 = ram;
+	machine->image_dirty = calloc((image_size + MACHINE_PAGE_MASK) >> MACHINE_PAGE_BITS, 1);
+	machine->mem_dirty = calloc((ram_size + MACHINE_PAGE_MASK) >> MACHINE_PAGE_BITS, 1);
+
+	if (ram == NULL || machine->image_dirty == NULL || machine->mem_dirty == NULL || !machine_map_init(machine)) {
+		machine_free(machine);
+		return NULL;
+	}
 
 	return machine;
 }
 
-void machine_load(machine_t *machine, uint8_t *image, size_t image_size) {
+// Load a copy of the image. Returns false when out of memory.
+bool machine_load(machine_t *machine, uint8_t *image, size_t image_size) {
 	// caller should check this, but at least fail in a reasonable way
 	if (image_size > machine->image_size) {
 		image_size = machine->image_size;
 	}
+	if (!machine_image_unshare(machine)) {
+		return false;
+	}
 	memcpy(machine->image8, image, image_size);
+	machine_invalidate(machine, 0, image_size);
+	machine->snapshot = NULL;
+	return true;
+}
+
+// Use the given image of image_size bytes, which may be shared between
+// machines (for example in a batch run), instead of loading a copy. A shared
+// image is never written: the first write to flash gives the machine its own
+// copy. The image must stay alive until the machine is freed.
+void machine_share_image(machine_t *machine, const uint8_t *image) {
+	if (!machine->image_shared) {
+		free(machine->image);
+	}
+	machine->image8 = (uint8_t*)image;
+	machine->image_shared = true;
+	machine_map(machine, 0x00000000, machine->image_size, machine->image8, NULL, &machine_flash);
+	machine_invalidate(machine, 0, machine->image_size);
+	machine->snapshot = NULL;
 }
 
+// Returns NULL when out of memory for a copy of a shared image.
 KEEPALIVE
 uint8_t * machine_get_image(machine_t *machine) {
+	if (!machine_image_unshare(machine)) { // the caller may write to it
+		return NULL;
+	}
 	return machine->image8;
 }
 
+// A snapshot starts with this header, followed by the image, RAM and the
+// state of the core and all peripherals. It is only valid for the same build
+// of the emulator with the same configuration.
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t image_size;
+	uint32_t mem_size;
+	uint32_t size; // size of the whole snapshot
+} machine_snapshot_header_t;
+
+#define MACHINE_SNAPSHOT_MAGIC   (0x55434d45) // "EMCU"
+#define MACHINE_SNAPSHOT_VERSION (3)
+
+void machine_state_field(machine_state_t *state, void *field, size_t size) {
+	if (state->buf != NULL && state->used + size <= state->size) {
+		if (state->restore) {
+			memcpy(field, state->buf + state->used, size);
+		} else {
+			memcpy(state->buf + state->used, field, size);
+		}
+	}
+	state->used += size;
+}
+
+void machine_state_event(machine_t *machine, machine_state_t *state, machine_event_t *event) {
+	uint64_t when = event->index != 0 ? event->when : UINT64_MAX;
+	MACHINE_STATE_FIELD(state, when);
+	if (state->restore && when != UINT64_MAX) {
+		machine_schedule(machine, event, when);
+	}
+}
+
+// Save or restore everything except for the image and RAM.
+static void machine_state(machine_t *machine, machine_state_t *state) {
+	if (!state->restore) {
+		machine_sync_flags(machine);
+	}
+	MACHINE_STATE_FIELD(state, machine->regs);
+	MACHINE_STATE_FIELD(state, machine->image_writable);
+	MACHINE_STATE_FIELD(state, machine->ipsr);
+	MACHINE_STATE_FIELD(state, machine->primask);
+	MACHINE_STATE_FIELD(state, machine->sleeping);
+	MACHINE_STATE_FIELD(state, machine->event_register);
+	MACHINE_STATE_FIELD(state, machine->nvic);
+	MACHINE_STATE_FIELD(state, machine->scb);
+	MACHINE_STATE_FIELD(state, machine->systick.csr);
+	MACHINE_STATE_FIELD(state, machine->systick.rvr);
+	MACHINE_STATE_FIELD(state, machine->systick.cvr);
+	machine_state_event(machine, state, &machine->systick.wrap);
+	MACHINE_STATE_FIELD(state, machine->dwt);
+	MACHINE_STATE_FIELD(state, machine->instructions);
+	MACHINE_STATE_FIELD(state, machine->cycles);
+	MACHINE_STATE_FIELD(state, machine->inputs);
+	MACHINE_STATE_FIELD(state, machine->call_depth);
+	MACHINE_STATE_FIELD(state, machine->backtrace);
+	if (state->restore) {
+		machine->flags.op = FLAGS_PSR;
+	}
+
+	for (machine_peripheral_t *peripheral = machine->peripherals; peripheral != NULL; peripheral = peripheral->next) {
+		if (peripheral->ops->snapshot == NULL) {
+			continue;
+		}
+		uint32_t base = peripheral->base;
+		MACHINE_STATE_FIELD(state, base);
+		if (base != peripheral->base) {
+			state->error = true;
+			return;
+		}
+		peripheral->ops->snapshot(machine, peripheral->ctx, state);
+	}
+}
+
+// Save the machine state in buf, if it fits. Returns the size of the
+// snapshot, call with a NULL buf to get the required size. After saving, only
+// pages that are modified (until the next snapshot) need to be copied when
+// restoring from the same buf.
+KEEPALIVE
+size_t machine_snapshot(machine_t *machine, void *buf, size_t size) {
+	machine_state_t state = {NULL, 0, 0, false, false};
+	machine_state(machine, &state);
+	size_t total = sizeof(machine_snapshot_header_t) + machine->image_size + machine->mem_size + state.used;
+	if (buf == NULL || size < total) {
+		return total;
+	}
+
+	machine_snapshot_header_t *header = buf;
+	header->magic = MACHINE_SNAPSHOT_MAGIC;
+	header->version = MACHINE_SNAPSHOT_VERSION;
+	header->image_size = machine->image_size;
+	header->mem_size = machine->mem_size;
+	header->size = total;
+	uint8_t *image = (uint8_t*)(header + 1);
+	memcpy(image, machine->image8, machine->image_size);
+	memcpy(image + machine->image_size, machine->mem8, machine->mem_size);
+	state = (machine_state_t){image + machine->image_size + machine->mem_size, state.used, 0, false, false};
+	machine_state(machine, &state);
+
+	memset(machine->image_dirty, 0, (machine->image_size + MACHINE_PAGE_MASK) >> MACHINE_PAGE_BITS);
+	memset(machine->mem_dirty, 0, (machine->mem_size + MACHINE_PAGE_MASK) >> MACHINE_PAGE_BITS);
+	machine_protect_ram(machine);
+	machine->snapshot = buf;
+	return total;
+}
+
+// Restore the machine state from a snapshot, which may be read-only (for
+// example when it is mapped from a file). When the snapshot was last saved to
+// or restored from the same buf, only the pages that were modified since then
+// are copied, so buf must not be changed in the meantime. Returns false if
+// the snapshot doesn't match this machine, or when out of memory for a copy
+// of a shared image (before anything was restored).
+KEEPALIVE
+bool machine_restore(machine_t *machine, const void *buf, size_t size) {
+	const machine_snapshot_header_t *header = buf;
+	if (size < sizeof(machine_snapshot_header_t) ||
+		header->magic != MACHINE_SNAPSHOT_MAGIC ||
+		header->version != MACHINE_SNAPSHOT_VERSION ||
+		header->image_size != machine->image_size ||
+		header->mem_size != machine->mem_size ||
+		header->size != size ||
+		size != machine_snapshot(machine, NULL, 0)) {
+		machine_log(machine, LOG_ERROR, "ERROR: snapshot doesn't match this machine\n");
+		return false;
+	}
+
+	// Only invalidate predecoded instructions (and native code) that actually
+	// changed.
+	bool incremental = buf == machine->snapshot;
+	const uint8_t *image = (const uint8_t*)(header + 1);
+	for (size_t offset = 0; offset < machine->image_size; offset += MACHINE_PAGE_SIZE) {
+		size_t length = machine->image_size - offset < MACHINE_PAGE_SIZE ? machine->image_size - offset : MACHINE_PAGE_SIZE;
+		bool dirty = !incremental || machine->image_dirty[offset >> MACHINE_PAGE_BITS];
+		if (dirty && memcmp(machine->image8 + offset, image + offset, length) != 0) {
+			if (!machine_image_unshare(machine)) {
+				return false; // only fails before the first copy
+			}
+			memcpy(machine->image8 + offset, image + offset, length);
+			machine_invalidate(machine, offset, length);
+		}
+	}
+	const uint8_t *mem = image + machine->image_size;
+	for (size_t offset = 0; offset < machine->mem_size; offset += MACHINE_PAGE_SIZE) {
+		size_t length = machine->mem_size - offset < MACHINE_PAGE_SIZE ? machine->mem_size - offset : MACHINE_PAGE_SIZE;
+		if (!incremental || machine->mem_dirty[offset >> MACHINE_PAGE_BITS]) {
+			memcpy(machine->mem8 + offset, mem + offset, length);
+		}
+	}
+	memset(machine->image_dirty, 0, (machine->image_size + MACHINE_PAGE_MASK) >> MACHINE_PAGE_BITS);
+	memset(machine->mem_dirty, 0, (machine->mem_size + MACHINE_PAGE_MASK) >> MACHINE_PAGE_BITS);
+	machine_protect_ram(machine);
+	machine->snapshot = buf;
+
+	// All events are scheduled again by machine_state().
+	for (size_t i = 1; i <= machine->events_len; i++) {
+		machine->events[i]->index = 0;
+	}
+	machine->events_len = 0;
+	machine->events_idle = 0;
+	machine_state_t state = {(uint8_t*)mem + machine->mem_size, size - (mem + machine->mem_size - (const uint8_t*)buf), 0, true, false};
+	machine_state(machine, &state);
+	if (state.error) {
+		machine_log(machine, LOG_ERROR, "ERROR: snapshot has different peripherals, machine state is undefined\n");
+		return false;
+	}
+	machine_update_deadline(machine);
+	if (machine->realtime_hz != 0) {
+		machine_set_realtime(machine, machine->realtime_hz);
+	}
+	return true;
+}
+
 void machine_free(machine_t *machine) {
-	free(machine->image);
+	if (!machine->image_shared) {
+		free(machine->image);
+	}
 	machine->image = NULL;
+	if (machine->blocks != NULL) {
+		machine_invalidate(machine, 0, machine->image_size);
+		machine_block_free_garbage(machine);
+		free(machine->blocks);
+		machine->blocks = NULL;
+	}
+	free(machine->decoded);
+	machine->decoded = NULL;
+#if MACHINE_JIT
+	machine_jit_free(machine);
+#endif
 	free(machine->mem);
 	machine->mem = NULL;
+	free(machine->image_dirty);
+	free(machine->mem_dirty);
+	free(machine->breakpoints);
+	free(machine->hooks);
+	free(machine->watchpoints);
+	free(machine->trace);
+	free(machine->coverage);
+	machine_map_free(machine);
 	free(machine);
 }
 
 KEEPALIVE
 int machine_run(machine_t *machine) {
-	while (1) {
-		if (machine->halt) {
-			machine->halt = false;
-			return ERR_HALT;
-		}
+	int err;
+	do {
+		machine->reselect = false;
+		err = machine_run_variants[machine_versioncheck(machine, CORTEX_M4)][machine_debugging(machine)](machine);
+	} while (err == ERR_RESELECT);
+	return err;
+}
+
+static void machine_slice_end(machine_t *machine, void *ctx) {
+	machine->halt = true;
+}
+
+// Run for max_cycles (rounded up to the end of a block) and then return
+// ERR_YIELD, for hosts that must get control back regularly (such as a
+// browser). Every instruction takes at least one cycle, so at most about
+// max_cycles instructions are executed. Other results are the same as for
+// machine_run(), which may return earlier.
+KEEPALIVE
+int machine_run_slice(machine_t *machine, uint32_t max_cycles) {
+	machine->slice.fn = machine_slice_end;
+	machine_schedule(machine, &machine->slice, machine->cycles + max_cycles);
+	int err = machine_run(machine);
+	if (machine->slice.index != 0) {
+		machine_unschedule(machine, &machine->slice); // returned earlier
+	} else if (err == ERR_HALT) {
+		err = ERR_YIELD;
+	}
+	return err;
+}
 
-		// Print registers
-		if (machine_loglevel(machine) >= LOG_INSTRS || (machine_loglevel(machine) >= LOG_CALLS_SP && machine->sp != machine->last_sp)) {
-			machine->last_sp = machine->sp;
-			machine_print_registers(machine);
+// Read a range of memory, for debuggers. Flash and RAM are copied directly,
+// only peripherals are read one word (or byte) at a time.
+void machine_readmem(machine_t *machine, void *buf, size_t address, size_t length) {
+	uint8_t *dst = buf;
+	while (length != 0) {
+		size_t chunk = MACHINE_PAGE_SIZE - (address & MACHINE_PAGE_MASK);
+		if (chunk > length) {
+			chunk = length;
+		}
+		// Don't use the page table, so that watchpoints aren't triggered.
+		const uint8_t *ptr = machine_memory(machine, address, chunk);
+		if (ptr != NULL) {
+			memcpy(dst, ptr, chunk);
+		} else if (address % 4 == 0 && chunk % 4 == 0) {
+			for (size_t i=0; i<chunk; i += 4) {
+				uint32_t reg = 0;
+				machine_access(machine, address + i, LOAD, &reg, WIDTH_32, false);
+				memcpy(dst + i, &reg, 4);
+			}
+		} else {
+			for (size_t i=0; i<chunk; i++) {
+				uint32_t reg = 0;
+				machine_access(machine, address + i, LOAD, &reg, WIDTH_8, false);
+				dst[i] = reg;
+			}
 		}
+		dst += chunk;
+		address += chunk;
+		length -= chunk;
+	}
+}
 
-		// Execute a single instruction
-		int err = machine_step(machine);
-		switch (err) {
-			case ERR_OK:
-				break; // no error
-			case ERR_HALT:
-				// expected
-				break;
-			case ERR_EXIT:
-				return 0;
-			case ERR_BREAK:
-				machine_log(machine, LOG_ERROR, "\nhit breakpoint at address %x\n", machine->pc - 3);
-				break;
-			case ERR_MEM:
-				// already printed
-				break;
-			case ERR_PC:
-				machine_log(machine, LOG_ERROR, "\nERROR: invalid PC address: 0x%08x\n", machine->pc);
-				break;
-			case ERR_UNDEFINED:
-				machine_log(machine, LOG_ERROR, "\nERROR: unknown instruction %04x at address %x\n", machine->image16[machine->pc/2 - 1], machine->pc - 3);
-				break;
-			default:
-				machine_log(machine, LOG_ERROR, "\nERROR: unknown error: %d\n", err);
-				break;
+// Return a pointer to the host memory backing the given range of flash or
+// RAM, or NULL if the range is (partially) outside of them. Only valid until
+// the machine runs again.
+const uint8_t * machine_memory(machine_t *machine, uint32_t address, size_t length) {
+	if (address < machine->image_size && length <= machine->image_size - address) {
+		return machine->image8 + address;
+	}
+	if (address >= 0x20000000 && address - 0x20000000 < machine->mem_size && length <= machine->mem_size - (address - 0x20000000)) {
+		return machine->mem8 + (address - 0x20000000);
+	}
+	return NULL;
+}
+
+// Write a range of memory, for debuggers. Unlike stores by the firmware,
+// this writes directly to flash. Returns an error (ERR_MEM) when part of the
+// range isn't mapped, or when out of memory.
+int machine_writemem(machine_t *machine, const void *buf, size_t address, size_t length) {
+	const uint8_t *src = buf;
+	while (length != 0) {
+		size_t chunk = MACHINE_PAGE_SIZE - (address & MACHINE_PAGE_MASK);
+		if (chunk > length) {
+			chunk = length;
 		}
-		if (err != 0) {
-			if (machine_loglevel(machine) < LOG_INSTRS) { // don't double-log
-				machine_print_registers(machine);
+		if (address + chunk <= machine->image_size) {
+			if (!machine_image_unshare(machine)) {
+				return ERR_MEM;
 			}
-			machine_add_backtrace(machine, machine->pc, machine->sp);
-			machine_log(machine, LOG_ERROR, "Backtrace:\n");
-			for (int i = 1; i < machine->call_depth; i++) {
-				if (i >= MACHINE_BACKTRACE_LEN) {
-					machine_log(machine, LOG_ERROR, " %3d. (too much recursion)\n", i);
-					break;
+			memcpy(machine->image8 + address, src, chunk);
+			machine->image_dirty[address >> MACHINE_PAGE_BITS] = 1;
+			machine_invalidate(machine, address, chunk);
+		} else if (address >= 0x20000000 && address - 0x20000000 + chunk <= machine->mem_size) {
+			machine_sram_unprotect(machine, address - 0x20000000);
+			memcpy(machine->mem8 + (address - 0x20000000), src, chunk);
+		} else if (address % 4 == 0 && chunk % 4 == 0) {
+			for (size_t i=0; i<chunk; i += 4) {
+				uint32_t reg;
+				memcpy(&reg, src + i, 4);
+				if (machine_access(machine, address + i, STORE, &reg, WIDTH_32, false)) {
+					return ERR_MEM;
+				}
+			}
+		} else {
+			for (size_t i=0; i<chunk; i++) {
+				uint32_t reg = src[i];
+				if (machine_access(machine, address + i, STORE, &reg, WIDTH_8, false)) {
+					return ERR_MEM;
 				}
-				machine_log(machine, LOG_ERROR, " %3d. %8x (SP: %x)\n", i, machine->backtrace[i].pc, machine->backtrace[i].sp);
 			}
-			return err;
 		}
+		src += chunk;
+		address += chunk;
+		length -= chunk;
 	}
+	return 0;
 }
 
-void machine_readmem(machine_t *machine, void *buf, size_t address, size_t length) {
-	if (address % 4 == 0 && length % 4 == 0) {
-		for (size_t i=0; i<length; i += 4) {
-			uint32_t reg;
-			machine_transfer(machine, address + i, LOAD, &reg, WIDTH_32, false);
-			((uint32_t*)buf)[i / 4] = reg;
-		}
-	} else {
-		for (size_t i=0; i<length; i++) {
-			uint32_t reg;
-			machine_transfer(machine, address + i, LOAD, &reg, WIDTH_8, false);
-			((uint8_t*)buf)[i] = reg;
+// Erase all flash pages (of machine->pagesize) in the given range, like
+// NVMC.ERASEPAGE. Returns false if the range isn't page aligned, or when out
+// of memory.
+bool machine_erase_flash(machine_t *machine, uint32_t address, size_t length) {
+	if ((address & (machine->pagesize-1)) != 0 || (length & (machine->pagesize-1)) != 0 || address > machine->image_size || length > machine->image_size - address) {
+		return false;
+	}
+	for (size_t offset = 0; offset < length; offset += machine->pagesize) {
+		if (!machine_flash_erase(machine, address + offset, machine->pagesize)) {
+			return false;
 		}
 	}
+	return true;
+}
+
+// Program flash like the NVMC does with writing enabled: bits can only be
+// cleared. Returns false if the range is outside the flash, or when out of
+// memory.
+bool machine_program_flash(machine_t *machine, uint32_t address, const uint8_t *buf, size_t length) {
+	if (address > machine->image_size || length > machine->image_size - address || !machine_image_unshare(machine)) {
+		return false;
+	}
+	for (size_t i = 0; i < length; i++) {
+		machine->image8[address + i] &= buf[i];
+	}
+	for (size_t offset = address & ~MACHINE_PAGE_MASK; offset < address + length; offset += MACHINE_PAGE_SIZE) {
+		machine->image_dirty[offset >> MACHINE_PAGE_BITS] = 1;
+	}
+	machine_invalidate(machine, address, length);
+	return true;
 }
 
 void machine_readregs(machine_t *machine, uint32_t *regs, size_t num) {
-	if (num < sizeof(machine->regs) / sizeof(machine->regs[0])) {
+	machine_sync_flags(machine);
+	if (num > sizeof(machine->regs) / sizeof(machine->regs[0])) {
 		num = sizeof(machine->regs) / sizeof(machine->regs[0]);
 	}
-	for (size_t i=0; i<num; i++) {
-		regs[i] = machine->regs[i];
+	memcpy(regs, machine->regs, num * sizeof(uint32_t));
+}
+
+// Write the registers as returned by machine_readregs().
+void machine_writeregs(machine_t *machine, const uint32_t *regs, size_t num) {
+	machine_sync_flags(machine);
+	if (num > sizeof(machine->regs) / sizeof(machine->regs[0])) {
+		num = sizeof(machine->regs) / sizeof(machine->regs[0]);
 	}
+	memcpy(machine->regs, regs, num * sizeof(uint32_t));
+	machine->pc |= 1; // force T-bit to 1
 }
 
 KEEPALIVE
 uint32_t machine_readreg(machine_t *machine, size_t reg) {
+	machine_sync_flags(machine);
 	if (reg >= sizeof(machine->regs) / sizeof(machine->regs[0])) {
 		return 0;
 	}
 	return machine->regs[reg];
 }
 
+// Connect the UART to the given terminal (see terminal.h) instead of stdin
+// and stdout.
+void machine_set_terminal(machine_t *machine, struct terminal *terminal) {
+	machine->terminal = terminal;
+}
+
+// Select the emulated core (the default is the Cortex-M4, or the Cortex-M0 in
+// the browser). This decides which instructions exist, whether unaligned
+// accesses are allowed and how many cycles instructions take.
+void machine_set_core(machine_t *machine, machine_core_t core) {
+	machine->core = core;
+	// Decoding and blocks depend on the core.
+	machine_invalidate(machine, 0, machine->image_size);
+}
+
+// Use the given function symbols, sorted by address, to print backtraces and
+// profiles. They must stay alive until the machine is freed.
+void machine_set_symbols(machine_t *machine, const machine_symbol_t *symbols, size_t num) {
+	machine->symbols = symbols;
+	machine->num_symbols = num;
+}
+
+// Return the name of the function that contains the given address and set
+// *offset (if not NULL) to the offset into that function, or return NULL when
+// it isn't known.
+const char * machine_symbolize(machine_t *machine, uint32_t address, uint32_t *offset) {
+	// Find the last symbol that starts at or before address.
+	size_t low = 0, high = machine->num_symbols;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (machine->symbols[mid].start <= address) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low == 0) {
+		return NULL;
+	}
+	const machine_symbol_t *symbol = &machine->symbols[low - 1];
+	if (symbol->size != 0 && address - symbol->start >= symbol->size) {
+		return NULL;
+	}
+	if (offset != NULL) {
+		*offset = address - symbol->start;
+	}
+	return symbol->name;
+}
+
+void machine_get_counters(machine_t *machine, machine_counters_t *counters) {
+	counters->instructions = machine->instructions;
+	counters->cycles = machine->cycles;
+	counters->uart_rx = machine->uart_rx;
+	counters->uart_tx = machine->uart_tx;
+}
+
 void machine_halt(machine_t *machine) {
 	machine->halt = true;
 }
 
-bool machine_break(machine_t *machine, size_t num, uint32_t addr) {
-	if (num >= sizeof(machine->hwbreak) / sizeof(machine->hwbreak[0])) {
+// Let the next machine_run() execute instructions one at a time until the PC
+// is outside of [start, end), and then return ERR_HALT. This is how debuggers
+// step over a line without a round trip per instruction. At least one
+// instruction is executed. An empty range disables range stepping.
+void machine_set_step_range(machine_t *machine, uint32_t start, uint32_t end) {
+	machine->step_start = start;
+	machine->step_end = end;
+}
+
+// Pass all external inputs (see machine_input_t) through fn, which records or
+// replays them. When replaying, peripherals don't read them from the host. A
+// NULL fn reads them from the host again.
+void machine_set_input(machine_t *machine, machine_input_fn_t fn, void *ctx, bool replay) {
+	machine->input_fn = fn;
+	machine->input_ctx = ctx;
+	machine->input_replay = fn != NULL && replay;
+}
+
+int machine_input(machine_t *machine, machine_input_t source, int value) {
+	if (machine->input_fn != NULL) {
+		value = machine->input_fn(machine, machine->input_ctx, source, value);
+	}
+	machine->inputs++;
+	return value;
+}
+
+// Set or remove a breakpoint on the instruction at the given flash address.
+// Returns false for addresses outside of the flash, or when out of memory.
+bool machine_set_breakpoint(machine_t *machine, uint32_t address, bool enable) {
+	address &= ~1;
+	if (address >= machine->image_size) {
+		return false;
+	}
+	if (machine->breakpoints == NULL) {
+		machine->breakpoints = calloc(machine->image_size / 16 + 1, 1);
+		if (machine->breakpoints == NULL) {
+			return false;
+		}
+	}
+	uint8_t bit = 1 << (address / 2 % 8);
+	uint8_t *byte = &machine->breakpoints[address / 16];
+	if (enable && !(*byte & bit)) {
+		*byte |= bit;
+		machine->num_breakpoints++;
+	} else if (!enable && (*byte & bit)) {
+		*byte &= ~bit;
+		machine->num_breakpoints--;
+	}
+	// Blocks are built around breakpoints.
+	machine_invalidate(machine, address, 2);
+	return true;
+}
+
+// Run a native implementation instead of the firmware function at the given
+// flash address, or remove it with HOOK_NONE. Like the function, it takes its
+// arguments from r0..r3 and returns to LR. Returns false for addresses outside
+// of the flash, or when out of memory.
+bool machine_set_hook(machine_t *machine, uint32_t address, machine_hook_t hook) {
+	address &= ~1;
+	if (address >= machine->image_size) {
+		return false;
+	}
+	size_t i = 0;
+	while (i < machine->num_hooks && machine->hooks[i].address != address) {
+		i++;
+	}
+	if (hook == HOOK_NONE) {
+		if (i < machine->num_hooks) {
+			machine->hooks[i] = machine->hooks[--machine->num_hooks];
+		}
+	} else {
+		if (i == machine->num_hooks) {
+			machine_hook_entry_t *hooks = realloc(machine->hooks, (machine->num_hooks + 1) * sizeof(machine_hook_entry_t));
+			if (hooks == NULL) {
+				return false;
+			}
+			machine->hooks = hooks;
+			machine->num_hooks++;
+		}
+		machine->hooks[i] = (machine_hook_entry_t){address, hook};
+	}
+	// The hook replaces the first instruction of the function.
+	machine_invalidate(machine, address, 2);
+	return true;
+}
+
+// Hook the C library functions that have a native implementation, found by
+// name in the symbols (see machine_set_symbols). Returns how many were hooked.
+size_t machine_hook_symbols(machine_t *machine) {
+	static const char * const names[] = {
+		[HOOK_MEMCPY] = "memcpy",
+		[HOOK_MEMSET] = "memset",
+		[HOOK_MEMCMP] = "memcmp",
+		[HOOK_STRLEN] = "strlen",
+	};
+	size_t count = 0;
+	for (size_t i = 0; i < machine->num_symbols; i++) {
+		for (machine_hook_t hook = HOOK_MEMCPY; hook <= HOOK_STRLEN; hook++) {
+			if (strcmp(machine->symbols[i].name, names[hook]) == 0 && machine_set_hook(machine, machine->symbols[i].start, hook)) {
+				machine_log(machine, LOG_CALLS, "hook %s at %x\n", names[hook], machine->symbols[i].start);
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+// Restore the direct pointers of flash and SRAM, except for pages that are
+// still watched or write protected for a snapshot.
+static void machine_remap_memory(machine_t *machine) {
+	machine_map(machine, 0x00000000, machine->image_size, machine->image8, NULL, &machine_flash);
+	machine_map(machine, 0x20000000, machine->mem_size, machine->mem8, machine->mem8, &machine_sram);
+	if (machine->snapshot != NULL) {
+		for (size_t offset = 0; offset + MACHINE_PAGE_SIZE <= machine->mem_size; offset += MACHINE_PAGE_SIZE) {
+			if (!machine->mem_dirty[offset >> MACHINE_PAGE_BITS]) {
+				machine_page(machine, 0x20000000 + offset)->store = NULL;
+			}
+		}
+	}
+}
+
+// Set or remove a data watchpoint on the given range. Accesses that hit it halt
+// the machine (machine_run() returns ERR_HALT) after the instruction, or with
+// ENGINE_BLOCKS and ENGINE_JIT at the end of its basic block, see
+// machine_watch_hit(). Returns false when out of memory or when removing a
+// watchpoint that doesn't exist.
+bool machine_set_watchpoint(machine_t *machine, uint32_t address, uint32_t length, machine_watch_t type, bool enable) {
+	if (length == 0) {
+		return false;
+	}
+#if MACHINE_JIT
+	// Compiled code only uses the memory map while there are watchpoints.
+	if (machine->jit_code != NULL && (machine->num_watchpoints == 0 || (!enable && machine->num_watchpoints == 1))) {
+		machine_jit_flush(machine);
+	}
+#endif
+	if (enable) {
+		machine_watchpoint_t *watchpoints = realloc(machine->watchpoints, (machine->num_watchpoints + 1) * sizeof(machine_watchpoint_t));
+		if (watchpoints == NULL) {
+			return false;
+		}
+		machine->watchpoints = watchpoints;
+		machine->watchpoints[machine->num_watchpoints++] = (machine_watchpoint_t){address, length, type};
+		machine_watch_map(machine);
+		return true;
+	}
+	for (size_t i = 0; i < machine->num_watchpoints; i++) {
+		machine_watchpoint_t *w = &machine->watchpoints[i];
+		if (w->address == address && w->length == length && w->type == type) {
+			*w = machine->watchpoints[--machine->num_watchpoints];
+			machine_remap_memory(machine);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Return which kind of watchpoint halted the machine (or 0 if none did), at
+// which address, and forget about it.
+machine_watch_t machine_watch_hit(machine_t *machine, uint32_t *address) {
+	machine_watch_t type = machine->watch_hit;
+	*address = machine->watch_address;
+	machine->watch_hit = 0;
+	return type;
+}
+
+// Record every executed instruction, with its memory accesses and the
+// registers it changed, in a ring buffer of (at least) the given number of
+// records. Most instructions take two or three records. With overwrite, only
+// the most recent records are kept, for example to see what led up to a
+// crash, and they must only be read while the machine isn't running.
+// Otherwise machine_run() waits while the buffer is full, for a reader in
+// another thread. Tracing executes one instruction at a time. Returns false
+// when out of memory.
+bool machine_trace_start(machine_t *machine, size_t records, bool overwrite) {
+	size_t size = 64;
+	while (size < records) {
+		size *= 2;
+	}
+	struct machine_trace *trace = malloc(sizeof(struct machine_trace) + size * sizeof(machine_trace_record_t));
+	if (trace == NULL) {
+		return false;
+	}
+	trace->size = size;
+	trace->overwrite = overwrite;
+	atomic_init(&trace->head, 0);
+	atomic_init(&trace->tail, 0);
+	machine_trace_stop(machine);
+	machine->trace = trace;
+	machine_watch_map(machine);
+	return true;
+}
+
+// Take up to max of the oldest records out of the trace buffer, and return how
+// many there were. May be called from another thread than machine_run().
+size_t machine_trace_read(machine_t *machine, machine_trace_record_t *buf, size_t max) {
+	struct machine_trace *trace = machine->trace;
+	size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+	size_t n = atomic_load_explicit(&trace->tail, memory_order_acquire) - head;
+	if (n > max) {
+		n = max;
+	}
+	for (size_t i = 0; i < n; i++) {
+		buf[i] = trace->records[(head + i) & (trace->size - 1)];
+	}
+	atomic_store_explicit(&trace->head, head + n, memory_order_release);
+	return n;
+}
+
+// Stop tracing and drop the records that haven't been read.
+void machine_trace_stop(machine_t *machine) {
+	if (machine->trace == NULL) {
+		return;
+	}
+	free(machine->trace);
+	machine->trace = NULL;
+	machine_remap_memory(machine);
+}
+
+// Record which instructions are executed and which way conditional branches
+// go, in the bitmaps of machine_coverage(). They are updated once per basic
+// block, and only until all bits of the block have been set, so this is cheap
+// enough for every run. Starting again clears them. Returns false when out of
+// memory.
+bool machine_coverage_start(machine_t *machine) {
+	size_t size = (machine->image_size / 2 + 7) / 8;
+	uint8_t *coverage = calloc(COVERAGE_KINDS, size);
+	if (coverage == NULL) {
 		return false;
 	}
-	machine->hwbreak[num] = addr;
+	free(machine->coverage);
+	machine->coverage = coverage;
+	machine->coverage_size = size;
+	if (machine->blocks != NULL) {
+		for (size_t i = 0; i < machine->image_size / 2; i++) {
+			if (machine->blocks[i] != NULL) {
+				machine->blocks[i]->covered = 0;
+			}
+		}
+	}
 	return true;
 }
+
+// Return one of the coverage bitmaps, with bit i % 8 of byte i / 8 for the
+// halfword at address i * 2. Returns NULL when coverage isn't enabled.
+const uint8_t * machine_coverage(machine_t *machine, machine_coverage_t kind, size_t *size) {
+	if (machine->coverage == NULL) {
+		return NULL;
+	}
+	*size = machine->coverage_size;
+	return machine->coverage + kind * machine->coverage_size;
+}
+
+// Count the edges between basic blocks in the given map, with a size that is
+// a power of two, like the instrumentation of AFL and libFuzzer does for
+// native code: the counter of a block at address b after one at a is at
+// hash(a) / 2 ^ hash(b). The single-step engine only sees blocks that start
+// after a branch. Also forgets the previous block, so call it at the start of
+// each run. A NULL map stops counting.
+void machine_set_edges(machine_t *machine, uint8_t *map, size_t size) {
+	machine->edges = map;
+	machine->edges_mask = size - 1;
+	machine->edges_prev = 0;
+}
+
+// Get the number of loads and stores that went to each peripheral added with
+// machine_add_peripheral(), most recently added first, with its base address.
+// Returns the number of peripherals, of which at most num are written.
+size_t machine_get_peripheral_accesses(machine_t *machine, uint32_t *bases, uint64_t *accesses, size_t num) {
+	size_t n = 0;
+	for (const machine_peripheral_t *peripheral = machine->peripherals; peripheral != NULL; peripheral = peripheral->next, n++) {
+		if (n >= num) {
+			continue;
+		}
+		uint64_t count = 0;
+		for (uint64_t offset = 0; offset < peripheral->size; offset += MACHINE_PAGE_SIZE) {
+			count += machine_page(machine, peripheral->base + offset)->accesses;
+		}
+		bases[n] = peripheral->base;
+		accesses[n] = count;
+	}
+	return n;
+}
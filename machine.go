@@ -35,15 +35,37 @@ func (m *Machine) Step() int {
 }
 
 func (m *Machine) Continue() {
+	m.ContinueRange(0, 0)
+}
+
+// ContinueRange continues, but the machine halts again (single-stepping
+// inside the C code) once the PC is outside of [start, end). An empty range
+// means a normal continue.
+func (m *Machine) ContinueRange(start, end uint32) {
 	if !m.halted {
 		panic("machine is already running")
 	}
+	C.machine_set_step_range(m.machine, C.uint32_t(start), C.uint32_t(end))
 	m.halted = false
 	m.runChan <- struct{}{}
 }
 
-func (m *Machine) SetBreakpoint(num int, address uint32) bool {
-	return bool(C.machine_break(m.machine, C.size_t(num), C.uint32_t(address)))
+func (m *Machine) SetBreakpoint(address uint32, enable bool) bool {
+	return bool(C.machine_set_breakpoint(m.machine, C.uint32_t(address), C.bool(enable)))
+}
+
+// SetWatchpoint sets or removes a data watchpoint of the given kind
+// (C.WATCH_WRITE, C.WATCH_READ or C.WATCH_ACCESS).
+func (m *Machine) SetWatchpoint(address, length uint32, kind C.machine_watch_t, enable bool) bool {
+	return bool(C.machine_set_watchpoint(m.machine, C.uint32_t(address), C.uint32_t(length), kind, C.bool(enable)))
+}
+
+// WatchHit returns the kind and address of the watchpoint that halted the
+// machine, or 0 if it wasn't halted by a watchpoint.
+func (m *Machine) WatchHit() (C.machine_watch_t, uint32) {
+	var address C.uint32_t
+	kind := C.machine_watch_hit(m.machine, &address)
+	return kind, uint32(address)
 }
 
 func (m *Machine) ReadRegister(register int) uint32 {
@@ -51,22 +73,61 @@ func (m *Machine) ReadRegister(register int) uint32 {
 }
 
 func (m *Machine) ReadRegisters(num int) []byte {
-	length := num * 4
-	cregs := C.malloc(C.size_t(length))
-	regs := (*[1 << 30]byte)(unsafe.Pointer(cregs))[:length:length]
-	C.machine_readregs(m.machine, (*C.uint32_t)(cregs), C.size_t(num))
-	buf := make([]byte, length)
-	copy(buf, regs)
-	C.free(cregs)
+	buf := make([]byte, num*4)
+	if num != 0 {
+		C.machine_readregs(m.machine, (*C.uint32_t)(unsafe.Pointer(&buf[0])), C.size_t(num))
+	}
 	return buf
 }
 
+// Memory returns the flash or RAM in the given range without copying it, or
+// nil if the range is (partially) outside flash and RAM. The slice must not be
+// modified and is only valid while the machine is halted.
+func (m *Machine) Memory(addr, length int) []byte {
+	ptr := C.machine_memory(m.machine, C.uint32_t(addr), C.size_t(length))
+	if ptr == nil || length == 0 {
+		return nil
+	}
+	return unsafe.Slice((*byte)(unsafe.Pointer(ptr)), length)
+}
+
+// ReadMemory returns the contents of the given range, which may include
+// peripherals. Like Memory, flash and RAM are returned without copying.
 func (m *Machine) ReadMemory(addr, length int) []byte {
-	cmem := C.malloc(C.size_t(length))
-	mem := (*[1 << 30]byte)(unsafe.Pointer(cmem))[:length:length]
-	C.machine_readmem(m.machine, cmem, C.size_t(addr), C.size_t(length))
+	if mem := m.Memory(addr, length); mem != nil {
+		return mem
+	}
 	buf := make([]byte, length)
-	copy(buf, mem)
-	C.free(cmem)
+	if length != 0 {
+		C.machine_readmem(m.machine, unsafe.Pointer(&buf[0]), C.size_t(addr), C.size_t(length))
+	}
 	return buf
 }
+
+func (m *Machine) WriteRegisters(regs []byte) {
+	if len(regs) >= 4 {
+		C.machine_writeregs(m.machine, (*C.uint32_t)(unsafe.Pointer(&regs[0])), C.size_t(len(regs)/4))
+	}
+}
+
+// WriteMemory writes to flash, RAM or peripherals. It returns false when part
+// of the range isn't mapped.
+func (m *Machine) WriteMemory(addr int, data []byte) bool {
+	if len(data) == 0 {
+		return true
+	}
+	return C.machine_writemem(m.machine, unsafe.Pointer(&data[0]), C.size_t(addr), C.size_t(len(data))) == 0
+}
+
+// EraseFlash erases the flash pages in the given range.
+func (m *Machine) EraseFlash(addr, length int) bool {
+	return bool(C.machine_erase_flash(m.machine, C.uint32_t(addr), C.size_t(length)))
+}
+
+// ProgramFlash writes to (erased) flash like the NVMC does.
+func (m *Machine) ProgramFlash(addr int, data []byte) bool {
+	if len(data) == 0 {
+		return true
+	}
+	return bool(C.machine_program_flash(m.machine, C.uint32_t(addr), (*C.uint8_t)(unsafe.Pointer(&data[0])), C.size_t(len(data))))
+}
@@ -10,7 +10,9 @@ typedef struct {
 	uint32_t t   : 1; // Thumb mode
 	uint32_t     : 4;
 	uint32_t it2 : 6; // IT[7:2]
-	uint32_t     : 11;
+	uint32_t ge  : 4; // greater than or equal, set by parallel add/subtract
+	uint32_t q   : 1; // sticky saturation
+	uint32_t     : 6;
 	uint32_t it1 : 2; // IT[1:0]
 	uint32_t v   : 1; // overflow
 	uint32_t c   : 1; // carry
@@ -23,9 +25,182 @@ typedef struct {
 	uint32_t sp;
 } backtrace_item_t;
 
+// A function in the firmware, for example from the symbol table of an ELF
+// file (see machine_set_symbols).
+typedef struct {
+	uint32_t start;
+	uint32_t size; // 0 when unknown
+	const char *name;
+} machine_symbol_t;
+
 #define MACHINE_BACKTRACE_LEN (100)
 
+// A single predecoded instruction. The meaning of the fields depends on the
+// opcode ID, see machine_decode().
 typedef struct {
+	uint8_t  op; // opcode ID, 0 when not yet decoded
+	uint8_t  rd;
+	uint8_t  rn;
+	uint8_t  rm;
+	uint32_t imm;
+} machine_decoded_t;
+
+#define MACHINE_BLOCK_MAX (64)
+
+// A basic block: a run of instructions that ends with a branch (or another
+// instruction that needs special handling) or after MACHINE_BLOCK_MAX
+// instructions.
+typedef struct machine_block {
+	uint32_t pc;                // start address (with Thumb bit)
+	uint32_t size;              // size in bytes
+	struct machine_block *next; // garbage list
+	uint32_t runs;              // number of executions (ENGINE_JIT)
+	void *jit;                  // native code (ENGINE_JIT)
+	uint32_t count;             // number of instructions
+	uint32_t cycles;            // estimated cycles, without a taken branch
+	uint8_t covered;            // coverage bits already set, see machine_coverage_start()
+	machine_decoded_t instrs[]; // instructions, terminated with OP_END
+} machine_block_t;
+
+typedef enum {
+	ENGINE_STEP,   // decode and execute one instruction at a time
+	ENGINE_BLOCKS, // execute cached basic blocks as threaded code
+	ENGINE_JIT,    // like ENGINE_BLOCKS, but compile hot blocks to native code
+	               // (only when built with MACHINE_JIT=1)
+} machine_engine_t;
+
+typedef enum {
+	CORTEX_M0,
+	CORTEX_M4,
+} machine_core_t;
+
+typedef enum {
+	WIDTH_8,
+	WIDTH_16,
+	WIDTH_32,
+} width_t;
+
+typedef enum {
+	LOAD,
+	STORE,
+} transfer_type_t;
+
+// Kinds of data watchpoints, see machine_set_watchpoint().
+typedef enum {
+	WATCH_WRITE  = 1,
+	WATCH_READ   = 2,
+	WATCH_ACCESS = 3,
+} machine_watch_t;
+
+typedef struct {
+	uint32_t address;
+	uint32_t length;
+	machine_watch_t type;
+} machine_watchpoint_t;
+
+// Firmware functions that can run natively, see machine_set_hook().
+typedef enum {
+	HOOK_NONE,
+	HOOK_MEMCPY,
+	HOOK_MEMSET,
+	HOOK_MEMCMP,
+	HOOK_STRLEN,
+} machine_hook_t;
+
+typedef struct {
+	uint32_t address;
+	machine_hook_t hook;
+} machine_hook_entry_t;
+
+// Kinds of binary trace records, see machine_trace_start(). Every instruction
+// starts with a TRACE_INSTR record, followed by a record for each of its memory
+// accesses through the memory map and then one for each register it changed.
+typedef enum {
+	TRACE_INSTR, // a: address, b: instruction (second halfword in the upper bits)
+	TRACE_REG,   // arg: register number (16 for xPSR, never the PC), a: value
+	TRACE_LOAD,  // arg: width, a: address, b: value
+	TRACE_STORE, // arg: width, a: address, b: value
+} machine_trace_type_t;
+
+typedef struct {
+	uint8_t  type; // machine_trace_type_t
+	uint8_t  arg;
+	uint32_t a;
+	uint32_t b;
+} machine_trace_record_t;
+
+// Bitmaps of machine_coverage_start(), with one bit for each halfword of the
+// image. The branch bits are only set for conditional branches.
+typedef enum {
+	COVERAGE_EXECUTED,  // an instruction that starts or continues here was executed
+	COVERAGE_TAKEN,     // the branch at this address was taken
+	COVERAGE_NOT_TAKEN, // the branch at this address was not taken
+	COVERAGE_KINDS,
+} machine_coverage_t;
+
+struct machine;
+struct machine_state;
+struct machine_trace;
+
+// Sources of input from outside of the machine, see machine_set_input().
+typedef enum {
+	INPUT_UART, // character from the terminal, or -1 when there is none
+	INPUT_RNG,  // random byte
+} machine_input_t;
+
+// Gets every input with the value read from the host (-1 while replaying) and
+// returns the value that the firmware reads, see replay.c.
+typedef int (*machine_input_fn_t)(struct machine *machine, void *ctx, machine_input_t source, int value);
+
+// Callbacks of a memory-mapped device, see machine_add_peripheral(). Offsets
+// are relative to the base address of the device. read and write return 0 or
+// an ERR_* code, tick, free and snapshot may be NULL.
+typedef struct {
+	int (*read)(struct machine *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width);
+	int (*write)(struct machine *machine, void *ctx, uint32_t offset, uint32_t value, width_t width);
+	void (*tick)(struct machine *machine, void *ctx); // called between instructions or blocks
+	void (*free)(void *ctx); // called from machine_free()
+	void (*snapshot)(struct machine *machine, void *ctx, struct machine_state *state); // save or restore the device state
+} machine_peripheral_ops_t;
+
+// A memory range that can't be accessed directly, usually a peripheral.
+typedef struct machine_peripheral {
+	uint32_t base;
+	uint32_t size;
+	const machine_peripheral_ops_t *ops;
+	void *ctx;
+	struct machine_peripheral *next; // all peripherals of a machine
+} machine_peripheral_t;
+
+// The address space is split into pages, with a two-level table from address
+// to page. Most accesses go to a page with a direct pointer to host memory,
+// everything else is handled by the peripheral (if any).
+#define MACHINE_PAGE_BITS (12) // 4 KiB pages
+#define MACHINE_PAGE_SIZE (1 << MACHINE_PAGE_BITS)
+#define MACHINE_PAGE_MASK (MACHINE_PAGE_SIZE - 1)
+#define MACHINE_PAGE_L2_BITS (10)
+#define MACHINE_PAGE_L1_BITS (32 - MACHINE_PAGE_BITS - MACHINE_PAGE_L2_BITS)
+
+typedef struct {
+	uint8_t *load;  // host memory for loads, or NULL
+	uint8_t *store; // host memory for stores, or NULL
+	const machine_peripheral_t *peripheral; // handles all other accesses
+	uint64_t accesses; // through the peripheral, see machine_get_peripheral_accesses()
+} machine_page_t;
+
+// A callback at a given cycle count, see machine_schedule(). Events are
+// usually part of the ctx of a peripheral, with fn and ctx set once.
+typedef struct {
+	uint64_t when; // cycle count at which fn is called
+	void (*fn)(struct machine *machine, void *ctx);
+	void *ctx;
+	size_t index;  // position in the event queue, 0 when not scheduled
+	bool idle;     // doesn't keep a sleeping machine busy, like sampling
+} machine_event_t;
+
+#define MACHINE_EVENTS_MAX (32)
+
+typedef struct machine {
 	// Regular registers (r0 .. r15)
 	union {
 		struct {
@@ -59,6 +234,18 @@ typedef struct {
 		uint32_t regs[17];
 	};
 
+	// Condition flags that haven't been written to psr yet, so that most
+	// flags never need to be computed. N and Z follow from result, C and V
+	// from the operands of the last addition or subtraction. Call
+	// machine_sync_flags() before accessing the flags in psr directly.
+	struct {
+		uint8_t  op;     // which flags are pending (FLAGS_* in machine.c)
+		uint8_t  carry;  // carry input of the addition or subtraction
+		uint32_t result; // last flag-setting result
+		uint32_t a;      // operands of the addition or subtraction
+		uint32_t b;
+	} flags;
+
 	// ROM/flash area
 	union {
 		uint32_t *image32;
@@ -68,8 +255,29 @@ typedef struct {
 	};
 	size_t image_size;
 	bool image_writable;
+	bool image_shared; // see machine_share_image()
 	size_t pagesize;
 
+	// Predecoded instructions, one entry for each halfword in the image.
+	machine_decoded_t *decoded;
+
+	// Basic block cache for ENGINE_BLOCKS, indexed by start address / 2.
+	machine_engine_t engine;
+	machine_block_t **blocks;
+	machine_block_t *blocks_garbage;
+
+	// Code buffer for ENGINE_JIT.
+	uint8_t *jit_code;
+	size_t jit_code_used;
+
+	// Reserved guest address space with only the RAM accessible, or NULL, and
+	// the accesses of compiled code that rely on it. See
+	// machine_enable_guard_pages().
+	uint8_t *jit_window;
+	struct machine_jit_guard *jit_guards;
+	size_t jit_guards_len;
+	size_t jit_guards_cap;
+
 	// RAM area
 	union {
 		uint32_t *mem32;
@@ -79,18 +287,78 @@ typedef struct {
 	};
 	size_t mem_size;
 
+	// Pages (of MACHINE_PAGE_SIZE) of the image and RAM that may have been
+	// modified since the snapshot was saved or restored, see
+	// machine_restore(). RAM pages are write protected in the memory map
+	// until the first store.
+	const void *snapshot;
+	uint8_t *image_dirty;
+	uint8_t *mem_dirty;
+
+	// Memory map, indexed by the upper bits of the address. Unused entries
+	// point to a shared table without any mappings.
+	machine_page_t *pages[1 << MACHINE_PAGE_L1_BITS];
+	machine_peripheral_t *peripherals;
+	size_t peripherals_tick; // number of peripherals with a tick callback
+
+	// Events ordered by time, as a binary heap (events[1] is the first).
+	// machine_run() only compares the cycle count against deadline, which is
+	// the time of the first event or 0 when an exception must be taken.
+	machine_event_t *events[MACHINE_EVENTS_MAX + 1];
+	size_t events_len;
+	size_t events_idle; // number of scheduled idle events
+	uint64_t deadline;
+
+	// Exception state. Exceptions 16 and up are external interrupts.
+	uint32_t ipsr; // current exception number, 0 in thread mode
+	bool primask;  // mask all exceptions with configurable priority
+	bool sleeping; // in WFI or WFE, until an exception is pending
+	bool event_register; // set by SEV and exceptions, cleared by WFE
+
+	// Real-time pacing, see machine_set_realtime().
+	uint32_t realtime_hz;      // 0 to run as fast as possible
+	uint64_t realtime_cycles;  // cycle count at realtime_start
+	int64_t realtime_start;    // host time in nanoseconds
+
 	// The NVIC peripheral
 	struct {
+		uint32_t enabled;  // interrupt set-enable register
+		uint32_t pending;  // interrupt set-pending register
+		uint32_t active;   // interrupt active bit register
 		uint8_t ip[8 * 4]; // interrupt priority
 	} nvic;
 
 	struct {
-		uint32_t cpacr; // coprocessor access control register
+		uint32_t ccr;     // configuration and control register
+		uint32_t cpacr;   // coprocessor access control register
+		uint32_t demcr;   // debug exception and monitor control register
+		uint32_t vtor;    // vector table offset register
+		uint8_t shp[12];  // priority of system exceptions 4..15
+		uint16_t pending; // pending system exceptions (by number)
+		uint16_t active;  // active system exceptions (by number)
 	} scb;
 
+	// SysTick timer, counting CPU cycles.
 	struct {
-		uint32_t pselreset[2];
-	} uicr;
+		uint32_t csr;          // control and status register
+		uint32_t rvr;          // reload value register
+		uint32_t cvr;          // current value while the timer is disabled
+		machine_event_t wrap;  // when the counter reaches zero
+	} systick;
+
+	// Data watchpoint and trace unit (only the cycle counter).
+	struct {
+		uint32_t ctrl;
+		uint32_t cyccnt;       // value of CYCCNT when cycles was cyccnt_start
+		uint64_t cyccnt_start;
+	} dwt;
+
+	// Retired instructions and the estimated number of cycles they took.
+	// These are updated per basic block, so they are always enabled.
+	uint64_t instructions;
+	uint64_t cycles;
+	uint64_t uart_rx; // bytes read from the UART by the firmware
+	uint64_t uart_tx; // bytes written to the UART by the firmware
 
 	// Statistics and backtrace depth.
 	// Warning: call_depth may not fit in the backtrace! So check before
@@ -99,24 +367,57 @@ typedef struct {
 	backtrace_item_t backtrace[MACHINE_BACKTRACE_LEN];
 	uint32_t last_sp;
 
-	volatile uint32_t hwbreak[4];
+	// Function symbols sorted by address, see machine_set_symbols().
+	const machine_symbol_t *symbols;
+	size_t num_symbols;
+
+	// Breakpoints, one bit per halfword of the image. Blocks never contain
+	// a breakpoint, so only machine_step() needs to check them.
+	uint8_t *breakpoints;
+	size_t num_breakpoints;
+
+	// Functions with a native implementation, see machine_set_hook(). The
+	// instruction at their address is decoded as OP_HOOK.
+	machine_hook_entry_t *hooks;
+	size_t num_hooks;
+
+	// Data watchpoints. Pages with a watchpoint have no direct pointers, so
+	// only accesses through machine_transfer() need to be checked.
+	machine_watchpoint_t *watchpoints;
+	size_t num_watchpoints;
+	machine_watch_t watch_hit; // last triggered watchpoint, see machine_watch_hit()
+	uint32_t watch_address;
+
+	uint32_t step_start; // see machine_set_step_range()
+	uint32_t step_end;
+
+	struct machine_trace *trace; // binary trace ring buffer, or NULL
+
+	// Coverage bitmaps (COVERAGE_KINDS of coverage_size bytes), or NULL.
+	uint8_t *coverage;
+	size_t coverage_size;
+
+	// Edge counters for fuzzers, see machine_set_edges(), or NULL.
+	uint8_t *edges;
+	uint32_t edges_mask;
+	uint32_t edges_prev; // hash of the previous block
+
+	// Record or replay of external inputs, see machine_set_input().
+	machine_input_fn_t input_fn;
+	void *input_ctx;
+	bool input_replay; // don't read inputs from the host
+	uint64_t inputs;   // number of inputs so far, kept in snapshots
+
+	machine_event_t slice; // end of the time slice, see machine_run_slice()
 
 	// misc
+	machine_core_t core;
+	bool reselect; // see machine_reselect()
 	int loglevel;
 	volatile bool halt;
+	struct terminal *terminal; // UART input and output, NULL for stdin/stdout
 } machine_t;
 
-typedef enum {
-	WIDTH_8,
-	WIDTH_16,
-	WIDTH_32,
-} width_t;
-
-typedef enum {
-	LOAD,
-	STORE,
-} transfer_type_t;
-
 enum {
 	ERR_OK,        // no error
 	ERR_HALT,      // program has paused after a request
@@ -126,6 +427,8 @@ enum {
 	ERR_MEM,       // memory error
 	ERR_PC,        // invalid PC
 	ERR_UNDEFINED, // undefined instruction
+	ERR_SLEEP,     // sleeping without anything that could wake up the CPU
+	ERR_YIELD,     // the time slice is over, see machine_run_slice()
 };
 
 enum {
@@ -137,19 +440,56 @@ enum {
 	LOG_INSTRS,   // log everything
 };
 
-enum {
-	CORTEX_M0,
-	CORTEX_M4,
-} machine_core_t;
+typedef struct {
+	uint64_t instructions; // retired instructions
+	uint64_t cycles;       // estimated CPU cycles
+	uint64_t uart_rx;      // bytes read from the UART
+	uint64_t uart_tx;      // bytes written to the UART
+} machine_counters_t;
 
-machine_t * machine_create(size_t image_size, size_t pagesize, size_t ram_size, int loglevel);
-void machine_load(machine_t *machine, uint8_t *image, size_t image_size);
+bool machine_enable_guard_pages(void);
+// Returns NULL when the image is too small or when out of memory.
+machine_t * machine_create(size_t image_size, size_t pagesize, size_t ram_size, int loglevel, machine_engine_t engine);
+bool machine_load(machine_t *machine, uint8_t *image, size_t image_size);
+void machine_share_image(machine_t *machine, const uint8_t *image);
 void machine_readmem(machine_t *machine, void *buf, size_t offset, size_t length);
+const uint8_t * machine_memory(machine_t *machine, uint32_t address, size_t length);
 void machine_readregs(machine_t *machine, uint32_t *regs, size_t num);
+int machine_writemem(machine_t *machine, const void *buf, size_t address, size_t length);
+void machine_writeregs(machine_t *machine, const uint32_t *regs, size_t num);
+bool machine_erase_flash(machine_t *machine, uint32_t address, size_t length);
+bool machine_program_flash(machine_t *machine, uint32_t address, const uint8_t *buf, size_t length);
 uint32_t machine_readreg(machine_t *machine, size_t reg);
 void machine_reset(machine_t *machine);
+bool machine_add_peripheral(machine_t *machine, uint32_t base, uint32_t size, const machine_peripheral_ops_t *ops, void *ctx);
+void machine_sync_flags(machine_t *machine);
+void machine_get_counters(machine_t *machine, machine_counters_t *counters);
+bool machine_schedule(machine_t *machine, machine_event_t *event, uint64_t when);
+void machine_unschedule(machine_t *machine, machine_event_t *event);
+void machine_set_irq_pending(machine_t *machine, uint32_t irq);
+void machine_set_realtime(machine_t *machine, uint32_t hz);
+void machine_set_terminal(machine_t *machine, struct terminal *terminal);
+void machine_set_core(machine_t *machine, machine_core_t core);
+void machine_set_symbols(machine_t *machine, const machine_symbol_t *symbols, size_t num);
+const char * machine_symbolize(machine_t *machine, uint32_t address, uint32_t *offset);
+size_t machine_snapshot(machine_t *machine, void *buf, size_t size);
+bool machine_restore(machine_t *machine, const void *buf, size_t size);
 int machine_step(machine_t *machine);
 int machine_run(machine_t *machine);
+int machine_run_slice(machine_t *machine, uint32_t max_cycles);
 void machine_halt(machine_t *machine);
-bool machine_break(machine_t *machine, size_t num, uint32_t addr);
+void machine_set_step_range(machine_t *machine, uint32_t start, uint32_t end);
+bool machine_set_breakpoint(machine_t *machine, uint32_t address, bool enable);
+bool machine_set_hook(machine_t *machine, uint32_t address, machine_hook_t hook);
+size_t machine_hook_symbols(machine_t *machine);
+bool machine_set_watchpoint(machine_t *machine, uint32_t address, uint32_t length, machine_watch_t type, bool enable);
+machine_watch_t machine_watch_hit(machine_t *machine, uint32_t *address);
+void machine_set_input(machine_t *machine, machine_input_fn_t fn, void *ctx, bool replay);
+bool machine_trace_start(machine_t *machine, size_t records, bool overwrite);
+size_t machine_trace_read(machine_t *machine, machine_trace_record_t *buf, size_t max);
+void machine_trace_stop(machine_t *machine);
+bool machine_coverage_start(machine_t *machine);
+const uint8_t * machine_coverage(machine_t *machine, machine_coverage_t kind, size_t *size);
+void machine_set_edges(machine_t *machine, uint8_t *map, size_t size);
+size_t machine_get_peripheral_accesses(machine_t *machine, uint32_t *bases, uint64_t *accesses, size_t num);
 void machine_free(machine_t *machine);
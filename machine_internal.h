@@ -0,0 +1,90 @@
+#pragma once
+
+// Definitions shared by the CPU core (machine.c) and the device models that
+// are registered with machine_add_peripheral().
+
+#include "machine.h"
+
+#ifdef __EMSCRIPTEN__
+
+#include <emscripten.h>
+
+#define MACHINE_DEFAULT_CORE CORTEX_M0
+#define machine_loglevel(machine) (0)
+#define machine_log(machine, level, ...) ((false) ? (void)fprintf(stderr, __VA_ARGS__) : (void)0)
+
+#define KEEPALIVE EMSCRIPTEN_KEEPALIVE
+
+#else // all other compilers
+
+#include <stdio.h>
+
+#define MACHINE_DEFAULT_CORE CORTEX_M4
+#define machine_loglevel(machine) (machine->loglevel)
+#define machine_log(machine, level, ...) ((machine->loglevel >= level) ? fprintf(stderr, __VA_ARGS__) : 0)
+
+#define KEEPALIVE
+
+#endif
+
+// Whether the emulated core is at least the given one, see machine_set_core().
+#define machine_versioncheck(machine, version) ((machine)->core >= (version))
+
+// Saved machine state, for machine_snapshot() and machine_restore(). Device
+// models use the same snapshot callback for both, which transfers every
+// field with machine_state_field() in the direction given by restore.
+typedef struct machine_state {
+	uint8_t *buf;  // NULL to only count the size
+	size_t size;
+	size_t used;
+	bool restore;  // copy from buf to the fields instead of the other way
+	bool error;    // the saved state doesn't match this machine
+} machine_state_t;
+
+void machine_state_field(machine_state_t *state, void *field, size_t size);
+#define MACHINE_STATE_FIELD(state, field) machine_state_field(state, &(field), sizeof(field))
+
+// Save an event, or schedule it again when restoring. All events have been
+// unscheduled before the state is restored.
+void machine_state_event(machine_t *machine, machine_state_t *state, machine_event_t *event);
+
+// Read or write a value of the given width from host memory.
+static inline uint32_t machine_ptr_read(const uint8_t *ptr, width_t width) {
+	if (width == WIDTH_8) {
+		return *ptr;
+	} else if (width == WIDTH_16) {
+		return *(uint16_t*)ptr;
+	} else {
+		return *(uint32_t*)ptr;
+	}
+}
+
+static inline void machine_ptr_write(uint8_t *ptr, uint32_t value, width_t width) {
+	if (width == WIDTH_8) {
+		*ptr = value;
+	} else if (width == WIDTH_16) {
+		*(uint16_t*)ptr = value;
+	} else {
+		*(uint32_t*)ptr = value;
+	}
+}
+
+// Report an access to an address where nothing is mapped. Returns ERR_MEM.
+int machine_invalid_address(machine_t *machine, uint32_t address, transfer_type_t transfer_type, uint32_t value);
+
+// Log an access to an unimplemented peripheral register, which reads as zero.
+// Returns 0.
+int machine_peripheral_unknown(machine_t *machine, uint32_t address, transfer_type_t transfer_type, uint32_t value);
+
+// Write to NOR flash (the image or UICR), which only allows aligned 32-bit
+// writes after NVMC.CONFIG enabled writing and can only clear bits.
+int machine_nor_write(machine_t *machine, uint32_t *ptr, uint32_t address, uint32_t value, width_t width);
+
+// Pass an external input (read from the host, unless machine->input_replay is
+// set) through the record or replay of machine_set_input(). Returns the value
+// for the firmware.
+int machine_input(machine_t *machine, machine_input_t source, int value);
+
+// Erase (set to 0xff) a range of the flash image. Returns false when out of
+// memory.
+bool machine_flash_erase(machine_t *machine, uint32_t address, size_t length);
@@ -1,14 +1,17 @@
 package main
 
 import (
+	"debug/elf"
 	"flag"
 	"fmt"
-	"io"
 	"os"
 	"unsafe"
 )
 
+// #include "loader.h"
 // #include "machine.h"
+// #include "profile.h"
+// #include "stats.h"
 // #include "terminal.h"
 import "C"
 
@@ -18,6 +21,17 @@ var (
 	flagFlashPageSize int
 	flagLoglevel      string
 	flagGdbServer     string
+	flagEngine        string
+	flagCore          string
+	flagInput         string
+	flagRealtime      int
+	flagProfile       string
+	flagProfileEvery  int
+	flagELF           string
+	flagHooks         bool
+	flagMetrics       string
+	flagMetricsEvery  int
+	flagMetricsTop    int
 )
 
 var loglevels = map[string]int{
@@ -30,6 +44,28 @@ var loglevels = map[string]int{
 	"instrs":  C.LOG_INSTRS,
 }
 
+var engines = map[string]C.machine_engine_t{
+	"step":   C.ENGINE_STEP,
+	"blocks": C.ENGINE_BLOCKS,
+	"jit":    C.ENGINE_JIT, // falls back to blocks when not built with -tags jit
+}
+
+var cores = map[string]C.machine_core_t{
+	"m0": C.CORTEX_M0,
+	"m4": C.CORTEX_M4,
+}
+
+// Whether the file is an ELF file, to use its symbols when there is no -elf
+// flag.
+func isELF(path string) bool {
+	f, err := elf.Open(path)
+	if err != nil {
+		return false
+	}
+	f.Close()
+	return true
+}
+
 func isPowerOfTwo(n int) bool {
 	// https://stackoverflow.com/a/600306/559350
 	return n >= 0 && (n&(n-1)) == 0
@@ -41,6 +77,17 @@ func main() {
 	flag.IntVar(&flagFlashPageSize, "pagesize", 1024, "flash page size in bytes")
 	flag.StringVar(&flagLoglevel, "loglevel", "error", "error, warning, calls, instrs")
 	flag.StringVar(&flagGdbServer, "gdb", "localhost:7333", "GDB target port")
+	flag.StringVar(&flagEngine, "engine", "blocks", "execution engine: step, blocks, jit")
+	flag.StringVar(&flagCore, "core", "m4", "emulated core: m0, m4")
+	flag.StringVar(&flagInput, "input", "", "read UART input from this file or pipe instead of the terminal")
+	flag.IntVar(&flagRealtime, "realtime", 0, "run no faster than this clock frequency in Hz (0 for as fast as possible)")
+	flag.StringVar(&flagProfile, "profile", "", "write a profile in folded stack format to this file")
+	flag.IntVar(&flagProfileEvery, "profile-interval", 1009, "profiler sample interval in cycles")
+	flag.StringVar(&flagELF, "elf", "", "ELF file of the firmware, for function names in the profile and GDB (default: the image, if it is an ELF file)")
+	flag.BoolVar(&flagHooks, "hooks", false, "run memcpy, memset, memcmp and strlen natively, when the image has symbols for them")
+	flag.StringVar(&flagMetrics, "metrics", "", "serve runtime statistics for Prometheus on this address (for example localhost:9090)")
+	flag.IntVar(&flagMetricsEvery, "metrics-interval", 10007, "statistics update interval in cycles")
+	flag.IntVar(&flagMetricsTop, "metrics-top", 10, "number of hot PCs in the statistics")
 	flag.Parse()
 
 	if flag.NArg() != 1 {
@@ -61,33 +108,48 @@ func main() {
 		os.Exit(1)
 	}
 
-	f, err := os.Open(flag.Arg(0))
-	if err != nil {
-		fmt.Fprintln(os.Stderr, "cannot open firmware image:", err)
-		os.Exit(1)
-	}
-	defer f.Close()
-	st, err := f.Stat()
-	if err != nil {
-		fmt.Fprintln(os.Stderr, "cannot stat firmware image:", err)
+	if _, ok := engines[flagEngine]; !ok {
+		fmt.Fprintln(os.Stderr, "error: engine must be one of: step, blocks, jit")
+		flag.PrintDefaults()
 		os.Exit(1)
 	}
-	if st.Size() > int64(flagFlashSize*1024) {
-		fmt.Fprintln(os.Stderr, "firmware does not fit in flash")
+
+	if _, ok := cores[flagCore]; !ok {
+		fmt.Fprintln(os.Stderr, "error: core must be one of: m0, m4")
+		flag.PrintDefaults()
 		os.Exit(1)
 	}
-	cfirmware := C.malloc(C.size_t(st.Size()))
-	defer C.free(cfirmware)
-	firmware := (*[1 << 30]byte)(unsafe.Pointer(cfirmware))[:st.Size():st.Size()]
-	_, err = io.ReadFull(f, firmware)
-	if err != nil {
-		fmt.Fprintln(os.Stderr, "cannot read firmware image:", err)
-		os.Exit(1)
+
+	if flagInput != "" {
+		cinput := C.CString(flagInput)
+		ok := C.terminal_set_input(cinput)
+		C.free(unsafe.Pointer(cinput))
+		if !ok {
+			fmt.Fprintln(os.Stderr, "cannot open input:", flagInput)
+			os.Exit(1)
+		}
 	}
 
 	// This is where the MCU is actually started.
-	machine := C.machine_create(C.size_t(flagFlashSize*1024), C.size_t(flagFlashPageSize), C.size_t(flagRAMSize*1024), C.int(loglevels[flagLoglevel]))
-	C.machine_load(machine, (*C.uint8_t)(cfirmware), C.size_t(len(firmware)))
+	cpath := C.CString(flag.Arg(0))
+	loader := C.loader_open(cpath, C.size_t(flagFlashSize*1024), C.size_t(flagRAMSize*1024))
+	C.free(unsafe.Pointer(cpath))
+	if loader == nil {
+		os.Exit(1) // the error has been printed
+	}
+	if flagELF == "" && isELF(flag.Arg(0)) {
+		flagELF = flag.Arg(0)
+	}
+	machine := C.machine_create(C.size_t(flagFlashSize*1024), C.size_t(flagFlashPageSize), C.size_t(flagRAMSize*1024), C.int(loglevels[flagLoglevel]), engines[flagEngine])
+	if machine == nil {
+		fmt.Fprintln(os.Stderr, "cannot create the machine")
+		os.Exit(1)
+	}
+	C.machine_set_core(machine, cores[flagCore])
+	C.loader_apply(loader, machine)
+	if flagHooks && C.machine_hook_symbols(machine) == 0 {
+		fmt.Fprintln(os.Stderr, "no functions to hook")
+	}
 
 	runChan := make(chan struct{})
 	if flagGdbServer != "" {
@@ -100,10 +162,53 @@ func main() {
 	}
 
 	C.machine_reset(machine)
+	if flagRealtime > 0 {
+		C.machine_set_realtime(machine, C.uint32_t(flagRealtime))
+	}
+	var profile *C.profile_t
+	var symbols []symbol
+	if (flagProfile != "" || flagMetrics != "") && flagELF != "" {
+		var err error
+		symbols, err = readSymbols(flagELF)
+		if err != nil {
+			fmt.Fprintln(os.Stderr, "cannot read symbols:", err)
+			os.Exit(1)
+		}
+	}
+	if flagProfile != "" {
+		profile = C.profile_start(machine, C.uint64_t(flagProfileEvery))
+		if profile == nil {
+			fmt.Fprintln(os.Stderr, "cannot start the profiler")
+			os.Exit(1)
+		}
+	}
+	if flagMetrics != "" {
+		stats := C.stats_start(machine, C.uint64_t(flagMetricsEvery))
+		if stats == nil {
+			fmt.Fprintln(os.Stderr, "cannot start the statistics")
+			os.Exit(1)
+		}
+		go func() {
+			err := serveStats(stats, flagMetrics, flagMetricsTop, symbols)
+			if err != nil {
+				fmt.Fprintln(os.Stderr, "metrics server error:", err)
+			}
+		}()
+	}
 	for {
-		if C.machine_run(machine) == 0 {
+		result := C.machine_run(machine)
+		if result == 0 || (result == C.ERR_HALT && C.terminal_exited(nil)) {
+			// Exited, or Ctrl-X was pressed.
+			C.terminal_flush()
+			C.terminal_disable_raw()
+			if profile != nil {
+				if err := writeProfile(profile, flagProfile, symbols); err != nil {
+					fmt.Fprintln(os.Stderr, "cannot write profile:", err)
+				}
+			}
 			return
 		}
+		C.terminal_flush()
 		C.terminal_disable_raw()
 
 		// send "machine has stopped"
@@ -0,0 +1,753 @@
+#include "nrf.h"
+#include "machine_internal.h"
+#include "terminal.h"
+
+// This file implements the peripherals of the nRF51/nRF52 series that are
+// emulated, as devices registered with machine_add_peripheral().
+// For more information, see the nRF51 Series Reference Manual:
+// https://infocenter.nordicsemi.com/pdf/nRF51_RM_v3.0.pdf
+
+#define NRF_FICR   (0x10000000)
+#define NRF_UICR   (0x10001000)
+#define NRF_UART   (0x40002000)
+#define NRF_TIMER0 (0x40008000)
+#define NRF_TIMER1 (0x40009000)
+#define NRF_TIMER2 (0x4000a000)
+#define NRF_RTC0   (0x4000b000)
+#define NRF_RNG    (0x4000d000)
+#define NRF_RTC1   (0x40011000)
+#define NRF_NVMC   (0x4001e000)
+
+// Interrupt numbers (the peripheral ID, which is base address bits 12..17).
+#define NRF_IRQ(base) (((base) >> 12) & 0x3f)
+
+// Timing. The emulated CPU runs at the same speed as the timers.
+#define NRF_CPU_HZ         (16000000)
+#define NRF_UART_BYTE_TIME (NRF_CPU_HZ / 11520) // 10 bits at 115200 baud
+
+// Factory information configuration registers.
+static int nrf_ficr_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	if (offset == 0x130) {
+		*value = 0; // undocumented, but somewhere in FICR
+		return 0;
+	}
+	return machine_invalid_address(machine, NRF_FICR + offset, LOAD, 0);
+}
+
+static int nrf_ficr_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	return machine_invalid_address(machine, NRF_FICR + offset, STORE, value);
+}
+
+static const machine_peripheral_ops_t nrf_ficr_ops = {nrf_ficr_read, nrf_ficr_write, NULL, NULL};
+
+// User information configuration registers, which are NOR flash like the
+// image.
+typedef struct {
+	uint32_t pselreset[2];
+} nrf_uicr_t;
+
+static int nrf_uicr_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	nrf_uicr_t *uicr = ctx;
+	if (offset != 0x200 && offset != 0x204) {
+		return machine_invalid_address(machine, NRF_UICR + offset, LOAD, 0);
+	}
+	*value = machine_ptr_read((uint8_t*)&uicr->pselreset[(offset - 0x200) / 4], width);
+	return 0;
+}
+
+static int nrf_uicr_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	nrf_uicr_t *uicr = ctx;
+	if (offset != 0x200 && offset != 0x204) {
+		return machine_invalid_address(machine, NRF_UICR + offset, STORE, value);
+	}
+	return machine_nor_write(machine, &uicr->pselreset[(offset - 0x200) / 4], NRF_UICR + offset, value, width);
+}
+
+static void nrf_free(void *ctx) {
+	free(ctx);
+}
+
+static void nrf_uicr_snapshot(machine_t *machine, void *ctx, machine_state_t *state) {
+	nrf_uicr_t *uicr = ctx;
+	MACHINE_STATE_FIELD(state, uicr->pselreset);
+}
+
+static const machine_peripheral_ops_t nrf_uicr_ops = {nrf_uicr_read, nrf_uicr_write, NULL, nrf_free, nrf_uicr_snapshot};
+
+// UART0, connected to the terminal. Input is buffered by the terminal, so
+// RXDRDY is only set once a character has actually been received. Output is
+// sent immediately, so TXDRDY is always set after writing TXD.
+typedef struct {
+	int      rxd_pending; // received character that hasn't been read, or -1
+	uint32_t rxd;         // last character read from RXD
+	bool     txdrdy;
+	uint32_t inten;
+	machine_event_t rx_poll; // checks for input while RXDRDY interrupts are enabled
+} nrf_uart_t;
+
+#define NRF_UART_INT_RXDRDY (1 << 2)
+#define NRF_UART_INT_TXDRDY (1 << 7)
+
+static void nrf_uart_update_irq(machine_t *machine, nrf_uart_t *uart) {
+	if (((uart->inten & NRF_UART_INT_RXDRDY) && uart->rxd_pending >= 0) ||
+		((uart->inten & NRF_UART_INT_TXDRDY) && uart->txdrdy)) {
+		machine_set_irq_pending(machine, NRF_IRQ(NRF_UART));
+	}
+}
+
+// Ctrl-X stops the machine, see terminal_exited().
+static int nrf_uart_input(machine_t *machine, int c) {
+	if (c == TERMINAL_EXIT) {
+		machine_halt(machine);
+		return -1;
+	}
+	return c;
+}
+
+// Read a character from the terminal, through machine_input() so that it can
+// be recorded and replayed.
+static int nrf_uart_getchar(machine_t *machine, bool poll) {
+	int c = -1;
+	if (!machine->input_replay) {
+		c = poll ? terminal_poll(machine->terminal) : terminal_getchar(machine->terminal);
+	}
+	return nrf_uart_input(machine, machine_input(machine, INPUT_UART, c));
+}
+
+static void nrf_uart_rx_poll(machine_t *machine, void *ctx) {
+	nrf_uart_t *uart = ctx;
+	if (uart->rxd_pending < 0) {
+		uart->rxd_pending = nrf_uart_getchar(machine, true);
+	}
+	nrf_uart_update_irq(machine, uart);
+	if (uart->inten & NRF_UART_INT_RXDRDY) {
+		machine_schedule(machine, &uart->rx_poll, machine->cycles + NRF_UART_BYTE_TIME);
+	}
+}
+
+static void nrf_uart_set_inten(machine_t *machine, nrf_uart_t *uart, uint32_t inten) {
+	uart->inten = inten;
+	if (inten & NRF_UART_INT_RXDRDY) {
+		if (uart->rx_poll.index == 0) {
+			machine_schedule(machine, &uart->rx_poll, machine->cycles + NRF_UART_BYTE_TIME);
+		}
+	} else {
+		machine_unschedule(machine, &uart->rx_poll);
+	}
+	nrf_uart_update_irq(machine, uart);
+}
+
+static bool nrf_uart_rx_ready(machine_t *machine, nrf_uart_t *uart) {
+	if (uart->rxd_pending < 0) {
+		uart->rxd_pending = nrf_uart_getchar(machine, false);
+	}
+	return uart->rxd_pending >= 0;
+}
+
+static int nrf_uart_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	nrf_uart_t *uart = ctx;
+	switch (offset) {
+	case 0x108: // RXDRDY
+		*value = nrf_uart_rx_ready(machine, uart);
+		return 0;
+	case 0x11c: // TXDRDY
+		*value = uart->txdrdy;
+		return 0;
+	case 0x124: // ERROR
+	case 0x144: // RXTO
+		return 0;
+	case 0x304: // INTENSET
+	case 0x308: // INTENCLR
+		*value = uart->inten;
+		return 0;
+	case 0x518: // RXD
+		if (nrf_uart_rx_ready(machine, uart)) {
+			uart->rxd = uart->rxd_pending;
+			uart->rxd_pending = -1;
+			machine->uart_rx++;
+		}
+		*value = uart->rxd;
+		return 0;
+	default:
+		return machine_peripheral_unknown(machine, NRF_UART + offset, LOAD, 0);
+	}
+}
+
+static int nrf_uart_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	nrf_uart_t *uart = ctx;
+	switch (offset) {
+	case 0x000: // STARTRX
+	case 0x004: // STOPRX
+	case 0x008: // STARTTX
+	case 0x00c: // STOPTX
+	case 0x108: // RXDRDY
+	case 0x124: // ERROR
+	case 0x144: // RXTO
+		return 0;
+	case 0x11c: // TXDRDY
+		uart->txdrdy = value != 0;
+		return 0;
+	case 0x304: // INTENSET
+		nrf_uart_set_inten(machine, uart, uart->inten | value);
+		return 0;
+	case 0x308: // INTENCLR
+		nrf_uart_set_inten(machine, uart, uart->inten & ~value);
+		return 0;
+	case 0x51c: // TXD
+		terminal_putchar(machine->terminal, value & 0xff);
+		machine->uart_tx++;
+		uart->txdrdy = true;
+		nrf_uart_update_irq(machine, uart);
+		return 0;
+	default:
+		return machine_peripheral_unknown(machine, NRF_UART + offset, STORE, value);
+	}
+}
+
+static void nrf_uart_snapshot(machine_t *machine, void *ctx, machine_state_t *state) {
+	nrf_uart_t *uart = ctx;
+	MACHINE_STATE_FIELD(state, uart->rxd_pending);
+	MACHINE_STATE_FIELD(state, uart->rxd);
+	MACHINE_STATE_FIELD(state, uart->txdrdy);
+	MACHINE_STATE_FIELD(state, uart->inten);
+	machine_state_event(machine, state, &uart->rx_poll);
+}
+
+static const machine_peripheral_ops_t nrf_uart_ops = {nrf_uart_read, nrf_uart_write, NULL, nrf_free, nrf_uart_snapshot};
+
+// Timers, counting at 16MHz / 2^PRESCALER. Counter mode only counts COUNT
+// tasks.
+typedef struct {
+	uint32_t base;
+	bool     running;
+	uint32_t counter; // value at start
+	uint64_t start;   // cycle count when the counter had that value
+	uint32_t mode;
+	uint32_t bitmode;
+	uint32_t prescaler;
+	uint32_t shorts;
+	uint32_t inten;
+	uint32_t cc[4];
+	uint32_t events_compare[4];
+	machine_event_t compare; // next compare match
+} nrf_timer_t;
+
+static uint32_t nrf_timer_mask(nrf_timer_t *timer) {
+	static const uint32_t masks[4] = {0xffff, 0xff, 0xffffff, 0xffffffff};
+	return masks[timer->bitmode & 3];
+}
+
+static uint32_t nrf_timer_counter(nrf_timer_t *timer, uint64_t cycles) {
+	if (!timer->running || timer->mode != 0) {
+		return timer->counter;
+	}
+	return (timer->counter + ((cycles - timer->start) >> timer->prescaler)) & nrf_timer_mask(timer);
+}
+
+// Continue counting from value, which must be called before changing any of
+// the timing parameters.
+static void nrf_timer_rebase(machine_t *machine, nrf_timer_t *timer, uint32_t value) {
+	timer->counter = value & nrf_timer_mask(timer);
+	timer->start = machine->cycles;
+}
+
+// Schedule an event at the next compare match.
+static void nrf_timer_schedule(machine_t *machine, nrf_timer_t *timer) {
+	if (!timer->running || timer->mode != 0) {
+		machine_unschedule(machine, &timer->compare);
+		return;
+	}
+	uint64_t ticks = (machine->cycles - timer->start) >> timer->prescaler;
+	uint32_t now = (timer->counter + ticks) & nrf_timer_mask(timer);
+	uint64_t next = 0;
+	for (size_t i = 0; i < 4; i++) {
+		uint64_t delta = (timer->cc[i] - now) & nrf_timer_mask(timer);
+		if (delta == 0) {
+			delta = (uint64_t)nrf_timer_mask(timer) + 1; // matched already
+		}
+		if (next == 0 || delta < next) {
+			next = delta;
+		}
+	}
+	machine_schedule(machine, &timer->compare, timer->start + ((ticks + next) << timer->prescaler));
+}
+
+// Handle the counter reaching the given value at the given time.
+static void nrf_timer_match(machine_t *machine, nrf_timer_t *timer, uint32_t counter, uint64_t when) {
+	for (size_t i = 0; i < 4; i++) {
+		if (timer->cc[i] != counter) {
+			continue;
+		}
+		timer->events_compare[i] = 1;
+		if (timer->inten & (1 << (16 + i))) {
+			machine_set_irq_pending(machine, NRF_IRQ(timer->base));
+		}
+		if (timer->shorts & (1 << i)) { // COMPARE[i]_CLEAR
+			timer->counter = 0;
+			timer->start = when;
+		}
+		if (timer->shorts & (1 << (8 + i))) { // COMPARE[i]_STOP
+			timer->running = false;
+		}
+	}
+}
+
+static void nrf_timer_compare(machine_t *machine, void *ctx) {
+	nrf_timer_t *timer = ctx;
+	uint64_t when = timer->compare.when; // may be a bit in the past
+	uint32_t counter = nrf_timer_counter(timer, when);
+	timer->counter = counter;
+	timer->start = when;
+	nrf_timer_match(machine, timer, counter, when);
+	nrf_timer_schedule(machine, timer);
+}
+
+static int nrf_timer_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	nrf_timer_t *timer = ctx;
+	if (offset >= 0x140 && offset < 0x150) { // EVENTS_COMPARE[n]
+		*value = timer->events_compare[(offset - 0x140) / 4];
+		return 0;
+	}
+	if (offset >= 0x540 && offset < 0x550) { // CC[n]
+		*value = timer->cc[(offset - 0x540) / 4];
+		return 0;
+	}
+	switch (offset) {
+	case 0x200: // SHORTS
+		*value = timer->shorts;
+		return 0;
+	case 0x304: // INTENSET
+	case 0x308: // INTENCLR
+		*value = timer->inten;
+		return 0;
+	case 0x504: // MODE
+		*value = timer->mode;
+		return 0;
+	case 0x508: // BITMODE
+		*value = timer->bitmode;
+		return 0;
+	case 0x510: // PRESCALER
+		*value = timer->prescaler;
+		return 0;
+	default:
+		return machine_peripheral_unknown(machine, timer->base + offset, LOAD, 0);
+	}
+}
+
+static int nrf_timer_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	nrf_timer_t *timer = ctx;
+	uint32_t counter = nrf_timer_counter(timer, machine->cycles);
+	if (offset >= 0x040 && offset < 0x050) { // TASKS_CAPTURE[n]
+		timer->cc[(offset - 0x040) / 4] = counter;
+		nrf_timer_schedule(machine, timer);
+		return 0;
+	}
+	if (offset >= 0x140 && offset < 0x150) { // EVENTS_COMPARE[n]
+		timer->events_compare[(offset - 0x140) / 4] = value;
+		return 0;
+	}
+	if (offset >= 0x540 && offset < 0x550) { // CC[n]
+		timer->cc[(offset - 0x540) / 4] = value & nrf_timer_mask(timer);
+		nrf_timer_schedule(machine, timer);
+		return 0;
+	}
+	switch (offset) {
+	case 0x000: // TASKS_START
+		if (!timer->running) {
+			timer->running = true;
+			nrf_timer_rebase(machine, timer, counter);
+		}
+		break;
+	case 0x004: // TASKS_STOP
+	case 0x010: // TASKS_SHUTDOWN
+		timer->running = false;
+		timer->counter = counter;
+		break;
+	case 0x008: // TASKS_COUNT
+		if (timer->running && timer->mode != 0) {
+			timer->counter = (counter + 1) & nrf_timer_mask(timer);
+			nrf_timer_match(machine, timer, timer->counter, machine->cycles);
+		}
+		break;
+	case 0x00c: // TASKS_CLEAR
+		nrf_timer_rebase(machine, timer, 0);
+		break;
+	case 0x200: // SHORTS
+		timer->shorts = value;
+		break;
+	case 0x304: // INTENSET
+		timer->inten |= value;
+		break;
+	case 0x308: // INTENCLR
+		timer->inten &= ~value;
+		break;
+	case 0x504: // MODE
+		timer->mode = value & 1;
+		nrf_timer_rebase(machine, timer, counter);
+		break;
+	case 0x508: // BITMODE
+		timer->bitmode = value & 3;
+		nrf_timer_rebase(machine, timer, counter);
+		break;
+	case 0x510: // PRESCALER
+		timer->prescaler = value & 0xf;
+		if (timer->prescaler > 9) {
+			timer->prescaler = 9;
+		}
+		nrf_timer_rebase(machine, timer, counter);
+		break;
+	default:
+		return machine_peripheral_unknown(machine, timer->base + offset, STORE, value);
+	}
+	nrf_timer_schedule(machine, timer);
+	return 0;
+}
+
+static void nrf_timer_snapshot(machine_t *machine, void *ctx, machine_state_t *state) {
+	nrf_timer_t *timer = ctx;
+	MACHINE_STATE_FIELD(state, timer->running);
+	MACHINE_STATE_FIELD(state, timer->counter);
+	MACHINE_STATE_FIELD(state, timer->start);
+	MACHINE_STATE_FIELD(state, timer->mode);
+	MACHINE_STATE_FIELD(state, timer->bitmode);
+	MACHINE_STATE_FIELD(state, timer->prescaler);
+	MACHINE_STATE_FIELD(state, timer->shorts);
+	MACHINE_STATE_FIELD(state, timer->inten);
+	MACHINE_STATE_FIELD(state, timer->cc);
+	MACHINE_STATE_FIELD(state, timer->events_compare);
+	machine_state_event(machine, state, &timer->compare);
+}
+
+static const machine_peripheral_ops_t nrf_timer_ops = {nrf_timer_read, nrf_timer_write, NULL, nrf_free, nrf_timer_snapshot};
+
+// Real time counters: 24-bit counters at 32768Hz / (PRESCALER + 1).
+typedef struct {
+	uint32_t base;
+	bool     running;
+	uint32_t counter; // value at start
+	uint64_t start;   // cycle count when the counter had that value
+	uint32_t prescaler;
+	uint32_t inten;
+	uint32_t evten;
+	uint32_t cc[4];
+	uint32_t events_tick;
+	uint32_t events_ovrflw;
+	uint32_t events_compare[4];
+	uint32_t next;         // number of ticks after start of the next event
+	machine_event_t event; // next tick, overflow or compare match
+} nrf_rtc_t;
+
+#define NRF_RTC_MASK (0xffffff)
+
+// The cycle count (relative to start) at which the counter has advanced the
+// given number of ticks.
+static uint64_t nrf_rtc_cycles(nrf_rtc_t *rtc, uint64_t ticks) {
+	uint64_t per_tick = (uint64_t)NRF_CPU_HZ * (rtc->prescaler + 1);
+	return (ticks * per_tick + 32767) / 32768;
+}
+
+static uint32_t nrf_rtc_counter(nrf_rtc_t *rtc, uint64_t cycles) {
+	if (!rtc->running) {
+		return rtc->counter;
+	}
+	uint64_t per_tick = (uint64_t)NRF_CPU_HZ * (rtc->prescaler + 1);
+	return (rtc->counter + (cycles - rtc->start) * 32768 / per_tick) & NRF_RTC_MASK;
+}
+
+static void nrf_rtc_rebase(machine_t *machine, nrf_rtc_t *rtc, uint32_t value) {
+	rtc->counter = value & NRF_RTC_MASK;
+	rtc->start = machine->cycles;
+}
+
+// Schedule an event for the next tick that changes an event register.
+static void nrf_rtc_schedule(machine_t *machine, nrf_rtc_t *rtc) {
+	if (!rtc->running) {
+		machine_unschedule(machine, &rtc->event);
+		return;
+	}
+	uint64_t per_tick = (uint64_t)NRF_CPU_HZ * (rtc->prescaler + 1);
+	uint32_t ticks = (machine->cycles - rtc->start) * 32768 / per_tick;
+	uint32_t now = (rtc->counter + ticks) & NRF_RTC_MASK;
+	uint32_t next = NRF_RTC_MASK + 1 - now; // overflow
+	if ((rtc->inten | rtc->evten) & 1) {
+		next = 1; // every tick
+	}
+	for (size_t i = 0; i < 4; i++) {
+		uint32_t delta = (rtc->cc[i] - now) & NRF_RTC_MASK;
+		if (delta != 0 && delta < next) {
+			next = delta;
+		}
+	}
+	rtc->next = ticks + next;
+	machine_schedule(machine, &rtc->event, rtc->start + nrf_rtc_cycles(rtc, rtc->next));
+}
+
+static void nrf_rtc_event(machine_t *machine, void *ctx) {
+	nrf_rtc_t *rtc = ctx;
+	rtc->counter = (rtc->counter + rtc->next) & NRF_RTC_MASK;
+	rtc->start = rtc->event.when;
+	uint32_t events = 0; // same bits as INTEN
+	if ((rtc->inten | rtc->evten) & 1) {
+		rtc->events_tick = 1;
+		events |= 1 << 0;
+	}
+	if (rtc->counter == 0) {
+		rtc->events_ovrflw = 1;
+		events |= 1 << 1;
+	}
+	for (size_t i = 0; i < 4; i++) {
+		if (rtc->cc[i] == rtc->counter) {
+			rtc->events_compare[i] = 1;
+			events |= 1 << (16 + i);
+		}
+	}
+	if (events & rtc->inten) {
+		machine_set_irq_pending(machine, NRF_IRQ(rtc->base));
+	}
+	nrf_rtc_schedule(machine, rtc);
+}
+
+static int nrf_rtc_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	nrf_rtc_t *rtc = ctx;
+	if (offset >= 0x140 && offset < 0x150) { // EVENTS_COMPARE[n]
+		*value = rtc->events_compare[(offset - 0x140) / 4];
+		return 0;
+	}
+	if (offset >= 0x540 && offset < 0x550) { // CC[n]
+		*value = rtc->cc[(offset - 0x540) / 4];
+		return 0;
+	}
+	switch (offset) {
+	case 0x100: // EVENTS_TICK
+		*value = rtc->events_tick;
+		return 0;
+	case 0x104: // EVENTS_OVRFLW
+		*value = rtc->events_ovrflw;
+		return 0;
+	case 0x304: // INTENSET
+	case 0x308: // INTENCLR
+		*value = rtc->inten;
+		return 0;
+	case 0x340: // EVTEN
+	case 0x344: // EVTENSET
+	case 0x348: // EVTENCLR
+		*value = rtc->evten;
+		return 0;
+	case 0x504: // COUNTER
+		*value = nrf_rtc_counter(rtc, machine->cycles);
+		return 0;
+	case 0x508: // PRESCALER
+		*value = rtc->prescaler;
+		return 0;
+	default:
+		return machine_peripheral_unknown(machine, rtc->base + offset, LOAD, 0);
+	}
+}
+
+static int nrf_rtc_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	nrf_rtc_t *rtc = ctx;
+	uint32_t counter = nrf_rtc_counter(rtc, machine->cycles);
+	if (offset >= 0x140 && offset < 0x150) { // EVENTS_COMPARE[n]
+		rtc->events_compare[(offset - 0x140) / 4] = value;
+		return 0;
+	}
+	if (offset >= 0x540 && offset < 0x550) { // CC[n]
+		rtc->cc[(offset - 0x540) / 4] = value & NRF_RTC_MASK;
+		nrf_rtc_schedule(machine, rtc);
+		return 0;
+	}
+	switch (offset) {
+	case 0x000: // TASKS_START
+		if (!rtc->running) {
+			rtc->running = true;
+			nrf_rtc_rebase(machine, rtc, counter);
+		}
+		break;
+	case 0x004: // TASKS_STOP
+		rtc->running = false;
+		rtc->counter = counter;
+		break;
+	case 0x008: // TASKS_CLEAR
+		nrf_rtc_rebase(machine, rtc, 0);
+		break;
+	case 0x00c: // TASKS_TRIGOVRFLW
+		nrf_rtc_rebase(machine, rtc, 0xfffff0);
+		break;
+	case 0x100: // EVENTS_TICK
+		rtc->events_tick = value;
+		return 0;
+	case 0x104: // EVENTS_OVRFLW
+		rtc->events_ovrflw = value;
+		return 0;
+	case 0x304: // INTENSET
+		rtc->inten |= value;
+		break;
+	case 0x308: // INTENCLR
+		rtc->inten &= ~value;
+		break;
+	case 0x340: // EVTEN
+		rtc->evten = value;
+		break;
+	case 0x344: // EVTENSET
+		rtc->evten |= value;
+		break;
+	case 0x348: // EVTENCLR
+		rtc->evten &= ~value;
+		break;
+	case 0x508: // PRESCALER
+		rtc->prescaler = value & 0xfff;
+		nrf_rtc_rebase(machine, rtc, counter);
+		break;
+	default:
+		return machine_peripheral_unknown(machine, rtc->base + offset, STORE, value);
+	}
+	nrf_rtc_schedule(machine, rtc);
+	return 0;
+}
+
+static void nrf_rtc_snapshot(machine_t *machine, void *ctx, machine_state_t *state) {
+	nrf_rtc_t *rtc = ctx;
+	MACHINE_STATE_FIELD(state, rtc->running);
+	MACHINE_STATE_FIELD(state, rtc->counter);
+	MACHINE_STATE_FIELD(state, rtc->start);
+	MACHINE_STATE_FIELD(state, rtc->prescaler);
+	MACHINE_STATE_FIELD(state, rtc->inten);
+	MACHINE_STATE_FIELD(state, rtc->evten);
+	MACHINE_STATE_FIELD(state, rtc->cc);
+	MACHINE_STATE_FIELD(state, rtc->events_tick);
+	MACHINE_STATE_FIELD(state, rtc->events_ovrflw);
+	MACHINE_STATE_FIELD(state, rtc->events_compare);
+	MACHINE_STATE_FIELD(state, rtc->next);
+	machine_state_event(machine, state, &rtc->event);
+}
+
+static const machine_peripheral_ops_t nrf_rtc_ops = {nrf_rtc_read, nrf_rtc_write, NULL, nrf_free, nrf_rtc_snapshot};
+
+// Random number generator, always ready. Every device has its own xorshift
+// generator (with the same seed), so that runs are repeatable and machines in
+// other threads don't change the numbers.
+typedef struct {
+	uint32_t state;
+} nrf_rng_t;
+
+#define NRF_RNG_SEED (2463534242)
+
+static int nrf_rng_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	nrf_rng_t *rng = ctx;
+	if (offset == 0x100) { // VALRDY
+		*value = 1;
+	} else if (offset == 0x508) { // VALUE
+		int random = -1;
+		if (!machine->input_replay) {
+			rng->state ^= rng->state << 13;
+			rng->state ^= rng->state >> 17;
+			rng->state ^= rng->state << 5;
+			random = rng->state >> 24;
+		}
+		*value = machine_input(machine, INPUT_RNG, random) & 0xff;
+	} else {
+		return machine_peripheral_unknown(machine, NRF_RNG + offset, LOAD, 0);
+	}
+	return 0;
+}
+
+static int nrf_rng_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	return machine_peripheral_unknown(machine, NRF_RNG + offset, STORE, value);
+}
+
+static void nrf_rng_snapshot(machine_t *machine, void *ctx, machine_state_t *state) {
+	nrf_rng_t *rng = ctx;
+	MACHINE_STATE_FIELD(state, rng->state);
+}
+
+static const machine_peripheral_ops_t nrf_rng_ops = {nrf_rng_read, nrf_rng_write, NULL, nrf_free, nrf_rng_snapshot};
+
+// Non-volatile memory controller: enables writes to flash and erases pages.
+static int nrf_nvmc_read(machine_t *machine, void *ctx, uint32_t offset, uint32_t *value, width_t width) {
+	if (offset == 0x400) { // READY
+		*value = 1; // always ready
+		return 0;
+	}
+	return machine_peripheral_unknown(machine, NRF_NVMC + offset, LOAD, 0);
+}
+
+static int nrf_nvmc_write(machine_t *machine, void *ctx, uint32_t offset, uint32_t value, width_t width) {
+	if (offset == 0x504) { // CONFIG
+		machine->image_writable = value != 0;
+	} else if (offset == 0x508) { // ERASEPAGE
+		if ((value & (machine->pagesize-1)) != 0 || value >= machine->image_size) {
+			machine_log(machine, LOG_ERROR, "ERROR: invalid page address: %x (PC: %x)\n", value, machine->pc - 3);
+			return ERR_MEM;
+		}
+		if (!machine_flash_erase(machine, value, machine->pagesize)) {
+			return ERR_MEM;
+		}
+	} else {
+		return machine_peripheral_unknown(machine, NRF_NVMC + offset, STORE, value);
+	}
+	return 0;
+}
+
+static const machine_peripheral_ops_t nrf_nvmc_ops = {nrf_nvmc_read, nrf_nvmc_write, NULL, NULL};
+
+bool nrf_add_peripherals(machine_t *machine) {
+	nrf_uicr_t *uicr = calloc(1, sizeof(nrf_uicr_t));
+	if (uicr == NULL) {
+		return false;
+	}
+	if (!machine_add_peripheral(machine, NRF_UICR, 0x1000, &nrf_uicr_ops, uicr)) {
+		free(uicr);
+		return false;
+	}
+	nrf_uart_t *uart = calloc(1, sizeof(nrf_uart_t));
+	if (uart == NULL) {
+		return false;
+	}
+	uart->rxd_pending = -1;
+	uart->txdrdy = true; // for firmware that waits before the first write
+	uart->rx_poll.fn = nrf_uart_rx_poll;
+	uart->rx_poll.ctx = uart;
+	if (!machine_add_peripheral(machine, NRF_UART, 0x1000, &nrf_uart_ops, uart)) {
+		free(uart);
+		return false;
+	}
+	static const uint32_t timers[] = {NRF_TIMER0, NRF_TIMER1, NRF_TIMER2};
+	for (size_t i = 0; i < sizeof(timers) / sizeof(timers[0]); i++) {
+		nrf_timer_t *timer = calloc(1, sizeof(nrf_timer_t));
+		if (timer == NULL) {
+			return false;
+		}
+		timer->base = timers[i];
+		timer->compare.fn = nrf_timer_compare;
+		timer->compare.ctx = timer;
+		if (!machine_add_peripheral(machine, timers[i], 0x1000, &nrf_timer_ops, timer)) {
+			free(timer);
+			return false;
+		}
+	}
+	static const uint32_t rtcs[] = {NRF_RTC0, NRF_RTC1};
+	for (size_t i = 0; i < sizeof(rtcs) / sizeof(rtcs[0]); i++) {
+		nrf_rtc_t *rtc = calloc(1, sizeof(nrf_rtc_t));
+		if (rtc == NULL) {
+			return false;
+		}
+		rtc->base = rtcs[i];
+		rtc->event.fn = nrf_rtc_event;
+		rtc->event.ctx = rtc;
+		if (!machine_add_peripheral(machine, rtcs[i], 0x1000, &nrf_rtc_ops, rtc)) {
+			free(rtc);
+			return false;
+		}
+	}
+	nrf_rng_t *rng = calloc(1, sizeof(nrf_rng_t));
+	if (rng == NULL) {
+		return false;
+	}
+	rng->state = NRF_RNG_SEED;
+	if (!machine_add_peripheral(machine, NRF_RNG, 0x1000, &nrf_rng_ops, rng)) {
+		free(rng);
+		return false;
+	}
+	return machine_add_peripheral(machine, NRF_FICR, 0x1000, &nrf_ficr_ops, NULL) &&
+		machine_add_peripheral(machine, NRF_NVMC, 0x1000, &nrf_nvmc_ops, NULL);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "machine.h"
+
+bool nrf_add_peripherals(machine_t *machine);
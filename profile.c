@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+
+// This file implements a sampling profiler. Every interval cycles it records
+// the PC and the call stack (as tracked by machine_add_backtrace), and counts
+// how often each distinct stack was seen. It uses the event scheduler, so it
+// costs nothing between samples.
+
+typedef struct {
+	uint64_t count; // 0 for an empty slot
+	uint32_t hash;
+	uint32_t depth;
+	uint32_t *stack;
+} profile_entry_t;
+
+struct profile {
+	machine_t *machine;
+	machine_event_t event;
+	uint64_t interval;
+	profile_entry_t *entries; // hash table with open addressing
+	size_t capacity;          // always a power of two
+	size_t used;
+	uint32_t stack[MACHINE_BACKTRACE_LEN + 1];
+};
+
+static uint32_t profile_hash(const uint32_t *stack, size_t depth) {
+	uint32_t hash = 2166136261u; // FNV-1a
+	for (size_t i = 0; i < depth; i++) {
+		hash = (hash ^ stack[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Double the size of the hash table. Returns false when out of memory.
+static bool profile_grow(profile_t *profile) {
+	size_t capacity = profile->capacity * 2;
+	profile_entry_t *entries = calloc(capacity, sizeof(profile_entry_t));
+	if (entries == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i < profile->capacity; i++) {
+		profile_entry_t *entry = &profile->entries[i];
+		if (entry->count == 0) {
+			continue;
+		}
+		size_t slot = entry->hash & (capacity - 1);
+		while (entries[slot].count != 0) {
+			slot = (slot + 1) & (capacity - 1);
+		}
+		entries[slot] = *entry;
+	}
+	free(profile->entries);
+	profile->entries = entries;
+	profile->capacity = capacity;
+	return true;
+}
+
+static void profile_add(profile_t *profile, const uint32_t *stack, size_t depth) {
+	if (profile->used * 2 >= profile->capacity && !profile_grow(profile)) {
+		return; // drop the sample
+	}
+	uint32_t hash = profile_hash(stack, depth);
+	size_t slot = hash & (profile->capacity - 1);
+	while (profile->entries[slot].count != 0) {
+		profile_entry_t *entry = &profile->entries[slot];
+		if (entry->hash == hash && entry->depth == depth && memcmp(entry->stack, stack, depth * sizeof(uint32_t)) == 0) {
+			entry->count++;
+			return;
+		}
+		slot = (slot + 1) & (profile->capacity - 1);
+	}
+	uint32_t *copy = malloc(depth * sizeof(uint32_t));
+	if (copy == NULL) {
+		return;
+	}
+	memcpy(copy, stack, depth * sizeof(uint32_t));
+	profile->entries[slot] = (profile_entry_t){1, hash, depth, copy};
+	profile->used++;
+}
+
+static void profile_sample(machine_t *machine, void *ctx) {
+	profile_t *profile = ctx;
+	size_t depth = 0;
+	// The last call is at backtrace[call_depth].
+	int last = machine->call_depth < MACHINE_BACKTRACE_LEN ? machine->call_depth : MACHINE_BACKTRACE_LEN - 1;
+	for (int i = 0; i <= last; i++) {
+		// Leave out calls that have returned since (their stack is gone),
+		// and unused entries.
+		if (machine->backtrace[i].sp >= machine->sp) {
+			profile->stack[depth++] = machine->backtrace[i].pc;
+		}
+	}
+	profile->stack[depth++] = machine->pc - 1;
+	profile_add(profile, profile->stack, depth);
+	machine_schedule(machine, &profile->event, machine->cycles + profile->interval);
+}
+
+// Start sampling the call stack every interval cycles. Note that restoring
+// a snapshot stops the profiler, so start it afterwards. Returns NULL when out
+// of memory.
+profile_t * profile_start(machine_t *machine, uint64_t interval) {
+	profile_t *profile = calloc(1, sizeof(profile_t));
+	if (profile == NULL) {
+		return NULL;
+	}
+	profile->machine = machine;
+	profile->interval = interval > 0 ? interval : 1;
+	profile->capacity = 256;
+	profile->entries = calloc(profile->capacity, sizeof(profile_entry_t));
+	profile->event = (machine_event_t){0, profile_sample, profile, 0, true}; // idle, samples a sleeping CPU too
+	if (profile->entries == NULL || !machine_schedule(machine, &profile->event, machine->cycles + profile->interval)) {
+		free(profile->entries);
+		free(profile);
+		return NULL;
+	}
+	return profile;
+}
+
+// Iterate over all sampled stacks, starting with *iter set to 0. Returns
+// false after the last one.
+bool profile_next(profile_t *profile, size_t *iter, profile_sample_t *sample) {
+	for (; *iter < profile->capacity; (*iter)++) {
+		const profile_entry_t *entry = &profile->entries[*iter];
+		if (entry->count != 0) {
+			(*iter)++;
+			*sample = (profile_sample_t){entry->count, entry->depth, entry->stack};
+			return true;
+		}
+	}
+	return false;
+}
+
+// Write all samples in the folded stack format used by flame graph tools.
+// Addresses outside of the known functions (see machine_set_symbols) are
+// written in hexadecimal.
+void profile_write_folded(profile_t *profile, FILE *fp) {
+	size_t iter = 0;
+	profile_sample_t sample;
+	while (profile_next(profile, &iter, &sample)) {
+		for (size_t i = 0; i < sample.depth; i++) {
+			const char *name = machine_symbolize(profile->machine, sample.stack[i], NULL);
+			if (name != NULL) {
+				fprintf(fp, "%s%s", i == 0 ? "" : ";", name);
+			} else {
+				fprintf(fp, "%s0x%x", i == 0 ? "" : ";", sample.stack[i]);
+			}
+		}
+		fprintf(fp, " %llu\n", (unsigned long long)sample.count);
+	}
+}
+
+// Stop the profiler and free all samples.
+void profile_free(profile_t *profile) {
+	machine_unschedule(profile->machine, &profile->event);
+	for (size_t i = 0; i < profile->capacity; i++) {
+		free(profile->entries[i].stack);
+	}
+	free(profile->entries);
+	free(profile);
+}
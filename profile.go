@@ -0,0 +1,106 @@
+package main
+
+// This file writes the profiles of the sampling profiler in profile.c.
+
+import (
+	"bufio"
+	"debug/elf"
+	"fmt"
+	"os"
+	"sort"
+	"strings"
+	"unsafe"
+)
+
+// #include "profile.h"
+import "C"
+
+// A function in the firmware, from the symbol table of its ELF file.
+type symbol struct {
+	name  string
+	start uint32
+	end   uint32
+}
+
+// Read all function symbols from an ELF file, sorted by address.
+func readSymbols(path string) ([]symbol, error) {
+	f, err := elf.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	elfSymbols, err := f.Symbols()
+	if err != nil {
+		return nil, err
+	}
+	var symbols []symbol
+	for _, s := range elfSymbols {
+		if elf.ST_TYPE(s.Info) != elf.STT_FUNC {
+			continue
+		}
+		start := uint32(s.Value) &^ 1 // clear the Thumb bit
+		symbols = append(symbols, symbol{s.Name, start, start + uint32(s.Size)})
+	}
+	sort.Slice(symbols, func(i, j int) bool {
+		return symbols[i].start < symbols[j].start
+	})
+	return symbols, nil
+}
+
+// Return the name of the function at the given address, or the address itself
+// if it isn't known.
+func symbolize(symbols []symbol, address uint32) string {
+	i := sort.Search(len(symbols), func(i int) bool {
+		return symbols[i].start > address
+	}) - 1
+	if i >= 0 && (address < symbols[i].end || symbols[i].start == symbols[i].end) {
+		return symbols[i].name
+	}
+	return fmt.Sprintf("0x%x", address)
+}
+
+// Write the profile in the folded stack format of flame graph tools, and print
+// the functions where the most samples were taken.
+func writeProfile(profile *C.profile_t, path string, symbols []symbol) error {
+	f, err := os.Create(path)
+	if err != nil {
+		return err
+	}
+	defer f.Close()
+	w := bufio.NewWriter(f)
+
+	self := make(map[string]uint64)
+	total := uint64(0)
+	var iter C.size_t
+	var sample C.profile_sample_t
+	for C.profile_next(profile, &iter, &sample) {
+		stack := unsafe.Slice((*uint32)(unsafe.Pointer(sample.stack)), int(sample.depth))
+		names := make([]string, len(stack))
+		for i, address := range stack {
+			names[i] = symbolize(symbols, address)
+		}
+		count := uint64(sample.count)
+		fmt.Fprintf(w, "%s %d\n", strings.Join(names, ";"), count)
+		self[names[len(names)-1]] += count
+		total += count
+	}
+	if err := w.Flush(); err != nil {
+		return err
+	}
+
+	functions := make([]string, 0, len(self))
+	for name := range self {
+		functions = append(functions, name)
+	}
+	sort.Slice(functions, func(i, j int) bool {
+		return self[functions[i]] > self[functions[j]]
+	})
+	if len(functions) > 10 {
+		functions = functions[:10]
+	}
+	fmt.Fprintf(os.Stderr, "profile: %d samples\n", total)
+	for _, name := range functions {
+		fmt.Fprintf(os.Stderr, "%6.2f%% %8d  %s\n", float64(self[name])*100/float64(total), self[name], name)
+	}
+	return nil
+}
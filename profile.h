@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "machine.h"
+
+// A sampling profiler, see profile.c.
+typedef struct profile profile_t;
+
+// One distinct call stack and how often it was sampled.
+typedef struct {
+	uint64_t count;
+	size_t depth;
+	const uint32_t *stack; // call sites, outermost first, then the sampled PC
+} profile_sample_t;
+
+profile_t * profile_start(machine_t *machine, uint64_t interval);
+bool profile_next(profile_t *profile, size_t *iter, profile_sample_t *sample);
+void profile_write_folded(profile_t *profile, FILE *fp);
+void profile_free(profile_t *profile);
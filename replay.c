@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200809L // for putc_unlocked
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+#include "terminal.h"
+
+// This file records the external inputs of a machine (see machine_input_t) to
+// a file, and feeds them back in a later run of the same firmware, which then
+// runs the same way. Inputs are numbered in the order in which the firmware
+// reads them (machine->inputs, which is kept in snapshots). Only inputs with a
+// value are stored, not UART polls that found nothing. Each record is the
+// difference of its number and its instruction count with the previous
+// record, the source and the value, as variable length integers.
+
+#define REPLAY_MAGIC "EMCINPUT"
+
+typedef struct {
+	uint64_t index;        // number of inputs before this one
+	uint64_t instructions; // at the start of the basic block that read it
+	uint32_t source;
+	int32_t value;
+} replay_record_t;
+
+struct replay {
+	machine_t *machine;
+	FILE *fp;
+	replay_record_t last; // previous record, for the differences
+	replay_record_t next; // next record to replay
+	bool warned;          // about a different instruction count
+	bool stopped;         // halted the machine, see replay_stopped()
+	bool error;
+};
+
+static void replay_write_varint(FILE *fp, uint64_t value) {
+	while (value >= 0x80) {
+		putc_unlocked((value & 0x7f) | 0x80, fp);
+		value >>= 7;
+	}
+	putc_unlocked(value, fp);
+}
+
+static bool replay_read_varint(FILE *fp, uint64_t *value) {
+	*value = 0;
+	for (int shift = 0; shift < 70; shift += 7) {
+		int c = getc(fp);
+		if (c == EOF) {
+			return false;
+		}
+		*value |= (uint64_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int replay_record_input(machine_t *machine, void *ctx, machine_input_t source, int value) {
+	replay_t *replay = ctx;
+	if (source == INPUT_UART && value == -1) {
+		return value; // replayed as the default
+	}
+	replay_record_t record = {machine->inputs, machine->instructions, source, value};
+	replay_write_varint(replay->fp, record.index - replay->last.index);
+	replay_write_varint(replay->fp, record.instructions - replay->last.instructions);
+	replay_write_varint(replay->fp, record.source);
+	replay_write_varint(replay->fp, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+	replay->last = record;
+	return value;
+}
+
+// Read the next record into replay->next. Returns false at the end of the
+// file.
+static bool replay_read(replay_t *replay) {
+	uint64_t index, instructions, source, zigzag;
+	if (!replay_read_varint(replay->fp, &index)) {
+		return false; // the normal end
+	}
+	if (!replay_read_varint(replay->fp, &instructions) ||
+		!replay_read_varint(replay->fp, &source) ||
+		!replay_read_varint(replay->fp, &zigzag) ||
+		source > INPUT_RNG) {
+		fprintf(stderr, "replay: truncated or invalid recording\n");
+		replay->error = true;
+		return false;
+	}
+	replay->next.index = replay->last.index + index;
+	replay->next.instructions = replay->last.instructions + instructions;
+	replay->next.source = source;
+	replay->next.value = (zigzag >> 1) ^ -(zigzag & 1);
+	replay->last = replay->next;
+	return true;
+}
+
+// Continue with the inputs of the host.
+static void replay_end(replay_t *replay) {
+	machine_set_input(replay->machine, NULL, NULL, false);
+}
+
+static int replay_input(machine_t *machine, void *ctx, machine_input_t source, int value) {
+	replay_t *replay = ctx;
+	if (replay->next.index != machine->inputs || replay->next.source != source) {
+		if (source == INPUT_UART && replay->next.index > machine->inputs) {
+			return -1; // nothing was received here
+		}
+		fprintf(stderr, "replay: the run diverged from the recording at input %llu (instruction %llu)\n",
+			(unsigned long long)machine->inputs, (unsigned long long)machine->instructions);
+		replay->stopped = true;
+		replay->error = true;
+		replay_end(replay);
+		machine_halt(machine);
+		return -1;
+	}
+	if (replay->next.instructions != machine->instructions && !replay->warned) {
+		fprintf(stderr, "replay: input %llu was recorded at instruction %llu, replayed at %llu (another engine?)\n",
+			(unsigned long long)machine->inputs, (unsigned long long)replay->next.instructions, (unsigned long long)machine->instructions);
+		replay->warned = true;
+	}
+	value = replay->next.value;
+	if (value == TERMINAL_EXIT) {
+		replay->stopped = true;
+	}
+	if (!replay_read(replay)) {
+		replay_end(replay);
+	}
+	return value;
+}
+
+// Write all external inputs of the machine from now on to the given file.
+// Returns NULL when out of memory.
+replay_t * replay_record(machine_t *machine, FILE *fp) {
+	replay_t *replay = calloc(1, sizeof(replay_t));
+	if (replay == NULL) {
+		return NULL;
+	}
+	replay->machine = machine;
+	replay->fp = fp;
+	fwrite(REPLAY_MAGIC, 1, strlen(REPLAY_MAGIC), fp);
+	machine_set_input(machine, replay_record_input, replay, false);
+	return replay;
+}
+
+// Feed the inputs recorded in the given file to the machine instead of those of
+// the host, from the current input on (for example after restoring a snapshot
+// that was saved while recording). After the last one, the machine gets the
+// inputs of the host again. Returns NULL when it isn't a recording.
+replay_t * replay_start(machine_t *machine, FILE *fp) {
+	char magic[sizeof(REPLAY_MAGIC) - 1];
+	if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, REPLAY_MAGIC, sizeof(magic)) != 0) {
+		return NULL;
+	}
+	replay_t *replay = calloc(1, sizeof(replay_t));
+	if (replay == NULL) {
+		return NULL;
+	}
+	replay->machine = machine;
+	replay->fp = fp;
+	bool more;
+	while ((more = replay_read(replay)) && replay->next.index < machine->inputs) {
+		// Read before the snapshot.
+	}
+	if (more) {
+		machine_set_input(machine, replay_input, replay, true);
+	}
+	return replay;
+}
+
+// Whether the replay halted the machine, because the recording ends with a
+// Ctrl-X from the terminal or because the run diverged from it.
+bool replay_stopped(replay_t *replay) {
+	return replay->stopped;
+}
+
+// Stop recording or replaying. Returns false when the recording couldn't be
+// written, or the replay went wrong.
+bool replay_stop(replay_t *replay) {
+	if (replay->machine->input_ctx == replay) {
+		machine_set_input(replay->machine, NULL, NULL, false);
+	}
+	bool ok = !replay->error && fflush(replay->fp) == 0 && !ferror(replay->fp);
+	free(replay);
+	return ok;
+}
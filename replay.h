@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "machine.h"
+
+// Records the external inputs of a machine to a file, or replays them from
+// one, see replay.c.
+typedef struct replay replay_t;
+
+replay_t * replay_record(machine_t *machine, FILE *fp);
+replay_t * replay_start(machine_t *machine, FILE *fp);
+bool replay_stopped(replay_t *replay);
+bool replay_stop(replay_t *replay);
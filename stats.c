@@ -0,0 +1,155 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "stats.h"
+
+// This file publishes runtime statistics of a machine for other threads, like
+// the metrics endpoint of the Go CLI. Every interval cycles an event copies the
+// counters of the machine into atomic variables and samples the PC, like the
+// profiler in profile.c. Readers only load those variables, so they don't have
+// to halt the machine, and the machine costs nothing between events. The
+// values are up to interval cycles old.
+
+#define STATS_PERIPHERALS (16)   // at most this many peripherals are counted
+#define STATS_PCS         (1024) // sampled PCs, always a power of two
+
+typedef struct {
+	_Atomic uint32_t pc;
+	_Atomic uint64_t samples; // 0 for an empty slot
+} stats_pc_t;
+
+struct stats {
+	machine_t *machine;
+	machine_event_t event;
+	uint64_t interval;
+	_Atomic uint64_t instructions;
+	_Atomic uint64_t cycles;
+	_Atomic uint64_t uart_rx;
+	_Atomic uint64_t uart_tx;
+	_Atomic int call_depth;
+	_Atomic size_t peripherals_len;
+	_Atomic uint32_t peripheral_bases[STATS_PERIPHERALS];
+	_Atomic uint64_t peripheral_accesses[STATS_PERIPHERALS];
+	stats_pc_t pcs[STATS_PCS]; // hash table with open addressing
+};
+
+// Only the machine thread writes, so relaxed stores are enough for the
+// counters. The PC of a new slot is stored before its first sample is
+// released.
+#define stats_store(var, value) atomic_store_explicit(&(var), (value), memory_order_relaxed)
+#define stats_load(var)         atomic_load_explicit(&(var), memory_order_relaxed)
+
+static void stats_add_pc(stats_t *stats, uint32_t pc) {
+	size_t slot = (pc * 0x9e3779b1u) >> 22; // 10 bits for STATS_PCS
+	for (size_t i = 0; i < STATS_PCS; i++, slot = (slot + 1) & (STATS_PCS - 1)) {
+		stats_pc_t *entry = &stats->pcs[slot];
+		uint64_t samples = stats_load(entry->samples);
+		if (samples == 0) {
+			stats_store(entry->pc, pc);
+			atomic_store_explicit(&entry->samples, 1, memory_order_release);
+			return;
+		}
+		if (stats_load(entry->pc) == pc) {
+			stats_store(entry->samples, samples + 1);
+			return;
+		}
+	}
+	// The table is full, drop the sample.
+}
+
+static void stats_update(machine_t *machine, void *ctx) {
+	stats_t *stats = ctx;
+	machine_counters_t counters;
+	machine_get_counters(machine, &counters);
+	stats_store(stats->instructions, counters.instructions);
+	stats_store(stats->cycles, counters.cycles);
+	stats_store(stats->uart_rx, counters.uart_rx);
+	stats_store(stats->uart_tx, counters.uart_tx);
+	stats_store(stats->call_depth, machine->call_depth);
+
+	uint32_t bases[STATS_PERIPHERALS];
+	uint64_t accesses[STATS_PERIPHERALS];
+	size_t len = machine_get_peripheral_accesses(machine, bases, accesses, STATS_PERIPHERALS);
+	if (len > STATS_PERIPHERALS) {
+		len = STATS_PERIPHERALS;
+	}
+	for (size_t i = 0; i < len; i++) {
+		stats_store(stats->peripheral_bases[i], bases[i]);
+		stats_store(stats->peripheral_accesses[i], accesses[i]);
+	}
+	atomic_store_explicit(&stats->peripherals_len, len, memory_order_release);
+
+	stats_add_pc(stats, machine->pc - 1);
+	machine_schedule(machine, &stats->event, machine->cycles + stats->interval);
+}
+
+// Start publishing statistics every interval cycles. Like the profiler, this
+// has to be started after restoring a snapshot. Returns NULL when out of
+// memory.
+stats_t * stats_start(machine_t *machine, uint64_t interval) {
+	stats_t *stats = calloc(1, sizeof(stats_t));
+	if (stats == NULL) {
+		return NULL;
+	}
+	stats->machine = machine;
+	stats->interval = interval > 0 ? interval : 1;
+	stats->event = (machine_event_t){0, stats_update, stats, 0, true};
+	if (!machine_schedule(machine, &stats->event, machine->cycles + stats->interval)) {
+		free(stats);
+		return NULL;
+	}
+	return stats;
+}
+
+// Read the last published counters. This may be called from any thread.
+void stats_read(stats_t *stats, stats_counters_t *counters) {
+	counters->instructions = stats_load(stats->instructions);
+	counters->cycles = stats_load(stats->cycles);
+	counters->uart_rx = stats_load(stats->uart_rx);
+	counters->uart_tx = stats_load(stats->uart_tx);
+	counters->call_depth = stats_load(stats->call_depth);
+}
+
+// Read the number of accesses to each peripheral, see
+// machine_get_peripheral_accesses. Returns the number of peripherals written,
+// at most num. This may be called from any thread.
+size_t stats_peripherals(stats_t *stats, uint32_t *bases, uint64_t *accesses, size_t num) {
+	size_t len = atomic_load_explicit(&stats->peripherals_len, memory_order_acquire);
+	if (len > num) {
+		len = num;
+	}
+	for (size_t i = 0; i < len; i++) {
+		bases[i] = stats_load(stats->peripheral_bases[i]);
+		accesses[i] = stats_load(stats->peripheral_accesses[i]);
+	}
+	return len;
+}
+
+// Get the num PCs with the most samples, most samples first. Returns the number
+// of PCs written. This may be called from any thread.
+size_t stats_hot_pcs(stats_t *stats, uint32_t *pcs, uint64_t *samples, size_t num) {
+	size_t len = 0;
+	for (size_t slot = 0; slot < STATS_PCS && num != 0; slot++) {
+		const stats_pc_t *entry = &stats->pcs[slot];
+		uint64_t count = atomic_load_explicit(&entry->samples, memory_order_acquire);
+		if (count == 0 || (len == num && count <= samples[len - 1])) {
+			continue;
+		}
+		// Insertion sort into the result.
+		size_t i = len < num ? len++ : len - 1;
+		for (; i > 0 && samples[i - 1] < count; i--) {
+			pcs[i] = pcs[i - 1];
+			samples[i] = samples[i - 1];
+		}
+		pcs[i] = stats_load(entry->pc);
+		samples[i] = count;
+	}
+	return len;
+}
+
+// Stop publishing statistics. Call this from the machine thread, while the
+// machine doesn't run.
+void stats_free(stats_t *stats) {
+	machine_unschedule(stats->machine, &stats->event);
+	free(stats);
+}
@@ -0,0 +1,102 @@
+package main
+
+// This file serves the runtime statistics of stats.c over HTTP, in the text
+// format of Prometheus. The statistics are read without halting the machine.
+
+import (
+	"fmt"
+	"net/http"
+	"sync"
+	"time"
+)
+
+// #include "stats.h"
+import "C"
+
+const statsMaxPeripherals = 16 // STATS_PERIPHERALS in stats.c
+
+type statsServer struct {
+	stats   *C.stats_t
+	symbols []symbol
+	top     int
+
+	lock         sync.Mutex
+	mips         float64
+	lastTime     time.Time
+	instructions uint64
+}
+
+// Serve the statistics on addr until an error occurs. The MIPS gauge is
+// updated every second.
+func serveStats(stats *C.stats_t, addr string, top int, symbols []symbol) error {
+	s := &statsServer{stats: stats, symbols: symbols, top: top, lastTime: time.Now()}
+	go func() {
+		for range time.Tick(time.Second) {
+			s.updateMIPS()
+		}
+	}()
+	mux := http.NewServeMux()
+	mux.HandleFunc("/metrics", s.serveMetrics)
+	return http.ListenAndServe(addr, mux)
+}
+
+func (s *statsServer) updateMIPS() {
+	var counters C.stats_counters_t
+	C.stats_read(s.stats, &counters)
+	now := time.Now()
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	instructions := uint64(counters.instructions)
+	if elapsed := now.Sub(s.lastTime).Seconds(); elapsed > 0 {
+		s.mips = float64(instructions-s.instructions) / elapsed / 1e6
+	}
+	s.lastTime = now
+	s.instructions = instructions
+}
+
+func (s *statsServer) serveMetrics(w http.ResponseWriter, r *http.Request) {
+	var counters C.stats_counters_t
+	C.stats_read(s.stats, &counters)
+	s.lock.Lock()
+	mips := s.mips
+	s.lock.Unlock()
+
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	fmt.Fprintln(w, "# HELP emculator_instructions_total Retired instructions.")
+	fmt.Fprintln(w, "# TYPE emculator_instructions_total counter")
+	fmt.Fprintf(w, "emculator_instructions_total %d\n", uint64(counters.instructions))
+	fmt.Fprintln(w, "# HELP emculator_cycles_total Estimated CPU cycles.")
+	fmt.Fprintln(w, "# TYPE emculator_cycles_total counter")
+	fmt.Fprintf(w, "emculator_cycles_total %d\n", uint64(counters.cycles))
+	fmt.Fprintln(w, "# HELP emculator_mips Emulation speed over the last second, in millions of instructions per second.")
+	fmt.Fprintln(w, "# TYPE emculator_mips gauge")
+	fmt.Fprintf(w, "emculator_mips %g\n", mips)
+	fmt.Fprintln(w, "# HELP emculator_uart_bytes_total Bytes read (rx) and written (tx) by the firmware.")
+	fmt.Fprintln(w, "# TYPE emculator_uart_bytes_total counter")
+	fmt.Fprintf(w, "emculator_uart_bytes_total{direction=\"rx\"} %d\n", uint64(counters.uart_rx))
+	fmt.Fprintf(w, "emculator_uart_bytes_total{direction=\"tx\"} %d\n", uint64(counters.uart_tx))
+	fmt.Fprintln(w, "# HELP emculator_call_depth Current call depth.")
+	fmt.Fprintln(w, "# TYPE emculator_call_depth gauge")
+	fmt.Fprintf(w, "emculator_call_depth %d\n", int(counters.call_depth))
+
+	var bases [statsMaxPeripherals]C.uint32_t
+	var accesses [statsMaxPeripherals]C.uint64_t
+	n := int(C.stats_peripherals(s.stats, &bases[0], &accesses[0], statsMaxPeripherals))
+	fmt.Fprintln(w, "# HELP emculator_peripheral_accesses_total Loads and stores to each peripheral, by base address.")
+	fmt.Fprintln(w, "# TYPE emculator_peripheral_accesses_total counter")
+	for i := 0; i < n; i++ {
+		fmt.Fprintf(w, "emculator_peripheral_accesses_total{device=\"0x%08x\"} %d\n", uint32(bases[i]), uint64(accesses[i]))
+	}
+
+	if s.top > 0 {
+		pcs := make([]C.uint32_t, s.top)
+		samples := make([]C.uint64_t, s.top)
+		n = int(C.stats_hot_pcs(s.stats, &pcs[0], &samples[0], C.size_t(s.top)))
+		fmt.Fprintln(w, "# HELP emculator_hot_pc_samples Samples of the PCs where the most samples were taken.")
+		fmt.Fprintln(w, "# TYPE emculator_hot_pc_samples counter")
+		for i := 0; i < n; i++ {
+			pc := uint32(pcs[i])
+			fmt.Fprintf(w, "emculator_hot_pc_samples{pc=\"0x%x\",function=%q} %d\n", pc, symbolize(s.symbols, pc), uint64(samples[i]))
+		}
+	}
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "machine.h"
+
+// Runtime statistics that another thread can read while the machine runs, see
+// stats.c.
+typedef struct stats stats_t;
+
+typedef struct {
+	uint64_t instructions; // retired instructions
+	uint64_t cycles;       // estimated CPU cycles
+	uint64_t uart_rx;      // bytes read from the UART
+	uint64_t uart_tx;      // bytes written to the UART
+	int call_depth;        // current call depth, see machine_add_backtrace
+} stats_counters_t;
+
+stats_t * stats_start(machine_t *machine, uint64_t interval);
+void stats_read(stats_t *stats, stats_counters_t *counters);
+size_t stats_peripherals(stats_t *stats, uint32_t *bases, uint64_t *accesses, size_t num);
+size_t stats_hot_pcs(stats_t *stats, uint32_t *pcs, uint64_t *samples, size_t num);
+void stats_free(stats_t *stats);
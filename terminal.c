@@ -1,60 +1,427 @@
+#define _POSIX_C_SOURCE 200809L
 
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
-#include <stdbool.h>
+
+#include "terminal.h"
 
 // This file handles raw terminal input and output.
+// Output is buffered and input is read ahead, both by a background I/O thread,
+// so that the emulator doesn't need a system call (or block) for every byte.
+// Alternatively, a captured terminal (see terminal_create_capture) reads
+// input from memory and collects output in memory, so that many machines can
+// run in the same process. On both, Ctrl-X in the input stops the machine
+// (see terminal_exited). A linked terminal (see terminal_create_link) is a
+// captured terminal whose input is the output of another one, for a UART
+// that is wired to that of another machine.
+
+#define TERMINAL_BUF_SIZE (4096) // must be a power of two
+#define TERMINAL_FLUSH_MS (10)   // maximum delay of buffered output
+#define TERMINAL_SPIN_NS  (100 * 1000)
+#define TERMINAL_SPINS    (100)
+
+typedef struct {
+	uint8_t data[TERMINAL_BUF_SIZE];
+	size_t head; // read position (wraps around)
+	size_t tail; // write position (wraps around)
+} terminal_ring_t;
+
+struct terminal {
+	// Captured terminal: all input is known in advance, output is appended
+	// to a growing buffer.
+	const uint8_t *input;
+	size_t input_len;
+	size_t input_pos;
+	bool exited; // Ctrl-X was read (also used by the process terminal)
+	size_t drained; // reads that found no more input
+	uint8_t *output;
+	size_t output_len;
+	size_t output_cap;
+
+	// Linked terminal: output is appended to the input of peer by
+	// terminal_deliver(), Ctrl-X is a normal character.
+	bool link;
+	bool echo;          // also write the output to the process terminal
+	terminal_t *peer;   // NULL when not connected
+	uint8_t *link_input; // owned input buffer (input points into it)
+	size_t link_cap;
+
+	// The terminal of the process. All of these are protected by lock.
+	pthread_mutex_t lock;
+	pthread_cond_t input_cond; // input was received
+	pthread_cond_t space_cond; // input buffer is no longer full
+	terminal_ring_t rx;
+	terminal_ring_t tx;
+	bool started;
+	bool eof;
+	int in_fd;
+
+	// Used to detect when the firmware is waiting for input in a loop, to
+	// avoid spinning the host CPU. Only used from the emulator thread.
+	struct timespec last_empty;
+	int spins;
+
+	// Terminal mode before enabling raw mode.
+	struct termios termios_state;
+	bool enabled_raw;
+};
 
-static int terminal_buf = -1;
-static struct termios terminal_termios_state;
-static bool terminal_enabled_raw = false;
+// The terminal of the process, connected to stdin and stdout. A NULL
+// terminal_t refers to this one.
+static terminal_t terminal_stdio = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.input_cond = PTHREAD_COND_INITIALIZER,
+	.space_cond = PTHREAD_COND_INITIALIZER,
+	.in_fd = STDIN_FILENO,
+};
+
+static inline size_t terminal_ring_used(const terminal_ring_t *ring) {
+	return ring->tail - ring->head;
+}
 
 void terminal_disable_raw() {
-	if (!terminal_enabled_raw) {
+	terminal_t *t = &terminal_stdio;
+	if (!t->enabled_raw) {
 		return;
 	}
-	terminal_enabled_raw = false;
-	tcsetattr(STDIN_FILENO, TCSAFLUSH, &terminal_termios_state);
+	t->enabled_raw = false;
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &t->termios_state);
 }
 
 void terminal_enable_raw() {
 	// https://viewsourcecode.org/snaptoken/kilo/02.enteringRawMode.html
-	if (terminal_enabled_raw) {
+	terminal_t *t = &terminal_stdio;
+	if (t->enabled_raw) {
 		return; // make enabling idempotent
 	}
-	terminal_enabled_raw = true;
+	t->enabled_raw = true;
 	atexit(terminal_disable_raw);
-	tcgetattr(STDIN_FILENO, &terminal_termios_state);
-	struct termios state = terminal_termios_state;
+	tcgetattr(STDIN_FILENO, &t->termios_state);
+	struct termios state = t->termios_state;
 	state.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
 	state.c_lflag &= ~(ECHO | ICANON | ISIG);
 	state.c_lflag &= ~(ECHO);
 	tcsetattr(STDIN_FILENO, TCSAFLUSH, &state);
 }
 
-static int terminal_getchar_raw() {
-	terminal_enable_raw(); // idempotent
+// Set deadline to the given number of nanoseconds from now, for
+// pthread_cond_timedwait().
+static void terminal_deadline(struct timespec *deadline, long ns) {
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_nsec += ns;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
 
-	if (terminal_buf >= 0) {
-		int c = terminal_buf;
-		terminal_buf = -1;
-		return c;
+// Write all buffered output. Must be called with the lock held.
+static void terminal_flush_locked(terminal_t *t) {
+	while (terminal_ring_used(&t->tx) != 0) {
+		size_t start = t->tx.head % TERMINAL_BUF_SIZE;
+		size_t length = terminal_ring_used(&t->tx);
+		if (start + length > TERMINAL_BUF_SIZE) {
+			length = TERMINAL_BUF_SIZE - start;
+		}
+		ssize_t n = write(STDOUT_FILENO, &t->tx.data[start], length);
+		if (n <= 0) {
+			t->tx.head = t->tx.tail; // drop output on error
+			break;
+		}
+		t->tx.head += n;
 	}
-	int c = getchar(); // TODO: this blocks
-	if (c == 24) { // Ctrl-X
-		exit(0);
+}
+
+void terminal_flush() {
+	terminal_t *t = &terminal_stdio;
+	pthread_mutex_lock(&t->lock);
+	terminal_flush_locked(t);
+	pthread_mutex_unlock(&t->lock);
+}
+
+// The I/O thread: flush output regularly and read input when there is room
+// for it.
+static void * terminal_thread(void *arg) {
+	terminal_t *t = arg;
+	uint8_t buf[TERMINAL_BUF_SIZE];
+	pthread_mutex_lock(&t->lock);
+	while (1) {
+		terminal_flush_locked(t);
+		size_t space = TERMINAL_BUF_SIZE - terminal_ring_used(&t->rx);
+		if (space == 0 && !t->eof) {
+			// Wait until the emulator has read some input.
+			struct timespec deadline;
+			terminal_deadline(&deadline, TERMINAL_FLUSH_MS * 1000 * 1000);
+			pthread_cond_timedwait(&t->space_cond, &t->lock, &deadline);
+			continue;
+		}
+		pthread_mutex_unlock(&t->lock);
+
+		struct pollfd fd = {t->in_fd, POLLIN, 0};
+		int ready = poll(&fd, t->eof ? 0 : 1, TERMINAL_FLUSH_MS);
+		ssize_t n = 0;
+		if (ready > 0) {
+			n = read(t->in_fd, buf, space);
+		}
+
+		pthread_mutex_lock(&t->lock);
+		if (ready > 0) {
+			if (n <= 0) {
+				t->eof = true;
+			}
+			for (ssize_t i = 0; i < n; i++) {
+				t->rx.data[t->rx.tail++ % TERMINAL_BUF_SIZE] = buf[i];
+			}
+			pthread_cond_broadcast(&t->input_cond);
+		}
+	}
+	return NULL;
+}
+
+static void terminal_start(terminal_t *t) {
+	if (t->started) {
+		return;
+	}
+	t->started = true;
+	atexit(terminal_flush);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, terminal_thread, t) != 0) {
+		perror("could not start terminal thread");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+// Read input from the given file (or pipe) instead of the terminal. Must be
+// called before any other terminal function. Returns false if the file could
+// not be opened.
+bool terminal_set_input(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	terminal_stdio.in_fd = fd;
+	return true;
+}
+
+static void terminal_start_input(terminal_t *t) {
+	terminal_start(t);
+	if (t->in_fd == STDIN_FILENO && isatty(STDIN_FILENO)) {
+		terminal_enable_raw(); // idempotent
+	}
+}
+
+// Take the next input character from the buffer, or return -1 if there is
+// none. Must be called with the lock held.
+static int terminal_read_locked(terminal_t *t) {
+	if (terminal_ring_used(&t->rx) == 0) {
+		return -1;
+	}
+	if (terminal_ring_used(&t->rx) == TERMINAL_BUF_SIZE) {
+		pthread_cond_signal(&t->space_cond);
+	}
+	return t->rx.data[t->rx.head++ % TERMINAL_BUF_SIZE];
+}
+
+// Take the next input character of a captured terminal.
+static int terminal_read_capture(terminal_t *t) {
+	if (t->input_pos == t->input_len) {
+		t->drained++;
+		return -1;
 	}
+	int c = t->input[t->input_pos];
+	if (c == 24 && !t->link) { // Ctrl-X
+		t->exited = true;
+		return TERMINAL_EXIT; // keep returning it
+	}
+	t->input_pos++;
 	return c;
 }
 
-int terminal_getchar() {
-	int c = terminal_getchar_raw();
+static int terminal_check_exit(int c) {
+	if (c == 24) { // Ctrl-X
+		terminal_stdio.exited = true;
+		return TERMINAL_EXIT;
+	}
 	return c;
 }
 
-void terminal_putchar(int c) {
-	// bypass all buffering etc.
-	write(STDOUT_FILENO, &c, 1);
+// Return the next input character, or -1 if there is none (yet).
+int terminal_getchar(terminal_t *t) {
+	if (t != NULL) {
+		return terminal_read_capture(t);
+	}
+	t = &terminal_stdio;
+	terminal_start_input(t);
+
+	if (t->exited) {
+		return TERMINAL_EXIT; // keep returning it
+	}
+	pthread_mutex_lock(&t->lock);
+	if (terminal_ring_used(&t->rx) == 0 && !t->eof) {
+		// When the firmware is polling for input in a tight loop, give the
+		// I/O thread some time to receive input instead of spinning.
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int64_t elapsed = (now.tv_sec - t->last_empty.tv_sec) * 1000000000LL + (now.tv_nsec - t->last_empty.tv_nsec);
+		t->last_empty = now;
+		if (elapsed > TERMINAL_SPIN_NS) {
+			t->spins = 0;
+		} else if (t->spins < TERMINAL_SPINS) {
+			t->spins++;
+		} else {
+			struct timespec deadline;
+			terminal_deadline(&deadline, 1000 * 1000); // 1ms
+			pthread_cond_timedwait(&t->input_cond, &t->lock, &deadline);
+		}
+	}
+	int c = terminal_read_locked(t);
+	if (c >= 0) {
+		t->spins = 0;
+	}
+	pthread_mutex_unlock(&t->lock);
+	return terminal_check_exit(c);
+}
+
+// Like terminal_getchar(), but never wait for input. For periodic checks
+// (like a receive interrupt) instead of firmware polling in a loop.
+int terminal_poll(terminal_t *t) {
+	if (t != NULL) {
+		return terminal_read_capture(t);
+	}
+	t = &terminal_stdio;
+	if (t->exited) {
+		return TERMINAL_EXIT;
+	}
+	terminal_start_input(t);
+	pthread_mutex_lock(&t->lock);
+	int c = terminal_read_locked(t);
+	pthread_mutex_unlock(&t->lock);
+	return terminal_check_exit(c);
+}
+
+void terminal_putchar(terminal_t *t, int c) {
+	if (t != NULL) {
+		if (t->output_len == t->output_cap) {
+			size_t cap = t->output_cap ? t->output_cap * 2 : 256;
+			uint8_t *output = realloc(t->output, cap);
+			if (output == NULL) {
+				return; // drop output
+			}
+			t->output = output;
+			t->output_cap = cap;
+		}
+		t->output[t->output_len++] = c;
+		return;
+	}
+	t = &terminal_stdio;
+	terminal_start(t);
+	pthread_mutex_lock(&t->lock);
+	if (terminal_ring_used(&t->tx) == TERMINAL_BUF_SIZE) {
+		terminal_flush_locked(t);
+	}
+	t->tx.data[t->tx.tail++ % TERMINAL_BUF_SIZE] = c;
+	pthread_mutex_unlock(&t->lock);
+}
+
+// Create a terminal that reads the given input (which must stay alive) and
+// collects all output, see terminal_get_output(). Returns NULL when out of
+// memory.
+terminal_t * terminal_create_capture(const uint8_t *input, size_t length) {
+	terminal_t *t = calloc(1, sizeof(terminal_t));
+	if (t == NULL) {
+		return NULL;
+	}
+	t->input = input;
+	t->input_len = length;
+	return t;
+}
+
+// Create a terminal for a UART that is wired to another one, see
+// terminal_connect(). With echo, its output also goes to the terminal of the
+// process. Returns NULL when out of memory.
+terminal_t * terminal_create_link(bool echo) {
+	terminal_t *t = calloc(1, sizeof(terminal_t));
+	if (t == NULL) {
+		return NULL;
+	}
+	t->link = true;
+	t->echo = echo;
+	return t;
+}
+
+// Wire the output of the linked terminal a to the input of b.
+void terminal_connect(terminal_t *a, terminal_t *b) {
+	a->peer = b;
+}
+
+// Append the output of a linked terminal since the last call to the input of
+// its peer, and discard it. Neither terminal may be in use at the same time.
+// Returns false when out of memory.
+bool terminal_deliver(terminal_t *t) {
+	if (t->echo) {
+		for (size_t i = 0; i < t->output_len; i++) {
+			terminal_putchar(NULL, t->output[i]);
+		}
+	}
+	terminal_t *peer = t->peer;
+	if (peer != NULL && t->output_len != 0) {
+		// Move the unread input to the start of the buffer first.
+		size_t unread = peer->input_len - peer->input_pos;
+		memmove(peer->link_input, peer->input + peer->input_pos, unread);
+		if (unread + t->output_len > peer->link_cap) {
+			size_t cap = peer->link_cap ? peer->link_cap : 256;
+			while (cap < unread + t->output_len) {
+				cap *= 2;
+			}
+			uint8_t *input = realloc(peer->link_input, cap);
+			if (input == NULL) {
+				return false;
+			}
+			peer->link_input = input;
+			peer->link_cap = cap;
+		}
+		memcpy(peer->link_input + unread, t->output, t->output_len);
+		peer->input = peer->link_input;
+		peer->input_len = unread + t->output_len;
+		peer->input_pos = 0;
+	}
+	t->output_len = 0;
+	return true;
+}
+
+// Whether the firmware tried to read a Ctrl-X, which is returned as
+// TERMINAL_EXIT from then on.
+bool terminal_exited(terminal_t *t) {
+	if (t == NULL) {
+		t = &terminal_stdio;
+	}
+	return t->exited;
+}
+
+// How often the firmware tried to read more than the input of a captured
+// terminal, for example because it is waiting for the next command.
+size_t terminal_drained(terminal_t *t) {
+	return t->drained;
+}
+
+// Return the output of a captured terminal so far.
+const uint8_t * terminal_get_output(terminal_t *t, size_t *length) {
+	*length = t->output_len;
+	return t->output;
+}
+
+void terminal_free(terminal_t *t) {
+	free(t->link_input);
+	free(t->output);
+	free(t);
 }
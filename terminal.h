@@ -1,7 +1,28 @@
-
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A terminal connected to the UART. NULL is the terminal of the process
+// (stdin and stdout), the other functions below only apply to that one.
+typedef struct terminal terminal_t;
+
+#define TERMINAL_EXIT (-2) // Ctrl-X, see terminal_exited()
+
+terminal_t * terminal_create_capture(const uint8_t *input, size_t length);
+terminal_t * terminal_create_link(bool echo);
+void terminal_connect(terminal_t *a, terminal_t *b);
+bool terminal_deliver(terminal_t *t);
+bool terminal_exited(terminal_t *t);
+size_t terminal_drained(terminal_t *t);
+const uint8_t * terminal_get_output(terminal_t *t, size_t *length);
+void terminal_free(terminal_t *t);
+int terminal_getchar(terminal_t *t);
+int terminal_poll(terminal_t *t);
+void terminal_putchar(terminal_t *t, int c);
+
+bool terminal_set_input(const char *path);
 void terminal_enable_raw();
-int terminal_getchar();
-void terminal_putchar(int c);
+void terminal_flush();
 void terminal_disable_raw();
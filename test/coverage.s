@@ -0,0 +1,20 @@
+@ A conditional branch followed by a literal pool whose data decodes as one
+@ (0xd000 is BEQ), for the branch records of the coverage: test/test.sh.
+
+	.syntax unified
+	.thumb
+
+	.section .vectors, "a"
+	.word 0x20008000 @ initial stack pointer
+	.word reset
+
+	.text
+	.thumb_func
+	.global reset
+reset:
+	ldr r0, =0x4000d000
+	cmp r0, #0
+	beq 1f
+	adds r0, #1
+1:	bx lr @ exit
+	.ltorg
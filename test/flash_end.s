@@ -0,0 +1,22 @@
+@ Unaligned word loads that walk up to the end of flash, in a loop that is
+@ hot enough to be compiled: the last one at 0x3fffe must stop with an invalid
+@ load address, see test/test.sh.
+
+	.syntax unified
+	.thumb
+
+	.section .vectors, "a"
+	.word 0x20008000 @ initial stack pointer
+	.word reset
+
+	.text
+	.thumb_func
+	.global reset
+reset:
+	ldr r1, =0x3fe00
+	ldr r2, =0x40000 @ the end of the 256K of flash
+1:	ldr r0, [r1]
+	adds r1, #2
+	cmp r1, r2
+	bne 1b
+	bx lr @ exit
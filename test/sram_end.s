@@ -0,0 +1,22 @@
+@ Unaligned word stores that walk up to the end of RAM, in a loop that is hot
+@ enough to be compiled: the last one at 0x20007ffe must stop with an invalid
+@ store address, see test/test.sh.
+
+	.syntax unified
+	.thumb
+
+	.section .vectors, "a"
+	.word 0x20008000 @ initial stack pointer
+	.word reset
+
+	.text
+	.thumb_func
+	.global reset
+reset:
+	ldr r1, =0x20007e00
+	ldr r2, =0x20008000 @ the end of the 32K of RAM
+1:	str r0, [r1]
+	adds r1, #2
+	cmp r1, r2
+	bne 1b
+	bx lr @ exit
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Check the output of emculator for the images in test/ on the given
+# execution engines:
+#
+#     test/test.sh ./emculator "step blocks"
+#
+# The branch records of the coverage of test/coverage.elf: the BEQ has one,
+# the literal pool after it, which also decodes as a BEQ, has none. The
+# accesses at the end of RAM, flash and the address space (test/*_end.elf)
+# must fail at the first byte past the end, ENGINE_JIT also with guard pages.
+
+set -e
+
+emculator=$1
+engines=$2
+info=$(mktemp)
+trap 'rm -f "$info"' EXIT
+
+"$emculator" -C "$info" test/coverage.elf </dev/null
+if ! grep -q '^BRDA:17,12,' "$info"; then
+	echo "test/coverage.elf: no branch record for the BEQ" >&2
+	exit 1
+fi
+if grep -q '^BRDA:19,' "$info"; then
+	echo "test/coverage.elf: branch record for the literal pool" >&2
+	exit 1
+fi
+echo "test/coverage.elf: ok"
+
+# expect_error <image> <message>
+expect_error() {
+	for engine in $engines; do
+		for flags in "" $( [ "$engine" = jit ] && echo -g ); do
+			if ! "$emculator" -e "$engine" $flags "$1" 2>&1 </dev/null | grep -q "$2"; then
+				echo "$1: no \"$2\" on engine $engine $flags" >&2
+				exit 1
+			fi
+		done
+	done
+	echo "$1: ok"
+}
+
+expect_error test/sram_end.elf "invalid store address: 0x20008000"
+expect_error test/flash_end.elf "invalid load address: 0x00040000"
+expect_error test/window_end.elf "invalid load address: 0xfffffffe"
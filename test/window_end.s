@@ -0,0 +1,30 @@
+@ A compiled load that is first used for RAM, and then for a word at
+@ 0xfffffffe, of which only the first two bytes are in the address space of
+@ the guest. That one must fail like on the other engines, with or without
+@ guard pages, see test/test.sh.
+
+	.syntax unified
+	.thumb
+
+	.section .vectors, "a"
+	.word 0x20008000 @ initial stack pointer
+	.word reset
+
+	.text
+	.thumb_func
+	.global reset
+reset:
+	mov r7, lr
+	ldr r1, =0x20000000
+	movs r2, #100 @ enough to compile load
+1:	bl load
+	subs r2, #1
+	bne 1b
+	ldr r1, =0xfffffffe
+	bl load
+	bx r7 @ exit
+
+	.thumb_func
+load:
+	ldr r0, [r1]
+	bx lr
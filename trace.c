@@ -0,0 +1,244 @@
+#define _POSIX_C_SOURCE 200809L // for nanosleep
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+// This file writes the trace records of machine_trace_start() to a file,
+// either continuously from a background thread or all at once after a crash.
+// Records are compressed by storing every value as the difference with the
+// previous value of the same kind (the expected PC, the old register value,
+// the last accessed address), as a variable length integer. Most instructions
+// take a few bytes this way.
+
+#define TRACE_MAGIC   "EMCTRACE"
+#define TRACE_CHUNK   (4096) // records read at a time
+#define TRACE_IDLE_NS (1000 * 1000)
+
+// State of the delta encoding, the same for the writer and the reader.
+typedef struct {
+	uint32_t pc;      // address of the next instruction when not branching
+	uint32_t regs[17];
+	uint32_t address; // last memory access
+} trace_state_t;
+
+struct trace {
+	machine_t *machine;
+	FILE *fp;
+	pthread_t thread;
+	atomic_bool stop;
+	bool error;
+};
+
+static void trace_write_varint(FILE *fp, uint32_t value) {
+	while (value >= 0x80) {
+		putc_unlocked((value & 0x7f) | 0x80, fp);
+		value >>= 7;
+	}
+	putc_unlocked(value, fp);
+}
+
+// Write the difference between two values, so that small negative
+// differences are small numbers too.
+static void trace_write_delta(FILE *fp, uint32_t value, uint32_t previous) {
+	int32_t delta = value - previous;
+	trace_write_varint(fp, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+}
+
+static bool trace_read_varint(FILE *fp, uint32_t *value) {
+	*value = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		int c = getc(fp);
+		if (c == EOF) {
+			return false;
+		}
+		*value |= (uint32_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool trace_read_delta(FILE *fp, uint32_t *value, uint32_t previous) {
+	uint32_t zigzag;
+	if (!trace_read_varint(fp, &zigzag)) {
+		return false;
+	}
+	*value = previous + ((zigzag >> 1) ^ -(zigzag & 1));
+	return true;
+}
+
+// Instructions are 32 bits when the second halfword is included.
+static uint32_t trace_instr_size(uint32_t instruction) {
+	return instruction > 0xffff ? 4 : 2;
+}
+
+static void trace_write_records(trace_state_t *state, FILE *fp, const machine_trace_record_t *records, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		const machine_trace_record_t *r = &records[i];
+		putc_unlocked(r->type | (r->arg << 2), fp);
+		switch (r->type) {
+		case TRACE_INSTR:
+			trace_write_delta(fp, r->a, state->pc);
+			trace_write_varint(fp, r->b);
+			state->pc = r->a + trace_instr_size(r->b);
+			break;
+		case TRACE_REG:
+			trace_write_delta(fp, r->a, state->regs[r->arg]);
+			state->regs[r->arg] = r->a;
+			break;
+		default: // TRACE_LOAD, TRACE_STORE
+			trace_write_delta(fp, r->a, state->address);
+			trace_write_varint(fp, r->b);
+			state->address = r->a;
+			break;
+		}
+	}
+}
+
+static void * trace_thread(void *arg) {
+	trace_t *trace = arg;
+	trace_state_t state = {0};
+	machine_trace_record_t *records = malloc(TRACE_CHUNK * sizeof(machine_trace_record_t));
+	if (records == NULL) {
+		trace->error = true;
+		return NULL;
+	}
+	while (1) {
+		// Check the stop flag first, so that the last records are read after
+		// the machine stopped.
+		bool stop = atomic_load(&trace->stop);
+		size_t n = machine_trace_read(trace->machine, records, TRACE_CHUNK);
+		trace_write_records(&state, trace->fp, records, n);
+		if (n == 0 && stop) {
+			break;
+		}
+		if (n < TRACE_CHUNK) {
+			nanosleep(&(struct timespec){0, TRACE_IDLE_NS}, NULL);
+		}
+	}
+	free(records);
+	return NULL;
+}
+
+// Trace all instructions that the machine executes from now on, and write them
+// to the given file from a background thread. Returns NULL when out of memory.
+trace_t * trace_start(machine_t *machine, FILE *fp) {
+	trace_t *trace = calloc(1, sizeof(trace_t));
+	if (trace == NULL) {
+		return NULL;
+	}
+	if (!machine_trace_start(machine, 1024 * 1024, false)) {
+		free(trace);
+		return NULL;
+	}
+	trace->machine = machine;
+	trace->fp = fp;
+	atomic_init(&trace->stop, false);
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), fp);
+	if (pthread_create(&trace->thread, NULL, trace_thread, trace) != 0) {
+		machine_trace_stop(machine);
+		free(trace);
+		return NULL;
+	}
+	return trace;
+}
+
+// Write the remaining records and stop tracing. Must be called while the
+// machine isn't running. Returns false when the trace couldn't be written.
+bool trace_stop(trace_t *trace) {
+	atomic_store(&trace->stop, true);
+	pthread_join(trace->thread, NULL);
+	machine_trace_stop(trace->machine);
+	bool ok = !trace->error && fflush(trace->fp) == 0 && !ferror(trace->fp);
+	free(trace);
+	return ok;
+}
+
+// Write the records that are still in the trace buffer of the machine, as
+// kept with machine_trace_start(machine, records, true). The oldest records
+// may belong to an instruction that was overwritten, they are skipped.
+bool trace_dump(machine_t *machine, FILE *fp) {
+	machine_trace_record_t records[TRACE_CHUNK];
+	trace_state_t state = {0};
+	bool started = false;
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), fp);
+	while (1) {
+		size_t n = machine_trace_read(machine, records, TRACE_CHUNK);
+		if (n == 0) {
+			break;
+		}
+		size_t start = 0;
+		while (!started && start < n && records[start].type != TRACE_INSTR) {
+			start++;
+		}
+		started = started || start < n;
+		trace_write_records(&state, fp, records + start, n - start);
+	}
+	return fflush(fp) == 0 && !ferror(fp);
+}
+
+// Print a trace file as text, one line per instruction. Returns false when it
+// isn't a (complete) trace file.
+bool trace_print(FILE *in, FILE *out) {
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+		return false;
+	}
+	static const char *widths[] = {"8", "16", "32"};
+	trace_state_t state = {0};
+	bool line = false;
+	int pad = 0; // to align the first record after a 16-bit instruction
+	int c;
+	while ((c = getc(in)) != EOF) {
+		uint32_t type = c & 3, arg = c >> 2, a, b = 0;
+		bool ok;
+		switch (type) {
+		case TRACE_INSTR:
+			ok = trace_read_delta(in, &a, state.pc) && trace_read_varint(in, &b);
+			if (ok) {
+				fprintf(out, line ? "\n%8x: " : "%8x: ", a);
+				fprintf(out, b > 0xffff ? "%04x %04x" : "%04x", b & 0xffff, b >> 16);
+				pad = b > 0xffff ? 0 : 5;
+				state.pc = a + trace_instr_size(b);
+				line = true;
+			}
+			break;
+		case TRACE_REG:
+			ok = arg < 17 && trace_read_delta(in, &a, state.regs[arg]);
+			if (ok) {
+				static const char *names[16] = {"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "r12", "sp", "lr", "pc"};
+				if (arg == 16) {
+					flags_t psr;
+					memcpy(&psr, &a, sizeof(psr));
+					fprintf(out, "%*s %c%c%c%c", pad, "", psr.n ? 'N' : '_', psr.z ? 'Z' : '_', psr.c ? 'C' : '_', psr.v ? 'V' : '_');
+				} else {
+					fprintf(out, "%*s %s=%x", pad, "", names[arg], a);
+				}
+				pad = 0;
+				state.regs[arg] = a;
+			}
+			break;
+		default: // TRACE_LOAD, TRACE_STORE
+			ok = arg <= WIDTH_32 && trace_read_delta(in, &a, state.address) && trace_read_varint(in, &b);
+			if (ok) {
+				fprintf(out, "%*s %s%s [%x]=%x", pad, "", type == TRACE_LOAD ? "ld" : "st", widths[arg], a, b);
+				pad = 0;
+				state.address = a;
+			}
+			break;
+		}
+		if (!ok) {
+			return false;
+		}
+	}
+	if (line) {
+		fprintf(out, "\n");
+	}
+	return true;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "machine.h"
+
+// Writes the binary instruction trace of a machine to a file, see trace.c.
+typedef struct trace trace_t;
+
+trace_t * trace_start(machine_t *machine, FILE *fp);
+bool trace_stop(trace_t *trace);
+bool trace_dump(machine_t *machine, FILE *fp);
+bool trace_print(FILE *in, FILE *out);
@@ -4,13 +4,22 @@ const PAGESIZE     = 1024;
 const IMAGESIZE    = 256 * 1024;
 const RAMSIZE      = 32 * 1024;
 const FIRMWARE_URL = 'firmware.bin';
+const ENGINE       = 1; // ENGINE_BLOCKS, memory grows to fit the block cache
+const ERR_HALT     = 1;
+const ERR_YIELD    = 9; // see machine_run_slice()
 
-var memory = new WebAssembly.Memory({ initial: 32, maximum: 32 });
-var memoryStart = 0; // like sbrk(), used by wasm_malloc() for allocation
+// The emulator runs in slices of SLICE_CYCLES, for at most FRAME_BUDGET_MS
+// per animation frame, so that the page stays responsive.
+const SLICE_CYCLES       = 100000;
+const FRAME_BUDGET_MS    = 8;
+
+var memory = new WebAssembly.Memory({ initial: 32, maximum: 16384 });
 
 var emculator;
 var machineInstance; // *machine_t
-var image8, image32; // two views on the loaded firmware image
+
+var input = [];      // characters typed but not yet read by the firmware
+var output = [];     // characters written by the firmware in this frame
 
 var importObject = {
   imports: {
@@ -18,25 +27,63 @@ var importObject = {
   },
   env: {
     memory: memory,
-    _wasm_malloc: function(size) {
-      let buf = memoryStart;
-      if ((size & 7) != 0) {
-        size += (size & 7); // align on 8-byte boundary
-      }
-      memoryStart += size;
-      return buf;
+    _terminal_getchar: function(terminal) {
+      return input.length ? input.shift() : -1;
     },
-    _terminal_getchar: function() {
-      throw 'TODO: terminal_getchar';
+    _terminal_poll: function(terminal) {
+      return input.length ? input.shift() : -1;
     },
-    _terminal_putchar: function(c) {
-      document.querySelector('#terminal').textContent += String.fromCharCode(c);
+    _terminal_putchar: function(terminal, c) {
+      output.push(c);
     },
   },
 };
 
+// Buffers are detached when memory grows, so create a view each time.
+function heap8() {
+  let mem = emculator.exports.memory || memory;
+  return new Uint8Array(mem.buffer);
+}
+
+// Write the output of this frame to the terminal at once.
+function flushOutput() {
+  if (!output.length) {
+    return;
+  }
+  let terminal = document.querySelector('#terminal');
+  terminal.textContent += new TextDecoder('latin1').decode(new Uint8Array(output));
+  terminal.scrollTop = terminal.scrollHeight;
+  output = [];
+}
+
+function runFrame() {
+  let start = performance.now();
+  let err;
+  do {
+    err = emculator.exports._machine_run_slice(machineInstance, SLICE_CYCLES);
+  } while (err == ERR_YIELD && performance.now() - start < FRAME_BUDGET_MS);
+  flushOutput();
+  if (err == ERR_YIELD || err == ERR_HALT) {
+    requestAnimationFrame(runFrame);
+  } else {
+    console.log('emculator result:', err);
+  }
+}
 
 function init() {
+  document.querySelector('#terminal').addEventListener('keydown', function(e) {
+    if (e.key.length == 1) {
+      input.push(e.ctrlKey ? e.key.toUpperCase().charCodeAt(0) & 0x1f : e.key.charCodeAt(0));
+    } else if (e.key == 'Enter') {
+      input.push(13);
+    } else if (e.key == 'Backspace') {
+      input.push(8);
+    } else {
+      return;
+    }
+    e.preventDefault(); // the firmware echoes the input
+  });
+
   // Do two things parallel:
   // 1. Fetch and instantiate the machine module.
   // 2. Fetch the firmware file.
@@ -45,10 +92,7 @@ function init() {
     // Fetch and instantiate machine.
     WebAssembly.instantiateStreaming(fetch('machine.wasm'), importObject).then(function(obj) {
       emculator = obj.instance;
-      machineInstance = emculator.exports._machine_create(IMAGESIZE, PAGESIZE, RAMSIZE, 0);
-      let imageAddress = emculator.exports._machine_get_image(machineInstance);
-      image8 = new Uint8Array(memory.buffer, imageAddress, IMAGESIZE);
-      image32 = new Uint32Array(memory.buffer, imageAddress, IMAGESIZE);
+      machineInstance = emculator.exports._machine_create(IMAGESIZE, PAGESIZE, RAMSIZE, 0, ENGINE);
     }),
     // Load the firmware image.
     fetch(FIRMWARE_URL).then(function(response) {
@@ -58,12 +102,12 @@ function init() {
       return response.arrayBuffer();
     })]).then(function(array) {
       // Write the firmware image to the emulated chip.
-      image8.set(new Uint8Array(array[1]), 0);
+      let imageAddress = emculator.exports._machine_get_image(machineInstance);
+      heap8().set(new Uint8Array(array[1]), imageAddress);
       // Reset: initialize PC and SP.
       emculator.exports._machine_reset(machineInstance);
       // Start the emulator.
-      let err = emculator.exports._machine_run(machineInstance);
-      console.log('emculator result:', err);
+      requestAnimationFrame(runFrame);
     }).catch(function(err) {
       console.error(err);
     });